@@ -1,44 +1,205 @@
+#define _GNU_SOURCE
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 #include <pthread.h>
 
+#include "waltsara.archive.h"
+#include "waltsara.feed.h"
+#include "waltsara.live.h"
+#include "waltsara.reroll.h"
+#include "waltsara.stats.h"
+#include "waltsara.world.h"
+
 /* Helpful constants */
-#define MAX_ROOM_NAME_LENGTH 32
 #define NUM_REQUIRED_ROOMS 7
 #define MAX_ROOM_COUNT 10
 #define MIN_ROOM_CONNECTIONS 3
 #define MAX_ROOM_CONNECTIONS 6
+#define SCRIPT_FLUSH_SIZE (1 << 16)             // Headless output is written in blocks of about this size
+#define SERVER_EVENTS 256                       // Events handled per epoll_wait in server mode
+#define MAX_INPUT_LENGTH 255                    // Longest line a server player can send
+#define MAX_PENDING_OUTPUT (1 << 16)            // Server stops reading from players with this much unsent output
+#define WORKER_QUEUE_SIZE 256                   // Jobs a thread can have in flight with the background worker
+#define TIME_LENGTH 80                          // Room for the formatted time
+#define RESOLVE_RUN 1024                        // Rooms a resolver thread claims at a time
+#define PATH_CHUNK (1 << 16)                    // Moves a path keeps in memory before spilling them to disk
+#define PROMPT_ROOMS (1 << 16)                  // Worlds up to this size build every room's prompt at load
+#define QUERY_BATCH (1 << 16)                   // Rooms --query answers with one search
+#define ARENA_BLOCK 4096                        // Smallest block a session's scratch arena allocates
+#define SNAPSHOT_MAGIC "WALTSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_RECORD 32                      // Largest write a snapshot job carries, a header or one move
+#define SNAPSHOT_SLOTS (WORKER_QUEUE_SIZE + 1)  // Snapshot writes that can be queued or being filled
+
+/* Set by SIGINT or SIGTERM to stop server mode */
+volatile sig_atomic_t serverDone = 0;
+
+/* Whether the time command also writes currentTime.txt */
+bool writeTimeFile = false;
+
+/* Threads that load room directories, 0 for one per online CPU */
+int loadThreads = 0;
+
+/* World of an archive to play, -1 for the newest */
+int64_t archiveWorldId = -1;
+
+/* Counters and timers, see waltsara.stats.h */
+enum
+{
+    STAT_DIRECTORY_ENTRIES,             // Entries read while looking for worlds and room files
+    STAT_STAT_CALLS,
+    STAT_FILES_READ,
+    STAT_READ_SYSCALLS,                 // open, read and close calls for room files
+    STAT_BYTES_READ,
+    STAT_TURNS,
+    STAT_MOVES,
+    STAT_PROMPTS_BUILT,                 // Prompts built on first visit rather than at load
+    STAT_ARENA_BLOCKS,                  // Blocks scratch arenas had to malloc
+    STAT_PATH_SPILLS,                   // Times a path was written out to its temporary file
+    STAT_ROUTE_SEARCHES,
+    STAT_TIME_READS,
+    STAT_TIME_RETRIES,                  // Reads of the cached time that raced the worker and went again
+    STAT_JOBS_SUBMITTED,
+    STAT_JOBS_REFUSED,                  // Jobs turned away because the channel was full
+    STAT_WORKER_WAKEUPS,                // eventfd writes to a sleeping worker
+    STAT_TIME_FILE_WRITES,
+    STAT_SNAPSHOT_WRITES,
+    STAT_WORLD_CHANGES,                 // Doors locked or unlocked and rooms closed or opened in a live world
+    STAT_ROOMS_REPAIRED,                // Rooms whose distance those changes revisited
+    STAT_WORLD_REFRESHES,               // Patches of the world file caught up with
+    STAT_LOAD_NS,
+    STAT_TIME_WAIT_NS,                  // Reading the cached time, retries included
+    STAT_WORKER_SLEEP_NS,               // Worker waiting for jobs or the next second
+    STAT_RESUME_NS,                     // Rebuilding a session from its snapshot
+    NUM_STATS
+};
+
+static const char *const adventureStatNames[NUM_STATS] = {
+    "directory_entries", "stat_calls", "files_read", "read_syscalls", "bytes_read",
+    "turns", "moves", "prompts_built", "arena_blocks", "path_spills", "route_searches",
+    "time_reads", "time_retries", "jobs_submitted", "jobs_refused", "worker_wakeups", "time_file_writes",
+    "snapshot_writes", "world_changes", "rooms_repaired", "world_refreshes", "load_ns", "time_wait_ns", "worker_sleep_ns", "resume_ns"
+};
+
+/* A job for the background worker: run(arg) on the worker, then done(arg) back on the submitter */
+typedef struct
+{
+    void (*run)(void *arg);
+    void (*done)(void *arg);
+    void  *arg;
+} Job;
+
+/* Lock-free single-producer single-consumer ring of jobs */
+typedef struct
+{
+    Job      slots[WORKER_QUEUE_SIZE];
+    uint64_t head;                      // Next slot to fill, written by the producer only
+    uint64_t tail;                      // Next slot to take, written by the consumer only
+} JobQueue;
+
+/* Jobs going to the worker from one submitting thread, and back again */
+typedef struct
+{
+    JobQueue requests;
+    JobQueue responses;
+    int      inFlight;                  // Submitted but not collected, owned by the submitter
+} WorkerChannel;
+
+/* The time string, rewritten by the worker whenever the second changes */
+typedef struct
+{
+    uint64_t sequence;                  // Odd while the text is being rewritten
+    time_t   second;
+    char     text[TIME_LENGTH];
+} TimeCache;
+
+/* The background worker and everything it looks after */
+typedef struct
+{
+    WorkerChannel *channels;            // One per submitting thread
+    int            numChannels;
+    TimeCache      timeCache;
+    int            wakeFd;              // eventfd the worker sleeps on
+    bool           sleeping;
+    bool           stop;
+    pthread_t      thread;
+} Worker;
+
+/* Runs jobs and keeps the clock for every session in this process */
+Worker background;
+
+/* What a player sees on entering a room, up to and including "WHERE TO? > " */
+typedef struct Prompt
+{
+    uint64_t        generation;         // World generation it was built at
+    bool            inBlock;            // Part of the world's prompt block rather than a block of its own
+    size_t          length;
+    char            text[];
+} Prompt;
+
+/*
+ * Scratch space for route searches. Each thread that plays sessions has
+ * its own, allocated the first time it is needed and sized for the world.
+ */
+typedef struct
+{
+    uint32_t  numWords;                 // 64-bit words per bitset, 0 until first used
+    uint64_t *forwardSeen;              // Rooms the search from the player has reached
+    uint64_t *backwardSeen;             // Rooms the search from the end has reached
+    uint64_t *forwardFrontier;
+    uint64_t *backwardFrontier;
+    uint64_t *next;                     // Frontier being built
+    uint32_t *via;                      // Player's first step towards each room the forward side reached
+} PathSearch;
+
+/* Route search scratch space, one per worker channel */
+PathSearch *searches = NULL;
 
-/* Bool doesn't exist in ANSI C, so I chose to define it */
-typedef enum { false, true } bool;
+/* Scratch space for rerolling rooms of a live world, set up on the first reroll */
+Reroll rerolls;
 
-/* Mutex and condition variables */
-pthread_mutex_t timeMutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t condition = PTHREAD_COND_INITIALIZER;
+/*
+ * Memory a refresh replaced while other threads may still be reading it,
+ * such as the prompts and distances of a world file that was patched.
+ * Patches are rare, so it is simply kept until exit.
+ */
+typedef struct Retired
+{
+    struct Retired *next;
+    void           *memory;
+} Retired;
 
-/* Predicates used to control reading/writing time and terminating the thread. */
-bool doTime = false;
-bool timeDone = false;
-bool gameDone = false;
+Retired *retired = NULL;
+pthread_mutex_t retireLock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Enumeration for Room type */
-typedef enum {
-  START_ROOM = 0,
-  MID_ROOM,
-  END_ROOM
-} Type;
+/* Serializes bringing the world's caches up to date with a patched file */
+pthread_mutex_t refreshLock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Struct for Room data, gives us everything we need to know about the room */
 typedef struct
 {
     char  name[MAX_ROOM_NAME_LENGTH];
-    char  connections[MAX_ROOM_CONNECTIONS][MAX_ROOM_NAME_LENGTH];
+    char *connections;          // connectCount names, each NUL terminated, back to back
     int   connectCount;
     Type  roomType;
 } Room;
@@ -46,371 +207,3585 @@ typedef struct
 /* The purpose of the graph is just to serve as a container for rooms */
 typedef struct
 {
-    Room rooms[NUM_REQUIRED_ROOMS];
+    Room *rooms;
+    int   numRooms;
 } Graph;
 
-/* Forward-declarations */
-Room *GetRoomFromName(Graph *g, char *name);		// Get room in graph with specified name
-void InitializeGraph(Graph *g, char *directory);	// Use directory to initialize graph
-void InitializeRoom(Room *r, char *filename);		// Initialize room with contents of its file
-char *GetPossibleConnections(Room *r);			// Returns string containing all possible connections to r
-Room *GetStartRoom(Graph *g);				// Gets pointer to start room of graph
-Room *GetEndRoom(Graph *g);				// Gets pointer to end room of graph
+/* Room files shared out between loader threads */
+typedef struct
+{
+    Graph  *graph;
+    int     directory;          // Descriptor the room files are opened relative to
+    char  **fileNames;
+    int     nextRoom;           // Next file a thread claims, atomically
+    bool    failed;
+} RoomLoader;
+
+/* Rooms whose connection names are shared out between resolver threads */
+typedef struct
+{
+    World  *world;
+    Graph  *graph;
+    int     nextRoom;           // First room of the next run a thread claims, atomically
+    bool    failed;
+} Resolver;
+
+/* Output waiting to be written, so a turn costs one write instead of a flush per printf */
+typedef struct
+{
+    char   *data;
+    size_t  length;
+    size_t  capacity;
+} OutBuf;
 
 /*
- * To be executed by the time thread. timeFile is a pointer to a FILE* that
- * will be used for writing the time. Loops indefinitely and waits to be
- * woken up by the main thread before processing. 
+ * The rooms a player has moved through, as IDs. The newest moves are kept
+ * in memory; once PATH_CHUNK of them pile up they are written to an
+ * unnamed temporary file, so a bot that wanders for a billion moves needs
+ * no more memory than one that wins in five.
  */
-void *WriteTime(void *timeFile)
+typedef struct
 {
-    while(1)
-    {
-        pthread_mutex_lock(&timeMutex);					// Lock the mutex object 					
-        while(doTime == false && gameDone == false)
-        {
-            pthread_cond_wait(&condition, &timeMutex);			// Release mutex until condition complete and mutex available
-        }
+    uint32_t    *rooms;                 // Moves not yet spilled
+    uint32_t     length;
+    uint32_t     capacity;
+    int          spillFd;               // Temporary file holding older moves, -1 until needed
+    uint64_t     spilled;               // Moves in the temporary file
+} PathLog;
 
-        if(gameDone)							// Break when we finish playing
-        {
-            break;
-        }
-		/* Get things set up to write to the file */
-        FILE *file = (FILE*)timeFile;
-        time_t theTime;
-        time(&theTime);
-        struct tm *timeinfo =  localtime(&theTime);
-
-        char buffer[80];
-        strftime(buffer, 80, "%I:%M%P, %A, %B %e, %G\n", timeinfo); 		// Format the time and date
-        file = fopen("currentTime.txt", "w");					// File handling
-        fputs(buffer, file);							// Writes the character array to the file
-        fclose(file);
+/* One block of a scratch arena; blocks are chained newest first */
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    size_t             size;
+    size_t             used;
+    char               data[];
+} ArenaBlock;
 
-        doTime = false;
-        timeDone = true;
-        pthread_mutex_unlock(&timeMutex);					// Release the mutex object
-        pthread_cond_signal(&condition);
-    }
-    pthread_exit(0);
-}
+/*
+ * Scratch memory for one turn. Allocating bumps a pointer and the whole
+ * arena is emptied at the start of the next turn, keeping only its newest
+ * block, so once that block is big enough a turn never calls malloc.
+ */
+typedef struct
+{
+    ArenaBlock  *blocks;
+} Arena;
 
-/* Main entry point */
-int main(int argc, char** argv)
+/*
+ * Session snapshot file. A header naming the world and the room the
+ * session started in, then one record per move: the difference between
+ * the new room ID and the previous one, zigzag encoded so small steps
+ * either way stay small, as a little-endian base 128 varint. The current
+ * room and the step count are where the records lead. A record cut short
+ * by a crash is dropped on resume, and a session that reached the end is
+ * over and starts again.
+ */
+typedef struct
 {
-    /* Find the appropriate directory - search for substring then see if rest of the string is an int
-	* (the PID). If it is, compare the timestamp to find the most current one
-	*/
-    DIR *dp = opendir(".");
-    struct dirent *curEntry = NULL;
-    struct dirent latestEntry;
-    memset(&latestEntry, 0, sizeof(struct dirent));
-    time_t latestTime;
-    memset(&latestTime, 0, sizeof(time_t));
-    struct stat st;
-    char *searchStr = "waltsara.rooms.";			// Search for directory with matching substring waltsara.rooms
+    char     magic[8];
+    uint32_t version;
+    uint32_t startRoom;
+    uint64_t fingerprint;               // FingerprintWorld of the world being played
+} SnapshotHeader;
 
-    /* Check all directory entries that match the search string */
-    while((curEntry = readdir(dp)) != NULL)
-    {
-        stat(curEntry->d_name, &st);
-        if(S_ISDIR(st.st_mode) && (strlen(curEntry->d_name) > strlen(searchStr)))
-        {
-            if(strstr(curEntry->d_name, searchStr) != NULL)
-            {
-                int searchStrLen = strlen(searchStr);			// Take the length of the search string (file name) 
-				char *pid = &curEntry->d_name[searchStrLen];
-                if(strtol(pid, NULL, 0) > 0)
-                {
-                    if(st.st_mtime> latestTime)
-                    {
-                        memcpy(&latestEntry, curEntry, sizeof(struct dirent));
-                        latestTime = st.st_mtime;
-                    }
-                }
-            }
-        }
-    }
+/* A write to a snapshot file, carried out by the background worker */
+typedef struct
+{
+    int      fd;
+    uint64_t offset;
+    bool     restart;                   // Empty the file first, the write is a new header
+    uint8_t  length;
+    uint8_t  bytes[SNAPSHOT_RECORD];
+} SnapshotWrite;
 
-    closedir(dp);
+/*
+ * The snapshot a session saves into as it is played. Every move is one
+ * small write handed to the background worker, so saving costs a turn
+ * no system call. Writes go through a ring with one slot more than the
+ * channel can have jobs in flight, so a slot is always finished with by
+ * the time it comes round again.
+ */
+typedef struct
+{
+    int            fd;
+    uint64_t       fingerprint;
+    uint64_t       length;              // Bytes the file holds once queued writes are done
+    uint32_t       lastRoom;            // Room the newest record leads to
+    bool           resume;              // Whether the first session picks up where the file left off
+    SnapshotWrite  slots[SNAPSHOT_SLOTS];
+    uint64_t       nextSlot;
+} SnapshotLog;
 
-    /* No suitable entry found, exit. */
-    if(latestEntry.d_name == NULL)
-    {
-        fprintf(stderr, "No room directories found.");
-        return -1;
-    }
+/* Everything one player's game needs besides the world itself */
+typedef struct
+{
+    const World *world;
+    uint32_t     id;                    // Number of the session within this game
+    int          channel;               // Background worker channel of the thread playing it
+    uint32_t     room;                  // Current location
+    int          steps;
+    uint64_t     generation;            // World generation the session last caught up with
+    PathLog      path;
+    Arena        scratch;               // Emptied at the start of every turn
+    SnapshotLog *snapshot;              // Where every move is saved, NULL if nowhere
+} Session;
 
-    /* Initialize the graph using the directory that we found. */
-    Graph graph;
-    InitializeGraph(&graph, latestEntry.d_name);
+/* Snapshot of the one session of interactive or headless play, NULL if none was asked for */
+SnapshotLog *sessionSnapshot = NULL;
 
-    /* Graph has been created */
-    Room *start = GetStartRoom(&graph);
-    Room *end   = GetEndRoom(&graph);
-    Room *cur = start;
+/* Spectator feed every move is published to, NULL if none */
+Feed *spectatorFeed = NULL;
 
-    /* Allocate buffer to store the user's path */
-    int bufferSize = 100;
-    char *pathTaken = (char*)calloc(bufferSize, sizeof(char));
+/* Number the next session to start gets */
+uint32_t nextSessionId = 0;
 
-    /* Create the thread for time feature */
-    pthread_t   timeThread;
-    FILE       *timeFile;
-    if(pthread_create(&timeThread, NULL, WriteTime, timeFile) != 0)
-    {
-        fprintf(stderr, "Failed to create time thread.");
-        return -1;
-    }
+/* One player connected to the server */
+typedef struct Connection
+{
+    int                fd;
+    Session            session;
+    char               input[MAX_INPUT_LENGTH + 1];     // Line being received
+    int                inputLength;
+    OutBuf             out;                             // Output the socket hasn't taken yet
+    uint32_t           watching;                        // Events registered with epoll
+    bool               closing;                         // Disconnect once out is written
+    struct Connection *prev;
+    struct Connection *next;
+} Connection;
 
-    /* Begin main game loop */
-    int steps = 0;
-    while(cur != end)
-    {
+/* One server event loop and the players it looks after */
+typedef struct
+{
+    const World *world;
+    int          channel;               // Background worker channel of this loop
+    int          listenFd;
+    int          epollFd;
+    pthread_t    thread;
+    Connection  *connections;
+    long         sessionsServed;
+    long         sessionsFinished;
+} ServerLoop;
 
-        /* Display the current state */
-        char *connections = GetPossibleConnections(cur);
-        printf("CURRENT LOCATION: %s\n", cur->name);
-        printf("POSSIBLE CONNECTIONS: %s\n", connections);
-        printf("WHERE TO? > ");
+/* Forward-declarations */
+bool FindLatestWorld(char *name, size_t size);		// Finds the newest world in the current directory
+void PlayInteractive(const World *w);			// Plays one game on the terminal
+int PlayScript(const World *w, const char *scriptPath, long numSessions, bool quiet);	// Plays sessions from a script
+int AnswerQueries(const World *w, const char *queryPath);	// Prints the distance to the end from rooms named in a file
+int RunServer(const World *w, const char *socketPath, int numThreads);	// Serves games over a Unix socket
+void StopServer(int signal);				// Signal handler that stops the server
+void *ServeLoop(void *loop);				// Body of one server event loop
+void AcceptPlayers(ServerLoop *l);			// Accepts every waiting player
+void ReadFromPlayer(ServerLoop *l, Connection *c);	// Plays the lines a player sent
+void WriteToPlayer(Connection *c);			// Writes pending output without blocking
+void WatchConnection(ServerLoop *l, Connection *c);	// Updates the events epoll reports for a player
+void CloseConnection(ServerLoop *l, Connection *c);	// Disconnects a player
+void StartSession(Session *s, const World *w);		// Puts a session in the start room
+void EndSession(Session *s);				// Releases a session
+void ShowRoom(Session *s, OutBuf *out);			// Shows the current location and prompt
+bool PlayTurn(Session *s, char *line, int length, OutBuf *out);	// Plays one line of input, true on victory
+bool TakeTurn(Session *s, char *line, int length, OutBuf *out);	// PlayTurn without the bookkeeping
+bool ChangeWorld(Session *s, const char *line, OutBuf *out);	// Plays a lock, unlock, close, open or reroll command
+void ForgetPrompts(const World *w, const uint32_t *rooms, uint32_t count);	// Drops prompts whose connections changed
+bool CatchUpWorld(Session *s, OutBuf *out);		// Catches up with patches of the world file since the last turn
+bool RefreshWorld(World *w, uint64_t generation, PathSearch *s);	// Brings par and distances up to date with a patch
+bool WorldMoved(const Session *s);			// Whether the world file was patched during this turn
+void Retire(void *memory);				// Frees memory at exit, once nobody can be reading it
+void FreeRetired(void);					// Frees retired memory
+void *RunWorker(void *w);				// Body of the background worker thread
+bool StartWorker(Worker *w, int numChannels);		// Starts the background worker
+void StopWorker(Worker *w);				// Finishes pending jobs and stops the worker
+bool SubmitJob(Worker *w, int channel, void (*run)(void *), void (*done)(void *), void *arg);	// Hands a job to the worker
+int CollectJobs(Worker *w, int channel);		// Runs completions of finished jobs
+void WakeWorker(Worker *w);				// Wakes the worker if it sleeps
+bool PushJob(JobQueue *q, const Job *job);		// Adds a job to a ring
+bool PopJob(JobQueue *q, Job *job);			// Takes a job off a ring
+void RefreshTime(Worker *w);				// Updates the cached time string
+void GetCurrentTime(Worker *w, int channel, char *buffer, int size);	// Copies the cached time
+void WriteTime(void *text);				// Worker job writing currentTime.txt
+void Append(OutBuf *out, const char *data, size_t length);	// Appends bytes to an output buffer
+void AppendString(OutBuf *out, const char *text);	// Appends a string to an output buffer
+void AppendFormat(OutBuf *out, const char *format, ...);	// Appends formatted text to an output buffer
+void *ArenaAlloc(Arena *a, size_t size);		// Allocates scratch memory that lasts until the arena is reset
+void ResetArena(Arena *a);				// Empties an arena, keeping its newest block
+void FreeArena(Arena *a);				// Releases every block of an arena
+void StartPath(PathLog *p);				// Empties a path
+bool RecordMove(PathLog *p, uint32_t room);		// Adds a room to the end of a path
+bool SpillPath(PathLog *p);				// Moves a path's rooms in memory to its temporary file
+void AppendPath(OutBuf *out, const World *w, const PathLog *p);	// Appends the names along a path, one per line
+void EndPath(PathLog *p);				// Releases a path
+bool OpenSnapshot(SnapshotLog *l, const char *path, const World *w, bool resume);	// Opens the file sessions are saved in
+void CloseSnapshot(SnapshotLog *l);			// Closes a snapshot once the worker is done with it
+void AttachSnapshot(Session *s, SnapshotLog *l);	// Resumes a new session from the snapshot, or starts the snapshot over
+bool ResumeSession(Session *s, SnapshotLog *l);		// Rebuilds a session from its snapshot
+void RestartSnapshot(Session *s);			// Empties the snapshot down to a header for the session
+void SaveMove(Session *s);				// Appends the session's latest move to its snapshot
+void QueueSnapshotWrite(Session *s, SnapshotWrite *w);	// Hands a snapshot write to the worker
+void WriteSnapshot(void *write);			// Worker job writing to a snapshot file
+void FlushOutput(OutBuf *out, int fd);			// Writes out and empties an output buffer
+bool InitializeGraph(Graph *g, const char *directory);	// Use directory to initialize graph
+void FreeGraph(Graph *g);				// Releases the rooms of a graph
+void *LoadRooms(void *loader);				// Body of one room file loader thread
+bool InitializeRoom(Room *r, int directory, const char *filename);	// Initialize room with contents of its file
+void RunInParallel(void *(*body)(void *), void *arg);	// Runs body on the loader threads and waits for them
+bool LoadWorld(World *w, const char *path, bool writable);	// Loads a world file, room directory or archive
+bool BuildWorldFromGraph(World *w, Graph *g);		// Packs a text-format graph into a world image
+void *ResolveConnections(void *resolver);		// Body of one connection resolver thread
+int ResolveConnection(const World *w, uint32_t room, const char *input);	// Connection named or abbreviated by input
+char *GetCompletions(const World *w, uint32_t room, const char *prefix, Arena *a);	// Connections starting with prefix
+size_t FormatPrompt(const World *w, uint32_t room, char *text);	// Writes a room's prompt, returns its length
+bool PreparePrompts(World *w);				// Sets up the prompt cache, building every prompt for small worlds
+const Prompt *GetPrompt(const World *w, uint32_t room);	// A room's prompt, built on first use
+bool PreparePathSearch(PathSearch *s, const World *w);	// Allocates search scratch space for the world
+void FreePathSearch(PathSearch *s);			// Releases search scratch space
+uint32_t FindRoute(const World *w, PathSearch *s, uint32_t from, uint32_t *step);	// Distance to the end and first step there
+void FindDistances(const World *w, PathSearch *s, const uint32_t *rooms, uint32_t count, uint32_t *distances);	// Distances from many rooms at once
+bool ComputeDistances(World *w);			// Precomputes the distance to the end from every room
+uint32_t *MeasureDistances(const World *w);		// Distance to the end from every room, in a new array
 
-        /* Get input from the user */
-        char line[MAX_ROOM_NAME_LENGTH + 1];
-        if(fgets(line, MAX_ROOM_NAME_LENGTH + 1, stdin) != NULL)
-        {
-            /* Replace newline with null terminator */
-            int length = strlen(line);
-            line[length-1] = '\0';
+/*
+ * Body of the background worker thread. Runs jobs from every channel as
+ * they arrive and keeps the cached time string current. When there is
+ * nothing to do it sleeps on its eventfd until a job comes in or the
+ * clock is due to tick over.
+ */
+void *RunWorker(void *arg)
+{
+    Worker *worker = (Worker*)arg;
 
-            /* Split the string on space, comma, and period.
-             ** Continue until we run out or find a match. */
-            char *validName = strtok(connections, " ,.");
-            while(validName != NULL && (strcmp(line, validName) != 0))
-            {
-                validName = strtok(NULL, " ,."); 
-            }
+    while(!__atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE))
+    {
+        RefreshTime(worker);
 
-            
-            if(validName != NULL) /* Match found */
+        bool ranJob = false;
+        int i;
+        for(i = 0; i < worker->numChannels; i++)
+        {
+            WorkerChannel *channel = &worker->channels[i];
+            Job job;
+            while(PopJob(&channel->requests, &job))
             {
-                /* Retrieve the target room and update the path taken */
-                cur = GetRoomFromName(&graph, line);
-                if(strlen(pathTaken) + strlen(line) + 2 > bufferSize)
+                job.run(job.arg);
+                while(!PushJob(&channel->responses, &job))
                 {
-                    /* May need to resize the buffer if the next location
-                     ** would cause it to overflow. */
-                    bufferSize += 100;
-                    char *newPath = (char *)calloc(bufferSize, sizeof(char));
-                    strcat(newPath, pathTaken);
-                    free(pathTaken);
-                    pathTaken = newPath;
+                    sched_yield();          // Can't happen while the owner keeps to its in-flight limit
                 }
-
-                strcat(pathTaken, cur->name);
-                strcat(pathTaken, "\n");
-                steps++;
+                ranJob = true;
             }
-            else if(strcmp("time", line) == 0) /* User wants the time */
+        }
+        if(ranJob)
+        {
+            continue;
+        }
+
+        /* Announce we're going to sleep, then look once more so no job is missed */
+        __atomic_store_n(&worker->sleeping, true, __ATOMIC_SEQ_CST);
+        bool pending = false;
+        for(i = 0; i < worker->numChannels && !pending; i++)
+        {
+            WorkerChannel *channel = &worker->channels[i];
+            pending = __atomic_load_n(&channel->requests.head, __ATOMIC_SEQ_CST) !=
+                      __atomic_load_n(&channel->requests.tail, __ATOMIC_SEQ_CST);
+        }
+        if(!pending && !__atomic_load_n(&worker->stop, __ATOMIC_SEQ_CST))
+        {
+            /* Sleep until the next whole second at the latest */
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            struct pollfd wake;
+            wake.fd = worker->wakeFd;
+            wake.events = POLLIN;
+            uint64_t timer = StartTimer();
+            if(poll(&wake, 1, 1000 - now.tv_nsec / 1000000) > 0)
             {
-                /* Signal the thread to write time to the file
-                 ** wait for it to complete */
-                pthread_mutex_lock(&timeMutex);
-                doTime = true;
-                pthread_cond_signal(&condition); 
-                while(!timeDone)
+                uint64_t count;
+                if(read(worker->wakeFd, &count, sizeof(count)) < 0)
                 {
-                    pthread_cond_wait(&condition, &timeMutex);
+                    /* Nothing to do, the next poll tells us again */
                 }
-
-                /* Open the file and read its contents to display */
-                char buffer[80];
-                timeFile = fopen("currentTime.txt", "r");
-                fgets(buffer, 80, timeFile);
-                fclose(timeFile);
-                timeDone = false;
-                pthread_mutex_unlock(&timeMutex);
-                printf("%s", buffer);
-            }
-            else    /* Invalid input */
-            {
-                printf("HUH? I DON’T UNDERSTAND THAT ROOM. TRY AGAIN.\n");
             }
+            StopTimer(STAT_WORKER_SLEEP_NS, timer);
+        }
+        __atomic_store_n(&worker->sleeping, false, __ATOMIC_SEQ_CST);
+    }
+
+    /* Finish anything that was already handed to us */
+    int i;
+    for(i = 0; i < worker->numChannels; i++)
+    {
+        Job job;
+        while(PopJob(&worker->channels[i].requests, &job))
+        {
+            job.run(job.arg);
+            PushJob(&worker->channels[i].responses, &job);
         }
+    }
+
+    return NULL;
+}
 
-        /*  GetPossibleConnections returns a malloc'd string, so free it */
-        free(connections);
+/*
+ * Starts the background worker with numChannels job channels. Each thread
+ * that submits jobs must use its own channel.
+ */
+bool StartWorker(Worker *worker, int numChannels)
+{
+    memset(worker, 0, sizeof(Worker));
+    worker->numChannels = numChannels;
+    worker->channels = (WorkerChannel*)calloc(numChannels, sizeof(WorkerChannel));
+    worker->wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(worker->channels == NULL || worker->wakeFd == -1)
+    {
+        free(worker->channels);
+        return false;
     }
 
-    /* User has found the end room */
-    printf("YOU HAVE FOUND THE END ROOM. CONGRATULATIONS!\n");
-    printf("YOU TOOK %d STEPS. YOUR PATH TO VICTORY WAS:\n", steps);
-    printf(pathTaken);
+    /* Have a time ready before anyone can ask */
+    RefreshTime(worker);
 
-    /* Lock the mutex to update the gameDone variable, 
-     ** signal, and wait to join */
-    pthread_mutex_lock(&timeMutex);
-    gameDone = true;
-    pthread_mutex_unlock(&timeMutex);
-    pthread_cond_signal(&condition);
-    pthread_join(timeThread, NULL);
+    if(pthread_create(&worker->thread, NULL, RunWorker, worker) != 0)
+    {
+        close(worker->wakeFd);
+        free(worker->channels);
+        return false;
+    }
 
-    free(pathTaken);
-    return 0;
+    return true;
 }
 
 /*
- * Retreives the room in the graph with the specified name, or NULL if not found.
+ * Stops the worker once it has run every job already submitted, then
+ * runs their completions.
  */
-Room *GetRoomFromName(Graph *graph, char *name)
+void StopWorker(Worker *worker)
 {
-    Room *result = NULL;
+    __atomic_store_n(&worker->stop, true, __ATOMIC_SEQ_CST);
+    WakeWorker(worker);
+    pthread_join(worker->thread, NULL);
 
     int i;
-    for(i = 0; i < NUM_REQUIRED_ROOMS && result == NULL; i++)
+    for(i = 0; i < worker->numChannels; i++)
     {
-        if(strcmp(name, graph->rooms[i].name) == 0)
-        {
-            result = &graph->rooms[i];
-        }
+        CollectJobs(worker, i);
     }
 
-    return result;
+    close(worker->wakeFd);
+    free(worker->channels);
+    worker->channels = NULL;
 }
 
 /*
- * Initializes the specified graph with the room files in the specified directory.
+ * Hands run(arg) to the worker on the specified channel. done(arg), if
+ * given, runs later on the submitting thread from CollectJobs, which is
+ * where arg should be released. Returns false when the channel already has
+ * WORKER_QUEUE_SIZE jobs in flight; the caller decides whether to run the
+ * job itself or drop it.
  */
-void InitializeGraph(Graph *graph, char *directory)
+bool SubmitJob(Worker *worker, int channelIndex, void (*run)(void *), void (*done)(void *), void *arg)
 {
-    DIR *dp = opendir(directory);
-    if(dp != NULL)
+    WorkerChannel *channel = &worker->channels[channelIndex];
+    CollectJobs(worker, channelIndex);
+    if(channel->inFlight >= WORKER_QUEUE_SIZE)
     {
-        chdir(directory);
-        struct dirent *curEntry = NULL;
+        CountStat(STAT_JOBS_REFUSED, 1);
+        return false;
+    }
 
-        int curRoom = 0;
-        struct stat st;
-        while((curEntry = readdir(dp)) != NULL)				// Make sure we're looking in a valid location
-        {
-            stat(curEntry->d_name, &st);
-            if(S_ISREG(st.st_mode))
-            {
-                InitializeRoom(&graph->rooms[curRoom], curEntry->d_name); 	// Initialize the room
-                curRoom++;							// Then iterate through
-            }
+    Job job;
+    job.run = run;
+    job.done = done;
+    job.arg = arg;
+    PushJob(&channel->requests, &job);
+    channel->inFlight++;
+    CountStat(STAT_JOBS_SUBMITTED, 1);
 
-        }
-        /* Go back */
-        chdir("..");
-        closedir(dp);
-    }
+    WakeWorker(worker);
+    return true;
 }
 
 /*
- * Initializes the specified room with the contents of the specified filename.
+ * Runs the completions of every finished job on the specified channel.
+ * Must be called from the channel's submitting thread; returns how many
+ * jobs finished.
  */
-void InitializeRoom(Room *room, char *filename)
+int CollectJobs(Worker *worker, int channelIndex)
 {
-
-    FILE *f = fopen(filename, "r");
-    char line[80];
-    int roomCount = 0;
-    while(fgets(line, 80, f) != NULL)
+    WorkerChannel *channel = &worker->channels[channelIndex];
+    int count = 0;
+    Job job;
+    while(PopJob(&channel->responses, &job))
     {
-        /* Replace newline with null terminator */
-        int length = strlen(line);
-        line[length-1] = '\0';
-        if(strstr(line, "NAME") != NULL)
-        {
-            strcpy(room->name, &line[11]);
-        }
-        else if(strstr(line, "CONNECTION") != NULL)
-        {
-            strcpy(room->connections[roomCount], &line[14]);
-            roomCount++;
-            room->connectCount = roomCount;
-        }
-        else if(strstr(line, "END_ROOM") != NULL)
-        {
-            room->roomType = END_ROOM;
-        }
-        else if(strstr(line, "MID_ROOM") != NULL)
+        if(job.done != NULL)
         {
-            room->roomType = MID_ROOM;
+            job.done(job.arg);
         }
-        else if(strstr(line, "START_ROOM") != NULL)
+        channel->inFlight--;
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Wakes the worker if it is asleep. Costs nothing but a load while it is
+ * busy, which is when jobs tend to arrive.
+ */
+void WakeWorker(Worker *worker)
+{
+    if(__atomic_load_n(&worker->sleeping, __ATOMIC_SEQ_CST))
+    {
+        CountStat(STAT_WORKER_WAKEUPS, 1);
+        uint64_t one = 1;
+        if(write(worker->wakeFd, &one, sizeof(one)) < 0)
         {
-            room->roomType = START_ROOM;
+            /* Counter is already non-zero, the worker wakes up regardless */
         }
     }
-    fclose(f);
 }
 
 /*
- * Gets a pointer to the start room of the specified graph.
+ * Adds a job to a single-producer single-consumer ring. Only the producer
+ * writes head and only the consumer writes tail, so no locks are needed.
+ * Returns false if the ring is full.
  */
-Room *GetStartRoom(Graph *graph)
+bool PushJob(JobQueue *queue, const Job *job)
 {
-    Room *result = NULL;
+    uint64_t head = queue->head;
+    if(head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) >= WORKER_QUEUE_SIZE)
+    {
+        return false;
+    }
 
-    int i;
-    for(i = 0; i < NUM_REQUIRED_ROOMS && result == NULL; i++)
+    queue->slots[head % WORKER_QUEUE_SIZE] = *job;
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_SEQ_CST);
+    return true;
+}
+
+/*
+ * Takes the oldest job off a single-producer single-consumer ring.
+ * Returns false if it is empty.
+ */
+bool PopJob(JobQueue *queue, Job *job)
+{
+    uint64_t tail = queue->tail;
+    if(tail == __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
     {
-        if(graph->rooms[i].roomType == START_ROOM)		// Look for the start room
-        {
-            result = &graph->rooms[i];
-        }
+        return false;
     }
 
-    return result;
+    *job = queue->slots[tail % WORKER_QUEUE_SIZE];
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
 }
 
 /*
- * Gets a pointer to the end room of the specified graph.
+ * Reformats the cached time string if the clock has moved on to another
+ * second. Only the worker writes the cache; the sequence number is odd
+ * while it does, so readers know to try again.
  */
-Room *GetEndRoom(Graph *graph)
+void RefreshTime(Worker *worker)
 {
-    Room *result = NULL;
+    time_t theTime = time(NULL);
+    if(theTime == worker->timeCache.second)
+    {
+        return;
+    }
 
+    struct tm timeinfo;
+    localtime_r(&theTime, &timeinfo);
+    char buffer[TIME_LENGTH];
+    strftime(buffer, TIME_LENGTH, "%I:%M%P, %A, %B %e, %G\n", &timeinfo);     // Format the time and date
+
+    TimeCache *cache = &worker->timeCache;
+    __atomic_store_n(&cache->sequence, cache->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
     int i;
-    for(i = 0; i < NUM_REQUIRED_ROOMS && result == NULL; i++)
+    for(i = 0; i < TIME_LENGTH; i++)
+    {
+        __atomic_store_n(&cache->text[i], buffer[i], __ATOMIC_RELAXED);
+    }
+    cache->second = theTime;
+    __atomic_store_n(&cache->sequence, cache->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies the cached time into buffer without waiting on the worker. If
+ * the time file was asked for, the worker also writes it afterwards.
+ */
+void GetCurrentTime(Worker *worker, int channel, char *buffer, int size)
+{
+    const TimeCache *cache = &worker->timeCache;
+    char copy[TIME_LENGTH];
+    uint64_t before;
+    uint64_t after;
+    uint64_t timer = StartTimer();
+    CountStat(STAT_TIME_READS, 1);
+    do
     {
-        if(graph->rooms[i].roomType == END_ROOM)		// Look for the end room
+        before = __atomic_load_n(&cache->sequence, __ATOMIC_ACQUIRE);
+        int i;
+        for(i = 0; i < TIME_LENGTH; i++)
         {
-            result = &graph->rooms[i];
+            copy[i] = __atomic_load_n(&cache->text[i], __ATOMIC_RELAXED);
         }
-    }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&cache->sequence, __ATOMIC_RELAXED);
+        if((before & 1) != 0 || before != after)
+        {
+            CountStat(STAT_TIME_RETRIES, 1);
+        }
+    } while((before & 1) != 0 || before != after);
+    StopTimer(STAT_TIME_WAIT_NS, timer);
 
-    return result;
+    copy[TIME_LENGTH - 1] = '\0';
+    snprintf(buffer, size, "%s", copy);
+
+    if(writeTimeFile)
+    {
+        char *text = strdup(copy);
+        if(text != NULL && !SubmitJob(worker, channel, WriteTime, free, text))
+        {
+            free(text);             // Worker is swamped; skipping one file update is fine
+        }
+    }
 }
 
 /*
- * Returns a string containing all possible connections to r.
- *
- * Format of string is "<name1>, <name2>, ..., <nameN>."
- *
- * NOTE: the returned string is malloc'd and must be freed by the caller.
+ * Worker job writing the time string in arg to currentTime.txt.
  */
-char *GetPossibleConnections(Room *r)
+void WriteTime(void *text)
 {
-    char *result = (char*)calloc(256, sizeof(char));
+    FILE *file = fopen("currentTime.txt", "w");					// File handling
+    if(file != NULL)
+    {
+        CountStat(STAT_TIME_FILE_WRITES, 1);
+        fputs((const char*)text, file);						// Writes the character array to the file
+        fclose(file);
+    }
+}
 
-    int i;
-    for(i = 0; i < r->connectCount; i++)
+/* Command line options */
+static struct option longOptions[] = {
+    { "world",    required_argument, NULL, 'w' },
+    { "headless", no_argument,       NULL, 'H' },
+    { "script",   required_argument, NULL, 'S' },
+    { "sessions", required_argument, NULL, 'N' },
+    { "quiet",    no_argument,       NULL, 'q' },
+    { "server",   required_argument, NULL, 'L' },
+    { "threads",  required_argument, NULL, 'T' },
+    { "time-file", no_argument,      NULL, 't' },
+    { "load-threads", required_argument, NULL, 'J' },
+    { "distances", no_argument,      NULL, 'D' },
+    { "snapshot", required_argument, NULL, 'P' },
+    { "resume",   no_argument,       NULL, 'R' },
+    { "live",     no_argument,       NULL, 'l' },
+    { "world-id", required_argument, NULL, 'i' },
+    { "feed",     required_argument, NULL, 'F' },
+    { "query",    required_argument, NULL, 'Q' },
+    { NULL, 0, NULL, 0 }
+};
+
+/* Main entry point */
+int main(int argc, char** argv)
+{
+    char *worldPath = NULL;
+    char *scriptPath = NULL;
+    bool headless = false;
+    bool quiet = false;
+    long numSessions = 0;
+    char *socketPath = NULL;
+    int numThreads = 1;
+    bool precompute = false;
+    char *snapshotPath = NULL;
+    bool resume = false;
+    bool live = false;
+    char *feedName = NULL;
+    char *queryPath = NULL;
+    StartStats("waltsara.adventure", adventureStatNames, NUM_STATS, "turn_latency");
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "w:HS:N:qL:T:tJ:DP:Rli:F:Q:", longOptions, NULL)) != -1)
     {
-        strcat(result, r->connections[i]);
-        if(i < r->connectCount - 1)
+        switch(opt)
         {
-            strcat(result, ", ");			// Used to format our string with commas between room names
+            case 'w': worldPath = optarg; break;
+            case 'H': headless = true; break;
+            case 'S': scriptPath = optarg; headless = true; break;
+            case 'N': numSessions = atol(optarg); headless = true; break;
+            case 'q': quiet = true; headless = true; break;
+            case 'L': socketPath = optarg; break;
+            case 'T': numThreads = atoi(optarg); break;
+            case 't': writeTimeFile = true; break;
+            case 'J': loadThreads = atoi(optarg); break;
+            case 'D': precompute = true; break;
+            case 'P': snapshotPath = optarg; break;
+            case 'R': resume = true; break;
+            case 'l': live = true; precompute = true; break;
+            case 'i': archiveWorldId = strtoll(optarg, NULL, 0); break;
+            case 'F': feedName = optarg; break;
+            case 'Q': queryPath = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-w world-file-room-directory-or-archive] [--world-id n]\n"
+                                "       [--headless] [--script file] [--sessions n] [--quiet]\n"
+                                "       [--server socket-path] [--threads n] [--time-file]\n"
+                                "       [--load-threads n] [--distances] [--snapshot file [--resume]] [--live]\n"
+                                "       [--feed shared-memory-name] [--query file]\n", argv[0]);
+                return 1;
         }
-        else
+    }
+    if(snapshotPath != NULL && socketPath != NULL)
+    {
+        fprintf(stderr, "Snapshots save a single session and can't be used with --server.\n");
+        return 1;
+    }
+    if(live && socketPath != NULL && numThreads > 1)
+    {
+        fprintf(stderr, "A live world can only be served on one thread.\n");
+        return 1;
+    }
+
+    /* Find the appropriate directory or world file; an archive knows its newest world without a scan */
+    char latestName[256];
+    struct stat archiveStat;
+    if(worldPath == NULL && stat(ARCHIVE_NAME, &archiveStat) == 0 && S_ISREG(archiveStat.st_mode))
+    {
+        worldPath = ARCHIVE_NAME;
+    }
+    if(worldPath == NULL)
+    {
+        if(!FindLatestWorld(latestName, sizeof(latestName)))
         {
-            strcat(result, ".");			// Format string with a period at the end of the room list
+            fprintf(stderr, "No room directories found.\n");
+            return -1;
         }
+        worldPath = latestName;
     }
 
-    return result;
-}
+    /* Load the world we found. */
+    World world;
+    uint64_t timer = StartTimer();
+    if(!LoadWorld(&world, worldPath, live))
+    {
+        fprintf(stderr, "Unable to load world %s.\n", worldPath);
+        return -1;
+    }
+    StopTimer(STAT_LOAD_NS, timer);
 
+    /* Start the worker for time feature, one channel per thread that plays sessions */
+    int numChannels = socketPath != NULL && numThreads > 1 ? numThreads : 1;
+    if(!StartWorker(&background, numChannels))
+    {
+        fprintf(stderr, "Failed to create time thread.");
+        return -1;
+    }
+
+    /* Work out par, and the distance from every room if asked to, before anyone plays */
+    searches = (PathSearch*)calloc(numChannels, sizeof(PathSearch));
+    if(searches == NULL || (precompute && !ComputeDistances(&world)) || (live && !MakeWorldLive(&world)))
+    {
+        fprintf(stderr, "Unable to compute distances.\n");
+        return -1;
+    }
+    uint32_t firstStep;
+    world.par = FindRoute(&world, &searches[0], GetStartRoom(&world), &firstStep);
+
+    /* Sessions save into the snapshot from their first turn */
+    SnapshotLog snapshot;
+    if(snapshotPath != NULL)
+    {
+        if(!OpenSnapshot(&snapshot, snapshotPath, &world, resume))
+        {
+            fprintf(stderr, "Unable to open snapshot %s.\n", snapshotPath);
+            return -1;
+        }
+        sessionSnapshot = &snapshot;
+    }
+
+    /* Spectators can follow from the first move, one ring per thread that plays sessions */
+    Feed feed;
+    if(feedName != NULL)
+    {
+        if(!CreateFeed(&feed, feedName, numChannels, &world))
+        {
+            fprintf(stderr, "Unable to publish the spectator feed %s.\n", feedName);
+            return -1;
+        }
+        spectatorFeed = &feed;
+    }
+
+    int result = 0;
+    if(queryPath != NULL)
+    {
+        result = AnswerQueries(&world, queryPath);
+    }
+    else if(socketPath != NULL)
+    {
+        result = RunServer(&world, socketPath, numThreads);
+    }
+    else if(headless)
+    {
+        result = PlayScript(&world, scriptPath, numSessions, quiet);
+    }
+    else
+    {
+        PlayInteractive(&world);
+    }
+
+    /* Let the worker finish any pending writes, then wait to join */
+    StopWorker(&background);
+    if(sessionSnapshot != NULL)
+    {
+        CloseSnapshot(sessionSnapshot);
+    }
+    if(spectatorFeed != NULL)
+    {
+        CloseFeed(spectatorFeed);
+    }
 
+    int i;
+    for(i = 0; i < numChannels; i++)
+    {
+        FreePathSearch(&searches[i]);
+    }
+    free(searches);
+    FreeReroll(&rerolls);
+    FreeRetired();
+    FreeLiveWorld(&world);
+    FreeWorld(&world);
+    DumpStats();
+    return result;
+}
+
+/*
+ * Search the current directory for room directories and world files - search for
+ * substring then see if rest of the string is an int (the PID). If it is, compare
+ * the timestamp to find the most current one, down to the nanosecond so
+ * worlds made in the same second don't tie. Worlds still being written are
+ * named waltsara.partial.* and never match. Copies its name into name and
+ * returns false if there is none.
+ */
+bool FindLatestWorld(char *name, size_t size)
+{
+    DIR *dp = opendir(".");
+    if(dp == NULL)
+    {
+        return false;
+    }
+
+    struct dirent *curEntry = NULL;
+    struct timespec latestTime;
+    memset(&latestTime, 0, sizeof(struct timespec));
+    struct stat st;
+    char *searchStr = "waltsara.rooms.";			// Search for directory with matching substring waltsara.rooms
+    char *worldStr = "waltsara.world.";			// or a binary world file named waltsara.world
+    name[0] = '\0';
+
+    /* Check all directory entries that match the search string */
+    while((curEntry = readdir(dp)) != NULL)
+    {
+        CountStat(STAT_DIRECTORY_ENTRIES, 1);
+        CountStat(STAT_STAT_CALLS, 1);
+        if(stat(curEntry->d_name, &st) == -1)
+        {
+            continue;
+        }
+
+        char *prefix = S_ISDIR(st.st_mode) ? searchStr : (S_ISREG(st.st_mode) ? worldStr : NULL);
+        if(prefix != NULL && (strlen(curEntry->d_name) > strlen(prefix)))
+        {
+            if(strstr(curEntry->d_name, prefix) == curEntry->d_name)
+            {
+                int searchStrLen = strlen(prefix);			// Take the length of the search string (file name)
+                char *pid = &curEntry->d_name[searchStrLen];
+                if(strtol(pid, NULL, 0) > 0)
+                {
+                    if(st.st_mtim.tv_sec > latestTime.tv_sec ||
+                       (st.st_mtim.tv_sec == latestTime.tv_sec && st.st_mtim.tv_nsec > latestTime.tv_nsec))
+                    {
+                        snprintf(name, size, "%s", curEntry->d_name);
+                        latestTime = st.st_mtim;
+                    }
+                }
+            }
+        }
+    }
+
+    closedir(dp);
+    return name[0] != '\0';
+}
+
+/*
+ * Plays one game on the terminal. Each turn's output is collected and
+ * written in one go before waiting for the player.
+ */
+void PlayInteractive(const World *world)
+{
+    Session session;
+    StartSession(&session, world);
+    if(sessionSnapshot != NULL)
+    {
+        AttachSnapshot(&session, sessionSnapshot);
+    }
+
+    OutBuf out;
+    memset(&out, 0, sizeof(OutBuf));
+
+    bool won = false;
+    while(!won)
+    {
+        /* Display the current state */
+        ShowRoom(&session, &out);
+        FlushOutput(&out, STDOUT_FILENO);
+
+        /* Get input from the user */
+        char line[MAX_ROOM_NAME_LENGTH + 2];
+        if(fgets(line, MAX_ROOM_NAME_LENGTH + 2, stdin) == NULL)
+        {
+            break;                  // Input is gone, nobody is left to play
+        }
+
+        /* Replace newline with null terminator */
+        int length = strlen(line);
+        if(length > 0 && line[length-1] == '\n')
+        {
+            line[--length] = '\0';
+        }
+
+        won = PlayTurn(&session, line, length, &out);
+    }
+
+    FlushOutput(&out, STDOUT_FILENO);
+    free(out.data);
+    EndSession(&session);
+}
+
+/*
+ * Plays sessions back to back from a script of commands, one per line,
+ * for regression and load tests. The whole script is read up front and
+ * output is written in large blocks, or skipped entirely when quiet.
+ *
+ * When a session reaches the end room, the next one starts at the
+ * following line. With numSessions set the script is replayed until that
+ * many sessions finished; otherwise it is played through once. A summary
+ * is printed at the end either way.
+ */
+int PlayScript(const World *world, const char *scriptPath, long numSessions, bool quiet)
+{
+    int fd = scriptPath ? open(scriptPath, O_RDONLY) : STDIN_FILENO;
+    if(fd == -1)
+    {
+        perror("Unable to open script.");
+        return 1;
+    }
+
+    /* Read it all in one go */
+    size_t size = 0;
+    size_t capacity = 1 << 16;
+    char *script = (char*)malloc(capacity);
+    ssize_t got = 0;
+    while(script != NULL && (got = read(fd, script + size, capacity - size - 1)) > 0)
+    {
+        size += got;
+        if(size + 1 == capacity)
+        {
+            capacity *= 2;
+            char *grown = (char*)realloc(script, capacity);
+            if(grown == NULL)
+            {
+                free(script);
+            }
+            script = grown;
+        }
+    }
+    if(fd != STDIN_FILENO)
+    {
+        close(fd);
+    }
+    if(script == NULL || got == -1)
+    {
+        perror("Unable to read script.");
+        free(script);
+        return 1;
+    }
+
+    /* Split it into lines in place */
+    size_t numLines = 0;
+    size_t i;
+    for(i = 0; i < size; i++)
+    {
+        numLines += script[i] == '\n';
+    }
+    numLines += size > 0 && script[size - 1] != '\n';
+
+    char **lines = (char**)malloc((numLines + 1) * sizeof(char*));
+    int *lengths = (int*)malloc((numLines + 1) * sizeof(int));
+    if(lines == NULL || lengths == NULL)
+    {
+        perror("Unable to split script into lines.");
+        free(lines);
+        free(lengths);
+        free(script);
+        return 1;
+    }
+    char *line = script;
+    for(i = 0; i < numLines; i++)
+    {
+        char *newline = memchr(line, '\n', script + size - line);
+        char *lineEnd = newline ? newline : script + size;
+        *lineEnd = '\0';
+        lines[i] = line;
+        lengths[i] = lineEnd - line;
+        line = lineEnd + 1;
+    }
+
+    OutBuf out;
+    memset(&out, 0, sizeof(OutBuf));
+    OutBuf *sink = quiet ? NULL : &out;
+
+    struct timespec began;
+    clock_gettime(CLOCK_MONOTONIC, &began);
+
+    long sessionsStarted = 0;
+    long sessionsFinished = 0;
+    long turns = 0;
+    long moves = 0;
+
+    Session session;
+    bool playing = false;
+
+    size_t next = 0;
+    long finishedThisPass = 0;
+    while(numLines > 0)
+    {
+        if(next == numLines)
+        {
+            /* Only go around again if there are sessions left and the last pass got somewhere */
+            if(numSessions == 0 || sessionsFinished >= numSessions || finishedThisPass == 0)
+            {
+                break;
+            }
+            next = 0;
+            finishedThisPass = 0;
+        }
+
+        /* Sessions only start once there is a line for them to play */
+        if(!playing)
+        {
+            StartSession(&session, world);
+            if(sessionSnapshot != NULL)
+            {
+                AttachSnapshot(&session, sessionSnapshot);
+            }
+            sessionsStarted++;
+            playing = true;
+        }
+
+        ShowRoom(&session, sink);
+        int stepsBefore = session.steps;
+        bool won = PlayTurn(&session, lines[next], lengths[next], sink);
+        next++;
+        turns++;
+        moves += session.steps - stepsBefore;
+
+        if(sink != NULL && out.length >= SCRIPT_FLUSH_SIZE)
+        {
+            FlushOutput(&out, STDOUT_FILENO);
+        }
+
+        if(won)
+        {
+            sessionsFinished++;
+            finishedThisPass++;
+            if(numSessions > 0 && sessionsFinished >= numSessions)
+            {
+                break;
+            }
+            EndSession(&session);
+            playing = false;
+        }
+    }
+    if(playing)
+    {
+        EndSession(&session);
+    }
+
+    struct timespec finished;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double elapsed = (finished.tv_sec - began.tv_sec) + (finished.tv_nsec - began.tv_nsec) / 1e9;
+
+    AppendFormat(&out, "SESSIONS: %ld FINISHED: %ld TURNS: %ld MOVES: %ld SECONDS: %.6f TURNS/SEC: %.0f\n",
+                 sessionsStarted, sessionsFinished, turns, moves, elapsed, elapsed > 0 ? turns / elapsed : 0.0);
+    FlushOutput(&out, STDOUT_FILENO);
+
+    free(out.data);
+    free(lines);
+    free(lengths);
+    free(script);
+    return 0;
+}
+
+/*
+ * Prints the distance to the end from every room named in queryPath, one
+ * name per line, or from standard input for "-". Names are answered
+ * QUERY_BATCH at a time with FindDistances, so a batch costs one search
+ * out from the end rather than a search per room, or nothing at all with
+ * --distances. Each line of output is the name and its distance, or
+ * UNREACHABLE or UNKNOWN.
+ */
+int AnswerQueries(const World *world, const char *queryPath)
+{
+    FILE *file = strcmp(queryPath, "-") == 0 ? stdin : fopen(queryPath, "r");
+    if(file == NULL)
+    {
+        perror("Unable to open queries.");
+        return 1;
+    }
+
+    char **names = (char**)calloc(QUERY_BATCH, sizeof(char*));
+    size_t *capacities = (size_t*)calloc(QUERY_BATCH, sizeof(size_t));
+    uint32_t *rooms = (uint32_t*)malloc(QUERY_BATCH * sizeof(uint32_t));
+    uint32_t *distances = (uint32_t*)malloc(QUERY_BATCH * sizeof(uint32_t));
+    OutBuf out;
+    memset(&out, 0, sizeof(OutBuf));
+    int result = 0;
+    if(names == NULL || capacities == NULL || rooms == NULL || distances == NULL)
+    {
+        perror("Unable to allocate queries.");
+        result = 1;
+    }
+
+    bool more = result == 0;
+    while(more)
+    {
+        /* Read a batch, taking unknown names past the last room so they come back as NO_PATH */
+        uint32_t count = 0;
+        ssize_t length;
+        while(count < QUERY_BATCH && (length = getline(&names[count], &capacities[count], file)) != -1)
+        {
+            if(length > 0 && names[count][length - 1] == '\n')
+            {
+                names[count][length - 1] = '\0';
+            }
+            int room = GetRoomFromName(world, names[count]);
+            rooms[count++] = room < 0 ? world->numRooms : (uint32_t)room;
+        }
+        more = count == QUERY_BATCH;
+
+        FindDistances(world, &searches[0], rooms, count, distances);
+        uint32_t i;
+        for(i = 0; i < count; i++)
+        {
+            if(rooms[i] == world->numRooms)
+            {
+                AppendFormat(&out, "%s UNKNOWN\n", names[i]);
+            }
+            else if(distances[i] == NO_PATH)
+            {
+                AppendFormat(&out, "%s UNREACHABLE\n", names[i]);
+            }
+            else
+            {
+                AppendFormat(&out, "%s %u\n", names[i], distances[i]);
+            }
+            if(out.length >= SCRIPT_FLUSH_SIZE)
+            {
+                FlushOutput(&out, STDOUT_FILENO);
+            }
+        }
+    }
+    FlushOutput(&out, STDOUT_FILENO);
+    if(ferror(file))
+    {
+        perror("Unable to read queries.");
+        result = 1;
+    }
+
+    uint32_t i;
+    for(i = 0; names != NULL && i < QUERY_BATCH; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
+    free(capacities);
+    free(rooms);
+    free(distances);
+    free(out.data);
+    if(file != stdin)
+    {
+        fclose(file);
+    }
+    return result;
+}
+
+/*
+ * Serves games over a Unix domain socket until interrupted. The world is
+ * shared read-only by every session; each connection only carries its own
+ * Session plus its unread input and unsent output. numThreads event loops
+ * each run their own epoll instance and take turns accepting players.
+ */
+int RunServer(const World *world, const char *socketPath, int numThreads)
+{
+    /* Tens of thousands of players need as many descriptors as we may have */
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(listenFd == -1)
+    {
+        perror("Unable to create socket.");
+        return 1;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path %s is too long.\n", socketPath);
+        close(listenFd);
+        return 1;
+    }
+    strcpy(address.sun_path, socketPath);
+    unlink(socketPath);
+
+    if(bind(listenFd, (struct sockaddr*)&address, sizeof(address)) == -1 || listen(listenFd, SOMAXCONN) == -1)
+    {
+        perror("Unable to listen on socket.");
+        close(listenFd);
+        return 1;
+    }
+
+    /* Stop cleanly on Ctrl-C and kill, and never die writing to a player who left */
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = StopServer;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if(numThreads < 1)
+    {
+        numThreads = 1;
+    }
+
+    ServerLoop *loops = (ServerLoop*)calloc(numThreads, sizeof(ServerLoop));
+    int i;
+    for(i = 0; i < numThreads; i++)
+    {
+        loops[i].world = world;
+        loops[i].channel = i;
+        loops[i].listenFd = listenFd;
+        loops[i].epollFd = epoll_create1(EPOLL_CLOEXEC);
+
+        /* Only one loop is woken for each new player */
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.ptr = NULL;
+        if(loops[i].epollFd == -1 || epoll_ctl(loops[i].epollFd, EPOLL_CTL_ADD, listenFd, &event) == -1)
+        {
+            perror("Unable to create event loop.");
+            return 1;
+        }
+    }
+
+    /* The main thread runs the first loop itself */
+    for(i = 1; i < numThreads; i++)
+    {
+        if(pthread_create(&loops[i].thread, NULL, ServeLoop, &loops[i]) != 0)
+        {
+            perror("Unable to start event loop.");
+            serverDone = 1;
+            numThreads = i;
+            break;
+        }
+    }
+    ServeLoop(&loops[0]);
+
+    long served = loops[0].sessionsServed;
+    long finished = loops[0].sessionsFinished;
+    for(i = 1; i < numThreads; i++)
+    {
+        pthread_join(loops[i].thread, NULL);
+        served += loops[i].sessionsServed;
+        finished += loops[i].sessionsFinished;
+    }
+    for(i = 0; i < numThreads; i++)
+    {
+        close(loops[i].epollFd);
+    }
+
+    close(listenFd);
+    unlink(socketPath);
+    free(loops);
+    fprintf(stderr, "Served %ld sessions, %ld reached the end room.\n", served, finished);
+    return 0;
+}
+
+/*
+ * Signal handler asking every event loop to wind down.
+ */
+void StopServer(int signal)
+{
+    (void)signal;
+    serverDone = 1;
+}
+
+/*
+ * Runs one event loop until the server stops: accepts players, plays
+ * every complete line they send, and writes back whatever the socket takes.
+ */
+void *ServeLoop(void *arg)
+{
+    ServerLoop *loop = (ServerLoop*)arg;
+    struct epoll_event events[SERVER_EVENTS];
+
+    while(!serverDone)
+    {
+        int count = epoll_wait(loop->epollFd, events, SERVER_EVENTS, 500);    // Wake up now and then to notice serverDone
+        int i;
+        for(i = 0; i < count; i++)
+        {
+            Connection *connection = (Connection*)events[i].data.ptr;
+            if(connection == NULL)
+            {
+                AcceptPlayers(loop);
+                continue;
+            }
+
+            if(events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                connection->closing = true;
+                connection->out.length = 0;
+            }
+            if(!connection->closing && (events[i].events & EPOLLIN))
+            {
+                ReadFromPlayer(loop, connection);
+            }
+            if(connection->out.length > 0)
+            {
+                WriteToPlayer(connection);
+            }
+
+            if(connection->closing && connection->out.length == 0)
+            {
+                CloseConnection(loop, connection);
+            }
+            else
+            {
+                WatchConnection(loop, connection);
+            }
+        }
+    }
+
+    /* Say goodbye to whoever is still here */
+    while(loop->connections != NULL)
+    {
+        CloseConnection(loop, loop->connections);
+    }
+
+    return NULL;
+}
+
+/*
+ * Accepts every player waiting on the listening socket and shows each one
+ * the start room.
+ */
+void AcceptPlayers(ServerLoop *loop)
+{
+    while(true)
+    {
+        int fd = accept4(loop->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd == -1)
+        {
+            return;                 // EAGAIN, or out of descriptors until someone leaves
+        }
+
+        Connection *connection = (Connection*)calloc(1, sizeof(Connection));
+        if(connection == NULL)
+        {
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        StartSession(&connection->session, loop->world);
+        connection->session.channel = loop->channel;
+
+        /* Keep a list so everyone can be closed at shutdown */
+        connection->next = loop->connections;
+        if(loop->connections != NULL)
+        {
+            loop->connections->prev = connection;
+        }
+        loop->connections = connection;
+        loop->sessionsServed++;
+
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = connection;
+        connection->watching = EPOLLIN;
+        if(epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event) == -1)
+        {
+            CloseConnection(loop, connection);
+            continue;
+        }
+
+        ShowRoom(&connection->session, &connection->out);
+        WriteToPlayer(connection);
+        WatchConnection(loop, connection);
+    }
+}
+
+/*
+ * Reads whatever the player sent and plays each complete line as a turn.
+ * A player who reaches the end room gets the victory message and is then
+ * disconnected, just like the game ends on the terminal.
+ */
+void ReadFromPlayer(ServerLoop *loop, Connection *connection)
+{
+    char buffer[4096];
+    ssize_t got;
+    while((got = read(connection->fd, buffer, sizeof(buffer))) > 0)
+    {
+        ssize_t i;
+        for(i = 0; i < got && !connection->closing; i++)
+        {
+            char c = buffer[i];
+            if(c != '\n')
+            {
+                /* Anything longer than a room name can't match one anyway */
+                if(connection->inputLength < MAX_INPUT_LENGTH)
+                {
+                    connection->input[connection->inputLength] = c;
+                }
+                connection->inputLength++;
+                continue;
+            }
+
+            int length = connection->inputLength < MAX_INPUT_LENGTH ? connection->inputLength : MAX_INPUT_LENGTH;
+            connection->input[length] = '\0';
+            if(length > 0 && connection->input[length - 1] == '\r')
+            {
+                connection->input[--length] = '\0';
+            }
+            connection->inputLength = 0;
+
+            if(PlayTurn(&connection->session, connection->input, length, &connection->out))
+            {
+                loop->sessionsFinished++;
+                connection->closing = true;
+            }
+            else
+            {
+                ShowRoom(&connection->session, &connection->out);
+            }
+        }
+
+        /* Stop reading from players who don't read their replies */
+        if(connection->closing || connection->out.length > MAX_PENDING_OUTPUT)
+        {
+            return;
+        }
+    }
+
+    if(got == 0)
+    {
+        connection->closing = true;         // Player hung up
+        connection->out.length = 0;
+    }
+}
+
+/*
+ * Writes as much pending output as the socket takes right now.
+ */
+void WriteToPlayer(Connection *connection)
+{
+    size_t written = 0;
+    while(written < connection->out.length)
+    {
+        ssize_t result = write(connection->fd, connection->out.data + written, connection->out.length - written);
+        if(result <= 0)
+        {
+            if(result == -1 && errno != EAGAIN && errno != EINTR)
+            {
+                connection->closing = true;     // Player is gone, drop what's left
+                connection->out.length = 0;
+                return;
+            }
+            break;
+        }
+        written += result;
+    }
+
+    memmove(connection->out.data, connection->out.data + written, connection->out.length - written);
+    connection->out.length -= written;
+}
+
+/*
+ * Asks epoll for writability only while output is pending, and stops
+ * reading while too much of it is pending.
+ */
+void WatchConnection(ServerLoop *loop, Connection *connection)
+{
+    uint32_t wanted = 0;
+    if(!connection->closing && connection->out.length <= MAX_PENDING_OUTPUT)
+    {
+        wanted |= EPOLLIN;
+    }
+    if(connection->out.length > 0)
+    {
+        wanted |= EPOLLOUT;
+    }
+
+    if(wanted != connection->watching)
+    {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = wanted;
+        event.data.ptr = connection;
+        epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, connection->fd, &event);
+        connection->watching = wanted;
+    }
+}
+
+/*
+ * Ends the player's session and releases the connection.
+ */
+void CloseConnection(ServerLoop *loop, Connection *connection)
+{
+    if(connection->prev != NULL)
+    {
+        connection->prev->next = connection->next;
+    }
+    else
+    {
+        loop->connections = connection->next;
+    }
+    if(connection->next != NULL)
+    {
+        connection->next->prev = connection->prev;
+    }
+
+    close(connection->fd);                  // Also removes it from epoll
+    EndSession(&connection->session);
+    free(connection->out.data);
+    free(connection);
+}
+
+/*
+ * Puts a session in the start room with an empty path.
+ */
+void StartSession(Session *session, const World *world)
+{
+    session->world = world;
+    session->id = __atomic_fetch_add(&nextSessionId, 1, __ATOMIC_RELAXED);
+    session->channel = 0;
+    session->room = GetStartRoom(world);
+    session->steps = 0;
+    session->generation = __atomic_load_n(&world->generation, __ATOMIC_ACQUIRE);
+    StartPath(&session->path);
+    session->scratch.blocks = NULL;
+    session->snapshot = NULL;
+}
+
+/*
+ * Releases the session's path and scratch memory.
+ */
+void EndSession(Session *session)
+{
+    EndPath(&session->path);
+    FreeArena(&session->scratch);
+}
+
+/*
+ * Shows the current location and its connections, then prompts for the
+ * next one. Does nothing when out is NULL.
+ */
+void ShowRoom(Session *session, OutBuf *out)
+{
+    if(out == NULL)
+    {
+        return;
+    }
+
+    const Prompt *prompt = GetPrompt(session->world, session->room);
+    if(prompt != NULL)
+    {
+        Append(out, prompt->text, prompt->length);
+        return;
+    }
+
+    /* Out of memory for the cache, so make a copy just for this turn */
+    size_t length = FormatPrompt(session->world, session->room, NULL);
+    char *text = (char*)ArenaAlloc(&session->scratch, length);
+    if(text != NULL)
+    {
+        FormatPrompt(session->world, session->room, text);
+        Append(out, text, length);
+    }
+}
+
+/*
+ * Plays one line of input and counts it, timing it for the turn latency
+ * histogram when statistics are being collected. Returns true when the
+ * move reached the end room.
+ */
+bool PlayTurn(Session *session, char *line, int length, OutBuf *out)
+{
+    uint64_t timer = StartTimer();
+    bool won = TakeTurn(session, line, length, out);
+    CountStat(STAT_TURNS, 1);
+    RecordLatency(timer);
+    return won;
+}
+
+/*
+ * Plays one line of input: a move, "time", "hint", "stats", or a tab
+ * completion request. Appends the response to out unless it is NULL.
+ * Returns true when the move reached the end room, after appending the
+ * victory message.
+ */
+bool TakeTurn(Session *session, char *line, int length, OutBuf *out)
+{
+    const World *world = session->world;
+    ResetArena(&session->scratch);
+
+    /* Another process may have patched the world file since the last turn */
+    if(world->fileGeneration != NULL && !CatchUpWorld(session, out))
+    {
+        return false;
+    }
+
+    /* A trailing tab asks for the connections that complete the line */
+    if(length > 0 && line[length-1] == '\t')
+    {
+        if(out != NULL)
+        {
+            line[length-1] = '\0';
+            char *completions = GetCompletions(world, session->room, line, &session->scratch);
+            if(completions != NULL)
+            {
+                AppendString(out, "COMPLETIONS: ");
+                AppendString(out, completions);
+                Append(out, "\n", 1);
+            }
+            line[length-1] = '\t';
+        }
+        return false;
+    }
+
+    /* Look up the name, or an unambiguous abbreviation of one */
+    int next = ResolveConnection(world, session->room, line);
+
+    if(next >= 0 && WorldMoved(session)) /* Connections changed while we looked them up */
+    {
+        if(out != NULL)
+        {
+            AppendString(out, "THE WORLD SHIFTED AS YOU MOVED. TRY AGAIN.\n");
+        }
+    }
+    else if(next >= 0 && world->changes != NULL && !IsDoorOpen(world, session->room, next)) /* Live world in the way */
+    {
+        if(out != NULL)
+        {
+            if(IsRoomClosed(world, session->room))
+            {
+                AppendString(out, "THIS ROOM IS CLOSED. NOBODY LEAVES UNTIL IT OPENS AGAIN.\n");
+            }
+            else if(IsRoomClosed(world, next))
+            {
+                AppendFormat(out, "%s IS CLOSED. TRY AGAIN.\n", GetRoomName(world, next));
+            }
+            else
+            {
+                AppendFormat(out, "THE DOOR TO %s IS LOCKED. TRY AGAIN.\n", GetRoomName(world, next));
+            }
+        }
+    }
+    else if(next >= 0 && !RecordMove(&session->path, next)) /* Path can't grow, so the move isn't taken */
+    {
+        if(out != NULL)
+        {
+            AppendString(out, "YOUR PATH CAN'T BE RECORDED RIGHT NOW. TRY AGAIN.\n");
+        }
+    }
+    else if(next >= 0) /* Match found */
+    {
+        /* Move to the target room; the path taken has it already */
+        uint32_t from = session->room;
+        session->room = next;
+        session->steps++;
+        CountStat(STAT_MOVES, 1);
+        if(session->snapshot != NULL)
+        {
+            SaveMove(session);
+        }
+        if(spectatorFeed != NULL)
+        {
+            PublishMove(spectatorFeed, session->channel, session->id, from, session->room, session->steps);
+        }
+
+        if(session->room == GetEndRoom(world))
+        {
+            /* User has found the end room */
+            if(out != NULL)
+            {
+                AppendString(out, "YOU HAVE FOUND THE END ROOM. CONGRATULATIONS!\n");
+                AppendFormat(out, "YOU TOOK %d STEPS. YOUR PATH TO VICTORY WAS:\n", session->steps);
+                AppendPath(out, world, &session->path);
+                if(world->par != NO_PATH)
+                {
+                    AppendFormat(out, "PAR FOR THIS WORLD IS %u STEPS.\n", world->par);
+                }
+            }
+            return true;
+        }
+    }
+    else if(strcmp("hint", line) == 0) /* User wants to know the way */
+    {
+        if(out != NULL)
+        {
+            uint32_t step;
+            uint32_t distance = FindRoute(world, &searches[session->channel], session->room, &step);
+            if(WorldMoved(session))
+            {
+                AppendString(out, "HINT: THE WORLD IS SHIFTING. ASK AGAIN.\n");
+            }
+            else if(distance == NO_PATH)
+            {
+                AppendString(out, "HINT: THERE IS NO WAY TO THE END FROM HERE.\n");
+            }
+            else
+            {
+                AppendFormat(out, "HINT: TRY %s. THE END IS %u STEPS AWAY.\n", GetRoomName(world, step), distance);
+            }
+        }
+    }
+    else if(strcmp("stats", line) == 0) /* User wants to know where the time goes */
+    {
+        if(out != NULL)
+        {
+            size_t statsLength = FormatStats(NULL, 0);
+            char *text = (char*)ArenaAlloc(&session->scratch, statsLength + 1);
+            if(text != NULL)
+            {
+                FormatStats(text, statsLength + 1);
+                Append(out, text, statsLength);
+            }
+        }
+    }
+    else if(strcmp("time", line) == 0) /* User wants the time */
+    {
+        char buffer[TIME_LENGTH];
+        GetCurrentTime(&background, session->channel, buffer, sizeof(buffer));
+        if(out != NULL)
+        {
+            AppendString(out, buffer);
+        }
+    }
+    else if(world->changes != NULL && ChangeWorld(session, line, out)) /* User changes a live world */
+    {
+        CountStat(STAT_WORLD_CHANGES, 1);
+    }
+    else if(out != NULL)    /* Invalid input */
+    {
+        AppendString(out, "HUH? I DON’T UNDERSTAND THAT ROOM. TRY AGAIN.\n");
+    }
+
+    return false;
+}
+
+/*
+ * Plays a command that changes a live world: "lock <room>" and
+ * "unlock <room>" for a door of the current room, named or abbreviated
+ * like a move, and "close <room>", "open <room>" and "reroll <room>" for
+ * any room by its full name. Appends the outcome to out unless it is
+ * NULL. Returns false if the line isn't one of them.
+ */
+bool ChangeWorld(Session *session, const char *line, OutBuf *out)
+{
+    const World *world = session->world;
+    uint64_t repairedBefore = world->changes->repaired;
+    char message[2 * MAX_ROOM_NAME_LENGTH + 64];
+
+    if(strncmp(line, "lock ", 5) == 0 || strncmp(line, "unlock ", 7) == 0)
+    {
+        bool locking = line[0] == 'l';
+        const char *name = line + (locking ? 5 : 7);
+        int door = ResolveConnection(world, session->room, name);
+        if(door < 0)
+        {
+            snprintf(message, sizeof(message), "THERE IS NO DOOR TO %s HERE.\n", name);
+        }
+        else if(locking ? LockDoor(world, session->room, door) : UnlockDoor(world, session->room, door))
+        {
+            snprintf(message, sizeof(message), "THE DOOR TO %s IS NOW %s.\n",
+                     GetRoomName(world, door), locking ? "LOCKED" : "UNLOCKED");
+        }
+        else
+        {
+            snprintf(message, sizeof(message), "THE DOOR TO %s IS %s.\n",
+                     GetRoomName(world, door), locking ? "ALREADY LOCKED" : "NOT LOCKED");
+        }
+    }
+    else if(strncmp(line, "close ", 6) == 0 || strncmp(line, "open ", 5) == 0)
+    {
+        bool closing = line[0] == 'c';
+        const char *name = line + (closing ? 6 : 5);
+        int room = GetRoomFromName(world, name);
+        if(room < 0)
+        {
+            snprintf(message, sizeof(message), "HUH? I DON’T UNDERSTAND THAT ROOM. TRY AGAIN.\n");
+        }
+        else if(closing && (uint32_t)room != session->room && CloseRoom(world, room))
+        {
+            snprintf(message, sizeof(message), "%s IS NOW CLOSED.\n", name);
+        }
+        else if(!closing && OpenRoom(world, room))
+        {
+            snprintf(message, sizeof(message), "%s IS OPEN AGAIN.\n", name);
+        }
+        else
+        {
+            snprintf(message, sizeof(message), closing ? "%s CAN'T BE CLOSED.\n" : "%s ISN'T CLOSED.\n", name);
+        }
+    }
+    else if(strncmp(line, "reroll ", 7) == 0)
+    {
+        /* Connections change in place, so the world's arrays are written through after all */
+        const char *name = line + 7;
+        int room = GetRoomFromName(world, name);
+        if(room < 0)
+        {
+            snprintf(message, sizeof(message), "HUH? I DON’T UNDERSTAND THAT ROOM. TRY AGAIN.\n");
+        }
+        else if(rerolls.numRooms == 0 &&
+                !InitializeReroll(&rerolls, world, ((uint64_t)time(NULL) << 20) ^ ((uint64_t)getpid() << 40)))
+        {
+            snprintf(message, sizeof(message), "%s CAN'T BE REROLLED RIGHT NOW.\n", name);
+        }
+        else if(RerollRooms(&rerolls, (World*)world, (const uint32_t*)&room, 1))
+        {
+            ForgetPrompts(world, rerolls.touched, rerolls.numTouched);
+            snprintf(message, sizeof(message), "THE DOORS OF %s NOW LEAD SOMEWHERE ELSE.\n", name);
+        }
+        else
+        {
+            snprintf(message, sizeof(message), "%s CAN'T BE REROLLED WITHOUT CUTTING THE WORLD IN TWO.\n", name);
+        }
+    }
+    else
+    {
+        return false;
+    }
+
+    /* Par is the start's distance, which the repairs have just kept up to date */
+    ((World*)world)->par = world->distanceToEnd[world->startRoom];
+    CountStat(STAT_ROOMS_REPAIRED, world->changes->repaired - repairedBefore);
+    if(out != NULL)
+    {
+        AppendString(out, message);
+    }
+    return true;
+}
+
+/*
+ * Appends length bytes of data to the output buffer, growing it as needed.
+ */
+void Append(OutBuf *out, const char *data, size_t length)
+{
+    if(out->length + length > out->capacity)
+    {
+        size_t capacity = out->capacity ? out->capacity : 4096;
+        while(capacity < out->length + length)
+        {
+            capacity *= 2;
+        }
+        char *grown = (char*)realloc(out->data, capacity);
+        if(grown == NULL)
+        {
+            return;
+        }
+        out->data = grown;
+        out->capacity = capacity;
+    }
+
+    memcpy(out->data + out->length, data, length);
+    out->length += length;
+}
+
+/*
+ * Appends a NUL terminated string to the output buffer.
+ */
+void AppendString(OutBuf *out, const char *text)
+{
+    Append(out, text, strlen(text));
+}
+
+/*
+ * Appends printf style formatted text to the output buffer.
+ */
+void AppendFormat(OutBuf *out, const char *format, ...)
+{
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    if(length >= (int)sizeof(buffer))
+    {
+        char *large = (char*)malloc(length + 1);
+        va_start(args, format);
+        vsnprintf(large, length + 1, format, args);
+        va_end(args);
+        Append(out, large, length);
+        free(large);
+    }
+    else if(length > 0)
+    {
+        Append(out, buffer, length);
+    }
+}
+
+/*
+ * Writes everything in the output buffer to fd and empties it.
+ */
+void FlushOutput(OutBuf *out, int fd)
+{
+    size_t written = 0;
+    while(written < out->length)
+    {
+        ssize_t result = write(fd, out->data + written, out->length - written);
+        if(result <= 0)
+        {
+            break;
+        }
+        written += result;
+    }
+    out->length = 0;
+}
+
+/*
+ * Returns size bytes of scratch memory from the specified arena, 8-byte
+ * aligned, or NULL if memory runs out. When the newest block is full a
+ * new one at least twice its size is chained in front of it.
+ */
+void *ArenaAlloc(Arena *arena, size_t size)
+{
+    size = (size + 7) & ~7UL;
+    ArenaBlock *block = arena->blocks;
+    if(block == NULL || block->size - block->used < size)
+    {
+        size_t blockSize = block == NULL ? ARENA_BLOCK : block->size * 2;
+        while(blockSize < size)
+        {
+            blockSize *= 2;
+        }
+
+        ArenaBlock *grown = (ArenaBlock*)malloc(sizeof(ArenaBlock) + blockSize);
+        if(grown == NULL)
+        {
+            return NULL;
+        }
+        CountStat(STAT_ARENA_BLOCKS, 1);
+        grown->next = block;
+        grown->size = blockSize;
+        grown->used = 0;
+        arena->blocks = block = grown;
+    }
+
+    void *result = block->data + block->used;
+    block->used += size;
+    return result;
+}
+
+/*
+ * Empties the specified arena. Only the newest block, which is also the
+ * biggest, is kept, so an arena settles at the size its busiest turn
+ * needed.
+ */
+void ResetArena(Arena *arena)
+{
+    ArenaBlock *block = arena->blocks;
+    if(block == NULL)
+    {
+        return;
+    }
+
+    ArenaBlock *older = block->next;
+    while(older != NULL)
+    {
+        ArenaBlock *next = older->next;
+        free(older);
+        older = next;
+    }
+    block->next = NULL;
+    block->used = 0;
+}
+
+/*
+ * Releases every block of the specified arena.
+ */
+void FreeArena(Arena *arena)
+{
+    while(arena->blocks != NULL)
+    {
+        ArenaBlock *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+}
+
+/*
+ * Empties the specified path. Nothing is allocated until the first move.
+ */
+void StartPath(PathLog *path)
+{
+    memset(path, 0, sizeof(PathLog));
+    path->spillFd = -1;
+}
+
+/*
+ * Adds a room to the end of the specified path, doubling the memory it
+ * keeps until that reaches PATH_CHUNK moves and spilling it from then on.
+ * Returns false if the move couldn't be kept.
+ */
+bool RecordMove(PathLog *path, uint32_t room)
+{
+    if(path->length == path->capacity)
+    {
+        if(path->capacity == PATH_CHUNK)
+        {
+            if(!SpillPath(path))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            uint32_t capacity = path->capacity == 0 ? 16 : path->capacity * 2;
+            uint32_t *rooms = (uint32_t*)realloc(path->rooms, capacity * sizeof(uint32_t));
+            if(rooms == NULL)
+            {
+                return false;
+            }
+            path->rooms = rooms;
+            path->capacity = capacity;
+        }
+    }
+
+    path->rooms[path->length++] = room;
+    return true;
+}
+
+/*
+ * Writes the moves the specified path holds in memory to the end of its
+ * temporary file, creating the file first if need be. The file has no
+ * name, so it goes away with the path even if the process dies.
+ */
+bool SpillPath(PathLog *path)
+{
+    CountStat(STAT_PATH_SPILLS, 1);
+    if(path->spillFd == -1)
+    {
+        const char *directory = getenv("TMPDIR");
+        if(directory == NULL)
+        {
+            directory = "/tmp";
+        }
+        path->spillFd = open(directory, O_TMPFILE | O_RDWR, 0600);
+        if(path->spillFd == -1)
+        {
+            /* Filesystems without O_TMPFILE get a named file that is unlinked straight away */
+            char name[256];
+            snprintf(name, sizeof(name), "%s/waltsara.path.XXXXXX", directory);
+            path->spillFd = mkstemp(name);
+            if(path->spillFd == -1)
+            {
+                return false;
+            }
+            unlink(name);
+        }
+    }
+
+    size_t size = path->length * sizeof(uint32_t);
+    size_t written = 0;
+    while(written < size)
+    {
+        ssize_t result = pwrite(path->spillFd, (char*)path->rooms + written, size - written,
+                                path->spilled * sizeof(uint32_t) + written);
+        if(result <= 0)
+        {
+            return false;
+        }
+        written += result;
+    }
+
+    path->spilled += path->length;
+    path->length = 0;
+    return true;
+}
+
+/*
+ * Appends the name of every room along the specified path to out, one per
+ * line, reading spilled moves back a chunk at a time.
+ */
+void AppendPath(OutBuf *out, const World *world, const PathLog *path)
+{
+    uint32_t chunk[1024];
+    uint64_t done = 0;
+    while(done < path->spilled)
+    {
+        uint64_t count = path->spilled - done < 1024 ? path->spilled - done : 1024;
+        ssize_t result = pread(path->spillFd, chunk, count * sizeof(uint32_t), done * sizeof(uint32_t));
+        if(result < (ssize_t)sizeof(uint32_t))
+        {
+            break;
+        }
+        count = result / sizeof(uint32_t);
+
+        uint64_t i;
+        for(i = 0; i < count; i++)
+        {
+            AppendString(out, GetRoomName(world, chunk[i]));
+            Append(out, "\n", 1);
+        }
+        done += count;
+    }
+
+    uint32_t i;
+    for(i = 0; i < path->length; i++)
+    {
+        AppendString(out, GetRoomName(world, path->rooms[i]));
+        Append(out, "\n", 1);
+    }
+}
+
+/*
+ * Releases the specified path's memory and temporary file.
+ */
+void EndPath(PathLog *path)
+{
+    free(path->rooms);
+    if(path->spillFd != -1)
+    {
+        close(path->spillFd);
+    }
+    StartPath(path);
+}
+
+/*
+ * Opens the snapshot file at path for sessions played in world, creating
+ * it if need be. With resume, the first session attached to it picks up
+ * where the file left off; otherwise it starts the file over.
+ */
+bool OpenSnapshot(SnapshotLog *log, const char *path, const World *world, bool resume)
+{
+    memset(log, 0, sizeof(SnapshotLog));
+    log->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    log->fingerprint = FingerprintWorld(world);
+    log->resume = resume;
+    return log->fd != -1;
+}
+
+/*
+ * Closes the snapshot file. The worker must have finished its writes.
+ */
+void CloseSnapshot(SnapshotLog *log)
+{
+    if(log->fd != -1)
+    {
+        close(log->fd);
+    }
+    log->fd = -1;
+}
+
+/*
+ * Has a newly started session save into the snapshot. The first session
+ * is rebuilt from what the file holds when resuming; every other one, or
+ * one that can't be resumed, empties the file down to a new header.
+ */
+void AttachSnapshot(Session *session, SnapshotLog *log)
+{
+    session->snapshot = log;
+    bool resumed = log->resume && ResumeSession(session, log);
+    log->resume = false;
+    if(!resumed)
+    {
+        RestartSnapshot(session);
+    }
+}
+
+/*
+ * Rebuilds the session from its snapshot: the room the moves lead to, the
+ * step count and the path. Nothing is replayed; each record is checked to
+ * be a connection of the room before it and decoding stops at the first
+ * that isn't, or was cut short. Returns false, leaving the session at the
+ * start, if the file is of another world or the session already won.
+ */
+bool ResumeSession(Session *session, SnapshotLog *log)
+{
+    const World *world = session->world;
+    uint64_t timer = StartTimer();
+    struct stat st;
+    if(fstat(log->fd, &st) == -1 || (size_t)st.st_size < sizeof(SnapshotHeader))
+    {
+        return false;
+    }
+
+    size_t size = st.st_size;
+    uint8_t *data = (uint8_t*)malloc(size);
+    size_t done = 0;
+    while(data != NULL && done < size)
+    {
+        ssize_t result = pread(log->fd, data + done, size - done, done);
+        if(result <= 0)
+        {
+            break;
+        }
+        done += result;
+    }
+
+    SnapshotHeader header;
+    if(data == NULL || done < size)
+    {
+        free(data);
+        return false;
+    }
+    memcpy(&header, data, sizeof(SnapshotHeader));
+    if(memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION ||
+       header.fingerprint != log->fingerprint || header.startRoom != GetStartRoom(world))
+    {
+        fprintf(stderr, "Snapshot is of another world, starting over.\n");
+        free(data);
+        return false;
+    }
+
+    uint32_t room = header.startRoom;
+    int steps = 0;
+    size_t position = sizeof(SnapshotHeader);
+    size_t valid = position;
+    while(position < size)
+    {
+        /* One varint, which may have been cut short */
+        uint64_t code = 0;
+        int shift = 0;
+        bool complete = false;
+        while(position < size && shift < 64)
+        {
+            uint8_t byte = data[position++];
+            code |= (uint64_t)(byte & 0x7F) << shift;
+            shift += 7;
+            if((byte & 0x80) == 0)
+            {
+                complete = true;
+                break;
+            }
+        }
+
+        int64_t next = (int64_t)room + ((int64_t)(code >> 1) ^ -(int64_t)(code & 1));
+        if(!complete || next < 0 || next >= world->numRooms || !IsConnected(world, room, next) ||
+           !RecordMove(&session->path, next))
+        {
+            break;
+        }
+        room = next;
+        steps++;
+        valid = position;
+    }
+    free(data);
+
+    if(room == GetEndRoom(world))
+    {
+        EndPath(&session->path);
+        return false;
+    }
+
+    /* Anything past the last good record is dropped so new moves follow on from it */
+    if(valid < size && ftruncate(log->fd, valid) == -1)
+    {
+        EndPath(&session->path);
+        return false;
+    }
+
+    session->room = room;
+    session->steps = steps;
+    log->length = valid;
+    log->lastRoom = room;
+    StopTimer(STAT_RESUME_NS, timer);
+    return true;
+}
+
+/*
+ * Starts the session's snapshot over with a header for its world and
+ * current room. Queued behind any writes of the session before it.
+ */
+void RestartSnapshot(Session *session)
+{
+    SnapshotLog *log = session->snapshot;
+    SnapshotWrite *write = &log->slots[log->nextSlot++ % SNAPSHOT_SLOTS];
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(SnapshotHeader));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.startRoom = session->room;
+    header.fingerprint = log->fingerprint;
+
+    write->fd = log->fd;
+    write->offset = 0;
+    write->restart = true;
+    write->length = sizeof(SnapshotHeader);
+    memcpy(write->bytes, &header, sizeof(SnapshotHeader));
+    log->length = sizeof(SnapshotHeader);
+    log->lastRoom = session->room;
+    QueueSnapshotWrite(session, write);
+}
+
+/*
+ * Appends the move the session just made to its snapshot, one to five
+ * bytes for the worker to write.
+ */
+void SaveMove(Session *session)
+{
+    SnapshotLog *log = session->snapshot;
+    SnapshotWrite *write = &log->slots[log->nextSlot++ % SNAPSHOT_SLOTS];
+
+    int64_t delta = (int64_t)session->room - (int64_t)log->lastRoom;
+    uint64_t code = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+    uint8_t length = 0;
+    do
+    {
+        write->bytes[length++] = (code & 0x7F) | (code >= 0x80 ? 0x80 : 0);
+        code >>= 7;
+    } while(code != 0);
+
+    write->fd = log->fd;
+    write->offset = log->length;
+    write->restart = false;
+    write->length = length;
+    log->length += length;
+    log->lastRoom = session->room;
+    QueueSnapshotWrite(session, write);
+}
+
+/*
+ * Hands a snapshot write to the background worker on the session's
+ * channel. Writes have to land in order, so a full channel is waited on
+ * rather than skipped.
+ */
+void QueueSnapshotWrite(Session *session, SnapshotWrite *write)
+{
+    while(!SubmitJob(&background, session->channel, WriteSnapshot, NULL, write))
+    {
+        sched_yield();
+    }
+}
+
+/*
+ * Worker job carrying out one SnapshotWrite. A restart empties the file
+ * before writing the header, so a crash in between leaves nothing to
+ * resume rather than a new header over old moves.
+ */
+void WriteSnapshot(void *arg)
+{
+    SnapshotWrite *write = (SnapshotWrite*)arg;
+    CountStat(STAT_SNAPSHOT_WRITES, 1);
+    if(write->restart && ftruncate(write->fd, 0) == -1)
+    {
+        return;
+    }
+
+    size_t done = 0;
+    while(done < write->length)
+    {
+        ssize_t result = pwrite(write->fd, write->bytes + done, write->length - done, write->offset + done);
+        if(result <= 0)
+        {
+            return;                 // Resuming stops at the gap, which is the best we can do
+        }
+        done += result;
+    }
+}
+
+/*
+ * Initializes the specified graph with the room files in the specified
+ * directory. Everything is opened relative to the directory's descriptor,
+ * so the working directory is left alone, and the graph is sized from the
+ * number of regular files found. The files are parsed on the loader
+ * threads. Returns false if the directory or any room file can't be read.
+ */
+bool InitializeGraph(Graph *graph, const char *directory)
+{
+    memset(graph, 0, sizeof(Graph));
+
+    RoomLoader loader;
+    memset(&loader, 0, sizeof(RoomLoader));
+    loader.graph = graph;
+    loader.directory = open(directory, O_RDONLY | O_DIRECTORY);
+    if(loader.directory == -1)
+    {
+        return false;
+    }
+
+    /* fdopendir takes the descriptor over, so hand it a copy */
+    int listing = dup(loader.directory);
+    DIR *dp = listing == -1 ? NULL : fdopendir(listing);
+    if(dp == NULL)
+    {
+        if(listing != -1)
+        {
+            close(listing);
+        }
+        close(loader.directory);
+        return false;
+    }
+
+    int capacity = 0;
+    struct dirent *curEntry = NULL;
+    while((curEntry = readdir(dp)) != NULL)
+    {
+        /* Most filesystems tell us the type for free, the rest need a stat */
+        CountStat(STAT_DIRECTORY_ENTRIES, 1);
+        bool regular = curEntry->d_type == DT_REG;
+        if(curEntry->d_type == DT_UNKNOWN)
+        {
+            CountStat(STAT_STAT_CALLS, 1);
+            struct stat st;
+            regular = fstatat(loader.directory, curEntry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                      S_ISREG(st.st_mode);
+        }
+        if(!regular)
+        {
+            continue;
+        }
+
+        if(graph->numRooms == capacity)
+        {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            char **fileNames = (char**)realloc(loader.fileNames, capacity * sizeof(char*));
+            if(fileNames == NULL)
+            {
+                loader.failed = true;
+                break;
+            }
+            loader.fileNames = fileNames;
+        }
+        loader.fileNames[graph->numRooms] = strdup(curEntry->d_name);
+        if(loader.fileNames[graph->numRooms] == NULL)
+        {
+            loader.failed = true;
+            break;
+        }
+        graph->numRooms++;
+    }
+    closedir(dp);
+
+    if(!loader.failed)
+    {
+        graph->rooms = (Room*)calloc(graph->numRooms > 0 ? graph->numRooms : 1, sizeof(Room));
+        if(graph->rooms == NULL)
+        {
+            loader.failed = true;
+        }
+        else
+        {
+            RunInParallel(LoadRooms, &loader);
+        }
+    }
+
+    int i;
+    for(i = 0; i < graph->numRooms; i++)
+    {
+        free(loader.fileNames[i]);
+    }
+    free(loader.fileNames);
+    close(loader.directory);
+
+    if(loader.failed)
+    {
+        FreeGraph(graph);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Releases the rooms of a graph read by InitializeGraph.
+ */
+void FreeGraph(Graph *graph)
+{
+    int i;
+    for(i = 0; graph->rooms != NULL && i < graph->numRooms; i++)
+    {
+        free(graph->rooms[i].connections);
+    }
+    free(graph->rooms);
+    memset(graph, 0, sizeof(Graph));
+}
+
+/*
+ * Body of one room file loader thread. Claims files one at a time until
+ * they are all taken, so a slow file only holds up its own thread.
+ */
+void *LoadRooms(void *arg)
+{
+    RoomLoader *loader = (RoomLoader*)arg;
+    Graph *graph = loader->graph;
+
+    int room;
+    while((room = __atomic_fetch_add(&loader->nextRoom, 1, __ATOMIC_RELAXED)) < graph->numRooms)
+    {
+        if(__atomic_load_n(&loader->failed, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+        if(!InitializeRoom(&graph->rooms[room], loader->directory, loader->fileNames[room]))
+        {
+            fprintf(stderr, "Invalid room file %s.\n", loader->fileNames[room]);
+            __atomic_store_n(&loader->failed, true, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Initializes the specified room with the contents of the specified file
+ * in the specified directory. The file is read whole and the connection
+ * names are packed down over its start, so the buffer the file was read
+ * into becomes the room's connection list. Returns false if the file
+ * can't be read or has no usable name.
+ */
+bool InitializeRoom(Room *room, int directory, const char *filename)
+{
+    int fd = openat(directory, filename, O_RDONLY);
+    CountStat(STAT_READ_SYSCALLS, 1);
+    if(fd == -1)
+    {
+        return false;
+    }
+
+    struct stat st;
+    CountStat(STAT_STAT_CALLS, 1);
+    if(fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return false;
+    }
+
+    char *text = (char*)malloc(st.st_size + 1);
+    size_t length = 0;
+    while(text != NULL && length < (size_t)st.st_size)
+    {
+        ssize_t result = read(fd, text + length, st.st_size - length);
+        CountStat(STAT_READ_SYSCALLS, 1);
+        if(result <= 0)
+        {
+            break;
+        }
+        length += result;
+    }
+    close(fd);
+    CountStat(STAT_READ_SYSCALLS, 1);
+    CountStat(STAT_BYTES_READ, length);
+    CountStat(STAT_FILES_READ, 1);
+    if(text == NULL || length < (size_t)st.st_size)
+    {
+        free(text);
+        return false;
+    }
+    text[length] = '\0';
+
+    room->roomType = MID_ROOM;
+    size_t packed = 0;
+    char *line = text;
+    while(*line != '\0')
+    {
+        char *lineEnd = strchr(line, '\n');
+        if(lineEnd == NULL)
+        {
+            lineEnd = line + strlen(line);
+        }
+        char *next = *lineEnd == '\0' ? lineEnd : lineEnd + 1;
+        *lineEnd = '\0';
+
+        /* Every line is "KEY: value", connections numbered from 1 */
+        char *value = strstr(line, ": ");
+        if(value != NULL)
+        {
+            value += 2;
+            if(strncmp(line, "ROOM NAME", 9) == 0)
+            {
+                if(strlen(value) >= MAX_ROOM_NAME_LENGTH)
+                {
+                    free(text);
+                    return false;
+                }
+                strcpy(room->name, value);
+            }
+            else if(strncmp(line, "CONNECTION", 10) == 0)
+            {
+                size_t nameLength = strlen(value) + 1;
+                memmove(text + packed, value, nameLength);      // Never ahead of where we're reading
+                packed += nameLength;
+                room->connectCount++;
+            }
+            else if(strncmp(line, "ROOM TYPE", 9) == 0)
+            {
+                if(strcmp(value, "START_ROOM") == 0)
+                {
+                    room->roomType = START_ROOM;
+                }
+                else if(strcmp(value, "END_ROOM") == 0)
+                {
+                    room->roomType = END_ROOM;
+                }
+            }
+        }
+        line = next;
+    }
+
+    room->connections = text;
+    return room->name[0] != '\0';
+}
+
+/*
+ * Runs body on --load-threads threads, one per online CPU by default, and
+ * returns once they have all finished. The calling thread is one of them.
+ */
+void RunInParallel(void *(*body)(void *), void *arg)
+{
+    int numThreads = loadThreads;
+    if(numThreads <= 0)
+    {
+        numThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    pthread_t *threads = NULL;
+    int started = 0;
+    if(numThreads > 1)
+    {
+        threads = (pthread_t*)malloc((numThreads - 1) * sizeof(pthread_t));
+    }
+    while(threads != NULL && started < numThreads - 1 &&
+          pthread_create(&threads[started], NULL, body, arg) == 0)
+    {
+        started++;
+    }
+
+    body(arg);
+
+    int i;
+    for(i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+/*
+ * Loads the world at the specified path. Directories are read as room
+ * files; an archive gives up the world archiveWorldId, unpacked into
+ * memory; anything else must be a binary world file, which is mapped in
+ * place rather than read, privately if the world has to be writable.
+ */
+bool LoadWorld(World *world, const char *path, bool writable)
+{
+    memset(world, 0, sizeof(World));
+
+    struct stat st;
+    if(stat(path, &st) == -1)
+    {
+        return false;
+    }
+
+    if(S_ISDIR(st.st_mode))
+    {
+        Graph graph;
+        if(!InitializeGraph(&graph, path))
+        {
+            return false;
+        }
+        bool built = BuildWorldFromGraph(world, &graph);
+        FreeGraph(&graph);
+        if(!built)
+        {
+            return false;
+        }
+    }
+    else if(IsArchive(path))
+    {
+        if(!LoadArchiveWorld(world, path, archiveWorldId, NULL))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        if(!(writable ? CopyWorld(world, path) : MapWorld(world, path)))
+        {
+            return false;
+        }
+
+        /* Files without a name index still work, they just pay for it here */
+        if((world->hashSlots == NULL || world->sortedNames == NULL) && !BuildNameIndex(world))
+        {
+            FreeWorld(world);
+            return false;
+        }
+    }
+
+    if(!PreparePrompts(world))
+    {
+        FreeWorld(world);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Packs a graph read from room files into a world built in memory, so the
+ * rest of the game only ever deals with one layout. Returns false, saying
+ * why, if the rooms don't make a world: none at all, not exactly one start
+ * and one end room, or two rooms with the same name.
+ */
+bool BuildWorldFromGraph(World *world, Graph *graph)
+{
+    int numRooms = graph->numRooms;
+    uint64_t numConnections = 0;
+    uint64_t namesSize = 0;
+    int numStarts = 0;
+    int numEnds = 0;
+    uint32_t start = 0;
+    uint32_t end = 0;
+
+    if(numRooms == 0)
+    {
+        fprintf(stderr, "The room directory has no rooms.\n");
+        return false;
+    }
+
+    int i;
+    for(i = 0; i < numRooms; i++)
+    {
+        numConnections += graph->rooms[i].connectCount;
+        namesSize += strlen(graph->rooms[i].name) + 1;
+        if(graph->rooms[i].roomType == START_ROOM)
+        {
+            start = i;
+            numStarts++;
+        }
+        else if(graph->rooms[i].roomType == END_ROOM)
+        {
+            end = i;
+            numEnds++;
+        }
+    }
+    if(numStarts != 1 || numEnds != 1)
+    {
+        fprintf(stderr, "The room directory has %d START_ROOMs and %d END_ROOMs; it needs one of each.\n",
+                numStarts, numEnds);
+        return false;
+    }
+
+    WorldHeader header;
+    LayOutWorld(&header, numRooms, numConnections, namesSize);
+    header.startRoom = start;
+    header.endRoom = end;
+    if(!CreateWorld(world, &header))
+    {
+        return false;
+    }
+
+    uint8_t  *roomType    = (uint8_t*)world->roomType;
+    uint64_t *offsets     = (uint64_t*)world->offsets;
+    uint64_t *nameOffsets = (uint64_t*)world->nameOffsets;
+    char     *names       = (char*)world->names;
+
+    /* Prompts list connections the way the room files do, lookups need them sorted */
+    world->listedOrder = (uint32_t*)malloc((numConnections + 1) * sizeof(uint32_t));
+    if(world->listedOrder == NULL)
+    {
+        FreeWorld(world);
+        return false;
+    }
+
+    /* Names and the name index go in first so connections can be resolved through it */
+    uint64_t nameOffset = 0;
+    uint64_t connection = 0;
+    for(i = 0; i < numRooms; i++)
+    {
+        Room *room = &graph->rooms[i];
+        roomType[i] = (uint8_t)room->roomType;
+        nameOffsets[i] = nameOffset;
+        strcpy(names + nameOffset, room->name);
+        nameOffset += strlen(room->name) + 1;
+        offsets[i] = connection;
+        connection += room->connectCount;
+    }
+    nameOffsets[numRooms] = nameOffset;
+    offsets[numRooms] = connection;
+    IndexWorld(world);
+
+    /* Names are sorted now, so two rooms with the same one sit side by side */
+    for(i = 1; i < numRooms; i++)
+    {
+        const char *name = GetRoomName(world, world->sortedNames[i]);
+        if(strcmp(GetRoomName(world, world->sortedNames[i - 1]), name) == 0)
+        {
+            fprintf(stderr, "More than one room is called %s.\n", name);
+            FreeWorld(world);
+            return false;
+        }
+    }
+
+    /* Then resolve the connection names on the loader threads */
+    Resolver resolver;
+    memset(&resolver, 0, sizeof(Resolver));
+    resolver.world = world;
+    resolver.graph = graph;
+    RunInParallel(ResolveConnections, &resolver);
+    if(resolver.failed)
+    {
+        FreeWorld(world);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Body of one connection resolver thread. Claims runs of RESOLVE_RUN
+ * rooms and turns their connection names into IDs through the name index,
+ * keeping each room's list sorted. Rooms write disjoint slices of the
+ * connections array, so no locking is needed beyond the claim.
+ */
+void *ResolveConnections(void *arg)
+{
+    Resolver *resolver = (Resolver*)arg;
+    World *world = resolver->world;
+    Graph *graph = resolver->graph;
+    uint32_t *connections = (uint32_t*)world->connections;
+
+    int first;
+    while((first = __atomic_fetch_add(&resolver->nextRoom, RESOLVE_RUN, __ATOMIC_RELAXED)) < graph->numRooms)
+    {
+        int last = first + RESOLVE_RUN < graph->numRooms ? first + RESOLVE_RUN : graph->numRooms;
+        int i;
+        for(i = first; i < last; i++)
+        {
+            Room *room = &graph->rooms[i];
+            uint64_t begin = world->offsets[i];
+            const char *name = room->connections;
+            int j;
+            for(j = 0; j < room->connectCount; j++)
+            {
+                int id = GetRoomFromName(world, name);
+                if(id < 0)
+                {
+                    fprintf(stderr, "Room %s has an unknown connection %s.\n", room->name, name);
+                    __atomic_store_n(&resolver->failed, true, __ATOMIC_RELAXED);
+                    return NULL;
+                }
+                name += strlen(name) + 1;
+                world->listedOrder[begin + j] = id;
+
+                uint64_t k = begin + j;
+                while(k > begin && connections[k - 1] > (uint32_t)id)
+                {
+                    connections[k] = connections[k - 1];
+                    k--;
+                }
+                connections[k] = id;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Collects up to max connections of 'room' whose names start with prefix
+ * into matches and returns how many there are in total. Walks whichever is
+ * shorter: the room's connections or the rooms sharing the prefix.
+ */
+static uint64_t MatchConnections(const World *world, uint32_t room, const char *prefix,
+                                 uint32_t *matches, uint64_t max)
+{
+    uint64_t first;
+    uint64_t count = FindRoomsWithPrefix(world, prefix, &first);
+    uint32_t degree;
+    const uint32_t *neighbors = GetNeighbors(world, room, &degree);
+    size_t length = strlen(prefix);
+    uint64_t found = 0;
+
+    uint64_t i;
+    if(count <= degree)
+    {
+        for(i = first; i < first + count; i++)
+        {
+            uint32_t candidate = world->sortedNames[i];
+            if(IsConnected(world, room, candidate))
+            {
+                if(found < max)
+                {
+                    matches[found] = candidate;
+                }
+                found++;
+            }
+        }
+    }
+    else
+    {
+        for(i = 0; i < degree; i++)
+        {
+            uint32_t candidate = neighbors[i];
+            if(candidate < world->numRooms && strncmp(GetRoomName(world, candidate), prefix, length) == 0)
+            {
+                if(found < max)
+                {
+                    matches[found] = candidate;
+                }
+                found++;
+            }
+        }
+    }
+
+    return found;
+}
+
+/*
+ * Returns the connection of 'room' that input names, or -1 if there is
+ * none. An exact name wins; otherwise input may be any prefix that only
+ * one connection starts with.
+ */
+int ResolveConnection(const World *world, uint32_t room, const char *input)
+{
+    if(input[0] == '\0')
+    {
+        return -1;
+    }
+
+    int target = GetRoomFromName(world, input);
+    if(target >= 0)
+    {
+        return IsConnected(world, room, target) ? target : -1;
+    }
+
+    uint32_t match;
+    if(MatchConnections(world, room, input, &match, 1) == 1)
+    {
+        return match;
+    }
+
+    return -1;
+}
+
+/*
+ * Returns a string listing the connections of 'room' that start with
+ * prefix, separated by commas and ending in a full stop like the
+ * POSSIBLE CONNECTIONS line of a prompt.
+ *
+ * NOTE: the returned string is allocated from arena and lasts until the
+ * arena is reset; it must not be freed. Returns NULL if the arena is out
+ * of memory.
+ */
+char *GetCompletions(const World *world, uint32_t room, const char *prefix, Arena *arena)
+{
+    uint32_t degree = GetDegree(world, room);
+    uint32_t *matches = (uint32_t*)ArenaAlloc(arena, (degree + 1) * sizeof(uint32_t));
+    if(matches == NULL)
+    {
+        return NULL;
+    }
+    uint64_t found = MatchConnections(world, room, prefix, matches, degree);
+
+    size_t size = 1;
+    uint64_t i;
+    for(i = 0; i < found; i++)
+    {
+        size += strlen(GetRoomName(world, matches[i])) + 2;
+    }
+
+    char *result = (char*)ArenaAlloc(arena, size);
+    if(result == NULL)
+    {
+        return NULL;
+    }
+    char *end = result;
+    for(i = 0; i < found; i++)
+    {
+        const char *name = GetRoomName(world, matches[i]);
+        size_t length = strlen(name);
+        memcpy(end, name, length);
+        end += length;
+        memcpy(end, i < found - 1 ? ", " : ".", i < found - 1 ? 2 : 1);
+        end += i < found - 1 ? 2 : 1;
+    }
+    *end = '\0';
+
+    return result;
+}
+
+/*
+ * Writes what a player sees on entering the specified room into text:
+ *
+ *   CURRENT LOCATION: <name>
+ *   POSSIBLE CONNECTIONS: <name1>, <name2>, ..., <nameN>.
+ *   WHERE TO? > 
+ *
+ * Connections are listed in the order the room files gave them, or by
+ * room ID in worlds that weren't read from room files.
+ *
+ * Returns the length, which is all that is worked out when text is NULL.
+ * The text is not NUL terminated. Connections to rooms that don't exist
+ * are left out, as every other walk over the connections does, so a
+ * damaged world can't take the game down at load.
+ */
+size_t FormatPrompt(const World *world, uint32_t room, char *text)
+{
+    static const char location[] = "CURRENT LOCATION: ";
+    static const char connections[] = "\nPOSSIBLE CONNECTIONS: ";
+    static const char question[] = "\nWHERE TO? > ";
+
+    size_t length = 0;
+    const char *name = GetRoomName(world, room);
+    size_t nameLength = strlen(name);
+    if(text != NULL)
+    {
+        memcpy(text, location, sizeof(location) - 1);
+        memcpy(text + sizeof(location) - 1, name, nameLength);
+        memcpy(text + sizeof(location) - 1 + nameLength, connections, sizeof(connections) - 1);
+    }
+    length += sizeof(location) - 1 + nameLength + sizeof(connections) - 1;
+
+    uint32_t degree;
+    const uint32_t *neighbors = GetNeighbors(world, room, &degree);
+    if(world->listedOrder != NULL)
+    {
+        neighbors = world->listedOrder + world->offsets[room];
+    }
+    bool first = true;
+    uint32_t i;
+    for(i = 0; i < degree; i++)
+    {
+        if(neighbors[i] >= world->numRooms)
+        {
+            continue;
+        }
+        name = GetRoomName(world, neighbors[i]);
+        nameLength = strlen(name);
+        if(text != NULL)
+        {
+            memcpy(text + length, first ? "" : ", ", first ? 0 : 2);     // Commas between room names, a period at the end
+            memcpy(text + length + (first ? 0 : 2), name, nameLength);
+        }
+        length += nameLength + (first ? 0 : 2);
+        first = false;
+    }
+    if(!first)
+    {
+        if(text != NULL)
+        {
+            text[length] = '.';
+        }
+        length++;
+    }
+
+    if(text != NULL)
+    {
+        memcpy(text + length, question, sizeof(question) - 1);
+    }
+    return length + sizeof(question) - 1;
+}
+
+/*
+ * Sets up the specified world's prompt cache. Worlds of up to
+ * PROMPT_ROOMS rooms get every prompt built now, in one block; bigger ones
+ * only build a room's prompt when somebody first walks into it, so
+ * loading stays quick and rooms nobody visits cost nothing but a pointer.
+ */
+bool PreparePrompts(World *world)
+{
+    world->prompts = (Prompt**)calloc(world->numRooms, sizeof(Prompt*));
+    if(world->prompts == NULL)
+    {
+        return false;
+    }
+    if(world->numRooms > PROMPT_ROOMS)
+    {
+        return true;
+    }
+
+    size_t size = 0;
+    uint32_t room;
+    for(room = 0; room < world->numRooms; room++)
+    {
+        size += (sizeof(Prompt) + FormatPrompt(world, room, NULL) + 7) & ~7UL;
+    }
+
+    world->promptBlock = (char*)malloc(size);
+    if(world->promptBlock == NULL)
+    {
+        return true;                        // They'll be built as they are needed instead
+    }
+
+    char *next = world->promptBlock;
+    for(room = 0; room < world->numRooms; room++)
+    {
+        Prompt *prompt = (Prompt*)next;
+        prompt->generation = world->generation;
+        prompt->inBlock = true;
+        prompt->length = FormatPrompt(world, room, prompt->text);
+        world->prompts[room] = prompt;
+        next += (sizeof(Prompt) + prompt->length + 7) & ~7UL;
+    }
+
+    return true;
+}
+
+/*
+ * Brings the session up to date with patches of the world file another
+ * process made since its last turn, and the world's par, distances and
+ * prompts with it if no other session got there first. Lets the player
+ * know, and returns false for the turn to be skipped while a patch is
+ * going in.
+ */
+bool CatchUpWorld(Session *session, OutBuf *out)
+{
+    World *world = (World*)session->world;
+    uint64_t generation = GetFileGeneration(world);
+    if(generation == session->generation)
+    {
+        return true;
+    }
+
+    bool current = false;
+    if(generation % 2 == 0)
+    {
+        pthread_mutex_lock(&refreshLock);
+        current = world->generation >= generation ||
+                  RefreshWorld(world, generation, &searches[session->channel]);
+        pthread_mutex_unlock(&refreshLock);
+    }
+    if(!current)
+    {
+        if(out != NULL)
+        {
+            AppendString(out, "THE WORLD IS SHIFTING AROUND YOU. TRY AGAIN.\n");
+        }
+        return false;
+    }
+
+    session->generation = generation;
+    if(out != NULL)
+    {
+        AppendString(out, "THE WORLD HAS CHANGED SINCE YOUR LAST MOVE.\n");
+    }
+    return true;
+}
+
+/*
+ * Works out par, and the distance from every room if they were
+ * precomputed, for the world file at the specified generation, and then
+ * moves the world on to it, which makes every prompt stale. Replaced
+ * distances are retired, since other threads may be reading them. Called
+ * with refreshLock held. Returns false, changing nothing, if the file was
+ * patched again while this looked at it.
+ */
+bool RefreshWorld(World *world, uint64_t generation, PathSearch *search)
+{
+    uint32_t *distances = NULL;
+    uint32_t par;
+    if(world->distanceToEnd != NULL && (distances = MeasureDistances(world)) != NULL)
+    {
+        par = distances[world->startRoom];
+    }
+    else
+    {
+        if(world->distanceToEnd != NULL)
+        {
+            /* Out of memory for new distances, so hints search instead of reading stale ones */
+            Retire(world->distanceToEnd);
+            __atomic_store_n(&world->distanceToEnd, NULL, __ATOMIC_RELEASE);
+        }
+        uint32_t step;
+        par = FindRoute(world, search, world->startRoom, &step);
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(GetFileGeneration(world) != generation)
+    {
+        free(distances);
+        return false;
+    }
+
+    if(distances != NULL)
+    {
+        Retire(world->distanceToEnd);
+        __atomic_store_n(&world->distanceToEnd, distances, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&world->par, par, __ATOMIC_RELAXED);
+    __atomic_store_n(&world->generation, generation, __ATOMIC_RELEASE);
+    CountStat(STAT_WORLD_REFRESHES, 1);
+    return true;
+}
+
+/*
+ * Determines if the world file was patched since the session caught up
+ * at the start of its turn, in which case whatever the turn read of the
+ * connections may be half old and half new and must not be acted on.
+ */
+bool WorldMoved(const Session *session)
+{
+    if(session->world->fileGeneration == NULL)
+    {
+        return false;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(session->world->fileGeneration, __ATOMIC_RELAXED) != session->generation;
+}
+
+/*
+ * Keeps memory until exit instead of freeing it, because another thread
+ * may still be reading it. If there is no memory to keep track of it, it
+ * is simply never freed.
+ */
+void Retire(void *memory)
+{
+    Retired *entry = (Retired*)malloc(sizeof(Retired));
+    if(entry == NULL)
+    {
+        return;
+    }
+    entry->memory = memory;
+    pthread_mutex_lock(&retireLock);
+    entry->next = retired;
+    retired = entry;
+    pthread_mutex_unlock(&retireLock);
+}
+
+/*
+ * Frees everything retired, once nothing is playing any more.
+ */
+void FreeRetired(void)
+{
+    while(retired != NULL)
+    {
+        Retired *entry = retired;
+        retired = entry->next;
+        free(entry->memory);
+        free(entry);
+    }
+}
+
+/*
+ * Drops the prompts of rooms whose connections changed, so they are built
+ * again on the next visit. Prompts built all at once in a block go back
+ * to being built one at a time; the block only exists for small worlds.
+ * Like every change to a live world, this is for one thread at a time.
+ */
+void ForgetPrompts(const World *world, const uint32_t *rooms, uint32_t count)
+{
+    World *changed = (World*)world;
+    if(changed->promptBlock != NULL)
+    {
+        memset(changed->prompts, 0, changed->numRooms * sizeof(Prompt*));
+        free(changed->promptBlock);
+        changed->promptBlock = NULL;
+        return;
+    }
+
+    uint32_t i;
+    for(i = 0; i < count; i++)
+    {
+        free(changed->prompts[rooms[i]]);
+        changed->prompts[rooms[i]] = NULL;
+    }
+}
+
+/*
+ * Returns the prompt for the specified room, building it if this is the
+ * first visit, or the first since the world file was patched. Threads that
+ * race to build the same prompt both succeed and the loser's copy is
+ * thrown away. Returns NULL if memory runs out.
+ */
+const Prompt *GetPrompt(const World *world, uint32_t room)
+{
+    uint64_t generation = __atomic_load_n(&world->generation, __ATOMIC_ACQUIRE);
+    Prompt *stale = __atomic_load_n(&world->prompts[room], __ATOMIC_ACQUIRE);
+    if(stale != NULL && stale->generation == generation)
+    {
+        return stale;
+    }
+
+    size_t length = FormatPrompt(world, room, NULL);
+    Prompt *prompt = (Prompt*)malloc(sizeof(Prompt) + length);
+    if(prompt == NULL)
+    {
+        return NULL;
+    }
+    prompt->generation = generation;
+    prompt->inBlock = false;
+    prompt->length = FormatPrompt(world, room, prompt->text);
+    CountStat(STAT_PROMPTS_BUILT, 1);
+
+    Prompt *expected = stale;
+    if(!__atomic_compare_exchange_n(&world->prompts[room], &expected, prompt, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        free(prompt);
+        return expected;
+    }
+    if(stale != NULL && !stale->inBlock)
+    {
+        Retire(stale);                      // Another thread may be showing it right now
+    }
+    return prompt;
+}
+
+/*
+ * Allocates the specified search's bitsets for the specified world, unless
+ * it already has them. Returns false if memory runs out.
+ */
+bool PreparePathSearch(PathSearch *search, const World *world)
+{
+    if(search->numWords != 0)
+    {
+        return true;
+    }
+
+    uint32_t numWords = (world->numRooms + 63) / 64;
+    search->forwardSeen      = (uint64_t*)malloc(numWords * sizeof(uint64_t));
+    search->backwardSeen     = (uint64_t*)malloc(numWords * sizeof(uint64_t));
+    search->forwardFrontier  = (uint64_t*)malloc(numWords * sizeof(uint64_t));
+    search->backwardFrontier = (uint64_t*)malloc(numWords * sizeof(uint64_t));
+    search->next             = (uint64_t*)malloc(numWords * sizeof(uint64_t));
+    search->via              = (uint32_t*)malloc(world->numRooms * sizeof(uint32_t));
+    if(search->forwardSeen == NULL || search->backwardSeen == NULL || search->forwardFrontier == NULL ||
+       search->backwardFrontier == NULL || search->next == NULL || search->via == NULL)
+    {
+        FreePathSearch(search);
+        return false;
+    }
+
+    search->numWords = numWords;
+    return true;
+}
+
+/*
+ * Releases the specified search's scratch space.
+ */
+void FreePathSearch(PathSearch *search)
+{
+    free(search->forwardSeen);
+    free(search->backwardSeen);
+    free(search->forwardFrontier);
+    free(search->backwardFrontier);
+    free(search->next);
+    free(search->via);
+    memset(search, 0, sizeof(PathSearch));
+}
+
+/*
+ * Finds the fewest steps from the specified room to the end, and the first
+ * room to go to on such a route. Returns NO_PATH if the end can't be
+ * reached. With precomputed distances this only looks at the room's
+ * connections; otherwise it is a bidirectional breadth-first search, one
+ * side from the room and one from the end, that always grows whichever
+ * frontier is smaller. Frontiers and visited sets are bitsets, so the
+ * search touches about the square root of the rooms a one-sided search
+ * would on a random world.
+ */
+uint32_t FindRoute(const World *world, PathSearch *search, uint32_t from, uint32_t *step)
+{
+    CountStat(STAT_ROUTE_SEARCHES, 1);
+    uint32_t end = GetEndRoom(world);
+    *step = from;
+    if(from == end)
+    {
+        return 0;
+    }
+
+    uint64_t i;
+    if(world->distanceToEnd != NULL)
+    {
+        uint32_t distance = world->distanceToEnd[from];
+        uint32_t degree;
+        const uint32_t *neighbors = GetNeighbors(world, from, &degree);
+        for(i = 0; distance != NO_PATH && i < degree; i++)
+        {
+            uint32_t room = neighbors[i];
+            if(room < world->numRooms && world->distanceToEnd[room] == distance - 1 &&
+               (world->changes == NULL || IsDoorOpen(world, from, room)))
+            {
+                *step = room;
+                return distance;
+            }
+        }
+        return NO_PATH;
+    }
+
+    if(!PreparePathSearch(search, world))
+    {
+        return NO_PATH;
+    }
+    size_t bitsetSize = search->numWords * sizeof(uint64_t);
+    memset(search->forwardSeen, 0, bitsetSize);
+    memset(search->backwardSeen, 0, bitsetSize);
+    memset(search->forwardFrontier, 0, bitsetSize);
+    memset(search->backwardFrontier, 0, bitsetSize);
+    memset(search->next, 0, bitsetSize);
+    search->forwardSeen[from / 64] |= 1ULL << (from % 64);
+    search->forwardFrontier[from / 64] |= 1ULL << (from % 64);
+    search->backwardSeen[end / 64] |= 1ULL << (end % 64);
+    search->backwardFrontier[end / 64] |= 1ULL << (end % 64);
+
+    uint32_t forwardCount = 1, backwardCount = 1;
+    uint32_t forwardDepth = 0, backwardDepth = 0;
+    while(forwardCount > 0 && backwardCount > 0)
+    {
+        bool forward = forwardCount <= backwardCount;
+        uint64_t *seen     = forward ? search->forwardSeen : search->backwardSeen;
+        uint64_t *other    = forward ? search->backwardSeen : search->forwardSeen;
+        uint64_t *frontier = forward ? search->forwardFrontier : search->backwardFrontier;
+
+        /*
+         * Every room within both depths has been seen, so the first meeting
+         * is a shortest route. The frontier is cleared as it is read, so it
+         * is empty when it takes over as scratch space for the next level.
+         */
+        uint32_t count = 0;
+        uint32_t word;
+        for(word = 0; word < search->numWords; word++)
+        {
+            uint64_t bits = frontier[word];
+            frontier[word] = 0;
+            while(bits != 0)
+            {
+                uint32_t room = word * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                uint32_t degree;
+                const uint32_t *neighbors = GetNeighbors(world, room, &degree);
+                for(i = 0; i < degree; i++)
+                {
+                    uint32_t next = neighbors[i];
+                    uint64_t bit = 1ULL << (next % 64);
+                    if(next >= world->numRooms || (seen[next / 64] & bit) != 0)
+                    {
+                        continue;
+                    }
+                    if((other[next / 64] & bit) != 0)
+                    {
+                        if(forward)
+                        {
+                            *step = room == from ? next : search->via[room];
+                        }
+                        else
+                        {
+                            *step = next == from ? room : search->via[next];
+                        }
+                        return forwardDepth + backwardDepth + 1;
+                    }
+                    seen[next / 64] |= bit;
+                    search->next[next / 64] |= bit;
+                    count++;
+                    if(forward)
+                    {
+                        search->via[next] = room == from ? next : search->via[room];
+                    }
+                }
+            }
+        }
+
+        uint64_t *grown = search->next;
+        search->next = frontier;
+        if(forward)
+        {
+            search->forwardFrontier = grown;
+            forwardCount = count;
+            forwardDepth++;
+        }
+        else
+        {
+            search->backwardFrontier = grown;
+            backwardCount = count;
+            backwardDepth++;
+        }
+    }
+
+    return NO_PATH;
+}
+
+/*
+ * Finds the distance to the end from each of count rooms, for callers with
+ * many questions at once. Rather than a search per room this is a single
+ * breadth-first search out from the end, a level at a time, that stops as
+ * soon as every room asked about has been reached. Rooms the end can't be
+ * reached from get NO_PATH.
+ */
+void FindDistances(const World *world, PathSearch *search, const uint32_t *rooms, uint32_t count, uint32_t *distances)
+{
+    uint32_t i;
+    if(world->distanceToEnd != NULL)
+    {
+        for(i = 0; i < count; i++)
+        {
+            distances[i] = rooms[i] < world->numRooms ? world->distanceToEnd[rooms[i]] : NO_PATH;
+        }
+        return;
+    }
+
+    for(i = 0; i < count; i++)
+    {
+        distances[i] = NO_PATH;
+    }
+    if(!PreparePathSearch(search, world))
+    {
+        return;
+    }
+
+    /* forwardSeen marks the rooms still wanted, via records the level each was found at */
+    size_t bitsetSize = search->numWords * sizeof(uint64_t);
+    uint64_t *wanted = search->forwardSeen;
+    uint64_t *seen = search->backwardSeen;
+    memset(wanted, 0, bitsetSize);
+    memset(seen, 0, bitsetSize);
+    memset(search->backwardFrontier, 0, bitsetSize);
+
+    uint32_t remaining = 0;
+    for(i = 0; i < count; i++)
+    {
+        uint32_t room = rooms[i];
+        if(room < world->numRooms && (wanted[room / 64] & (1ULL << (room % 64))) == 0)
+        {
+            wanted[room / 64] |= 1ULL << (room % 64);
+            remaining++;
+        }
+    }
+
+    uint32_t end = GetEndRoom(world);
+    seen[end / 64] |= 1ULL << (end % 64);
+    search->backwardFrontier[end / 64] |= 1ULL << (end % 64);
+
+    uint32_t depth = 0;
+    bool growing = true;
+    while(remaining > 0 && growing)
+    {
+        uint64_t *frontier = search->backwardFrontier;
+        uint32_t word;
+        for(word = 0; word < search->numWords; word++)
+        {
+            uint64_t found = frontier[word] & wanted[word];
+            if(found != 0)
+            {
+                wanted[word] &= ~found;
+                remaining -= __builtin_popcountll(found);
+                while(found != 0)
+                {
+                    search->via[word * 64 + __builtin_ctzll(found)] = depth;
+                    found &= found - 1;
+                }
+            }
+        }
+
+        memset(search->next, 0, bitsetSize);
+        growing = false;
+        for(word = 0; remaining > 0 && word < search->numWords; word++)
+        {
+            uint64_t bits = frontier[word];
+            while(bits != 0)
+            {
+                uint32_t room = word * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                uint32_t degree;
+                const uint32_t *neighbors = GetNeighbors(world, room, &degree);
+                uint32_t j;
+                for(j = 0; j < degree; j++)
+                {
+                    uint32_t next = neighbors[j];
+                    uint64_t bit = 1ULL << (next % 64);
+                    if(next < world->numRooms && (seen[next / 64] & bit) == 0)
+                    {
+                        seen[next / 64] |= bit;
+                        search->next[next / 64] |= bit;
+                        growing = true;
+                    }
+                }
+            }
+        }
+        search->backwardFrontier = search->next;
+        search->next = frontier;
+        depth++;
+    }
+
+    for(i = 0; i < count; i++)
+    {
+        uint32_t room = rooms[i];
+        if(room < world->numRooms && (seen[room / 64] & (1ULL << (room % 64))) != 0 &&
+           (wanted[room / 64] & (1ULL << (room % 64))) == 0)
+        {
+            distances[i] = search->via[room];
+        }
+    }
+}
+
+/*
+ * Precomputes the distance to the end from every room with one
+ * breadth-first search, so hints and par cost next to nothing afterwards.
+ * Takes four bytes per room. Returns false if memory runs out.
+ */
+bool ComputeDistances(World *world)
+{
+    world->distanceToEnd = MeasureDistances(world);
+    return world->distanceToEnd != NULL;
+}
+
+/*
+ * Finds the distance to the end from every room with one breadth-first
+ * search from the end, into an array the caller frees. Returns NULL if
+ * memory runs out.
+ */
+uint32_t *MeasureDistances(const World *world)
+{
+    uint32_t *distances = (uint32_t*)malloc(world->numRooms * sizeof(uint32_t));
+    uint32_t *queue = (uint32_t*)malloc(world->numRooms * sizeof(uint32_t));
+    if(distances == NULL || queue == NULL)
+    {
+        free(distances);
+        free(queue);
+        return NULL;
+    }
+
+    uint32_t i;
+    for(i = 0; i < world->numRooms; i++)
+    {
+        distances[i] = NO_PATH;
+    }
+
+    uint32_t head = 0, tail = 0;
+    distances[world->endRoom] = 0;
+    queue[tail++] = world->endRoom;
+    while(head < tail)
+    {
+        uint32_t room = queue[head++];
+        uint32_t degree;
+        const uint32_t *neighbors = GetNeighbors(world, room, &degree);
+        uint32_t j;
+        for(j = 0; j < degree; j++)
+        {
+            uint32_t next = neighbors[j];
+            if(next < world->numRooms && distances[next] == NO_PATH)
+            {
+                distances[next] = distances[room] + 1;
+                queue[tail++] = next;
+            }
+        }
+    }
+    free(queue);
+    return distances;
+}
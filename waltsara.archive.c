@@ -0,0 +1,685 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "waltsara.archive.h"
+
+#define INDEX_MAGIC "WALTAIDX"
+#define FOOTER_MAGIC "WALTAEND"
+
+/*
+ * Rounds an offset into the archive up to the next 8 byte boundary.
+ */
+static uint64_t AlignEnd(uint64_t offset)
+{
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+/*
+ * Writes v as a varint at p, seven bits a byte with the high bit set on
+ * all but the last. Returns the bytes written, at most ten.
+ */
+static size_t PutVarint(uint8_t *p, uint64_t v)
+{
+    size_t n = 0;
+    while(v >= 0x80)
+    {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+/*
+ * Reads a varint from *p, which mustn't go past end, and moves *p past
+ * it. Returns false if the varint is cut off or too long.
+ */
+static bool GetVarint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+    uint64_t value = 0;
+    int shift;
+    for(shift = 0; shift < 64 && *p < end; shift += 7)
+    {
+        uint8_t byte = *(*p)++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if(byte < 0x80)
+        {
+            *v = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Maps signed differences onto varint-friendly unsigned ones: 0, -1, 1, -2, ... */
+static uint64_t ZigZag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t UnZigZag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/*
+ * Number of decimal digits of x.
+ */
+static uint64_t CountDigits(uint32_t x)
+{
+    uint64_t digits = 1;
+    while(x >= 10)
+    {
+        x /= 10;
+        digits++;
+    }
+    return digits;
+}
+
+/*
+ * Hash of the fields of a footer before its check, FNV-1a over their bytes.
+ */
+static uint64_t CheckFooter(const ArchiveFooter *footer)
+{
+    const uint8_t *bytes = (const uint8_t*)footer;
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    for(i = 0; i < offsetof(ArchiveFooter, check); i++)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ * pread and pwrite of a whole buffer, going round again after short
+ * transfers. Return false on an error or end of file.
+ */
+static bool ReadAt(int fd, void *buffer, size_t size, uint64_t offset)
+{
+    size_t done = 0;
+    while(done < size)
+    {
+        ssize_t result = pread(fd, (char*)buffer + done, size - done, offset + done);
+        if(result <= 0)
+        {
+            return false;
+        }
+        done += result;
+    }
+    return true;
+}
+
+static bool WriteAt(int fd, const void *buffer, size_t size, uint64_t offset)
+{
+    size_t done = 0;
+    while(done < size)
+    {
+        ssize_t result = pwrite(fd, (const char*)buffer + done, size - done, offset + done);
+        if(result <= 0)
+        {
+            return false;
+        }
+        done += result;
+    }
+    return true;
+}
+
+/*
+ * Reads the header of the archive open on fd and the footer it points
+ * at. A new archive has a footer of zeroes. Returns false if the file
+ * isn't an archive or its footer is damaged.
+ */
+static bool ReadTail(int fd, ArchiveHeader *header, ArchiveFooter *footer)
+{
+    memset(footer, 0, sizeof(ArchiveFooter));
+    if(!ReadAt(fd, header, sizeof(ArchiveHeader), 0) ||
+       memcmp(header->magic, ARCHIVE_MAGIC, sizeof(header->magic)) != 0)
+    {
+        fprintf(stderr, "Not a world archive.\n");
+        return false;
+    }
+    if(header->version != ARCHIVE_VERSION)
+    {
+        fprintf(stderr, "World archive version %u is not supported.\n", header->version);
+        return false;
+    }
+    if(header->footer == 0)
+    {
+        return true;
+    }
+
+    if(!ReadAt(fd, footer, sizeof(ArchiveFooter), header->footer) ||
+       memcmp(footer->magic, FOOTER_MAGIC, sizeof(footer->magic)) != 0 ||
+       footer->check != CheckFooter(footer))
+    {
+        fprintf(stderr, "World archive is damaged.\n");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Packs a world into a record in *buffer, growing it as needed, and
+ * returns the bytes used, or 0 if memory runs out. Names are stored as
+ * numBases bases when every room is named after them the way
+ * waltsara.buildrooms does it, and in full otherwise.
+ */
+size_t EncodeWorld(const World *world, int numBases, uint8_t **buffer, size_t *capacity)
+{
+    uint32_t numRooms = world->numRooms;
+    uint32_t bases = numBases > 0 ? ((uint32_t)numBases < numRooms ? (uint32_t)numBases : numRooms) : 0;
+    char name[MAX_ROOM_NAME_LENGTH + 16];
+    uint32_t i;
+    for(i = bases; bases > 0 && i < numRooms; i++)
+    {
+        snprintf(name, sizeof(name), "%s%u", GetRoomName(world, i % bases), i / bases);
+        if(strcmp(name, GetRoomName(world, i)) != 0)
+        {
+            bases = 0;
+        }
+    }
+
+    uint32_t numStored = bases > 0 ? bases : numRooms;
+    uint64_t namesSize = 0;
+    for(i = 0; i < numStored; i++)
+    {
+        namesSize += strlen(GetRoomName(world, i)) + 1;
+    }
+    uint64_t numConnections = world->offsets[numRooms];
+    size_t bound = 5 * 10 + namesSize + 5 * ((uint64_t)numRooms + numConnections);
+    if(bound > *capacity)
+    {
+        uint8_t *grown = (uint8_t*)realloc(*buffer, bound);
+        if(grown == NULL)
+        {
+            return 0;
+        }
+        *buffer = grown;
+        *capacity = bound;
+    }
+
+    uint8_t *p = *buffer;
+    p += PutVarint(p, numRooms);
+    p += PutVarint(p, world->startRoom);
+    p += PutVarint(p, world->endRoom);
+    p += PutVarint(p, numConnections);
+    p += PutVarint(p, bases);
+    for(i = 0; i < numStored; i++)
+    {
+        const char *stored = GetRoomName(world, i);
+        size_t length = strlen(stored) + 1;
+        memcpy(p, stored, length);
+        p += length;
+    }
+
+    for(i = 0; i < numRooms; i++)
+    {
+        uint32_t degree;
+        const uint32_t *neighbors = GetNeighbors(world, i, &degree);
+        p += PutVarint(p, degree);
+        uint32_t j;
+        for(j = 0; j < degree; j++)
+        {
+            p += PutVarint(p, j == 0 ? ZigZag((int64_t)neighbors[0] - i) : neighbors[j] - neighbors[j - 1] - 1);
+        }
+    }
+
+    return p - *buffer;
+}
+
+/*
+ * Opens the archive at path for a batch of up to numSlots worlds,
+ * creating it if need be, and takes an exclusive lock on it that lasts
+ * until CloseArchive. Whatever a writer before left after the last
+ * footer is cut off. Returns false if the archive can't be opened.
+ */
+bool BeginArchive(ArchiveWriter *archive, const char *path, uint32_t numSlots)
+{
+    memset(archive, 0, sizeof(ArchiveWriter));
+    archive->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(archive->fd == -1)
+    {
+        perror("Failed to open the world archive.");
+        return false;
+    }
+    if(flock(archive->fd, LOCK_EX) == -1)
+    {
+        perror("Failed to lock the world archive.");
+        close(archive->fd);
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(archive->fd, &st) == -1)
+    {
+        perror("Failed to read the world archive.");
+        close(archive->fd);
+        return false;
+    }
+
+    ArchiveHeader header;
+    ArchiveFooter footer;
+    if(st.st_size == 0)
+    {
+        memset(&header, 0, sizeof(ArchiveHeader));
+        memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+        header.version = ARCHIVE_VERSION;
+        if(!WriteAt(archive->fd, &header, sizeof(ArchiveHeader), 0))
+        {
+            perror("Failed to write the world archive.");
+            close(archive->fd);
+            return false;
+        }
+        st.st_size = sizeof(ArchiveHeader);
+    }
+    if(!ReadTail(archive->fd, &header, &footer))
+    {
+        close(archive->fd);
+        return false;
+    }
+
+    archive->committed = header.footer != 0 ? header.footer + sizeof(ArchiveFooter) : AlignEnd(sizeof(ArchiveHeader));
+    archive->end = archive->committed;
+    archive->numWorlds = footer.numWorlds;
+    archive->index = footer.index;
+    if((uint64_t)st.st_size > archive->committed && ftruncate(archive->fd, archive->committed) == -1)
+    {
+        perror("Failed to cut off an unfinished append.");
+        close(archive->fd);
+        return false;
+    }
+
+    archive->numSlots = numSlots;
+    archive->pending = (ArchiveEntry*)calloc(numSlots > 0 ? numSlots : 1, sizeof(ArchiveEntry));
+    archive->added = (bool*)calloc(numSlots > 0 ? numSlots : 1, sizeof(bool));
+    if(archive->pending == NULL || archive->added == NULL)
+    {
+        perror("Failed to allocate the archive entries.");
+        free(archive->pending);
+        free(archive->added);
+        close(archive->fd);
+        return false;
+    }
+    pthread_mutex_init(&archive->lock, NULL);
+    return true;
+}
+
+/*
+ * Appends the record of the world in the specified slot of the batch.
+ * Only the space for it is claimed under the lock, so threads write their
+ * records side by side. Returns false if it couldn't be written.
+ */
+bool AddToArchive(ArchiveWriter *archive, uint32_t slot, const uint8_t *record, size_t size, uint64_t seed,
+                  uint32_t numRooms)
+{
+    if(slot >= archive->numSlots)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&archive->lock);
+    uint64_t offset = archive->end;
+    archive->end = AlignEnd(offset + size);
+    pthread_mutex_unlock(&archive->lock);
+
+    if(!WriteAt(archive->fd, record, size, offset))
+    {
+        perror("Failed to write to the world archive.");
+        return false;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    ArchiveEntry *entry = &archive->pending[slot];
+    entry->offset = offset;
+    entry->size = size;
+    entry->created = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    entry->seed = seed;
+    entry->numRooms = numRooms;
+    archive->added[slot] = true;
+    return true;
+}
+
+/*
+ * Makes the worlds added since BeginArchive part of the archive, numbered
+ * in slot order: writes an index block listing them, along with any
+ * earlier blocks no bigger than it, and a footer, syncs them, and points
+ * the header at the footer. Returns the number of the first world added,
+ * or -1 if there were none or the archive couldn't be written.
+ */
+int64_t CommitArchive(ArchiveWriter *archive)
+{
+    uint64_t count = 0;
+    uint32_t i;
+    for(i = 0; i < archive->numSlots; i++)
+    {
+        if(archive->added[i])
+        {
+            archive->pending[count++] = archive->pending[i];
+        }
+    }
+    if(count == 0)
+    {
+        return -1;
+    }
+
+    /* Take in earlier blocks while they are no bigger, oldest entries first */
+    ArchiveIndex block;
+    memcpy(block.magic, INDEX_MAGIC, sizeof(block.magic));
+    block.previous = archive->index;
+    uint64_t merged = 0;
+    ArchiveEntry *entries = NULL;
+    while(block.previous != 0)
+    {
+        ArchiveIndex earlier;
+        if(!ReadAt(archive->fd, &earlier, sizeof(ArchiveIndex), block.previous))
+        {
+            free(entries);
+            perror("Failed to read the world archive.");
+            return -1;
+        }
+        if(earlier.count > count + merged)
+        {
+            break;
+        }
+
+        ArchiveEntry *grown = (ArchiveEntry*)realloc(entries, (merged + earlier.count) * sizeof(ArchiveEntry));
+        if(grown == NULL)
+        {
+            free(entries);
+            perror("Failed to allocate the archive index.");
+            return -1;
+        }
+        entries = grown;
+        memmove(entries + earlier.count, entries, merged * sizeof(ArchiveEntry));
+        if(!ReadAt(archive->fd, entries, earlier.count * sizeof(ArchiveEntry), block.previous + sizeof(ArchiveIndex)))
+        {
+            free(entries);
+            perror("Failed to read the world archive.");
+            return -1;
+        }
+        merged += earlier.count;
+        block.previous = earlier.previous;
+    }
+    block.firstWorld = archive->numWorlds - merged;
+    block.count = merged + count;
+
+    uint64_t blockOffset = AlignEnd(archive->end);
+    uint64_t entriesOffset = blockOffset + sizeof(ArchiveIndex);
+    uint64_t footerOffset = entriesOffset + block.count * sizeof(ArchiveEntry);
+    ArchiveFooter footer;
+    memcpy(footer.magic, FOOTER_MAGIC, sizeof(footer.magic));
+    footer.index = blockOffset;
+    footer.numWorlds = archive->numWorlds + count;
+    footer.check = CheckFooter(&footer);
+
+    bool written = WriteAt(archive->fd, &block, sizeof(ArchiveIndex), blockOffset) &&
+                   WriteAt(archive->fd, entries, merged * sizeof(ArchiveEntry), entriesOffset) &&
+                   WriteAt(archive->fd, archive->pending, count * sizeof(ArchiveEntry),
+                           entriesOffset + merged * sizeof(ArchiveEntry)) &&
+                   WriteAt(archive->fd, &footer, sizeof(ArchiveFooter), footerOffset) &&
+                   fdatasync(archive->fd) == 0 &&
+                   WriteAt(archive->fd, &footerOffset, sizeof(footerOffset), offsetof(ArchiveHeader, footer)) &&
+                   fdatasync(archive->fd) == 0;
+    free(entries);
+    if(!written)
+    {
+        perror("Failed to write the world archive.");
+        return -1;
+    }
+
+    int64_t first = archive->numWorlds;
+    archive->numWorlds = footer.numWorlds;
+    archive->index = blockOffset;
+    archive->committed = footerOffset + sizeof(ArchiveFooter);
+    archive->end = archive->committed;
+    memset(archive->added, 0, archive->numSlots * sizeof(bool));
+    return first;
+}
+
+/*
+ * Cuts off any records that were never committed, releases the lock on
+ * the archive and closes it.
+ */
+void CloseArchive(ArchiveWriter *archive)
+{
+    if(archive->end > archive->committed && ftruncate(archive->fd, archive->committed) == -1)
+    {
+        perror("Failed to cut off the uncommitted worlds.");
+    }
+    close(archive->fd);
+    pthread_mutex_destroy(&archive->lock);
+    free(archive->pending);
+    free(archive->added);
+    memset(archive, 0, sizeof(ArchiveWriter));
+    archive->fd = -1;
+}
+
+/*
+ * Determines if the file at path starts with the archive magic.
+ */
+bool IsArchive(const char *path)
+{
+    char magic[8];
+    int fd = open(path, O_RDONLY);
+    if(fd == -1)
+    {
+        return false;
+    }
+    bool isArchive = ReadAt(fd, magic, sizeof(magic), 0) && memcmp(magic, ARCHIVE_MAGIC, sizeof(magic)) == 0;
+    close(fd);
+    return isArchive;
+}
+
+/*
+ * Unpacks a record into a world made by CreateWorld. Returns false if the
+ * record doesn't hold a whole, consistent world.
+ */
+static bool DecodeWorld(World *world, const uint8_t *record, size_t size, uint64_t seed)
+{
+    const uint8_t *p = record;
+    const uint8_t *end = record + size;
+    uint64_t numRooms, startRoom, endRoom, numConnections, numBases;
+    if(!GetVarint(&p, end, &numRooms) || !GetVarint(&p, end, &startRoom) || !GetVarint(&p, end, &endRoom) ||
+       !GetVarint(&p, end, &numConnections) || !GetVarint(&p, end, &numBases) ||
+       numRooms == 0 || numRooms > UINT32_MAX || startRoom >= numRooms || endRoom >= numRooms ||
+       numBases > numRooms || numConnections > (uint64_t)(end - p))
+    {
+        return false;
+    }
+
+    /* Every name is NUL terminated, and expanded names are longer by the digits of i / numBases */
+    const char *stored = (const char*)p;
+    uint64_t numStored = numBases > 0 ? numBases : numRooms;
+    uint64_t storedSize = 0;
+    uint64_t i;
+    for(i = 0; i < numStored; i++)
+    {
+        const char *nul = (const char*)memchr(stored + storedSize, '\0', end - p - storedSize);
+        if(nul == NULL)
+        {
+            return false;
+        }
+        storedSize = nul - stored + 1;
+    }
+    p += storedSize;
+
+    uint64_t namesSize = storedSize;
+    uint64_t *baseOffsets = NULL;
+    if(numBases > 0)
+    {
+        baseOffsets = (uint64_t*)malloc((numBases + 1) * sizeof(uint64_t));
+        if(baseOffsets == NULL)
+        {
+            return false;
+        }
+        baseOffsets[0] = 0;
+        for(i = 0; i < numBases; i++)
+        {
+            baseOffsets[i + 1] = baseOffsets[i] + strlen(stored + baseOffsets[i]) + 1;
+        }
+        for(i = numBases; i < numRooms; i++)
+        {
+            namesSize += baseOffsets[i % numBases + 1] - baseOffsets[i % numBases] + CountDigits(i / numBases);
+        }
+    }
+
+    WorldHeader header;
+    LayOutWorld(&header, numRooms, numConnections, namesSize);
+    header.startRoom = startRoom;
+    header.endRoom = endRoom;
+    header.seed = seed;
+    if(!CreateWorld(world, &header))
+    {
+        free(baseOffsets);
+        return false;
+    }
+
+    uint8_t *roomType = (uint8_t*)world->roomType;
+    uint64_t *offsets = (uint64_t*)world->offsets;
+    uint32_t *connections = (uint32_t*)world->connections;
+    uint64_t *nameOffsets = (uint64_t*)world->nameOffsets;
+    char *names = (char*)world->names;
+    memset(roomType, MID_ROOM, numRooms);
+    roomType[startRoom] = START_ROOM;
+    roomType[endRoom] = END_ROOM;
+
+    /* Names: the stored ones as they are, then the rest from their bases */
+    memcpy(names, stored, storedSize);
+    uint64_t used = storedSize;
+    for(i = 0; i < numRooms; i++)
+    {
+        if(numBases == 0 || i < numBases)
+        {
+            nameOffsets[i] = i == 0 ? 0 : nameOffsets[i - 1] + strlen(names + nameOffsets[i - 1]) + 1;
+            continue;
+        }
+        nameOffsets[i] = used;
+        uint64_t base = i % numBases;
+        uint64_t length = baseOffsets[base + 1] - baseOffsets[base] - 1;
+        memcpy(names + used, stored + baseOffsets[base], length);
+        used += length;
+        used += sprintf(names + used, "%u", (uint32_t)(i / numBases)) + 1;
+    }
+    nameOffsets[numRooms] = namesSize;
+    free(baseOffsets);
+
+    /* Connections, each room's sorted and in range */
+    uint64_t door = 0;
+    bool valid = true;
+    for(i = 0; i < numRooms && valid; i++)
+    {
+        uint64_t degree = 0;
+        offsets[i] = door;
+        valid = GetVarint(&p, end, &degree) && degree <= numConnections - door;
+        uint64_t j;
+        int64_t previous = 0;
+        for(j = 0; valid && j < degree; j++)
+        {
+            uint64_t delta = 0;
+            if(!GetVarint(&p, end, &delta))
+            {
+                valid = false;
+                break;
+            }
+            int64_t room = j == 0 ? (int64_t)i + UnZigZag(delta) : previous + 1 + (int64_t)delta;
+            valid = room >= 0 && room < (int64_t)numRooms;
+            connections[door++] = room;
+            previous = room;
+        }
+    }
+    offsets[numRooms] = door;
+    if(!valid || door != numConnections)
+    {
+        FreeWorld(world);
+        return false;
+    }
+
+    IndexWorld(world);
+    return true;
+}
+
+/*
+ * Loads world id of the archive at path, or the newest one if id is
+ * negative, into a heap image, and fills in its entry if entry isn't
+ * NULL. Only the header, the footer, the index blocks on the way to the
+ * world and its record are read, however big the archive is.
+ */
+bool LoadArchiveWorld(World *world, const char *path, int64_t id, ArchiveEntry *entry)
+{
+    memset(world, 0, sizeof(World));
+    int fd = open(path, O_RDONLY);
+    if(fd == -1)
+    {
+        return false;
+    }
+
+    ArchiveHeader header;
+    ArchiveFooter footer;
+    if(!ReadTail(fd, &header, &footer))
+    {
+        close(fd);
+        return false;
+    }
+    if(footer.numWorlds == 0 || id >= (int64_t)footer.numWorlds)
+    {
+        if(footer.numWorlds == 0)
+        {
+            fprintf(stderr, "The world archive is empty.\n");
+        }
+        else
+        {
+            fprintf(stderr, "The world archive only has worlds 0 to %llu.\n", (unsigned long long)footer.numWorlds - 1);
+        }
+        close(fd);
+        return false;
+    }
+    if(id < 0)
+    {
+        id = footer.numWorlds - 1;
+    }
+
+    /* Newest block first; each starts further back */
+    ArchiveEntry found;
+    ArchiveIndex block;
+    uint64_t offset = footer.index;
+    bool located = false;
+    while(offset != 0 && ReadAt(fd, &block, sizeof(ArchiveIndex), offset) &&
+          memcmp(block.magic, INDEX_MAGIC, sizeof(block.magic)) == 0)
+    {
+        if(id >= block.firstWorld)
+        {
+            located = id - block.firstWorld < block.count &&
+                      ReadAt(fd, &found, sizeof(ArchiveEntry),
+                             offset + sizeof(ArchiveIndex) + (id - block.firstWorld) * sizeof(ArchiveEntry));
+            break;
+        }
+        offset = block.previous;
+    }
+
+    uint8_t *record = located ? (uint8_t*)malloc(found.size > 0 ? found.size : 1) : NULL;
+    bool loaded = record != NULL && ReadAt(fd, record, found.size, found.offset) &&
+                  DecodeWorld(world, record, found.size, found.seed);
+    free(record);
+    close(fd);
+    if(!loaded)
+    {
+        fprintf(stderr, "World %lld of the archive is damaged.\n", (long long)id);
+        return false;
+    }
+
+    if(entry != NULL)
+    {
+        *entry = found;
+    }
+    return true;
+}
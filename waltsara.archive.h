@@ -0,0 +1,109 @@
+#ifndef WALTSARA_ARCHIVE_H
+#define WALTSARA_ARCHIVE_H
+
+/*
+ * Archives of many worlds in a single file that only ever grows, instead
+ * of a file or directory per world. Worlds are numbered from 0 in the
+ * order they went in, which is also the order they were made in.
+ *
+ *   header | record ... | index block | footer | record ... | index block | footer | ...
+ *
+ * Everything is little-endian and starts on an 8 byte boundary. The header
+ * holds the offset of the last footer written, so a reader finds the
+ * newest world, or any other, without reading anything else or scanning
+ * a directory. Writers append records, an index block and a footer, sync
+ * them, and only then point the header at the new footer; anything after
+ * the footer the header points at is an append that never finished, and
+ * the next writer cuts it off.
+ *
+ * A record is a world packed into varints:
+ *
+ *   numRooms startRoom endRoom numConnections numBases
+ *   names: numBases base names, or numRooms names, each NUL terminated
+ *   per room: degree, then the first connection as a zigzag difference
+ *             from the room and each later one as the gap from the last
+ *
+ * Worlds from waltsara.buildrooms name room i after base i % numBases,
+ * followed by i / numBases from room numBases on, so only the bases are
+ * stored. Any other names are stored in full, numBases being 0.
+ *
+ * Each index block lists the entries of a run of worlds and points back
+ * to the block before it. A new block takes in every earlier block no
+ * bigger than itself, so blocks halve in size going back and a lookup
+ * visits a handful of them however many worlds there are.
+ */
+
+#include <pthread.h>
+
+#include "waltsara.world.h"
+
+#define ARCHIVE_MAGIC "WALTARCH"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_NAME "waltsara.archive"         // Where waltsara.buildrooms --archive puts worlds
+
+typedef struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t footer;                    // Offset of the last complete footer, 0 while there is none
+} ArchiveHeader;
+
+/* Where a world is in the archive and what it is */
+typedef struct
+{
+    uint64_t offset;                    // Of its record
+    uint64_t size;                      // Bytes in the record
+    int64_t  created;                   // Nanoseconds since the epoch
+    uint64_t seed;                      // Seed the world was generated from
+    uint32_t numRooms;
+    uint32_t reserved;
+} ArchiveEntry;
+
+typedef struct
+{
+    char     magic[8];                  // "WALTAIDX"
+    uint32_t firstWorld;                // Number of the first world listed
+    uint32_t count;                     // Entries that follow
+    uint64_t previous;                  // Offset of the block before, 0 for the first
+} ArchiveIndex;
+
+typedef struct
+{
+    char     magic[8];                  // "WALTAEND"
+    uint64_t index;                     // Offset of the newest index block
+    uint64_t numWorlds;
+    uint64_t check;                     // Hash of the fields above, telling a footer from a torn write
+} ArchiveFooter;
+
+/*
+ * An archive open for appending. Records can be added from several
+ * threads at once; the index and footer only go in on commit, so a batch
+ * of worlds appears all at once or not at all.
+ */
+typedef struct
+{
+    int              fd;
+    uint64_t         end;               // Where the next record goes
+    uint64_t         committed;         // End of the archive as of the last commit
+    uint64_t         numWorlds;         // Worlds committed before this batch
+    uint64_t         index;             // Offset of the newest index block, 0 if none
+    ArchiveEntry    *pending;           // Entries of this batch, by slot
+    bool            *added;             // Whether each slot has its record in the file
+    uint32_t         numSlots;
+    pthread_mutex_t  lock;              // Guards end while records are added
+} ArchiveWriter;
+
+/* Writing */
+size_t EncodeWorld(const World *w, int numBases, uint8_t **buffer, size_t *capacity);   // Packs a world into a record
+bool BeginArchive(ArchiveWriter *a, const char *path, uint32_t numSlots);  // Opens or creates an archive for a batch
+bool AddToArchive(ArchiveWriter *a, uint32_t slot, const uint8_t *record, size_t size, uint64_t seed,
+                  uint32_t numRooms);                   // Appends one record of the batch
+int64_t CommitArchive(ArchiveWriter *a);               // Indexes the batch, number of its first world or -1
+void CloseArchive(ArchiveWriter *a);                   // Releases the archive, dropping anything not committed
+
+/* Reading */
+bool IsArchive(const char *path);                      // Whether the file starts like an archive
+bool LoadArchiveWorld(World *w, const char *path, int64_t id, ArchiveEntry *entry);  // Unpacks world id, -1 for the newest
+
+#endif
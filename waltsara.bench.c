@@ -0,0 +1,748 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Helpful constants */
+#define MAX_BENCHMARKS 32
+#define MAX_NAME_LENGTH 64
+#define DEFAULT_REPEATS 3                       // Runs per benchmark, the best one counts
+#define DEFAULT_THRESHOLD 20.0                  // Percent a result may be worse than its baseline
+#define BENCH_SEED "12345"                      // Every world is generated from the same seed
+#define TURN_PAIRS 500000                       // Back and forth moves in the turn benchmark
+#define TIME_COMMANDS 200000                    // time commands in the time benchmark
+#define TIME_REPEATS 4                          // Extra runs of the time benchmark per repeat
+#define CHANGE_PAIRS 100000                     // Lock and unlock commands in the live world benchmark
+
+/* Bool doesn't exist in ANSI C, so I chose to define it */
+typedef enum { false, true } bool;
+
+/* One measured number */
+typedef struct
+{
+    char    name[MAX_NAME_LENGTH];
+    double  value;
+    char    unit[16];
+    bool    higherIsBetter;
+} Result;
+
+/* Everything the benchmarks share */
+typedef struct
+{
+    char    buildrooms[4096];               // Absolute paths of the binaries under test
+    char    adventure[4096];
+    char    directory[64];                  // Scratch directory every run happens in
+    int     repeats;
+    Result  results[MAX_BENCHMARKS];
+    int     numResults;
+    int     failures;                       // Runs that failed, whose benchmarks have no result
+} Bench;
+
+/* Forward-declarations */
+bool RunProgram(Bench *b, char *const argv[], const char *input, const char *output, double *seconds, int *pid);	// Runs a binary in the scratch directory
+bool ReadFile(const char *path, char *buffer, size_t size);				// Reads the start of a file into buffer
+void RemoveTree(const char *path);							// Deletes a world file or room directory
+void AddResult(Bench *b, const char *name, double value, const char *unit, bool higherIsBetter);	// Records one number
+void BenchGeneration(Bench *b, int numRooms, int maxConnections);			// Rooms generated per second
+void BenchLoad(Bench *b, int numRooms, bool binary);					// Time to load a world and quit
+void BenchTurns(Bench *b);								// Time per turn of the game loop
+void BenchTime(Bench *b);								// Time per time command, file write included
+void BenchChanges(Bench *b, int numRooms);						// Time per door locked or unlocked in a live world
+double ParseTurnsPerSecond(const char *summary);					// TURNS/SEC from a headless summary
+bool FindStartRoom(Bench *b, const char *world, char *start, char *neighbor);		// Names of the start room and one connection
+void WriteResults(const Bench *b, FILE *f);						// Writes the results as JSON
+int LoadBaseline(const char *path, Result *baseline, int max);				// Reads results written by WriteResults
+int CompareResults(const Bench *b, const Result *baseline, int numBaseline, double threshold);	// Reports regressions, returns how many, missing ones included
+
+/* Command line options */
+static struct option longOptions[] = {
+    { "baseline",  required_argument, NULL, 'b' },
+    { "save",      no_argument,       NULL, 's' },
+    { "threshold", required_argument, NULL, 't' },
+    { "repeats",   required_argument, NULL, 'r' },
+    { "output",    required_argument, NULL, 'o' },
+    { NULL, 0, NULL, 0 }
+};
+
+/*
+ * Benchmarks the two binaries by running them the way a player or a test
+ * would, in a scratch directory, and prints the results as JSON. Given a
+ * baseline it compares against it and exits with 1 if any result got
+ * worse by more than the threshold; a baseline that doesn't exist yet is
+ * written instead, as is any baseline with --save.
+ */
+int main(int argc, char** argv)
+{
+    Bench bench;
+    memset(&bench, 0, sizeof(Bench));
+    bench.repeats = DEFAULT_REPEATS;
+    char *baselinePath = NULL;
+    char *outputPath = NULL;
+    bool save = false;
+    double threshold = DEFAULT_THRESHOLD;
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "b:st:r:o:", longOptions, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 'b': baselinePath = optarg; break;
+            case 's': save = true; break;
+            case 't': threshold = atof(optarg); break;
+            case 'r': bench.repeats = atoi(optarg); break;
+            case 'o': outputPath = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-b baseline.json] [--save] [-t threshold-percent] [-r repeats]\n"
+                                "       [-o results.json]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(bench.repeats < 1)
+    {
+        bench.repeats = 1;
+    }
+
+    if(realpath("waltsara.buildrooms", bench.buildrooms) == NULL ||
+       realpath("waltsara.adventure", bench.adventure) == NULL)
+    {
+        fprintf(stderr, "Run from the directory holding waltsara.buildrooms and waltsara.adventure.\n");
+        return 1;
+    }
+
+    strcpy(bench.directory, "/tmp/waltsara.bench.XXXXXX");
+    if(mkdtemp(bench.directory) == NULL)
+    {
+        perror("Failed to create scratch directory.");
+        return 1;
+    }
+
+    /* Lightest first, before the big worlds leave the page cache and allocator busy */
+    BenchTurns(&bench);
+    BenchTime(&bench);
+    BenchChanges(&bench, 1000000);
+    BenchLoad(&bench, 20000, false);
+    BenchLoad(&bench, 1000000, true);
+    BenchGeneration(&bench, 100000, 6);
+    BenchGeneration(&bench, 100000, 12);
+    BenchGeneration(&bench, 1000000, 6);
+    BenchGeneration(&bench, 1000000, 12);
+
+    RemoveTree(bench.directory);
+
+    WriteResults(&bench, stdout);
+    if(outputPath != NULL)
+    {
+        FILE *f = fopen(outputPath, "w");
+        if(f == NULL)
+        {
+            perror("Unable to write results.");
+            return 1;
+        }
+        WriteResults(&bench, f);
+        fclose(f);
+    }
+
+    if(bench.failures > 0)
+    {
+        fprintf(stderr, "%d benchmark run%s failed.\n", bench.failures, bench.failures == 1 ? "" : "s");
+    }
+    if(baselinePath == NULL)
+    {
+        return bench.failures > 0;
+    }
+
+    Result baseline[MAX_BENCHMARKS];
+    int numBaseline = save ? -1 : LoadBaseline(baselinePath, baseline, MAX_BENCHMARKS);
+    if(numBaseline < 0 && bench.failures > 0)
+    {
+        fprintf(stderr, "Not saving a baseline with benchmarks missing.\n");
+        return 1;
+    }
+    if(numBaseline < 0)
+    {
+        FILE *f = fopen(baselinePath, "w");
+        if(f == NULL)
+        {
+            perror("Unable to write baseline.");
+            return 1;
+        }
+        WriteResults(&bench, f);
+        fclose(f);
+        fprintf(stderr, "Saved baseline %s.\n", baselinePath);
+        return 0;
+    }
+
+    int regressions = CompareResults(&bench, baseline, numBaseline, threshold);
+    if(regressions > 0)
+    {
+        fprintf(stderr, "%d benchmark%s regressed by more than %.0f%% or didn't run.\n",
+                regressions, regressions == 1 ? "" : "s", threshold);
+        return 1;
+    }
+    if(bench.failures > 0)
+    {
+        return 1;
+    }
+    fprintf(stderr, "No regressions against %s.\n", baselinePath);
+    return 0;
+}
+
+/*
+ * Runs argv[0] in the scratch directory with input (or /dev/null) as its
+ * stdin and output (or /dev/null) as its stdout, and waits for it. Sets
+ * seconds to the wall time it took and pid to its process ID, which names
+ * the world files buildrooms writes. Returns false unless it exits with 0,
+ * and counts the failure.
+ */
+bool RunProgram(Bench *bench, char *const argv[], const char *input, const char *output, double *seconds, int *pid)
+{
+    /* Flush what earlier runs wrote so its writeback isn't timed here */
+    sync();
+
+    struct timespec began, finished;
+    clock_gettime(CLOCK_MONOTONIC, &began);
+
+    pid_t child = fork();
+    if(child == -1)
+    {
+        perror("Failed to start a benchmark.");
+        bench->failures++;
+        return false;
+    }
+    if(child == 0)
+    {
+        int in = open(input ? input : "/dev/null", O_RDONLY);
+        int out = open(output ? output : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(chdir(bench->directory) == -1 || in == -1 || out == -1 ||
+           dup2(in, STDIN_FILENO) == -1 || dup2(out, STDOUT_FILENO) == -1)
+        {
+            _exit(127);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    while(waitpid(child, &status, 0) == -1 && errno == EINTR)
+    {
+        /* Keep waiting */
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+
+    *seconds = (finished.tv_sec - began.tv_sec) + (finished.tv_nsec - began.tv_nsec) / 1e9;
+    if(pid != NULL)
+    {
+        *pid = child;
+    }
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "%s failed.\n", argv[0]);
+        bench->failures++;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Reads up to size - 1 bytes from the start of the specified file into
+ * buffer and NUL terminates them.
+ */
+bool ReadFile(const char *path, char *buffer, size_t size)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd == -1)
+    {
+        return false;
+    }
+
+    size_t length = 0;
+    ssize_t got;
+    while(length < size - 1 && (got = read(fd, buffer + length, size - 1 - length)) > 0)
+    {
+        length += got;
+    }
+    close(fd);
+    buffer[length] = '\0';
+    return true;
+}
+
+/*
+ * Deletes the specified file, or directory and the files in it. Room
+ * directories are never nested, so one level is enough.
+ */
+void RemoveTree(const char *path)
+{
+    DIR *dp = opendir(path);
+    if(dp == NULL)
+    {
+        unlink(path);
+        return;
+    }
+
+    int dirFd = dirfd(dp);
+    struct dirent *entry;
+    while((entry = readdir(dp)) != NULL)
+    {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        if(unlinkat(dirFd, entry->d_name, 0) == -1 && errno == EISDIR)
+        {
+            char child[4096];
+            snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+            RemoveTree(child);
+        }
+    }
+    closedir(dp);
+    rmdir(path);
+}
+
+/*
+ * Records one result under the specified name.
+ */
+void AddResult(Bench *bench, const char *name, double value, const char *unit, bool higherIsBetter)
+{
+    if(bench->numResults == MAX_BENCHMARKS)
+    {
+        return;
+    }
+
+    Result *result = &bench->results[bench->numResults++];
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    snprintf(result->unit, sizeof(result->unit), "%s", unit);
+    result->value = value;
+    result->higherIsBetter = higherIsBetter;
+    fprintf(stderr, "%-32s %14.1f %s\n", name, value, unit);
+}
+
+/*
+ * Measures how many rooms per second buildrooms generates and writes as
+ * a binary world, which is dominated by AddRandomConnection and friends.
+ */
+void BenchGeneration(Bench *bench, int numRooms, int maxConnections)
+{
+    char rooms[16], connections[16];
+    snprintf(rooms, sizeof(rooms), "%d", numRooms);
+    snprintf(connections, sizeof(connections), "%d", maxConnections);
+    char *argv[] = { bench->buildrooms, "-n", rooms, "-M", connections, "-s", BENCH_SEED,
+                     "-f", "binary", NULL };
+
+    double best = 0;
+    int i;
+    for(i = 0; i < bench->repeats; i++)
+    {
+        double seconds;
+        int pid;
+        bool ran = RunProgram(bench, argv, NULL, NULL, &seconds, &pid);
+
+        char world[4096];
+        snprintf(world, sizeof(world), "%s/waltsara.world.%d", bench->directory, pid);
+        RemoveTree(world);
+        if(!ran)
+        {
+            return;
+        }
+        best = (i == 0 || seconds < best) ? seconds : best;
+    }
+
+    char name[MAX_NAME_LENGTH];
+    snprintf(name, sizeof(name), "generate_%d_rooms_max_%d", numRooms, maxConnections);
+    AddResult(bench, name, numRooms / best, "rooms/s", true);
+}
+
+/*
+ * Measures how long the adventure takes to load a world of numRooms rooms
+ * and quit straight away, start up included. Text worlds go through
+ * InitializeGraph and InitializeRoom; binary ones are mapped.
+ */
+void BenchLoad(Bench *bench, int numRooms, bool binary)
+{
+    char rooms[16];
+    snprintf(rooms, sizeof(rooms), "%d", numRooms);
+    char *generate[] = { bench->buildrooms, "-n", rooms, "-s", BENCH_SEED, "-f", binary ? "binary" : "text", NULL };
+
+    double seconds;
+    int pid;
+    if(!RunProgram(bench, generate, NULL, NULL, &seconds, &pid))
+    {
+        return;
+    }
+    char world[4096];
+    snprintf(world, sizeof(world), "%s/waltsara.%s.%d", bench->directory, binary ? "world" : "rooms", pid);
+
+    char script[4096];
+    snprintf(script, sizeof(script), "%s/empty.script", bench->directory);
+    close(open(script, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+
+    char *play[] = { bench->adventure, "-w", world, "-S", script, "-q", NULL };
+    double best = 0;
+    int i;
+    for(i = 0; i < bench->repeats; i++)
+    {
+        if(!RunProgram(bench, play, NULL, NULL, &seconds, NULL))
+        {
+            RemoveTree(world);
+            return;
+        }
+        best = (i == 0 || seconds < best) ? seconds : best;
+    }
+    RemoveTree(world);
+
+    char name[MAX_NAME_LENGTH];
+    snprintf(name, sizeof(name), "load_%s_%d_rooms", binary ? "binary" : "text", numRooms);
+    AddResult(bench, name, best * 1e3, "ms", false);
+}
+
+/*
+ * Measures the time per turn of the game loop: moving back and forth
+ * between the start room and one of its connections, with every prompt
+ * rendered, as the headless mode reports it.
+ */
+void BenchTurns(Bench *bench)
+{
+    char *generate[] = { bench->buildrooms, "-n", "1000", "-s", BENCH_SEED, "-f", "binary", NULL };
+    double seconds;
+    int pid;
+    if(!RunProgram(bench, generate, NULL, NULL, &seconds, &pid))
+    {
+        return;
+    }
+    char world[4096];
+    snprintf(world, sizeof(world), "%s/waltsara.world.%d", bench->directory, pid);
+
+    char start[64], neighbor[64];
+    char script[4096];
+    snprintf(script, sizeof(script), "%s/turns.script", bench->directory);
+    if(!FindStartRoom(bench, world, start, neighbor))
+    {
+        RemoveTree(world);
+        return;
+    }
+    FILE *f = fopen(script, "w");
+    if(f == NULL)
+    {
+        fprintf(stderr, "Unable to write %s.\n", script);
+        bench->failures++;
+        RemoveTree(world);
+        return;
+    }
+    int i;
+    for(i = 0; i < TURN_PAIRS; i++)
+    {
+        fprintf(f, "%s\n%s\n", neighbor, start);
+    }
+    fclose(f);
+
+    /* Output goes to a file so the summary can be read back; the rest of it is the point */
+    char output[4096];
+    snprintf(output, sizeof(output), "%s/turns.out", bench->directory);
+    char *play[] = { bench->adventure, "-w", world, "-S", script, NULL };
+    double best = 0;
+    for(i = 0; i < bench->repeats; i++)
+    {
+        char summary[256];
+        double turnsPerSecond = 0;
+        if(RunProgram(bench, play, NULL, output, &seconds, NULL))
+        {
+            /* The summary is the last line */
+            int fd = open(output, O_RDONLY);
+            off_t size = lseek(fd, 0, SEEK_END);
+            ssize_t got = pread(fd, summary, sizeof(summary) - 1, size > 200 ? size - 200 : 0);
+            close(fd);
+            summary[got > 0 ? got : 0] = '\0';
+            turnsPerSecond = ParseTurnsPerSecond(summary);
+        }
+        if(turnsPerSecond <= 0)
+        {
+            break;
+        }
+        best = (i == 0 || 1e9 / turnsPerSecond < best) ? 1e9 / turnsPerSecond : best;
+    }
+    RemoveTree(output);
+    RemoveTree(script);
+    RemoveTree(world);
+
+    if(best > 0)
+    {
+        AddResult(bench, "turn_latency", best, "ns", false);
+    }
+}
+
+/*
+ * Measures the time per change to a live world of numRooms rooms: locking
+ * and unlocking a door of the start room over and over, with the distance
+ * to the end from every room kept up to date, as the headless mode
+ * reports it.
+ */
+void BenchChanges(Bench *bench, int numRooms)
+{
+    char rooms[16];
+    snprintf(rooms, sizeof(rooms), "%d", numRooms);
+    char *generate[] = { bench->buildrooms, "-n", rooms, "-s", BENCH_SEED, "-f", "binary", NULL };
+    double seconds;
+    int pid;
+    if(!RunProgram(bench, generate, NULL, NULL, &seconds, &pid))
+    {
+        return;
+    }
+    char world[4096];
+    snprintf(world, sizeof(world), "%s/waltsara.world.%d", bench->directory, pid);
+
+    char start[64], neighbor[64];
+    char script[4096];
+    snprintf(script, sizeof(script), "%s/changes.script", bench->directory);
+    if(!FindStartRoom(bench, world, start, neighbor))
+    {
+        RemoveTree(world);
+        return;
+    }
+    FILE *f = fopen(script, "w");
+    if(f == NULL)
+    {
+        fprintf(stderr, "Unable to write %s.\n", script);
+        bench->failures++;
+        RemoveTree(world);
+        return;
+    }
+    int i;
+    for(i = 0; i < CHANGE_PAIRS; i++)
+    {
+        fprintf(f, "lock %s\nunlock %s\n", neighbor, neighbor);
+    }
+    fclose(f);
+
+    char output[4096];
+    snprintf(output, sizeof(output), "%s/changes.out", bench->directory);
+    char *play[] = { bench->adventure, "-w", world, "-S", script, "--quiet", "--live", NULL };
+    double best = 0;
+    for(i = 0; i < bench->repeats; i++)
+    {
+        char summary[256];
+        double turnsPerSecond = 0;
+        if(RunProgram(bench, play, NULL, output, &seconds, NULL) && ReadFile(output, summary, sizeof(summary)))
+        {
+            turnsPerSecond = ParseTurnsPerSecond(summary);
+        }
+        if(turnsPerSecond <= 0)
+        {
+            break;
+        }
+        best = (i == 0 || 1e9 / turnsPerSecond < best) ? 1e9 / turnsPerSecond : best;
+    }
+    RemoveTree(output);
+    RemoveTree(script);
+    RemoveTree(world);
+
+    if(best > 0)
+    {
+        AddResult(bench, "world_change_latency", best, "ns", false);
+    }
+}
+
+/*
+ * Measures the round trip of the time command with --time-file: the game
+ * reads the cached time and hands WriteTime to the background worker,
+ * which writes currentTime.txt.
+ */
+void BenchTime(Bench *bench)
+{
+    char *generate[] = { bench->buildrooms, "-s", BENCH_SEED, "-f", "binary", NULL };
+    double seconds;
+    int pid;
+    if(!RunProgram(bench, generate, NULL, NULL, &seconds, &pid))
+    {
+        return;
+    }
+    char world[4096];
+    snprintf(world, sizeof(world), "%s/waltsara.world.%d", bench->directory, pid);
+
+    char script[4096];
+    snprintf(script, sizeof(script), "%s/time.script", bench->directory);
+    FILE *f = fopen(script, "w");
+    if(f == NULL)
+    {
+        fprintf(stderr, "Unable to write %s.\n", script);
+        bench->failures++;
+        RemoveTree(world);
+        return;
+    }
+    int i;
+    for(i = 0; i < TIME_COMMANDS; i++)
+    {
+        fputs("time\n", f);
+    }
+    fclose(f);
+
+    /*
+     * Wall time rather than the summary, so the worker draining its writes
+     * at exit counts too. How the worker and the game share the CPUs makes
+     * single runs vary a lot, so this one gets extra runs; they're short.
+     */
+    char *play[] = { bench->adventure, "-w", world, "-S", script, "-q", "--time-file", NULL };
+    double best = 0;
+    for(i = 0; i < bench->repeats * TIME_REPEATS; i++)
+    {
+        if(!RunProgram(bench, play, NULL, NULL, &seconds, NULL))
+        {
+            best = 0;
+            break;
+        }
+        best = (i == 0 || seconds < best) ? seconds : best;
+    }
+
+    char timeFile[4096];
+    snprintf(timeFile, sizeof(timeFile), "%s/currentTime.txt", bench->directory);
+    RemoveTree(timeFile);
+    RemoveTree(script);
+    RemoveTree(world);
+
+    if(best > 0)
+    {
+        AddResult(bench, "time_command_latency", best * 1e9 / TIME_COMMANDS, "ns", false);
+    }
+}
+
+/*
+ * Returns the TURNS/SEC figure from a headless summary line, or 0.
+ */
+double ParseTurnsPerSecond(const char *summary)
+{
+    const char *field = strstr(summary, "TURNS/SEC: ");
+    return field != NULL ? atof(field + strlen("TURNS/SEC: ")) : 0;
+}
+
+/*
+ * Plays the specified world with no input to read the first prompt, and
+ * copies out the start room's name and its first connection's.
+ */
+bool FindStartRoom(Bench *bench, const char *world, char *start, char *neighbor)
+{
+    char output[4096];
+    snprintf(output, sizeof(output), "%s/start.out", bench->directory);
+    char *play[] = { bench->adventure, "-w", (char*)world, NULL };
+    double seconds;
+    char text[1024];
+    bool ran = RunProgram(bench, play, NULL, output, &seconds, NULL) && ReadFile(output, text, sizeof(text));
+    RemoveTree(output);
+
+    if(ran && sscanf(text, "CURRENT LOCATION: %63s\nPOSSIBLE CONNECTIONS: %63[^,.]", start, neighbor) != 2)
+    {
+        fprintf(stderr, "Unable to find the start room of %s.\n", world);
+        bench->failures++;
+        return false;
+    }
+    return ran;
+}
+
+/*
+ * Writes the results as a JSON object with one benchmark per line, which
+ * is also the layout LoadBaseline reads back.
+ */
+void WriteResults(const Bench *bench, FILE *f)
+{
+    fputs("{\n  \"benchmarks\": [\n", f);
+    int i;
+    for(i = 0; i < bench->numResults; i++)
+    {
+        const Result *result = &bench->results[i];
+        fprintf(f, "    {\"name\": \"%s\", \"value\": %.3f, \"unit\": \"%s\", \"higher_is_better\": %s}%s\n",
+                result->name, result->value, result->unit, result->higherIsBetter ? "true" : "false",
+                i < bench->numResults - 1 ? "," : "");
+    }
+    fputs("  ]\n}\n", f);
+}
+
+/*
+ * Reads a baseline written by WriteResults into baseline. Returns the
+ * number of results, or -1 if there is no such file.
+ */
+int LoadBaseline(const char *path, Result *baseline, int max)
+{
+    FILE *f = fopen(path, "r");
+    if(f == NULL)
+    {
+        return -1;
+    }
+
+    int count = 0;
+    char line[512];
+    while(count < max && fgets(line, sizeof(line), f) != NULL)
+    {
+        Result *result = &baseline[count];
+        char better[8];
+        if(sscanf(line, " {\"name\": \"%63[^\"]\", \"value\": %lf, \"unit\": \"%15[^\"]\", \"higher_is_better\": %7[a-z]",
+                  result->name, &result->value, result->unit, better) == 4)
+        {
+            result->higherIsBetter = strcmp(better, "true") == 0;
+            count++;
+        }
+    }
+    fclose(f);
+    return count;
+}
+
+/*
+ * Compares every baseline with the result of the same name and reports
+ * the change. A baseline with no result means its benchmark didn't run,
+ * which counts against it as well. Returns how many got worse by more
+ * than threshold percent or went missing.
+ */
+int CompareResults(const Bench *bench, const Result *baseline, int numBaseline, double threshold)
+{
+    int regressions = 0;
+    int i, j;
+    for(i = 0; i < numBaseline; i++)
+    {
+        const Result *result = NULL;
+        for(j = 0; j < bench->numResults && result == NULL; j++)
+        {
+            result = strcmp(bench->results[j].name, baseline[i].name) == 0 ? &bench->results[j] : NULL;
+        }
+        if(result == NULL)
+        {
+            fprintf(stderr, "%-32s MISSING\n", baseline[i].name);
+            regressions++;
+            continue;
+        }
+        if(baseline[i].value <= 0)
+        {
+            fprintf(stderr, "%-32s no baseline\n", result->name);
+            continue;
+        }
+
+        /* Positive change is always an improvement */
+        double change = (result->value - baseline[i].value) / baseline[i].value * 100;
+        if(!result->higherIsBetter)
+        {
+            change = -change;
+        }
+        bool regressed = change < -threshold;
+        regressions += regressed;
+        fprintf(stderr, "%-32s %+7.1f%%%s\n", result->name, change, regressed ? "  REGRESSION" : "");
+    }
+
+    /* New benchmarks have nothing to compare with yet */
+    for(i = 0; i < bench->numResults; i++)
+    {
+        for(j = 0; j < numBaseline && strcmp(baseline[j].name, bench->results[i].name) != 0; j++)
+        {
+            /* Find the matching baseline */
+        }
+        if(j == numBaseline)
+        {
+            fprintf(stderr, "%-32s no baseline\n", bench->results[i].name);
+        }
+    }
+    return regressions;
+}
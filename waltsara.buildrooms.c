@@ -1,304 +1,3572 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "waltsara.archive.h"
+#include "waltsara.reroll.h"
+#include "waltsara.stats.h"
+#include "waltsara.world.h"
+
 /* Defining helpful constants */
-#define MAX_ROOM_NAME_LENGTH 32
 #define NUM_REQUIRED_ROOMS 7
 #define MAX_ROOM_COUNT 10
 #define MIN_ROOM_CONNECTIONS 3
 #define MAX_ROOM_CONNECTIONS 6
+#define MAX_RANDOM_PICKS 32             // Random pool picks before we fall back to scanning
+#define BLOCK_SIZE 65536                // Rooms per block in parallel generation, fixed so output never depends on threads
+#define NUM_ROUNDS 4                    // Rounds of block pairs before the last pass
+#define MERGE_PICKS 8                   // Random picks spent looking for a partner in another component
+#define FEISTEL_ROUNDS 4                // Rounds of the permutation that scatters streamed rooms over IDs
+#define SECTION_BUFFER (1 << 20)        // Bytes buffered for each section of a streamed world file
+#define DEFAULT_MEMORY_LIMIT (1ULL << 30)       // Budget of a streamed world without --memory-limit
+#define MIN_MEMORY_LIMIT (32ULL << 20)          // Smallest budget a streamed world can be built in
+#define MAX_WORLD_PATH 48               // Longest name of a world, "waltsara.partial.rooms.", a pid and an index
+
+/*
+ * The graph holds every room by integer ID. Room i's connections live in
+ * connections[i * maxConnections] and onward, so checking or adding a
+ * connection never has to copy or compare names.
+ *
+ * poolIndex records where each room sits in whichever Pool it currently
+ * belongs to, or -1 once it is full.
+ *
+ * A world with a minimum distance from the start to the end is split into
+ * numLayers layers of consecutive room IDs, and rooms only connect within
+ * a layer of their own. Every step then goes at most one layer further, so
+ * any room in the last layer is at least numLayers - 1 steps from a start
+ * in the first, however the connections come out.
+ */
+typedef struct
+{
+    int   numRooms;
+    int   minConnections;
+    int   maxConnections;
+    int   numLayers;                    // Layers connections stay within one of, 0 for none
+    int  *connectCount;                 // Number of connections of each room
+    int  *connections;                  // numRooms * maxConnections room IDs
+    Type *roomType;
+    int  *poolIndex;                    // Position of each room in its pool, -1 once full
+} Graph;
+
+/*
+ * A pool holds rooms that can still take another connection, which lets us
+ * pick a partner in constant time no matter how many rooms are full. Worker
+ * threads each keep a pool over the two blocks they are filling; the final
+ * pass uses one pool over the whole graph.
+ */
+typedef struct
+{
+    int  *rooms;
+    int   size;
+    int   from[2];                      // Ranges of room IDs the pool was filled from
+    int   to[2];
+} Pool;
+
+/*
+ * Random number stream. Every block pair in every round gets its own stream
+ * derived from the seed, so the world only depends on the seed and never
+ * on how many threads happened to do the work.
+ */
+typedef struct
+{
+    uint64_t state;
+} Rng;
 
-/* Bool doesn't exist in ANSI C, so I chose to define it */
-typedef enum { false, true } bool;
+/*
+ * Union-find over room IDs, tracking which rooms can reach each other.
+ * Sets are merged by size and paths are halved as they are followed.
+ * Taking a connection away can split a set, which union-find can't
+ * express, so anything that does so marks the sets stale instead.
+ */
+typedef struct
+{
+    int  *parent;
+    int  *size;                         // Rooms in each set, valid at the set's root
+    int   numSets;
+    bool  stale;                        // A connection was removed since the sets were built
+} Components;
 
-/* Enumeration for Room type */
-typedef enum {
-  START_ROOM = 0,
-  MID_ROOM,
-  END_ROOM
-} Type;
+/* State shared by the worker threads while the components are rebuilt */
+typedef struct
+{
+    const Graph *graph;
+    Components  *components;
+    int          numBlocks;
+    int          nextBlock;                 // Claimed with an atomic add
+} Linking;
 
-/* Struct for Room data, gives us everything we need to know about the room */
+/*
+ * Shape of a world that is streamed to disk instead of built in memory.
+ * Rooms sit at positions around a ring and each connects to the positions
+ * one stride away on either side, for every stride: stride 1 keeps the
+ * whole ring connected and the rest are random. Required strides give
+ * every room both of their connections; optional ones only exist where a
+ * hash of the position says so, which spreads the number of connections
+ * between the minimum and the maximum. With an even number of rooms,
+ * rooms can also connect straight across the ring.
+ *
+ * A Feistel permutation scatters the positions over room IDs, so any one
+ * room's connections can be worked out on their own, in any order,
+ * without ever holding the graph. Distinct strides below half the ring
+ * can never name the same room twice.
+ */
 typedef struct
 {
-    char  name[MAX_ROOM_NAME_LENGTH];
-    char  connections[MAX_ROOM_CONNECTIONS][MAX_ROOM_NAME_LENGTH];
-    int   connectCount;
-    Type  roomType;
-} Room;
+    uint32_t  numRooms;
+    int       halfBits;                 // Bits in each half of the Feistel block
+    uint64_t  keys[FEISTEL_ROUNDS];
+    uint32_t *strides;
+    int       numStrides;
+    int       numRequired;              // Strides every room has both connections of
+    int       across;                   // Connections across the ring: 0 none, 1 optional, 2 required
+    uint64_t  optionKey;                // Decides which optional connections exist
+} StreamShape;
 
-/* The purpose of the graph is just to serve as a container for rooms */
+/* Buffered writer for one section of a file, so sections can be filled side by side */
 typedef struct
 {
-    Room rooms[NUM_REQUIRED_ROOMS];
-} Graph;
+    int       fd;
+    uint64_t  offset;                   // Where the buffered bytes go in the file
+    char     *buffer;
+    size_t    used;
+    bool      failed;
+} SectionWriter;
+
+/* One sorted run of name index records being merged */
+typedef struct
+{
+    uint64_t  next;                     // Offset of the next record still in the scratch file
+    uint64_t  end;
+    uint64_t *buffer;
+    size_t    count;                    // Records in buffer
+    size_t    position;                 // Next record of buffer
+    size_t    capacity;
+} RunReader;
+
+/* What it took to make the world connected, for -v */
+typedef struct
+{
+    int   components;                   // Components left once every room had its connections
+    int   largest;                      // Rooms in the largest of them
+    int   added;                        // Components joined by a new connection
+    int   swapped;                      // Components joined by swapping two connections
+} ComponentStats;
+
+/* State shared by the worker threads during one round */
+typedef struct
+{
+    Graph    *graph;
+    uint64_t  seed;
+    int       round;
+    int       target;                   // Connections each room should reach this round
+    int      *blockOrder;               // Shuffled blocks, paired off two at a time
+    int       numBlocks;
+    int       numTasks;
+    int       nextTask;                 // Claimed with an atomic add
+    int     **blockPools;               // Pool buffer of each thread filling pairs
+    int       nextPool;                 // Claimed with an atomic add
+} Round;
+
+/*
+ * A graph and the scratch buffers generating and writing it work in.
+ * Every world of a run has the same shape, so a workspace is set up once
+ * and reused for each world a thread makes instead of allocating it all
+ * over again.
+ */
+typedef struct
+{
+    Graph        graph;
+    Pool         pool;                  // Last pass pool over the whole graph
+    Components   components;
+    int         *blockOrder;
+    pthread_t   *threads;
+    int        **blockPools;            // One pool buffer per thread filling block pairs
+    int          numThreads;            // Threads generating each world
+    char        *text;                  // Room file being put together
+    size_t       textCapacity;
+    uint32_t    *roomConnections;       // Connections of the room whose file is being written
+    int          minDistance;           // Bounds on the distance from the start to the end, 0 for none
+    int          maxDistance;
+    int         *distance;              // Distance of each room from the start, with either bound
+    int         *queue;                 // Rooms in the order they were reached
+    uint8_t     *record;                // World being packed for an archive
+    size_t       recordCapacity;
+} Workspace;
+
+/* A batch of worlds shared out between worker threads */
+typedef struct
+{
+    int       numRooms;
+    int       minConnections;
+    int       maxConnections;
+    bool      binaryFormat;
+    int       minDistance;
+    int       maxDistance;
+    uint64_t  seed;                     // Every world's seed is derived from this one
+    int       count;
+    int       nextWorld;                // Claimed with an atomic add
+    bool     *written;                  // Whether each world is on disk under its partial name, or in the archive
+    ArchiveWriter *archive;             // Archive the worlds go into instead of files of their own, or NULL
+} Batch;
+
+/* Counters and timers, see waltsara.stats.h */
+enum
+{
+    STAT_PICKS,                         // Partners asked of GetRandomRoom
+    STAT_PICK_RETRIES,                  // Random picks that hit the room itself or a room it connects to
+    STAT_MERGE_RETRIES,                 // Picks looking for another component that found none
+    STAT_POOL_SCANS,                    // Every random pick failed and the pool was scanned
+    STAT_REWIRES,                       // Connections split because no partner was left
+    STAT_FILES_WRITTEN,
+    STAT_WRITE_SYSCALLS,                // open, write and close calls for room files
+    STAT_BYTES_WRITTEN,
+    STAT_GENERATE_NS,
+    STAT_COMPONENTS_NS,                 // Rebuilding the union-find sets
+    STAT_WRITE_NS,
+    STAT_SYNC_NS,                       // Getting a finished world onto disk before it is published
+    NUM_STATS
+};
+
+static const char *const buildStatNames[NUM_STATS] = {
+    "picks", "pick_retries", "merge_retries", "pool_scans", "rewires",
+    "files_written", "write_syscalls", "bytes_written",
+    "generate_ns", "components_ns", "write_ns", "sync_ns"
+};
+
+/* Forward-declarations */
+bool InitializeGraph(Graph *g, int numRooms, int minConnections, int maxConnections);
+void ResetGraph(Graph *g);                          // Takes every connection away again
+void FreeGraph(Graph *g);
+bool InitializeWorkspace(Workspace *w, int numRooms, int minConnections, int maxConnections,
+                         int minDistance, int maxDistance, int numThreads);
+void FreeWorkspace(Workspace *w);
+void ChooseRooms(Rng *rng, int numRooms, int *start, int *end);    // Shuffles the names and picks the start and end
+int  ChooseEnd(Workspace *w, Rng *rng, int start);  // Picks an end within the distance bounds, -1 if none is
+void GenerateWorld(Workspace *w, uint64_t seed, int *start, int *end, ComponentStats *stats);   // Makes the world of a seed
+bool WriteWorld(Workspace *w, int start, int end, uint64_t seed, bool binaryFormat, const char *partial);
+bool ArchiveWorld(Workspace *w, int start, int end, uint64_t seed, ArchiveWriter *a, int slot);  // Appends the world to an archive
+int  MakeBatch(int numRooms, int minConnections, int maxConnections, int minDistance, int maxDistance,
+               bool binaryFormat, bool archive, uint64_t seed, int count, int numThreads, uint64_t memoryLimit,
+               bool verbose, const struct timespec *began);
+void *MakeWorlds(void *batch);                      // Worker thread body for MakeBatch
+uint64_t DeriveSeed(uint64_t seed, int index);      // Seed of one world of a batch
+int  UpdateWorld(const char *path, char *names, int numRandom, uint64_t seed, bool verbose);  // Rerolls rooms of a world file in place
+bool IsGraphFull(const Graph *g);                   // Used to determine if graph is full, rooms have required connections
+void BuildConnections(Workspace *w, uint64_t seed, ComponentStats *stats);       // Connects every room in parallel rounds
+void ChainLayers(Graph *g, Rng *rng);               // Connects a room of each layer to one of the next
+void *FillBlocks(void *round);                      // Worker thread body for one round
+void FillRoom(Graph *g, Pool *p, Components *c, Rng *rng, int room);            // Adds connections to a room until it has the minimum
+void AddRandomConnection(Graph *g, Pool *p, Components *c, Rng *rng, int room); // Used to add a connection from a room to a random partner
+int  GetRandomRoom(Graph *g, Pool *p, const Components *c, Rng *rng, int room); // Picks a random room that can connect to 'room', or -1
+int  PickCandidate(const Graph *g, const Pool *p, Rng *rng, int room);         // One random pick of a partner, -1 if it has no space
+int  ScanReach(const Graph *g, const Pool *p, Rng *rng, int room);             // Scans a layered room's reach for a partner
+int  SplitReach(const Graph *g, const Pool *p, int room, int *from, int *to);  // The parts of a room's reach in a pool
+void GetReach(const Graph *g, int room, int *from, int *to);                   // Room IDs a room may connect to
+int  GetLayer(const Graph *g, int room);            // Layer a room is in
+int  LayerStart(int numRooms, int numLayers, int layer);   // First room ID of a layer
+bool FitsLayers(int numRooms, int minConnections, int numLayers);  // Whether every room of every layer has enough partners
+void JoinComponents(Graph *g, Pool *p, Components *c, ComponentStats *stats);  // Connects the components left after filling
+bool ExploreComponent(const Graph *g, int room, int *mark, int stamp, int *stack, int *spares, int *numSpares,
+                      int *cycleA, int *cycleB);                               // Walks a component for spare rooms and a cycle connection
+void SwapConnections(Graph *g, Pool *p, int a, int b, int c, int d);           // Replaces a-b and c-d with a-c and b-d
+int  FindSpareNear(const Graph *g, const Components *c, int room);   // Room of another component a room can connect to
+bool FindSwapNear(const Graph *g, const Components *c, int x, int y, int *a, int *b);  // Connection a-b elsewhere to swap x-y with
+bool FindLayeredSwap(const Graph *g, const Components *c, int room, int *mark, int stamp, int *stack,
+                     int *a, int *b, int *x, int *y);   // A swap joining the room's component that keeps to the layers
+bool InitializeComponents(Components *c, int numRooms);                        // Every room in a set of its own
+void FreeComponents(Components *c);
+void BuildComponents(const Graph *g, Components *c, int numThreads);            // Rebuilds the sets from every connection
+void *LinkBlocks(void *linking);                    // Worker thread body for BuildComponents
+int  FindComponent(const Components *c, int room); // Root of the set the room is in
+bool MergeComponents(Components *c, int a, int b); // Joins the sets of two rooms, false if already joined
+bool RewireConnection(Graph *g, Pool *p, Components *c, Rng *rng, int room);    // Frees up a partner by splitting an existing connection
+bool HasConnection(const Graph *g, int from, int to);// Used to determine if a connection exists between rooms
+bool CanConnect(const Graph *g, int a, int b);      // Whether a new connection between two rooms is allowed
+bool CanAddConnectionFrom(const Graph *g, int room);// Used to determine if a valid connection can be made
+void ConnectRoom(Graph *g, Pool *p, int a, int b);  // Used to create a connection between two rooms
+void DisconnectRoom(Graph *g, Pool *p, int a, int b);               // Used to remove a connection between two rooms
+void AddToPool(Graph *g, Pool *p, int room);        // Puts a room with space left into a pool
+void SeedRandom(Rng *rng, uint64_t seed, uint64_t stream);          // Starts the stream with the given number
+uint64_t NextRandom(Rng *rng);                      // Next 64 random bits of a stream
+uint32_t RandomBelow(Rng *rng, uint32_t bound);     // Uniform random number in [0, bound)
+void MakeRoomName(int room, char *name);            // Writes the name a room is given into name
+bool WriteRoomFiles(Workspace *w, int directory);   // Writes one file per room into the directory
+bool WriteWorldFile(const Graph *g, int start, int end, uint64_t seed, const char *fileName);  // Writes the binary world format
+bool FillWorld(World *w, const Graph *g, int start, int end, uint64_t seed);   // Lays the graph out as a world in memory
+uint64_t MixBits(uint64_t x);                       // Scrambles 64 bits, the splitmix64 finalizer
+uint64_t EstimateMemory(int numRooms, int maxConnections);     // Bytes building a world in memory takes
+uint64_t ParseSize(const char *text);               // Number of bytes in "512M" and the like, 0 if invalid
+int  StreamWorld(int numRooms, int minConnections, int maxConnections, int start, int end, uint64_t seed,
+                 Rng *rng, bool binaryFormat, uint64_t memoryLimit, bool verbose, const struct timespec *began);
+bool PlanStream(StreamShape *s, int numRooms, int minConnections, int maxConnections, Rng *rng);  // Picks the strides
+uint32_t PermuteRoom(const StreamShape *s, uint32_t position);     // Room ID at a position of the ring
+uint32_t UnpermuteRoom(const StreamShape *s, uint32_t room);       // Position of a room on the ring
+bool HasOption(const StreamShape *s, int stride, uint32_t position);   // Whether an optional connection exists
+int  CountStreamConnections(const StreamShape *s, uint32_t position); // Connections of the room at a position
+int  GetStreamConnections(const StreamShape *s, uint32_t room, uint32_t *connections);  // A room's connections, sorted
+bool StreamWorldFile(const StreamShape *s, int start, int end, uint64_t seed, const char *fileName,
+                     uint64_t memoryLimit);     // Writes a streamed world in the binary format
+bool StreamRoomFiles(const StreamShape *s, int start, int end, int directory);  // Writes a streamed world as room files
+bool WriteRoomFile(int directory, char *text, size_t capacity, int room, Type type,
+                   const uint32_t *connections, int count);
+void NameWorld(bool binaryFormat, int index, char *partial, char *final);  // Where a world is written, and where it is published
+int  CreateWorldDirectory(const char *path);        // Makes the directory room files are written into
+bool SyncPath(const char *path, bool wholeFilesystem);     // Gets a file, or its whole filesystem, onto disk
+bool PublishWorld(const char *partial, const char *final, bool directory);  // Syncs a finished world and renames it into place
+int  PublishBatch(int count, bool binaryFormat, const bool *written);      // Syncs a batch once and renames its worlds
+void DiscardWorld(const char *path, bool directory);    // Removes a world that was never finished
+bool OpenSection(SectionWriter *w, int fd, uint64_t offset);       // Starts writing a section at offset
+void WriteSection(SectionWriter *w, const void *data, size_t length);  // Appends to a section
+bool CloseSection(SectionWriter *w);                // Flushes a section, false if any write failed
+int  OpenScratchFile(void);                         // Unnamed file in the current directory for sorted runs
+void SortRecords(uint64_t *records, uint64_t *scratch, size_t count);  // Radix sorts name index records by slot
+bool WriteNameIndex(int fd, uint64_t hashOffset, uint64_t numHashSlots, int scratchFd, const uint64_t *runEnds,
+                    int numRuns, uint64_t *records, size_t memory);   // Merges the runs into the hash slots
+bool FillRun(RunReader *r, int fd);                 // Reads the next records of a run
+void ReportStats(bool verbose, uint64_t memoryLimit);   // Prints the counters and peak memory for -v, dumps them if asked to
+
+/* Create 10 room names. I envision my game in a mansion, murder mystery style */
+const char defaultNames[MAX_ROOM_COUNT][MAX_ROOM_NAME_LENGTH] = {
+    "Conservatory", "Lounge", "Kitchen", "Library", "Hall",
+    "Study", "Ballroom", "DiningRoom", "BilliardRoom", "Courtyard"
+};
 
-/* Forward-declarations */  
-bool isGraphFull(const Graph *g);				        // Used to determine if graph is full, rooms have required connections
-void AddRandomConnection(Graph *g);				      // Used to add connections between rooms
-Room* GetRandomRoom(Graph *g);					        // Used to randomly assign rooms
-bool IsConnected(Room *from, Room *to);			    // Used to determine if a connection exists between rooms
-bool CanAddConnectionFrom(const Room *r);		    // Used to determine if a valid connection can be made 
-void ConnectRoom(Room *a, const Room* b);		    // Used to create a connection between two rooms
-bool IsSameRoom(const Room *a, const Room *b);	// Determine if rooms pointed to by a and b are same
+/* The names in the order of the world this thread is making, see ChooseRooms */
+__thread char roomNames[MAX_ROOM_COUNT][MAX_ROOM_NAME_LENGTH];
+
+/* Command line options */
+static struct option longOptions[] = {
+    { "rooms",           required_argument, NULL, 'n' },
+    { "min-connections", required_argument, NULL, 'm' },
+    { "max-connections", required_argument, NULL, 'M' },
+    { "format",          required_argument, NULL, 'f' },
+    { "seed",            required_argument, NULL, 's' },
+    { "jobs",            required_argument, NULL, 'j' },
+    { "verbose",         no_argument,       NULL, 'v' },
+    { "stream",          no_argument,       NULL, 'S' },
+    { "memory-limit",    required_argument, NULL, 'L' },
+    { "count",           required_argument, NULL, 'c' },
+    { "min-distance",    required_argument, NULL, 'd' },
+    { "max-distance",    required_argument, NULL, 'D' },
+    { "archive",         no_argument,       NULL, 'A' },
+    { "update",          required_argument, NULL, 'u' },
+    { "reroll",          required_argument, NULL, 'r' },
+    { "reroll-random",   required_argument, NULL, 'R' },
+    { NULL, 0, NULL, 0 }
+};
 
 /* Main entry point */
 int main(int argc, char** argv)
 {
-    /* Create 10 room names. I envision my game in a mansion, murder mystery style */
-    char roomNames[MAX_ROOM_COUNT][MAX_ROOM_NAME_LENGTH];
-    memset(roomNames, 0, sizeof(char) * MAX_ROOM_COUNT * MAX_ROOM_NAME_LENGTH);
-    memcpy(roomNames[0], "Conservatory", 12);
-    memcpy(roomNames[1], "Lounge", 6);
-    memcpy(roomNames[2], "Kitchen", 7);
-    memcpy(roomNames[3], "Library", 7);
-    memcpy(roomNames[4], "Hall", 4);
-    memcpy(roomNames[5], "Study", 5);
-    memcpy(roomNames[6], "Ballroom", 8);
-    memcpy(roomNames[7], "DiningRoom", 10);
-    memcpy(roomNames[8], "BilliardRoom", 12);
-    memcpy(roomNames[9], "Courtyard", 9);
-
-    Graph graph;
-    memset(&graph, 0, sizeof(Graph));
-
-    /* The purpose here is to keep track of the rooms we add to the graph. */
-    Room allRooms[MAX_ROOM_COUNT];
-    int numUsedRooms = 0;
-    int numAllRooms = 0;
+    int numRooms = NUM_REQUIRED_ROOMS;
+    int minConnections = MIN_ROOM_CONNECTIONS;
+    int maxConnections = MAX_ROOM_CONNECTIONS;
+    bool binaryFormat = false;
+    bool verbose = false;
+    int numThreads = 1;
+    bool stream = false;
+    uint64_t memoryLimit = 0;
+    int count = 1;
+    int minDistance = 0;
+    int maxDistance = 0;
+    bool archive = false;
+    char *updatePath = NULL;
+    char *rerollNames = NULL;
+    int numRandom = 0;
+    StartStats("waltsara.buildrooms", buildStatNames, NUM_STATS, NULL);
 
-    int i;
-    /* Fill out the allRoomes array in the graph. */
-    for(i = 0; i < MAX_ROOM_COUNT; i++)
+    /* Without a seed every run should differ, even two in the same second */
+    uint64_t seed = ((uint64_t)time(NULL) << 20) ^ ((uint64_t)getpid() << 40) ^ (uint64_t)clock();
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "n:m:M:f:s:j:vSL:c:d:D:Au:r:R:", longOptions, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 'n': numRooms = atoi(optarg); break;
+            case 'm': minConnections = atoi(optarg); break;
+            case 'M': maxConnections = atoi(optarg); break;
+            case 's': seed = strtoull(optarg, NULL, 0); break;
+            case 'j': numThreads = atoi(optarg); break;
+            case 'v': verbose = true; break;
+            case 'S': stream = true; break;
+            case 'c': count = atoi(optarg); break;
+            case 'd': minDistance = atoi(optarg); break;
+            case 'D': maxDistance = atoi(optarg); break;
+            case 'A': archive = true; break;
+            case 'u': updatePath = optarg; break;
+            case 'r': rerollNames = optarg; break;
+            case 'R': numRandom = atoi(optarg); break;
+            case 'L':
+                memoryLimit = ParseSize(optarg);
+                if(memoryLimit >= MIN_MEMORY_LIMIT)
+                {
+                    break;
+                }
+                fprintf(stderr, "Memory limits start at %lluM.\n", MIN_MEMORY_LIMIT >> 20);
+                return 1;
+            case 'f':
+                if(strcmp(optarg, "binary") == 0)
+                {
+                    binaryFormat = true;
+                    break;
+                }
+                else if(strcmp(optarg, "text") == 0)
+                {
+                    binaryFormat = false;
+                    break;
+                }
+                /* fall through */
+            default:
+                fprintf(stderr, "Usage: %s [-n rooms] [-m min-connections] [-M max-connections] [-f text|binary]\n"
+                                "       [-s seed] [-j threads] [-v] [--stream] [--memory-limit bytes[K|M|G]]\n"
+                                "       [-c count] [--min-distance steps] [--max-distance steps] [--archive]\n"
+                                "       [--update world-file [--reroll room,...] [--reroll-random count]]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    /* Rerolling changes a world that exists, whatever shape was asked for */
+    if(updatePath != NULL)
     {
-        Room r;
-        r.roomType = MID_ROOM;
-        r.connectCount = 0;
-        memcpy(r.name, &roomNames[i], sizeof(char) * MAX_ROOM_NAME_LENGTH);
-        memcpy(&allRooms[i], &r, sizeof(Room));
-        numAllRooms++;
+        return UpdateWorld(updatePath, rerollNames, numRandom, seed, verbose);
+    }
+    if(rerollNames != NULL || numRandom != 0)
+    {
+        fprintf(stderr, "Rerolling rooms needs the world to --update.\n");
+        return 1;
     }
 
-    srand(time(NULL));
-    /* Move room definitions from the allRooms array to the usedRooms array 
-    ** until we have the correct number of rooms.  
-    ** TODO: might be able to move the allRooms array out of the graph */
-    for(i = 0; i < NUM_REQUIRED_ROOMS; i++)
+    /* Reject shapes that no graph can satisfy instead of looping forever */
+    if(numRooms < 2 || minConnections < 1 || minConnections > maxConnections ||
+       maxConnections > numRooms - 1 || (maxConnections < 2 && numRooms > 2) ||
+       (minConnections == maxConnections && ((long)numRooms * minConnections) % 2 != 0))
+    {
+        fprintf(stderr, "No world has %d rooms with %d to %d connections each.\n",
+                numRooms, minConnections, maxConnections);
+        return 1;
+    }
+    if(numThreads < 1)
     {
-        /* Get random index */
-        int idx = rand() % numAllRooms;
+        numThreads = 1;
+    }
+    if(count < 1)
+    {
+        fprintf(stderr, "A batch needs at least one world.\n");
+        return 1;
+    }
+    if(minDistance < 0 || maxDistance < 0 || (maxDistance > 0 && minDistance > maxDistance))
+    {
+        fprintf(stderr, "No distance is at least %d and at most %d steps.\n", minDistance, maxDistance);
+        return 1;
+    }
+    if(minDistance > 1 && !FitsLayers(numRooms, minConnections, minDistance + 1))
+    {
+        fprintf(stderr, "A world of %d rooms with %d connections each can't put the end %d steps away.\n",
+                numRooms, minConnections, minDistance);
+        return 1;
+    }
+
+    struct timespec began;
+    clock_gettime(CLOCK_MONOTONIC, &began);
 
-        /* Copy the room at this index into the rooms array, 
-         ** and zero-out the old entry in allRooms array */
-        memcpy(&graph.rooms[numUsedRooms], &allRooms[idx], sizeof(Room));
-        memset(&allRooms[idx], 0, sizeof(Room));
-        numAllRooms--;
-        numUsedRooms++;
+    /* Worlds that wouldn't fit in the memory limit are streamed to disk instead */
+    bool tooBig = memoryLimit > 0 && EstimateMemory(numRooms, maxConnections) > memoryLimit;
+    if((stream || tooBig) && (minDistance > 0 || maxDistance > 0))
+    {
+        fprintf(stderr, "Only worlds built in memory can keep the end a distance away.\n");
+        return 1;
+    }
+    if((stream || tooBig) && archive)
+    {
+        fprintf(stderr, "Only worlds built in memory can go into an archive.\n");
+        return 1;
+    }
+    if(count > 1)
+    {
+        if(stream || tooBig)
+        {
+            fprintf(stderr, "Streamed worlds are made one at a time.\n");
+            return 1;
+        }
 
-        /* Collapes allRooms array, so Rooms are once again tightly packed */
-        while(idx <= numAllRooms)
+        /* Every worker holds a world at a time, so only as many as fit run at once */
+        if(memoryLimit > 0 && (uint64_t)numThreads * EstimateMemory(numRooms, maxConnections) > memoryLimit)
         {
-            memcpy(&allRooms[idx], &allRooms[idx+1], sizeof(Room));
-            idx++;
+            numThreads = memoryLimit / EstimateMemory(numRooms, maxConnections);
         }
+        return MakeBatch(numRooms, minConnections, maxConnections, minDistance, maxDistance, binaryFormat, archive,
+                         seed, count, numThreads, memoryLimit, verbose, &began);
     }
 
-
-    /* Randomly assign the start and end rooms since we need a different path every time */
-    Room *start = NULL;
-    Room *end = NULL;
-    do
+    if(stream || tooBig)
     {
-        start = GetRandomRoom(&graph);
-        end = GetRandomRoom(&graph);
-    } while (IsSameRoom(start, end));		    // Since the start and end point need to be different
-
-    start->roomType = START_ROOM;
-    end->roomType = END_ROOM;
+        /* Stream 0 makes the choices that come before the rounds */
+        Rng rng;
+        SeedRandom(&rng, seed, 0);
+        int start;
+        int end;
+        ChooseRooms(&rng, numRooms, &start, &end);
+        return StreamWorld(numRooms, minConnections, maxConnections, start, end, seed, &rng,
+                           binaryFormat, memoryLimit, verbose, &began);
+    }
 
-    /* Build the random room connections */
-    while(!isGraphFull(&graph))
+    Workspace space;
+    if(!InitializeWorkspace(&space, numRooms, minConnections, maxConnections, minDistance, maxDistance, numThreads))
     {
-        AddRandomConnection(&graph);
+        perror("Failed to allocate the graph.");
+        return 1;
     }
 
-    /* Write room files */
-    int pid = getpid();
-    int length = snprintf(NULL, 0, "waltsara.rooms.%d", pid);
-    char directory[length];
-    sprintf(directory, "waltsara.rooms.%d", pid);
+    /* Build the random room connections */
+    ComponentStats stats;
+    int start;
+    int end;
+    GenerateWorld(&space, seed, &start, &end, &stats);
 
-    /* Only create if directory does not exist */
-    struct stat st;
-    if(stat(directory, &st) == -1)
+    if(verbose)
     {
-        if(mkdir(directory, 0755) == -1)
+        struct timespec finished;
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        long connections = 0;
+        int i;
+        for(i = 0; i < numRooms; i++)
+        {
+            connections += space.graph.connectCount[i];
+        }
+        fprintf(stderr, "Seed: %llu\nRooms: %d\nConnections: %ld\nThreads: %d\nGeneration: %.3fs\n",
+                (unsigned long long)seed, numRooms, connections / 2, numThreads,
+                (finished.tv_sec - began.tv_sec) + (finished.tv_nsec - began.tv_nsec) / 1e9);
+        fprintf(stderr, "Components: %d (largest %d rooms)\nJoined: %d by new connections, %d by swaps\n",
+                stats.components, stats.largest, stats.added, stats.swapped);
+        if(space.distance != NULL)
+        {
+            fprintf(stderr, "Distance: %d steps from start to end\n", space.distance[end]);
+        }
+        if(memoryLimit > 0)
         {
-            perror("Failed to create file directory.");
+            fprintf(stderr, "Memory estimate: %.1f MB of %.1f MB allowed\n",
+                    EstimateMemory(numRooms, maxConnections) / 1048576.0, memoryLimit / 1048576.0);
         }
     }
 
-    /* Move to the new directory and create the room files */
-    chdir(directory);
-    for(i = 0; i < NUM_REQUIRED_ROOMS; i++)
+    bool written;
+    if(archive)
     {
-        int len = strlen(graph.rooms[i].name);
-        char *nameBuffer = (char*)calloc(len + 6, sizeof(char));
-        strcat(nameBuffer, graph.rooms[i].name);
-        strcat(nameBuffer, "_room");			          // I chose to append _room to each room name to use as a file name
-        FILE* theFile = fopen(nameBuffer, "w");
-        if(theFile != NULL)
+        /* Readers only see the world once the commit points the archive's header at it */
+        ArchiveWriter writer;
+        int64_t id = -1;
+        if(BeginArchive(&writer, ARCHIVE_NAME, 1))
         {
-            /* Write the file name */
-            fprintf(theFile, "ROOM NAME: %s\n", graph.rooms[i].name);
-
-            /* Write all connection data */
-            int j;
-            for(j = 1; j <= graph.rooms[i].connectCount; j++)
-            {
-                fprintf(theFile, "CONNECTION %d: %s\n", j, graph.rooms[i].connections[j-1]);
-            }
-
-            /* Write the type of room */
-            if(graph.rooms[i].roomType == START_ROOM)
-            {
-                fputs("ROOM TYPE: START_ROOM\n", theFile);
-            }
-            else if(graph.rooms[i].roomType == MID_ROOM)    //So for example, if my room type is a mid room it needs to be labeled as such in the file directory
-            {
-                fputs("ROOM TYPE: MID_ROOM\n", theFile);
-            }
-            else if(graph.rooms[i].roomType == END_ROOM)
-            {
-                fputs("ROOM TYPE: END_ROOM\n", theFile);
-            }
-
-            if(fclose(theFile) != 0)
-            {
-                perror("Unable to close file.");
-            }
+            id = ArchiveWorld(&space, start, end, seed, &writer, 0) ? CommitArchive(&writer) : -1;
+            CloseArchive(&writer);
         }
-        else
+        written = id >= 0;
+        if(written && verbose)
+        {
+            fprintf(stderr, "Archived: world %lld of %s\n", (long long)id, ARCHIVE_NAME);
+        }
+    }
+    else
+    {
+        /* The world is written under a name readers ignore, then renamed once it is complete */
+        char partial[MAX_WORLD_PATH];
+        char final[MAX_WORLD_PATH];
+        NameWorld(binaryFormat, -1, partial, final);
+        written = WriteWorld(&space, start, end, seed, binaryFormat, partial) &&
+                  PublishWorld(partial, final, !binaryFormat);
+        if(!written)
         {
-            perror("Failed to create file.");
+            DiscardWorld(partial, !binaryFormat);
         }
     }
 
-    return 0;
+    FreeWorkspace(&space);
+    ReportStats(verbose, memoryLimit);
+    return written ? 0 : 1;
 }
 
 /*
- *  Determines if the specified graph is full
- *  
- *  A full graph is defined in the assignment as a graph whose rooms all
- *  contain between 3 and 6 outgoing connections.
+ *  Shuffles the room names so small worlds get a different set of rooms
+ *  every time, then randomly assigns the start and end rooms since we need
+ *  a different path every time. The names go into this thread's roomNames,
+ *  so worlds made side by side each keep their own.
  */
-bool isGraphFull(const Graph* graph)
+void ChooseRooms(Rng *rng, int numRooms, int *start, int *end)
 {
-    bool result = true;
-
-    /* Loop will break out when result is set to false */
+    memcpy(roomNames, defaultNames, sizeof(roomNames));
     int i;
-    for(i = 0; i < NUM_REQUIRED_ROOMS && result; i++)
+    for(i = MAX_ROOM_COUNT - 1; i > 0; i--)
     {
-        int numRooms = graph->rooms[i].connectCount;
-        result = (numRooms <= MAX_ROOM_CONNECTIONS) && (numRooms >= MIN_ROOM_CONNECTIONS);
+        int idx = RandomBelow(rng, i + 1);
+        char tmp[MAX_ROOM_NAME_LENGTH];
+        memcpy(tmp, roomNames[i], MAX_ROOM_NAME_LENGTH);
+        memcpy(roomNames[i], roomNames[idx], MAX_ROOM_NAME_LENGTH);
+        memcpy(roomNames[idx], tmp, MAX_ROOM_NAME_LENGTH);
     }
 
-    return result;
+    *start = RandomBelow(rng, numRooms);
+    do
+    {
+        *end = RandomBelow(rng, numRooms);
+    } while(*start == *end);                // Since the start and end point need to be different
 }
 
 /*
- *  Adds one valid connection between two rooms in the specified graph.
+ *  Makes the world of the specified seed in the workspace's graph and
+ *  stores its start and end rooms. The seed alone decides the world, so
+ *  a world made in a batch comes out the same when made on its own.
+ *
+ *  With a bound on the distance from the start to the end, the end is
+ *  only picked once the connections are made, from the rooms that are
+ *  within the bounds. A layered world starts in its first layer, so some
+ *  room is always far enough away.
  */
-void AddRandomConnection(Graph* graph)
+void GenerateWorld(Workspace *space, uint64_t seed, int *start, int *end, ComponentStats *stats)
 {
-    Room* a;
-    Room* b;
+    Graph *graph = &space->graph;
 
-    while(true)
+    /* Stream 0 makes the choices that come before the rounds, and the end after them */
+    Rng rng;
+    SeedRandom(&rng, seed, 0);
+    ChooseRooms(&rng, graph->numRooms, start, end);
+    if(graph->numLayers > 0)
     {
-        a = GetRandomRoom(graph);
-        if(CanAddConnectionFrom(a))
+        *start = RandomBelow(&rng, LayerStart(graph->numRooms, graph->numLayers, 1));
+    }
+
+    ResetGraph(graph);
+    graph->roomType[*start] = START_ROOM;
+    if(space->distance == NULL)
+    {
+        graph->roomType[*end] = END_ROOM;
+    }
+
+    uint64_t timer = StartTimer();
+    BuildConnections(space, seed, stats);
+    if(space->distance != NULL)
+    {
+        *end = ChooseEnd(space, &rng, *start);
+        if(*end < 0)
         {
-            break;
+            /* Only when joining the components had to leave the layers, in worlds with very few rooms per layer */
+            fprintf(stderr, "No room of world %llu is far enough from the start, try more rooms or connections.\n",
+                    (unsigned long long)seed);
+            exit(1);
+        }
+        graph->roomType[*end] = END_ROOM;
+    }
+    StopTimer(STAT_GENERATE_NS, timer);
+}
+
+/*
+ *  Walks the world breadth first from the start, no further than the
+ *  maximum distance, and returns a random room among those at least the
+ *  minimum distance away, or -1 if there is none. Every room's distance
+ *  stays in the workspace afterwards.
+ */
+int ChooseEnd(Workspace *space, Rng *rng, int start)
+{
+    const Graph *graph = &space->graph;
+    int *distance = space->distance;
+    int *queue = space->queue;
+    int lowest = space->minDistance > 1 ? space->minDistance : 1;
+    int highest = space->maxDistance > 0 ? space->maxDistance : graph->numRooms;
+
+    int i;
+    for(i = 0; i < graph->numRooms; i++)
+    {
+        distance[i] = -1;
+    }
+
+    int head = 0;
+    int tail = 0;
+    int count = 0;
+    distance[start] = 0;
+    queue[tail++] = start;
+    while(head < tail)
+    {
+        int room = queue[head++];
+        if(distance[room] >= lowest)
+        {
+            count++;
+        }
+        if(distance[room] == highest)
+        {
+            continue;
+        }
+
+        const int *connections = &graph->connections[(size_t)room * graph->maxConnections];
+        for(i = 0; i < graph->connectCount[room]; i++)
+        {
+            if(distance[connections[i]] < 0)
+            {
+                distance[connections[i]] = distance[room] + 1;
+                queue[tail++] = connections[i];
+            }
         }
     }
 
-    do {
-        b = GetRandomRoom(graph);
-    } while(!CanAddConnectionFrom(b) || IsSameRoom(a, b) || IsConnected(a, b));
+    if(count == 0)
+    {
+        return -1;
+    }
+    int pick = RandomBelow(rng, count);
+    for(i = 0; i < tail; i++)
+    {
+        if(distance[queue[i]] >= lowest && pick-- == 0)
+        {
+            break;
+        }
+    }
+    return queue[i];
+}
 
-    ConnectRoom(a, b);		          // If rooms aren't the same or already connected, make connections
-    ConnectRoom(b, a);
+/*
+ *  Writes the world in the workspace to partial, as a world file or as a
+ *  directory of room files. Returns false if it couldn't be written.
+ */
+bool WriteWorld(Workspace *space, int start, int end, uint64_t seed, bool binaryFormat, const char *partial)
+{
+    uint64_t timer = StartTimer();
+    bool written;
+    if(binaryFormat)
+    {
+        /* The whole world goes into a single file next to the room directories */
+        written = WriteWorldFile(&space->graph, start, end, seed, partial);
+    }
+    else
+    {
+        int directory = CreateWorldDirectory(partial);
+        written = directory != -1 && WriteRoomFiles(space, directory);
+        if(directory != -1)
+        {
+            close(directory);
+        }
+    }
+    StopTimer(STAT_WRITE_NS, timer);
+    return written;
 }
 
 /*
- *  Returns a pointer to a random room stored inside the specified graph.
+ *  Packs the world in the workspace into its record buffer and appends it
+ *  to the archive as the specified slot of the batch. Returns false if it
+ *  couldn't be written.
  */
-Room* GetRandomRoom(Graph* g) {
-    int idx = rand() % NUM_REQUIRED_ROOMS;
-    return &g->rooms[idx];
+bool ArchiveWorld(Workspace *space, int start, int end, uint64_t seed, ArchiveWriter *archive, int slot)
+{
+    uint64_t timer = StartTimer();
+    World world;
+    if(!FillWorld(&world, &space->graph, start, end, seed))
+    {
+        perror("Failed to allocate the world.");
+        return false;
+    }
+
+    size_t size = EncodeWorld(&world, MAX_ROOM_COUNT, &space->record, &space->recordCapacity);
+    bool written = size > 0 && AddToArchive(archive, slot, space->record, size, seed, world.numRooms);
+    if(written)
+    {
+        CountStat(STAT_BYTES_WRITTEN, size);
+    }
+    FreeWorld(&world);
+    StopTimer(STAT_WRITE_NS, timer);
+    return written;
 }
 
 /*
- *  Determines if a connection exists between the rooms pointed 
- *  to by 'from' and 'to'
+ *  Makes count worlds of the same shape on numThreads worker threads and
+ *  publishes them together once they are all written. Each worker makes
+ *  whole worlds on its own and keeps one workspace for all of them, so a
+ *  batch of small worlds pays for no process startup and next to no
+ *  allocation per world. World i gets its own seed derived from the batch
+ *  seed and is published as waltsara.world.<pid>.<i> or
+ *  waltsara.rooms.<pid>.<i>, or with archive goes into the archive as
+ *  world i after the ones already there, the whole batch committed at
+ *  once. Returns the exit status.
  */
-bool IsConnected(Room *from, Room *to)
+int MakeBatch(int numRooms, int minConnections, int maxConnections, int minDistance, int maxDistance,
+              bool binaryFormat, bool archive, uint64_t seed, int count, int numThreads, uint64_t memoryLimit,
+              bool verbose, const struct timespec *began)
 {
-    bool result = false;
-    /* Checks all connections of 'from' to make sure 
-    ** that there is no existing connection to 'to' */
+    Batch batch;
+    memset(&batch, 0, sizeof(Batch));
+    batch.numRooms = numRooms;
+    batch.minConnections = minConnections;
+    batch.maxConnections = maxConnections;
+    batch.minDistance = minDistance;
+    batch.maxDistance = maxDistance;
+    batch.binaryFormat = binaryFormat;
+    batch.seed = seed;
+    batch.count = count;
+    batch.written = (bool*)calloc(count, sizeof(bool));
+    if(batch.written == NULL)
+    {
+        perror("Failed to allocate the batch.");
+        return 1;
+    }
+    ArchiveWriter writer;
+    if(archive)
+    {
+        if(!BeginArchive(&writer, ARCHIVE_NAME, count))
+        {
+            free(batch.written);
+            return 1;
+        }
+        batch.archive = &writer;
+    }
+
+    /* The main thread works too, so only start the extra ones */
+    if(numThreads > count)
+    {
+        numThreads = count;
+    }
+    pthread_t *threads = (pthread_t*)malloc(numThreads * sizeof(pthread_t));
+    int started = 0;
     int i;
-    for(i = 0; i < from->connectCount && !result; i++)
+    for(i = 1; threads != NULL && i < numThreads; i++)
+    {
+        if(pthread_create(&threads[started], NULL, MakeWorlds, &batch) == 0)
+        {
+            started++;
+        }
+    }
+    MakeWorlds(&batch);
+    for(i = 0; i < started; i++)
     {
-        result = (strcmp(to->name, from->connections[i]) == 0);
+        pthread_join(threads[i], NULL);
     }
+    free(threads);
 
-    return result;
+    int published = 0;
+    int64_t first = -1;
+    if(archive)
+    {
+        first = CommitArchive(&writer);
+        for(i = 0; first >= 0 && i < count; i++)
+        {
+            published += batch.written[i];
+        }
+        CloseArchive(&writer);
+    }
+    else
+    {
+        published = PublishBatch(count, binaryFormat, batch.written);
+    }
+    free(batch.written);
+
+    if(verbose)
+    {
+        struct timespec finished;
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        double seconds = (finished.tv_sec - began->tv_sec) + (finished.tv_nsec - began->tv_nsec) / 1e9;
+        fprintf(stderr, "Seed: %llu\nWorlds: %d\nRooms: %d each\nThreads: %d\nGeneration: %.3fs (%.0f worlds/s)\n",
+                (unsigned long long)seed, published, numRooms, started + 1, seconds, published / seconds);
+        if(first >= 0)
+        {
+            fprintf(stderr, "Archived: worlds %lld to %lld of %s\n", (long long)first,
+                    (long long)first + published - 1, ARCHIVE_NAME);
+        }
+    }
+    ReportStats(verbose, memoryLimit);
+
+    if(published < count)
+    {
+        fprintf(stderr, "Only %d of %d worlds were made.\n", published, count);
+        return 1;
+    }
+    return 0;
 }
 
 /*
- *  Determines if a room can be connected to.
+ *  Worker thread body for MakeBatch. Claims worlds one at a time until
+ *  they are all taken, making and writing each in the same workspace.
  */
-bool CanAddConnectionFrom(const Room* r)
+void *MakeWorlds(void *arg)
 {
-    return r->connectCount != MAX_ROOM_CONNECTIONS;
+    Batch *batch = (Batch*)arg;
+
+    Workspace space;
+    if(!InitializeWorkspace(&space, batch->numRooms, batch->minConnections, batch->maxConnections,
+                            batch->minDistance, batch->maxDistance, 1))
+    {
+        return NULL;                        // The other workers make the worlds we can't
+    }
+
+    int index;
+    while((index = __atomic_fetch_add(&batch->nextWorld, 1, __ATOMIC_RELAXED)) < batch->count)
+    {
+        uint64_t seed = DeriveSeed(batch->seed, index);
+        ComponentStats stats;
+        int start;
+        int end;
+        GenerateWorld(&space, seed, &start, &end, &stats);
+
+        if(batch->archive != NULL)
+        {
+            batch->written[index] = ArchiveWorld(&space, start, end, seed, batch->archive, index);
+            continue;
+        }
+
+        char partial[MAX_WORLD_PATH];
+        char final[MAX_WORLD_PATH];
+        NameWorld(batch->binaryFormat, index, partial, final);
+        batch->written[index] = WriteWorld(&space, start, end, seed, batch->binaryFormat, partial);
+    }
+
+    FreeWorkspace(&space);
+    return NULL;
 }
 
 /*
- *  Creates a connection from room 'a' to room 'b'
- *
- *  Note that this function only creates a connection in a single 
- *  direction (a to b). Thus, to create a bi-directional connection,
- *  this function must be called twice. i.e...
- *
- *  ConnectRoom(a, b)
- *  ConnectRoom(b, a)
+ *  Returns the seed of the world with the specified index in a batch.
+ *  Binary worlds record it like any other seed, so passing it to -s makes
+ *  that world again on its own.
  */
-void ConnectRoom(Room *a, const Room* b)
+uint64_t DeriveSeed(uint64_t seed, int index)
 {
-    /* Add b as a connection to a */
-    int numConnectionsA = a->connectCount;
-    memcpy(a->connections[numConnectionsA], b->name, MAX_ROOM_NAME_LENGTH * sizeof(char));
-    a->connectCount = numConnectionsA + 1;
+    return MixBits(seed ^ MixBits((uint64_t)index + 1));
 }
 
 /*
- *  Determines if the rooms pointed to by 'a' and 'b' are the same room.
+ *  Gives the rooms named in names, separated by commas, and numRandom
+ *  rooms picked at random new connections in the binary world at path,
+ *  see waltsara.reroll.h. The rerolls happen in a copy of the world, and
+ *  only the connection lists of rooms that changed are patched into the
+ *  file, through its journal, so players never see a reroll half done and
+ *  a crash never leaves one half done. Returns the exit status.
  */
-bool IsSameRoom(const Room* a, const Room* b)
+int UpdateWorld(const char *path, char *names, int numRandom, uint64_t seed, bool verbose)
 {
-    /* Since names must be unique, only the same room if the names are equal. */
-    const char *aName = a->name;
-    const char *bName = b->name;
+    struct timespec began, finished;
+    clock_gettime(CLOCK_MONOTONIC, &began);
+
+    struct stat st;
+    if(stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        fprintf(stderr, "%s is a room directory; only worlds built with -f binary are updated in place.\n", path);
+        return 1;
+    }
+    if(IsArchive(path))
+    {
+        fprintf(stderr, "Worlds in an archive never change; update a world file instead.\n");
+        return 1;
+    }
+
+    World world;
+    if(!CopyWorld(&world, path))
+    {
+        fprintf(stderr, "Unable to open world %s.\n", path);
+        return 1;
+    }
+    if((world.hashSlots == NULL || world.sortedNames == NULL) && !BuildNameIndex(&world))
+    {
+        perror("Failed to index the room names.");
+        FreeWorld(&world);
+        return 1;
+    }
+
+    /* Named rooms first, then the random ones */
+    int count = numRandom > 0 ? numRandom : 0;
+    char *name;
+    for(name = names; name != NULL && *name != '\0'; name = strchr(name, ',') ? strchr(name, ',') + 1 : NULL)
+    {
+        count++;
+    }
+    uint32_t *rooms = (uint32_t*)malloc((count > 0 ? count : 1) * sizeof(uint32_t));
+    Reroll reroll;
+    if(rooms == NULL || !InitializeReroll(&reroll, &world, seed))
+    {
+        perror("Failed to allocate the reroll.");
+        free(rooms);
+        FreeWorld(&world);
+        return 1;
+    }
+
+    int numRooms = 0;
+    char *save = NULL;
+    for(name = names != NULL ? strtok_r(names, ",", &save) : NULL; name != NULL; name = strtok_r(NULL, ",", &save))
+    {
+        int room = GetRoomFromName(&world, name);
+        if(room < 0)
+        {
+            fprintf(stderr, "No room of %s is called %s.\n", path, name);
+            free(rooms);
+            FreeReroll(&reroll);
+            FreeWorld(&world);
+            return 1;
+        }
+        rooms[numRooms++] = room;
+    }
+    Rng rng;
+    SeedRandom(&rng, seed, 0);
+    while(numRooms < count)
+    {
+        rooms[numRooms++] = RandomBelow(&rng, world.numRooms);
+    }
+
+    /* Reroll in our own copy, then patch the connection lists that changed into the file */
+    bool rerolled = RerollRooms(&reroll, &world, rooms, numRooms);
+    WorldPatch *patches = (WorldPatch*)malloc((reroll.numTouched > 0 ? reroll.numTouched : 1) * sizeof(WorldPatch));
+    uint64_t bytes = 0;
+    uint32_t i;
+    for(i = 0; rerolled && patches != NULL && i < reroll.numTouched; i++)
+    {
+        const uint32_t *connections = world.connections + world.offsets[reroll.touched[i]];
+        patches[i].offset = (const char*)connections - (const char*)world.image;
+        patches[i].length = GetDegree(&world, reroll.touched[i]) * sizeof(uint32_t);
+        patches[i].data = connections;
+        bytes += patches[i].length;
+    }
+    bool synced = rerolled && patches != NULL && PatchWorldFile(path, world.generation, patches, reroll.numTouched);
+    if(!rerolled)
+    {
+        fprintf(stderr, "Rerolling those rooms kept cutting %s in two; it was left as it was.\n", path);
+    }
+    else if(patches == NULL)
+    {
+        perror("Failed to allocate the patches.");
+    }
+    free(patches);
+    CountStat(STAT_REWIRES, reroll.numSwaps);
+    CountStat(STAT_BYTES_WRITTEN, bytes);
+    if(verbose && rerolled)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        fprintf(stderr, "Seed: %llu\nRerolled: %d rooms\nSwaps: %u\nRooms changed: %u (%llu bytes)\n"
+                        "Rooms searched: %llu\nUpdate: %.6fs\n",
+                (unsigned long long)seed, numRooms, reroll.numSwaps, reroll.numTouched, (unsigned long long)bytes,
+                (unsigned long long)reroll.searched,
+                (finished.tv_sec - began.tv_sec) + (finished.tv_nsec - began.tv_nsec) / 1e9);
+    }
+
+    free(rooms);
+    FreeReroll(&reroll);
+    FreeWorld(&world);
+    ReportStats(verbose, 0);
+    return synced ? 0 : 1;
+}
 
-    return (strcmp(aName, bName) == 0);
+/*
+ *  Allocates an empty graph of numRooms mid rooms.
+ */
+bool InitializeGraph(Graph *graph, int numRooms, int minConnections, int maxConnections)
+{
+    memset(graph, 0, sizeof(Graph));
+    graph->numRooms = numRooms;
+    graph->minConnections = minConnections;
+    graph->maxConnections = maxConnections;
+    graph->connectCount = (int*)malloc(numRooms * sizeof(int));
+    graph->connections = (int*)malloc((size_t)numRooms * maxConnections * sizeof(int));
+    graph->roomType = (Type*)malloc(numRooms * sizeof(Type));
+    graph->poolIndex = (int*)malloc(numRooms * sizeof(int));
+    if(!graph->connectCount || !graph->connections || !graph->roomType || !graph->poolIndex)
+    {
+        FreeGraph(graph);
+        return false;
+    }
+
+    ResetGraph(graph);
+    return true;
+}
+
+/*
+ *  Takes every connection out of the graph and makes every room a mid
+ *  room again, ready for the next world of the same shape.
+ */
+void ResetGraph(Graph *graph)
+{
+    int i;
+    for(i = 0; i < graph->numRooms; i++)
+    {
+        graph->connectCount[i] = 0;
+        graph->roomType[i] = MID_ROOM;
+        graph->poolIndex[i] = -1;
+    }
+}
+
+/*
+ *  Releases everything InitializeGraph allocated.
+ */
+void FreeGraph(Graph *graph)
+{
+    free(graph->connectCount);
+    free(graph->connections);
+    free(graph->roomType);
+    free(graph->poolIndex);
+    memset(graph, 0, sizeof(Graph));
+}
+
+/*
+ *  Sets up a workspace for worlds of numRooms rooms with the specified
+ *  bounds, generated on numThreads threads each. Distance bounds of 0
+ *  leave the distance to chance. A minimum above one step lays the rooms
+ *  out in layers, see Graph.
+ */
+bool InitializeWorkspace(Workspace *space, int numRooms, int minConnections, int maxConnections,
+                         int minDistance, int maxDistance, int numThreads)
+{
+    memset(space, 0, sizeof(Workspace));
+    space->numThreads = numThreads;
+    space->minDistance = minDistance;
+    space->maxDistance = maxDistance;
+    space->textCapacity = 64 + (size_t)maxConnections * (MAX_ROOM_NAME_LENGTH + 24);
+
+    /* A pair of blocks never has more rooms than the world */
+    int numBlocks = (numRooms + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int pairSize = numRooms < 2 * BLOCK_SIZE ? numRooms : 2 * BLOCK_SIZE;
+
+    bool allocated = InitializeGraph(&space->graph, numRooms, minConnections, maxConnections) &&
+                     InitializeComponents(&space->components, numRooms);
+    space->pool.rooms = (int*)malloc(numRooms * sizeof(int));
+    space->blockOrder = (int*)malloc(numBlocks * sizeof(int));
+    space->threads = (pthread_t*)malloc(numThreads * sizeof(pthread_t));
+    space->blockPools = (int**)calloc(numThreads, sizeof(int*));
+    space->text = (char*)malloc(space->textCapacity);
+    space->roomConnections = (uint32_t*)malloc(maxConnections * sizeof(uint32_t));
+    allocated = allocated && space->pool.rooms && space->blockOrder && space->threads &&
+                space->blockPools && space->text && space->roomConnections;
+    if(allocated && (minDistance > 0 || maxDistance > 0))
+    {
+        space->graph.numLayers = minDistance > 1 ? minDistance + 1 : 0;
+        space->distance = (int*)malloc(numRooms * sizeof(int));
+        space->queue = (int*)malloc(numRooms * sizeof(int));
+        allocated = space->distance && space->queue;
+    }
+
+    int i;
+    for(i = 0; allocated && i < numThreads; i++)
+    {
+        space->blockPools[i] = (int*)malloc(pairSize * sizeof(int));
+        allocated = space->blockPools[i] != NULL;
+    }
+
+    if(!allocated)
+    {
+        FreeWorkspace(space);
+        return false;
+    }
+    return true;
+}
+
+/*
+ *  Releases everything InitializeWorkspace allocated.
+ */
+void FreeWorkspace(Workspace *space)
+{
+    int i;
+    for(i = 0; space->blockPools != NULL && i < space->numThreads; i++)
+    {
+        free(space->blockPools[i]);
+    }
+    free(space->blockPools);
+    FreeGraph(&space->graph);
+    FreeComponents(&space->components);
+    free(space->pool.rooms);
+    free(space->blockOrder);
+    free(space->threads);
+    free(space->text);
+    free(space->roomConnections);
+    free(space->distance);
+    free(space->queue);
+    free(space->record);
+    memset(space, 0, sizeof(Workspace));
+}
+
+/*
+ *  Determines if the specified graph is full
+ *
+ *  A full graph is defined in the assignment as a graph whose rooms all
+ *  contain between 3 and 6 outgoing connections. The bounds now come from
+ *  the graph itself so bigger worlds can ask for different ones.
+ */
+bool IsGraphFull(const Graph* graph)
+{
+    bool result = true;
+
+    /* Loop will break out when result is set to false */
+    int i;
+    for(i = 0; i < graph->numRooms && result; i++)
+    {
+        int numRooms = graph->connectCount[i];
+        result = (numRooms <= graph->maxConnections) && (numRooms >= graph->minConnections);
+    }
+
+    return result;
+}
+
+/*
+ *  Connects every room in the graph.
+ *
+ *  Rooms are split into fixed blocks of BLOCK_SIZE. Each round shuffles the
+ *  blocks, pairs them off, and fills every pair on whichever thread is free,
+ *  only connecting rooms inside the pair. Pairs never share a room, so the
+ *  threads need no locks, and since the blocks, pairs and random streams are
+ *  fixed by the seed the result is the same for any number of threads.
+ *  The rounds raise the target a bit at a time so each room's connections
+ *  spread over several pairs. Whatever the rounds could not place is done
+ *  by one last pass over the whole graph, which tracks components and
+ *  prefers partners that join two of them. Anything still apart after that
+ *  is joined up by JoinComponents, so every world comes out playable.
+ *  A layered world is chained through its layers first, see ChainLayers.
+ */
+void BuildConnections(Workspace *space, uint64_t seed, ComponentStats *stats)
+{
+    Graph *graph = &space->graph;
+    int numThreads = space->numThreads;
+    int numBlocks = (graph->numRooms + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int *blockOrder = space->blockOrder;
+    pthread_t *threads = space->threads;
+
+    Rng rng;
+    SeedRandom(&rng, seed, 1);
+    if(graph->numLayers > 0)
+    {
+        ChainLayers(graph, &rng);
+    }
+
+    int i;
+    for(i = 0; i < numBlocks; i++)
+    {
+        blockOrder[i] = i;
+    }
+
+    int round;
+    for(round = 0; round < NUM_ROUNDS; round++)
+    {
+        for(i = numBlocks - 1; i > 0; i--)
+        {
+            int idx = RandomBelow(&rng, i + 1);
+            int tmp = blockOrder[i];
+            blockOrder[i] = blockOrder[idx];
+            blockOrder[idx] = tmp;
+        }
+
+        Round work;
+        work.graph = graph;
+        work.seed = seed;
+        work.round = round;
+        work.target = (graph->minConnections * (round + 1) + NUM_ROUNDS - 1) / NUM_ROUNDS;
+        work.blockOrder = blockOrder;
+        work.numBlocks = numBlocks;
+        work.numTasks = (numBlocks + 1) / 2;
+        work.nextTask = 0;
+        work.blockPools = space->blockPools;
+        work.nextPool = 0;
+
+        /* The main thread works too, so only start the extra ones */
+        int started = 0;
+        for(i = 1; i < numThreads && i < work.numTasks; i++)
+        {
+            if(pthread_create(&threads[started], NULL, FillBlocks, &work) == 0)
+            {
+                started++;
+            }
+        }
+        FillBlocks(&work);
+        for(i = 0; i < started; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    /* Last pass: every room with space left, on its own stream */
+    Pool *pool = &space->pool;
+    pool->size = 0;
+    pool->from[0] = 0;
+    pool->to[0] = graph->numRooms;
+    pool->from[1] = pool->to[1] = 0;
+    for(i = 0; i < graph->numRooms; i++)
+    {
+        AddToPool(graph, pool, i);
+    }
+
+    Components *components = &space->components;
+    BuildComponents(graph, components, numThreads);
+
+    Rng last;
+    SeedRandom(&last, seed, 2);
+    while(!IsGraphFull(graph))
+    {
+        for(i = 0; i < graph->numRooms; i++)
+        {
+            FillRoom(graph, pool, components, &last, i);
+        }
+    }
+
+    if(components->stale)
+    {
+        BuildComponents(graph, components, numThreads);
+    }
+    JoinComponents(graph, pool, components, stats);
+
+    for(i = 0; i < pool->size; i++)
+    {
+        graph->poolIndex[pool->rooms[i]] = -1;
+    }
+}
+
+/*
+ *  Connects one random room of each layer to one of the next, so the
+ *  world has a way through every layer from the start. Rooms that split
+ *  off into components of their own then always have rooms of the rest
+ *  nearby to be joined to without leaving the layers. No room is in a pool
+ *  yet, so the connections are made directly.
+ */
+void ChainLayers(Graph *graph, Rng *rng)
+{
+    int previous = -1;
+    int layer;
+    for(layer = 0; layer < graph->numLayers; layer++)
+    {
+        int first = LayerStart(graph->numRooms, graph->numLayers, layer);
+        int room = first + RandomBelow(rng, LayerStart(graph->numRooms, graph->numLayers, layer + 1) - first);
+        if(previous >= 0)
+        {
+            graph->connections[(size_t)previous * graph->maxConnections + graph->connectCount[previous]++] = room;
+            graph->connections[(size_t)room * graph->maxConnections + graph->connectCount[room]++] = previous;
+        }
+        previous = room;
+    }
+}
+
+/*
+ *  Worker thread body. Claims block pairs of the round until none are
+ *  left and connects the rooms of each pair among themselves.
+ */
+void *FillBlocks(void *arg)
+{
+    Round *work = (Round*)arg;
+    Graph *graph = work->graph;
+
+    /* Every thread filling pairs has a pool buffer of its own in the workspace */
+    Pool pool;
+    pool.rooms = work->blockPools[__atomic_fetch_add(&work->nextPool, 1, __ATOMIC_RELAXED)];
+
+    int task;
+    while((task = __atomic_fetch_add(&work->nextTask, 1, __ATOMIC_RELAXED)) < work->numTasks)
+    {
+        /* The stream depends on the round and the pair, never on the thread */
+        Rng rng;
+        SeedRandom(&rng, work->seed, 3 + (uint64_t)work->round * work->numTasks + task);
+
+        int first = work->blockOrder[2 * task];
+        int second = (2 * task + 1 < work->numBlocks) ? work->blockOrder[2 * task + 1] : -1;
+
+        pool.size = 0;
+        int block;
+        for(block = 0; block < 2; block++)
+        {
+            int b = block == 0 ? first : second;
+            pool.from[block] = 0;
+            pool.to[block] = 0;
+            if(b >= 0)
+            {
+                pool.from[block] = b * BLOCK_SIZE;
+                pool.to[block] = (b + 1) * BLOCK_SIZE < graph->numRooms ? (b + 1) * BLOCK_SIZE : graph->numRooms;
+            }
+            int room;
+            for(room = pool.from[block]; room < pool.to[block]; room++)
+            {
+                AddToPool(graph, &pool, room);
+            }
+        }
+
+        /* Rooms that run out of partners here wait for the last pass */
+        for(block = 0; block < 2; block++)
+        {
+            int b = block == 0 ? first : second;
+            int room;
+            for(room = b * BLOCK_SIZE; b >= 0 && room < (b + 1) * BLOCK_SIZE && room < graph->numRooms; room++)
+            {
+                while(graph->connectCount[room] < work->target)
+                {
+                    int partner = GetRandomRoom(graph, &pool, NULL, &rng, room);
+                    if(partner < 0)
+                    {
+                        break;
+                    }
+                    ConnectRoom(graph, &pool, room, partner);
+                    ConnectRoom(graph, &pool, partner, room);
+                }
+            }
+        }
+
+        int i;
+        for(i = 0; i < pool.size; i++)
+        {
+            graph->poolIndex[pool.rooms[i]] = -1;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ *  Adds connections to the specified room until it has at least the
+ *  minimum number. Rooms that are already satisfied are left alone.
+ */
+void FillRoom(Graph *graph, Pool *pool, Components *components, Rng *rng, int room)
+{
+    while(graph->connectCount[room] < graph->minConnections)
+    {
+        AddRandomConnection(graph, pool, components, rng, room);
+    }
+}
+
+/*
+ *  Adds one valid connection between the specified room and a random
+ *  partner, keeping the components up to date. When every room with space
+ *  left is already connected to it, an existing connection elsewhere is
+ *  split to make room instead.
+ */
+void AddRandomConnection(Graph* graph, Pool *pool, Components *components, Rng *rng, int room)
+{
+    int partner = GetRandomRoom(graph, pool, components, rng, room);
+    if(partner >= 0)
+    {
+        ConnectRoom(graph, pool, room, partner);    // If rooms aren't the same or already connected, make connections
+        ConnectRoom(graph, pool, partner, room);
+        MergeComponents(components, room, partner);
+    }
+    else if(!RewireConnection(graph, pool, components, rng, room))
+    {
+        fprintf(stderr, "Unable to find a connection for room %d.\n", room);
+        exit(1);
+    }
+}
+
+/*
+ *  Returns a random room from the pool that the specified room can connect
+ *  to, or -1 if there is none. A handful of random picks almost always
+ *  succeeds; only nearly full graphs ever fall through to the scan.
+ *
+ *  Given components, a room outside the largest half of the world first
+ *  spends up to MERGE_PICKS picks looking for a partner in another
+ *  component, so connections that join components win over ones that only
+ *  add another way around inside one.
+ */
+int GetRandomRoom(Graph *graph, Pool *pool, const Components *components, Rng *rng, int room)
+{
+    CountStat(STAT_PICKS, 1);
+    if(pool->size == 0)
+    {
+        return -1;
+    }
+
+    int i;
+    if(components != NULL)
+    {
+        int root = FindComponent(components, room);
+        for(i = 0; i < MERGE_PICKS && components->size[root] <= graph->numRooms / 2; i++)
+        {
+            int candidate = PickCandidate(graph, pool, rng, room);
+            if(candidate >= 0 && FindComponent(components, candidate) != root && CanConnect(graph, room, candidate))
+            {
+                return candidate;
+            }
+            CountStat(STAT_MERGE_RETRIES, 1);
+        }
+    }
+
+    for(i = 0; i < MAX_RANDOM_PICKS; i++)
+    {
+        int candidate = PickCandidate(graph, pool, rng, room);
+        if(candidate >= 0 && CanConnect(graph, room, candidate))
+        {
+            return candidate;
+        }
+        CountStat(STAT_PICK_RETRIES, 1);
+    }
+
+    /* Scan the pool starting at a random spot so the fallback stays fair */
+    CountStat(STAT_POOL_SCANS, 1);
+    if(graph->numLayers > 0)
+    {
+        return ScanReach(graph, pool, rng, room);
+    }
+    int offset = RandomBelow(rng, pool->size);
+    for(i = 0; i < pool->size; i++)
+    {
+        int candidate = pool->rooms[(offset + i) % pool->size];
+        if(candidate != room && !HasConnection(graph, room, candidate))
+        {
+            return candidate;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ *  Returns one random pick of a partner for the specified room, or -1 if
+ *  the pick has no space left. Without layers that is any room of the
+ *  pool. A layered room picks among the rooms of its reach the pool was
+ *  filled from instead, since the pool is mostly rooms it may not connect
+ *  to, and the pick may turn out to be full.
+ */
+int PickCandidate(const Graph *graph, const Pool *pool, Rng *rng, int room)
+{
+    if(graph->numLayers == 0)
+    {
+        return pool->rooms[RandomBelow(rng, pool->size)];
+    }
+
+    int from[2];
+    int to[2];
+    int total = SplitReach(graph, pool, room, from, to);
+    int pick = RandomBelow(rng, total);
+    int candidate = pick < to[0] - from[0] ? from[0] + pick : from[1] + pick - (to[0] - from[0]);
+    return CanAddConnectionFrom(graph, candidate) ? candidate : -1;
+}
+
+/*
+ *  Scans the part of a layered room's reach that the pool was filled from
+ *  for a partner, starting at a random spot, and returns it or -1 if there
+ *  is none. Only rooms of the reach are ever looked at, however many the
+ *  pool holds.
+ */
+int ScanReach(const Graph *graph, const Pool *pool, Rng *rng, int room)
+{
+    int from[2];
+    int to[2];
+    int total = SplitReach(graph, pool, room, from, to);
+    int offset = RandomBelow(rng, total);
+
+    int i;
+    for(i = 0; i < total; i++)
+    {
+        int pick = (offset + i) % total;
+        int candidate = pick < to[0] - from[0] ? from[0] + pick : from[1] + pick - (to[0] - from[0]);
+        if(CanAddConnectionFrom(graph, candidate) && CanConnect(graph, room, candidate))
+        {
+            return candidate;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ *  Sets from and to to the parts of the specified room's reach that fall in
+ *  the ranges the pool was filled from, and returns how many rooms they
+ *  hold. The room's own range always holds at least the room itself.
+ */
+int SplitReach(const Graph *graph, const Pool *pool, int room, int *from, int *to)
+{
+    int low;
+    int high;
+    GetReach(graph, room, &low, &high);
+
+    int total = 0;
+    int i;
+    for(i = 0; i < 2; i++)
+    {
+        from[i] = pool->from[i] > low ? pool->from[i] : low;
+        to[i] = pool->to[i] < high ? pool->to[i] : high;
+        if(to[i] < from[i])
+        {
+            to[i] = from[i];
+        }
+        total += to[i] - from[i];
+    }
+    return total;
+}
+
+/*
+ *  Sets from and to to the range of room IDs the specified room may connect
+ *  to: its own layer and the ones on either side, or the whole graph when
+ *  there are no layers.
+ */
+void GetReach(const Graph *graph, int room, int *from, int *to)
+{
+    if(graph->numLayers == 0)
+    {
+        *from = 0;
+        *to = graph->numRooms;
+        return;
+    }
+
+    int layer = GetLayer(graph, room);
+    *from = LayerStart(graph->numRooms, graph->numLayers, layer > 0 ? layer - 1 : 0);
+    *to = LayerStart(graph->numRooms, graph->numLayers, layer + 2 < graph->numLayers ? layer + 2 : graph->numLayers);
+}
+
+/*
+ *  Returns the layer the specified room is in.
+ */
+int GetLayer(const Graph *graph, int room)
+{
+    return (int)((int64_t)room * graph->numLayers / graph->numRooms);
+}
+
+/*
+ *  Returns the first room ID of the specified layer, or numRooms for the
+ *  layer after the last. Layers differ by at most one room in size.
+ */
+int LayerStart(int numRooms, int numLayers, int layer)
+{
+    return (int)(((int64_t)layer * numRooms + numLayers - 1) / numLayers);
+}
+
+/*
+ *  Determines if every room of a world split into numLayers layers has at
+ *  least minConnections other rooms within a layer of its own to connect to.
+ */
+bool FitsLayers(int numRooms, int minConnections, int numLayers)
+{
+    if(numLayers > numRooms)
+    {
+        return false;
+    }
+
+    int layer;
+    for(layer = 0; layer < numLayers; layer++)
+    {
+        int from = LayerStart(numRooms, numLayers, layer > 0 ? layer - 1 : 0);
+        int to = LayerStart(numRooms, numLayers, layer + 2 < numLayers ? layer + 2 : numLayers);
+        if(to - from - 1 < minConnections)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ *  Splits an existing connection x <-> y, where neither x nor y is the
+ *  specified room or connected to it and both are in its reach, and
+ *  connects the room to both ends.
+ *  If the room only has space for one more connection, y is left one
+ *  short and picked up by the next pass. x and y then may no longer reach
+ *  each other, so the components are marked stale.
+ *
+ *  Returns false if no such connection exists.
+ */
+bool RewireConnection(Graph *graph, Pool *pool, Components *components, Rng *rng, int room)
+{
+    CountStat(STAT_REWIRES, 1);
+    int from;
+    int to;
+    GetReach(graph, room, &from, &to);
+    int offset = RandomBelow(rng, to - from);
+
+    int i;
+    for(i = 0; i < to - from; i++)
+    {
+        int x = from + (offset + i) % (to - from);
+        if(!CanConnect(graph, room, x))
+        {
+            continue;
+        }
+
+        int j;
+        for(j = 0; j < graph->connectCount[x]; j++)
+        {
+            int y = graph->connections[(size_t)x * graph->maxConnections + j];
+            if(CanConnect(graph, room, y) || (graph->numLayers > 0 && graph->connectCount[room] + 1 == graph->maxConnections))
+            {
+                DisconnectRoom(graph, pool, x, y);
+                DisconnectRoom(graph, pool, y, x);
+                ConnectRoom(graph, pool, room, x);
+                ConnectRoom(graph, pool, x, room);
+                MergeComponents(components, room, x);
+                if(CanAddConnectionFrom(graph, room) && CanConnect(graph, room, y))
+                {
+                    ConnectRoom(graph, pool, room, y);
+                    ConnectRoom(graph, pool, y, room);
+                }
+                else
+                {
+                    components->stale = true;
+                }
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/*
+ *  Joins every component to the largest one, leaving the world connected
+ *  without changing how many connections any room has beyond its limits.
+ *  Each smaller component C is joined by the cheapest of:
+ *
+ *    - a new connection between a room of C and a room of the largest
+ *      component, when both have space left;
+ *    - swapping a connection c-d of C that lies on a cycle, and so can go
+ *      without splitting C, with any connection a-b of the largest, for
+ *      a-c and b-d;
+ *    - the same swap the other way round, with a cycle connection of the
+ *      largest component, when C is a tree and the largest is full.
+ *
+ *  Every room keeps its number of connections in a swap, so the bounds
+ *  still hold afterwards.
+ *
+ *  In a layered world the largest component may not reach C's layers at
+ *  all, so C is joined to whichever component has rooms within a layer of
+ *  it instead, by a new connection or by swapping any connection of C on
+ *  a cycle, and the pass repeats until the world is in one piece.
+ */
+void JoinComponents(Graph *graph, Pool *pool, Components *components, ComponentStats *stats)
+{
+    int numRooms = graph->numRooms;
+    memset(stats, 0, sizeof(ComponentStats));
+    stats->components = components->numSets;
+
+    int main = 0;
+    int i;
+    for(i = 0; i < numRooms; i++)
+    {
+        if(components->parent[i] == i && components->size[i] > components->size[main])
+        {
+            main = i;
+        }
+    }
+    stats->largest = components->size[main];
+    if(components->numSets == 1)
+    {
+        return;
+    }
+
+    /*
+     * Marks tell the walks which rooms they have seen, without clearing
+     * between walks. spares lists rooms of the largest component that had
+     * space left when they joined it; the ones that fill up are dropped
+     * as they come to the top.
+     */
+    int *mark = (int*)calloc(numRooms, sizeof(int));
+    int *stack = (int*)malloc(2 * (size_t)numRooms * sizeof(int));
+    int *spares = (int*)malloc(numRooms * sizeof(int));
+    if(mark == NULL || stack == NULL || spares == NULL)
+    {
+        perror("Failed to allocate the component walk.");
+        exit(1);
+    }
+    int stamp = 0;
+    int numSpares = 0;
+    for(i = 0; i < pool->size; i++)
+    {
+        if(FindComponent(components, pool->rooms[i]) == main)
+        {
+            spares[numSpares++] = pool->rooms[i];
+        }
+    }
+
+    /* A layered world may join C to another small component, so it goes round again until one is left */
+    do
+    {
+        for(i = 0; i < numRooms; i++)
+        {
+            if(components->parent[i] != i || FindComponent(components, main) == i)
+            {
+                continue;
+            }
+
+            while(numSpares > 0 && !CanAddConnectionFrom(graph, spares[numSpares - 1]))
+            {
+                numSpares--;
+            }
+            int mainSpare = numSpares > 0 ? spares[numSpares - 1] : -1;
+            if(graph->numLayers > 0)
+            {
+                numSpares = 0;              // Only C's own spares are of any use within the layers
+            }
+
+            /* C's spare rooms go on the list too, since C is about to become part of the largest */
+            int firstSpare = numSpares;
+            int c, d;
+            bool cycle = ExploreComponent(graph, i, mark, ++stamp, stack, spares, &numSpares, &c, &d);
+            int spare = numSpares > firstSpare ? spares[firstSpare] : -1;
+            if(graph->numLayers > 0)
+            {
+                /* In a layered world the new connection has to stay within a layer as well */
+                mainSpare = -1;
+                int j;
+                for(j = firstSpare; j < numSpares && mainSpare < 0; j++)
+                {
+                    spare = spares[j];
+                    mainSpare = FindSpareNear(graph, components, spare);
+                }
+            }
+
+            int joined = main;              // Room of the component C becomes part of
+            if(spare >= 0 && mainSpare >= 0)
+            {
+                ConnectRoom(graph, pool, spare, mainSpare);
+                ConnectRoom(graph, pool, mainSpare, spare);
+                joined = mainSpare;
+                stats->added++;
+            }
+            else if(cycle)
+            {
+                int a = main;
+                int b = graph->connections[(size_t)a * graph->maxConnections];
+                if(graph->numLayers > 0)
+                {
+                    FindLayeredSwap(graph, components, i, mark, ++stamp, stack, &a, &b, &c, &d);
+                }
+                SwapConnections(graph, pool, a, b, c, d);
+                joined = a;
+                stats->swapped++;
+            }
+            else
+            {
+                /* C is a tree, so c-d is any of its connections; the cycle has to come from the largest */
+                int a, b;
+                if(!ExploreComponent(graph, main, mark, ++stamp, stack, NULL, NULL, &a, &b))
+                {
+                    fprintf(stderr, "Unable to join room %d to the rest of the world.\n", i);
+                    exit(1);
+                }
+                SwapConnections(graph, pool, a, b, c, d);
+                stats->swapped++;
+            }
+            MergeComponents(components, joined, i);
+        }
+    } while(components->numSets > 1);
+
+    free(spares);
+    free(mark);
+    free(stack);
+}
+
+/*
+ *  Walks the component the specified room is in, depth first, marking
+ *  rooms with stamp, and sets a-b to a connection on a cycle, which can be
+ *  taken away without splitting the component. Returns whether there is
+ *  such a connection; when there isn't, a-b is some other connection.
+ *  Given a spares list, the walk covers the whole component and appends
+ *  every room with space for another connection. Without one it stops at
+ *  the first cycle it finds.
+ */
+bool ExploreComponent(const Graph *graph, int room, int *mark, int stamp, int *stack, int *spares, int *numSpares,
+                      int *a, int *b)
+{
+    bool cycle = false;
+    *a = room;
+    *b = graph->connections[(size_t)room * graph->maxConnections];
+
+    /* The stack holds each room found, next to the room it was found from */
+    int top = 0;
+    stack[top++] = room;
+    stack[top++] = -1;
+    mark[room] = stamp;
+
+    while(top > 0)
+    {
+        int parent = stack[--top];
+        int x = stack[--top];
+        if(spares != NULL && CanAddConnectionFrom(graph, x))
+        {
+            spares[(*numSpares)++] = x;
+        }
+
+        int j;
+        for(j = 0; j < graph->connectCount[x]; j++)
+        {
+            int y = graph->connections[(size_t)x * graph->maxConnections + j];
+            if(mark[y] != stamp)
+            {
+                mark[y] = stamp;
+                stack[top++] = y;
+                stack[top++] = x;
+            }
+            else if(y != parent && !cycle)
+            {
+                /* y was reached another way, so x-y isn't needed to hold the component together */
+                cycle = true;
+                *a = x;
+                *b = y;
+                if(spares == NULL)
+                {
+                    return true;
+                }
+            }
+        }
+    }
+
+    return cycle;
+}
+
+/*
+ *  Returns a room with space left within the reach of the specified room
+ *  that is in another component than it, or -1 if there is none.
+ */
+int FindSpareNear(const Graph *graph, const Components *components, int room)
+{
+    int root = FindComponent(components, room);
+    int from;
+    int to;
+    GetReach(graph, room, &from, &to);
+
+    int x;
+    for(x = from; x < to; x++)
+    {
+        if(CanAddConnectionFrom(graph, x) && FindComponent(components, x) != root && CanConnect(graph, room, x))
+        {
+            return x;
+        }
+    }
+    return -1;
+}
+
+/*
+ *  Walks the component the specified room is in for a connection c-d on a
+ *  cycle that can be swapped with a connection a-b of another component
+ *  without leaving the layers, and sets all four. Any connection the walk
+ *  reaches a room by a second time is on a cycle, and each is tried both
+ *  ways round. Returns false, leaving them alone, if there is none.
+ */
+bool FindLayeredSwap(const Graph *graph, const Components *components, int room, int *mark, int stamp, int *stack,
+                     int *a, int *b, int *c, int *d)
+{
+    int top = 0;
+    stack[top++] = room;
+    stack[top++] = -1;
+    mark[room] = stamp;
+
+    while(top > 0)
+    {
+        int parent = stack[--top];
+        int x = stack[--top];
+
+        int j;
+        for(j = 0; j < graph->connectCount[x]; j++)
+        {
+            int y = graph->connections[(size_t)x * graph->maxConnections + j];
+            if(mark[y] != stamp)
+            {
+                mark[y] = stamp;
+                stack[top++] = y;
+                stack[top++] = x;
+            }
+            else if(y != parent && FindSwapNear(graph, components, x, y, a, b))
+            {
+                *c = x;
+                *d = y;
+                return true;
+            }
+            else if(y != parent && FindSwapNear(graph, components, y, x, a, b))
+            {
+                *c = y;
+                *d = x;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/*
+ *  Looks for a connection a-b of another component than x's that x-y can
+ *  be swapped with for a-x and b-y without leaving the layers, and sets a
+ *  and b to it. Returns false, leaving a and b alone, if there is none.
+ */
+bool FindSwapNear(const Graph *graph, const Components *components, int x, int y, int *a, int *b)
+{
+    int root = FindComponent(components, x);
+    int from;
+    int to;
+    GetReach(graph, x, &from, &to);
+
+    int room;
+    for(room = from; room < to; room++)
+    {
+        if(FindComponent(components, room) == root)
+        {
+            continue;
+        }
+
+        int j;
+        for(j = 0; j < graph->connectCount[room]; j++)
+        {
+            int partner = graph->connections[(size_t)room * graph->maxConnections + j];
+            if(abs(GetLayer(graph, partner) - GetLayer(graph, y)) <= 1)
+            {
+                *a = room;
+                *b = partner;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+ *  Replaces the connections a-b and c-d with a-c and b-d. Every room keeps
+ *  the same number of connections.
+ */
+void SwapConnections(Graph *graph, Pool *pool, int a, int b, int c, int d)
+{
+    DisconnectRoom(graph, pool, a, b);
+    DisconnectRoom(graph, pool, b, a);
+    DisconnectRoom(graph, pool, c, d);
+    DisconnectRoom(graph, pool, d, c);
+    ConnectRoom(graph, pool, a, c);
+    ConnectRoom(graph, pool, c, a);
+    ConnectRoom(graph, pool, b, d);
+    ConnectRoom(graph, pool, d, b);
+}
+
+/*
+ *  Puts every one of numRooms rooms in a set of its own.
+ */
+bool InitializeComponents(Components *components, int numRooms)
+{
+    components->parent = (int*)malloc(numRooms * sizeof(int));
+    components->size = (int*)malloc(numRooms * sizeof(int));
+    if(components->parent == NULL || components->size == NULL)
+    {
+        FreeComponents(components);
+        return false;
+    }
+
+    int i;
+    for(i = 0; i < numRooms; i++)
+    {
+        components->parent[i] = i;
+        components->size[i] = 1;
+    }
+    components->numSets = numRooms;
+    components->stale = false;
+    return true;
+}
+
+/*
+ *  Releases everything InitializeComponents allocated.
+ */
+void FreeComponents(Components *components)
+{
+    free(components->parent);
+    free(components->size);
+    memset(components, 0, sizeof(Components));
+}
+
+/*
+ *  Rebuilds the sets from scratch out of every connection in the graph,
+ *  with the blocks of rooms shared out between numThreads threads. Sets
+ *  are linked by hanging the higher root under the lower one, so every
+ *  set ends up rooted at its lowest room whatever order the threads ran
+ *  in, and sizes are counted afterwards.
+ */
+void BuildComponents(const Graph *graph, Components *components, int numThreads)
+{
+    uint64_t timer = StartTimer();
+    int i;
+    for(i = 0; i < graph->numRooms; i++)
+    {
+        components->parent[i] = i;
+        components->size[i] = 0;
+    }
+
+    Linking work;
+    work.graph = graph;
+    work.components = components;
+    work.numBlocks = (graph->numRooms + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    work.nextBlock = 0;
+
+    /* The main thread works too, so only start the extra ones */
+    pthread_t *threads = (pthread_t*)malloc(numThreads * sizeof(pthread_t));
+    int started = 0;
+    for(i = 1; threads != NULL && i < numThreads && i < work.numBlocks; i++)
+    {
+        if(pthread_create(&threads[started], NULL, LinkBlocks, &work) == 0)
+        {
+            started++;
+        }
+    }
+    LinkBlocks(&work);
+    for(i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    components->numSets = 0;
+    for(i = 0; i < graph->numRooms; i++)
+    {
+        int root = FindComponent(components, i);
+        components->size[root]++;
+        if(root == i)
+        {
+            components->numSets++;
+        }
+    }
+    components->stale = false;
+    StopTimer(STAT_COMPONENTS_NS, timer);
+}
+
+/*
+ *  Worker thread body for BuildComponents. Claims blocks of rooms and
+ *  links each room with the higher numbered rooms it connects to. A root
+ *  only ever moves under a lower root, with a compare-and-swap, so threads
+ *  linking the same sets at once can't undo each other's work.
+ */
+void *LinkBlocks(void *arg)
+{
+    Linking *work = (Linking*)arg;
+    const Graph *graph = work->graph;
+    int *parent = work->components->parent;
+
+    int block;
+    while((block = __atomic_fetch_add(&work->nextBlock, 1, __ATOMIC_RELAXED)) < work->numBlocks)
+    {
+        int room;
+        for(room = block * BLOCK_SIZE; room < (block + 1) * BLOCK_SIZE && room < graph->numRooms; room++)
+        {
+            int j;
+            for(j = 0; j < graph->connectCount[room]; j++)
+            {
+                int other = graph->connections[(size_t)room * graph->maxConnections + j];
+                if(other < room)
+                {
+                    continue;
+                }
+
+                /* Retry if another thread moved the root before we could */
+                while(true)
+                {
+                    int a = FindComponent(work->components, room);
+                    int b = FindComponent(work->components, other);
+                    if(a == b)
+                    {
+                        break;
+                    }
+                    int high = a > b ? a : b;
+                    int low = a > b ? b : a;
+                    if(__atomic_compare_exchange_n(&parent[high], &high, low, false,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ *  Returns the root of the set the specified room is in. Halves the path
+ *  on the way, which only ever points rooms further up their own set, so
+ *  it is safe while LinkBlocks threads are linking and the sets look the
+ *  same to every caller.
+ */
+int FindComponent(const Components *components, int room)
+{
+    int *parent = components->parent;
+    int up;
+    while((up = __atomic_load_n(&parent[room], __ATOMIC_RELAXED)) != room)
+    {
+        int grand = __atomic_load_n(&parent[up], __ATOMIC_RELAXED);
+        __atomic_store_n(&parent[room], grand, __ATOMIC_RELAXED);
+        room = grand;
+    }
+    return room;
+}
+
+/*
+ *  Joins the sets of rooms a and b, hanging the smaller under the larger.
+ *  Returns false if they were already in the same set.
+ */
+bool MergeComponents(Components *components, int a, int b)
+{
+    a = FindComponent(components, a);
+    b = FindComponent(components, b);
+    if(a == b)
+    {
+        return false;
+    }
+
+    if(components->size[a] < components->size[b])
+    {
+        int tmp = a;
+        a = b;
+        b = tmp;
+    }
+    components->parent[b] = a;
+    components->size[a] += components->size[b];
+    components->numSets--;
+    return true;
+}
+
+/*
+ *  Determines if a connection exists between the rooms 'from' and 'to'
+ */
+bool HasConnection(const Graph *graph, int from, int to)
+{
+    /* Checks all connections of 'from' to make sure
+    ** that there is no existing connection to 'to' */
+    const int *connections = &graph->connections[(size_t)from * graph->maxConnections];
+    int i;
+    for(i = 0; i < graph->connectCount[from]; i++)
+    {
+        if(connections[i] == to)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ *  Determines if a new connection between rooms 'a' and 'b' is allowed:
+ *  they are different rooms, not connected yet, and within a layer of each
+ *  other in a layered world.
+ */
+bool CanConnect(const Graph *graph, int a, int b)
+{
+    return a != b && (graph->numLayers == 0 || abs(GetLayer(graph, a) - GetLayer(graph, b)) <= 1) &&
+           !HasConnection(graph, a, b);
+}
+
+/*
+ *  Determines if a room can be connected to.
+ */
+bool CanAddConnectionFrom(const Graph *graph, int room)
+{
+    return graph->connectCount[room] < graph->maxConnections;
+}
+
+/*
+ *  Creates a connection from room 'a' to room 'b'
+ *
+ *  Note that this function only creates a connection in a single
+ *  direction (a to b). Thus, to create a bi-directional connection,
+ *  this function must be called twice. i.e...
+ *
+ *  ConnectRoom(g, p, a, b)
+ *  ConnectRoom(g, p, b, a)
+ *
+ *  Rooms leave the pool as soon as they reach the maximum.
+ */
+void ConnectRoom(Graph *graph, Pool *pool, int a, int b)
+{
+    /* Add b as a connection to a */
+    int numConnectionsA = graph->connectCount[a];
+    graph->connections[(size_t)a * graph->maxConnections + numConnectionsA] = b;
+    graph->connectCount[a] = numConnectionsA + 1;
+
+    if(!CanAddConnectionFrom(graph, a))
+    {
+        /* Swap the last pool entry into a's slot */
+        int idx = graph->poolIndex[a];
+        int last = pool->rooms[--pool->size];
+        pool->rooms[idx] = last;
+        graph->poolIndex[last] = idx;
+        graph->poolIndex[a] = -1;
+    }
+}
+
+/*
+ *  Removes the connection from room 'a' to room 'b'. Like ConnectRoom,
+ *  this only works in one direction. A room that was full goes back into
+ *  the pool.
+ */
+void DisconnectRoom(Graph *graph, Pool *pool, int a, int b)
+{
+    int *connections = &graph->connections[(size_t)a * graph->maxConnections];
+    int count = graph->connectCount[a];
+
+    int i;
+    for(i = 0; i < count; i++)
+    {
+        if(connections[i] == b)
+        {
+            connections[i] = connections[count - 1];
+            break;
+        }
+    }
+
+    graph->connectCount[a] = count - 1;
+    AddToPool(graph, pool, a);
+}
+
+/*
+ *  Puts the specified room into the pool if it has space for another
+ *  connection and is not there already.
+ */
+void AddToPool(Graph *graph, Pool *pool, int room)
+{
+    if(graph->poolIndex[room] < 0 && CanAddConnectionFrom(graph, room))
+    {
+        graph->poolIndex[room] = pool->size;
+        pool->rooms[pool->size++] = room;
+    }
+}
+
+/*
+ *  Starts a random stream. Streams with the same seed but different
+ *  stream numbers are unrelated to each other.
+ */
+void SeedRandom(Rng *rng, uint64_t seed, uint64_t stream)
+{
+    rng->state = seed;
+    rng->state = NextRandom(rng) ^ (stream * 0xD1B54A32D192ED03ULL);
+    NextRandom(rng);
+}
+
+/*
+ *  Returns the next 64 bits of the stream (splitmix64).
+ */
+uint64_t NextRandom(Rng *rng)
+{
+    return MixBits(rng->state += 0x9E3779B97F4A7C15ULL);
+}
+
+/*
+ *  Scrambles the bits of x so that nearby inputs give unrelated outputs.
+ */
+uint64_t MixBits(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/*
+ *  Returns a random number in [0, bound) without the bias of a modulo.
+ */
+uint32_t RandomBelow(Rng *rng, uint32_t bound)
+{
+    return (uint32_t)(((NextRandom(rng) >> 32) * (uint64_t)bound) >> 32);
+}
+
+/*
+ *  Writes the name of the specified room into name, which must hold
+ *  MAX_ROOM_NAME_LENGTH characters. The first ten rooms use the plain
+ *  mansion names; after that we number them, i.e. "Kitchen12".
+ */
+void MakeRoomName(int room, char *name)
+{
+    const char *base = roomNames[room % MAX_ROOM_COUNT];
+    if(room < MAX_ROOM_COUNT)
+    {
+        snprintf(name, MAX_ROOM_NAME_LENGTH, "%s", base);
+    }
+    else
+    {
+        snprintf(name, MAX_ROOM_NAME_LENGTH, "%s%d", base, room / MAX_ROOM_COUNT);
+    }
+}
+
+/*
+ *  Writes one "<name>_room" file per room of the workspace's graph into
+ *  the directory open as directory. Returns false as soon as one of them
+ *  can't be written.
+ */
+bool WriteRoomFiles(Workspace *space, int directory)
+{
+    const Graph *graph = &space->graph;
+    uint32_t *connections = space->roomConnections;
+    bool result = true;
+    int i;
+    for(i = 0; result && i < graph->numRooms; i++)
+    {
+        int j;
+        for(j = 0; j < graph->connectCount[i]; j++)
+        {
+            connections[j] = graph->connections[(size_t)i * graph->maxConnections + j];
+        }
+        result = WriteRoomFile(directory, space->text, space->textCapacity, i, graph->roomType[i],
+                               connections, graph->connectCount[i]);
+    }
+    return result;
+}
+/*
+ *  Writes the "<name>_room" file of one room into the directory open as
+ *  directory. The file is put together in text, which has room for
+ *  capacity bytes, so it costs exactly one open, one write and one close.
+ *  Nothing is synced here; PublishWorld syncs every file at once.
+ */
+bool WriteRoomFile(int directory, char *text, size_t capacity, int room, Type type,
+                   const uint32_t *connections, int count)
+{
+    char name[MAX_ROOM_NAME_LENGTH];
+    MakeRoomName(room, name);
+
+    /* Write the file name */
+    size_t length = snprintf(text, capacity, "ROOM NAME: %s\n", name);
+
+    /* Write all connection data */
+    int j;
+    for(j = 1; j <= count; j++)
+    {
+        char connection[MAX_ROOM_NAME_LENGTH];
+        MakeRoomName(connections[j - 1], connection);
+        length += snprintf(text + length, capacity - length, "CONNECTION %d: %s\n", j, connection);
+    }
+
+    /* Write the type of room */
+    if(type == START_ROOM)
+    {
+        length += snprintf(text + length, capacity - length, "ROOM TYPE: START_ROOM\n");
+    }
+    else if(type == MID_ROOM)    //So for example, if my room type is a mid room it needs to be labeled as such in the file directory
+    {
+        length += snprintf(text + length, capacity - length, "ROOM TYPE: MID_ROOM\n");
+    }
+    else if(type == END_ROOM)
+    {
+        length += snprintf(text + length, capacity - length, "ROOM TYPE: END_ROOM\n");
+    }
+
+    char nameBuffer[MAX_ROOM_NAME_LENGTH + 6];
+    snprintf(nameBuffer, sizeof(nameBuffer), "%s_room", name);   // I chose to append _room to each room name to use as a file name
+    int fd = openat(directory, nameBuffer, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CountStat(STAT_WRITE_SYSCALLS, 1);
+    if(fd == -1)
+    {
+        perror("Failed to create file.");
+        return false;
+    }
+
+    size_t written = 0;
+    while(written < length)
+    {
+        ssize_t result = write(fd, text + written, length - written);
+        CountStat(STAT_WRITE_SYSCALLS, 1);
+        if(result <= 0)
+        {
+            perror("Unable to write file.");
+            break;
+        }
+        written += result;
+    }
+    CountStat(STAT_BYTES_WRITTEN, written);
+    CountStat(STAT_FILES_WRITTEN, 1);
+
+    CountStat(STAT_WRITE_SYSCALLS, 1);
+    if(close(fd) != 0)
+    {
+        perror("Unable to close file.");
+        return false;
+    }
+    return written == length;
+}
+
+/*
+ *  Names the world this process writes: partial is where it is put
+ *  together and final the name it is published under. Both have room for
+ *  MAX_WORLD_PATH bytes. Worlds of a batch add their index to the pid;
+ *  a lone world passes -1. waltsara.adventure only looks for final names,
+ *  so it never picks up a world that is still being written.
+ */
+void NameWorld(bool binaryFormat, int index, char *partial, char *final)
+{
+    const char *kind = binaryFormat ? "world" : "rooms";
+    int pid = getpid();
+    if(index < 0)
+    {
+        snprintf(partial, MAX_WORLD_PATH, "waltsara.partial.%s.%d", kind, pid);
+        snprintf(final, MAX_WORLD_PATH, "waltsara.%s.%d", kind, pid);
+    }
+    else
+    {
+        snprintf(partial, MAX_WORLD_PATH, "waltsara.partial.%s.%d.%d", kind, pid, index);
+        snprintf(final, MAX_WORLD_PATH, "waltsara.%s.%d.%d", kind, pid, index);
+    }
+}
+/*
+ *  Makes the directory at path for room files and returns it open, or -1
+ *  if it can't. Whatever a crashed run with the same pid left there is
+ *  cleared out first.
+ */
+int CreateWorldDirectory(const char *path)
+{
+    if(mkdir(path, 0755) == -1 && errno == EEXIST)
+    {
+        DiscardWorld(path, true);
+        mkdir(path, 0755);
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if(fd == -1)
+    {
+        perror("Failed to create file directory.");
+    }
+    return fd;
+}
+
+/*
+ *  Gets what was written at path onto disk: the file or directory itself,
+ *  or with wholeFilesystem everything on the filesystem holding it, which
+ *  covers any number of files for the price of one call.
+ */
+bool SyncPath(const char *path, bool wholeFilesystem)
+{
+    int fd = open(path, O_RDONLY);
+    bool synced = fd != -1 && (wholeFilesystem ? syncfs(fd) : fsync(fd)) == 0;
+    if(fd != -1)
+    {
+        close(fd);
+    }
+    return synced;
+}
+
+/*
+ *  Gets the finished world at partial onto disk and renames it to final,
+ *  so readers see all of it or none of it. A directory of room files is
+ *  synced with one syncfs rather than an fsync per file. The directory
+ *  holding the world is synced last so the rename itself lasts a crash.
+ *  Returns false if the world couldn't be published.
+ */
+bool PublishWorld(const char *partial, const char *final, bool directory)
+{
+    uint64_t timer = StartTimer();
+    if(!SyncPath(partial, directory) || rename(partial, final) == -1)
+    {
+        perror("Unable to publish world.");
+        StopTimer(STAT_SYNC_NS, timer);
+        return false;
+    }
+
+    SyncPath(".", false);
+    StopTimer(STAT_SYNC_NS, timer);
+    return true;
+}
+
+/*
+ *  Publishes every world of a batch that was written, with one sync of
+ *  the filesystem before the renames and one of the directory after them
+ *  however many worlds there are. Worlds that weren't written are
+ *  removed. Returns how many were published.
+ */
+int PublishBatch(int count, bool binaryFormat, const bool *written)
+{
+    uint64_t timer = StartTimer();
+    bool synced = SyncPath(".", true);
+    if(!synced)
+    {
+        perror("Unable to publish worlds.");
+    }
+
+    int published = 0;
+    int i;
+    for(i = 0; i < count; i++)
+    {
+        char partial[MAX_WORLD_PATH];
+        char final[MAX_WORLD_PATH];
+        NameWorld(binaryFormat, i, partial, final);
+        if(written[i] && synced && rename(partial, final) == 0)
+        {
+            published++;
+        }
+        else
+        {
+            DiscardWorld(partial, !binaryFormat);
+        }
+    }
+
+    SyncPath(".", false);
+    StopTimer(STAT_SYNC_NS, timer);
+    return published;
+}
+/*
+ *  Removes the unfinished world at path, along with its room files if it
+ *  is a directory.
+ */
+void DiscardWorld(const char *path, bool directory)
+{
+    if(!directory)
+    {
+        unlink(path);
+        return;
+    }
+
+    DIR *dp = opendir(path);
+    if(dp != NULL)
+    {
+        struct dirent *entry;
+        while((entry = readdir(dp)) != NULL)
+        {
+            if(strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            {
+                unlinkat(dirfd(dp), entry->d_name, 0);
+            }
+        }
+        closedir(dp);
+    }
+    rmdir(path);
+}
+
+/*
+ *  Builds the graph into a world in memory, laid out as the binary world
+ *  format described in waltsara.world.h, and saves it to fileName in one
+ *  write. Returns false if the file could not be written.
+ */
+bool WriteWorldFile(const Graph *graph, int start, int end, uint64_t seed, const char *fileName)
+{
+    World world;
+    if(!FillWorld(&world, graph, start, end, seed))
+    {
+        perror("Failed to allocate the world.");
+        return false;
+    }
+    IndexWorld(&world);
+
+    bool result = SaveWorld(&world, fileName);
+    if(result)
+    {
+        CountStat(STAT_FILES_WRITTEN, 1);
+        CountStat(STAT_BYTES_WRITTEN, world.imageSize);
+    }
+    FreeWorld(&world);
+    return result;
+}
+
+/*
+ *  Lays the graph out as a world made by CreateWorld, with every section
+ *  but the name index filled in. Returns false if memory runs out.
+ */
+bool FillWorld(World *world, const Graph *graph, int start, int end, uint64_t seed)
+{
+    int numRooms = graph->numRooms;
+    uint64_t numConnections = 0;
+    uint64_t namesSize = 0;
+
+    int i;
+    for(i = 0; i < numRooms; i++)
+    {
+        char name[MAX_ROOM_NAME_LENGTH];
+        MakeRoomName(i, name);
+        numConnections += graph->connectCount[i];
+        namesSize += strlen(name) + 1;
+    }
+
+    WorldHeader header;
+    LayOutWorld(&header, numRooms, numConnections, namesSize);
+    header.startRoom = start;
+    header.endRoom = end;
+    header.seed = seed;
+
+    if(!CreateWorld(world, &header))
+    {
+        return false;
+    }
+
+    uint8_t  *roomType    = (uint8_t*)world->roomType;
+    uint64_t *offsets     = (uint64_t*)world->offsets;
+    uint32_t *connections = (uint32_t*)world->connections;
+    uint64_t *nameOffsets = (uint64_t*)world->nameOffsets;
+    char     *names       = (char*)world->names;
+
+    uint64_t offset = 0;
+    uint64_t nameOffset = 0;
+    for(i = 0; i < numRooms; i++)
+    {
+        roomType[i] = (uint8_t)graph->roomType[i];
+        offsets[i] = offset;
+
+        /* Connections are sorted so readers can binary search them */
+        uint32_t *sorted = connections + offset;
+        const int *room = &graph->connections[(size_t)i * graph->maxConnections];
+        int j;
+        for(j = 0; j < graph->connectCount[i]; j++)
+        {
+            int k = j;
+            while(k > 0 && sorted[k - 1] > (uint32_t)room[j])
+            {
+                sorted[k] = sorted[k - 1];
+                k--;
+            }
+            sorted[k] = room[j];
+        }
+        offset += graph->connectCount[i];
+
+        nameOffsets[i] = nameOffset;
+        MakeRoomName(i, names + nameOffset);
+        nameOffset += strlen(names + nameOffset) + 1;
+    }
+    offsets[numRooms] = offset;
+    nameOffsets[numRooms] = nameOffset;
+    return true;
+}
+
+/*
+ *  Returns roughly how many bytes generating a world of numRooms rooms in
+ *  memory takes at its peak: the graph, its pools and components, then
+ *  the whole world WriteWorldFile builds next to it.
+ */
+uint64_t EstimateMemory(int numRooms, int maxConnections)
+{
+    return (uint64_t)numRooms * (8 * (uint64_t)maxConnections + 72);
+}
+
+/*
+ *  Returns the number of bytes in text, a number that may end in K, M, G
+ *  or T for powers of 1024, or 0 if it isn't one.
+ */
+uint64_t ParseSize(const char *text)
+{
+    char *unit;
+    uint64_t size = strtoull(text, &unit, 10);
+    int shift = 0;
+    switch(*unit)
+    {
+        case 'T': case 't': shift += 10;    /* Fall through */
+        case 'G': case 'g': shift += 10;    /* Fall through */
+        case 'M': case 'm': shift += 10;    /* Fall through */
+        case 'K': case 'k': shift += 10; unit++; break;
+    }
+    if(unit == text || *unit != '\0' || size > (UINT64_MAX >> shift))
+    {
+        return 0;
+    }
+    return size << shift;
+}
+
+/*
+ *  Generates the world without holding it in memory: plans its shape,
+ *  then writes it room by room as a world file or room directory.
+ *  Returns the exit code for main.
+ */
+int StreamWorld(int numRooms, int minConnections, int maxConnections, int start, int end, uint64_t seed,
+                Rng *rng, bool binaryFormat, uint64_t memoryLimit, bool verbose, const struct timespec *began)
+{
+    StreamShape shape;
+    if(!PlanStream(&shape, numRooms, minConnections, maxConnections, rng))
+    {
+        fprintf(stderr, "Can't stream a world with %d rooms and %d to %d connections each.\n",
+                numRooms, minConnections, maxConnections);
+        return 1;
+    }
+
+    char partial[MAX_WORLD_PATH];
+    char final[MAX_WORLD_PATH];
+    NameWorld(binaryFormat, -1, partial, final);
+    bool written;
+    uint64_t timer = StartTimer();
+    if(binaryFormat)
+    {
+        written = StreamWorldFile(&shape, start, end, seed, partial,
+                                  memoryLimit > 0 ? memoryLimit : DEFAULT_MEMORY_LIMIT);
+    }
+    else
+    {
+        int directory = CreateWorldDirectory(partial);
+        written = directory != -1 && StreamRoomFiles(&shape, start, end, directory);
+        if(directory != -1)
+        {
+            close(directory);
+        }
+    }
+    StopTimer(STAT_WRITE_NS, timer);
+
+    written = written && PublishWorld(partial, final, !binaryFormat);
+    if(!written)
+    {
+        DiscardWorld(partial, !binaryFormat);
+    }
+
+    if(verbose)
+    {
+        struct timespec finished;
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        uint64_t connections = 0;
+        uint32_t i;
+        for(i = 0; i < shape.numRooms; i++)
+        {
+            connections += CountStreamConnections(&shape, i);
+        }
+        fprintf(stderr, "Seed: %llu\nRooms: %d\nConnections: %llu\nStreamed: %d strides, %d required\nGeneration: %.3fs\n",
+                (unsigned long long)seed, numRooms, (unsigned long long)connections / 2,
+                shape.numStrides, shape.numRequired,
+                (finished.tv_sec - began->tv_sec) + (finished.tv_nsec - began->tv_nsec) / 1e9);
+    }
+
+    free(shape.strides);
+    ReportStats(verbose, memoryLimit);
+    return written ? 0 : 1;
+}
+
+/*
+ *  Works out how many strides of each kind give every room between
+ *  minConnections and maxConnections connections, and draws the strides
+ *  and keys from rng. Returns false if the ring is too small for them.
+ */
+bool PlanStream(StreamShape *shape, int numRooms, int minConnections, int maxConnections, Rng *rng)
+{
+    memset(shape, 0, sizeof(StreamShape));
+    shape->numRooms = numRooms;
+
+    /* Stride 1 is always required; an odd minimum rounds up unless only going across fits */
+    int required = minConnections / 2 > 1 ? minConnections / 2 : 1;
+    if(2 * required < minConnections)
+    {
+        if(2 * (required + 1) <= maxConnections)
+        {
+            required++;
+        }
+        else if(numRooms % 2 == 0)
+        {
+            shape->across = 2;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    int spare = maxConnections - 2 * required - (shape->across == 2);
+    int optional = spare / 2;
+    if(shape->across == 0 && numRooms % 2 == 0 && spare % 2 == 1)
+    {
+        shape->across = 1;
+    }
+
+    shape->numRequired = required;
+    shape->numStrides = required + optional;
+    uint32_t longest = (numRooms - 1) / 2;
+    if(spare < 0 || (uint32_t)shape->numStrides > longest)
+    {
+        return false;
+    }
+
+    /* Distinct random strides, stride 1 first */
+    shape->strides = (uint32_t*)malloc(shape->numStrides * sizeof(uint32_t));
+    if(shape->strides == NULL)
+    {
+        return false;
+    }
+    shape->strides[0] = 1;
+    int i;
+    for(i = 1; i < shape->numStrides; i++)
+    {
+        bool taken;
+        do
+        {
+            shape->strides[i] = 2 + RandomBelow(rng, longest - 1);
+            taken = false;
+            int j;
+            for(j = 0; j < i && !taken; j++)
+            {
+                taken = shape->strides[j] == shape->strides[i];
+            }
+        } while(taken);
+    }
+
+    while((1ULL << (2 * shape->halfBits)) < (uint64_t)numRooms)
+    {
+        shape->halfBits++;
+    }
+    for(i = 0; i < FEISTEL_ROUNDS; i++)
+    {
+        shape->keys[i] = NextRandom(rng);
+    }
+    shape->optionKey = NextRandom(rng);
+    return true;
+}
+
+/*
+ *  Returns the room ID at the specified position of the ring. Positions
+ *  outside the rooms are walked through the permutation again until they
+ *  land on a room, which keeps it a permutation of the rooms alone.
+ */
+uint32_t PermuteRoom(const StreamShape *shape, uint32_t position)
+{
+    uint64_t mask = (1ULL << shape->halfBits) - 1;
+    uint64_t x = position;
+    do
+    {
+        uint64_t left = x >> shape->halfBits;
+        uint64_t right = x & mask;
+        int i;
+        for(i = 0; i < FEISTEL_ROUNDS; i++)
+        {
+            uint64_t next = left ^ (MixBits(shape->keys[i] ^ right) & mask);
+            left = right;
+            right = next;
+        }
+        x = (left << shape->halfBits) | right;
+    } while(x >= shape->numRooms);
+    return (uint32_t)x;
+}
+
+/*
+ *  Returns the position of the specified room on the ring, undoing
+ *  PermuteRoom.
+ */
+uint32_t UnpermuteRoom(const StreamShape *shape, uint32_t room)
+{
+    uint64_t mask = (1ULL << shape->halfBits) - 1;
+    uint64_t x = room;
+    do
+    {
+        uint64_t left = x >> shape->halfBits;
+        uint64_t right = x & mask;
+        int i;
+        for(i = FEISTEL_ROUNDS - 1; i >= 0; i--)
+        {
+            uint64_t previous = right ^ (MixBits(shape->keys[i] ^ left) & mask);
+            right = left;
+            left = previous;
+        }
+        x = (left << shape->halfBits) | right;
+    } while(x >= shape->numRooms);
+    return (uint32_t)x;
+}
+
+/*
+ *  Returns whether the optional connection from the specified position one
+ *  stride further round the ring exists. Stride numStrides stands for
+ *  going across, asked about from the lower of the two positions.
+ */
+bool HasOption(const StreamShape *shape, int stride, uint32_t position)
+{
+    return (MixBits(shape->optionKey ^ ((uint64_t)stride << 32) ^ position) & 1) != 0;
+}
+
+/*
+ *  Returns how many connections the room at the specified position has,
+ *  without working out which rooms they go to.
+ */
+int CountStreamConnections(const StreamShape *shape, uint32_t position)
+{
+    uint32_t numRooms = shape->numRooms;
+    int count = 2 * shape->numRequired;
+    int i;
+    for(i = shape->numRequired; i < shape->numStrides; i++)
+    {
+        uint32_t stride = shape->strides[i];
+        count += HasOption(shape, i, position);
+        count += HasOption(shape, i, position >= stride ? position - stride : position + numRooms - stride);
+    }
+    if(shape->across != 0)
+    {
+        uint32_t half = numRooms / 2;
+        uint32_t lower = position < half ? position : position - half;
+        count += shape->across == 2 || HasOption(shape, shape->numStrides, lower);
+    }
+    return count;
+}
+
+/*
+ *  Writes the specified room's connections into connections, which must
+ *  have room for 2 * numStrides + 1 of them, in room ID order. Returns
+ *  how many there are.
+ */
+int GetStreamConnections(const StreamShape *shape, uint32_t room, uint32_t *connections)
+{
+    uint32_t numRooms = shape->numRooms;
+    uint32_t position = UnpermuteRoom(shape, room);
+    int count = 0;
+    int i;
+    for(i = 0; i < shape->numStrides; i++)
+    {
+        uint32_t stride = shape->strides[i];
+        uint32_t up = position + stride < numRooms ? position + stride : position + stride - numRooms;
+        uint32_t down = position >= stride ? position - stride : position + numRooms - stride;
+        if(i < shape->numRequired || HasOption(shape, i, position))
+        {
+            connections[count++] = PermuteRoom(shape, up);
+        }
+        if(i < shape->numRequired || HasOption(shape, i, down))
+        {
+            connections[count++] = PermuteRoom(shape, down);
+        }
+    }
+    if(shape->across != 0)
+    {
+        uint32_t half = numRooms / 2;
+        uint32_t lower = position < half ? position : position - half;
+        if(shape->across == 2 || HasOption(shape, shape->numStrides, lower))
+        {
+            connections[count++] = PermuteRoom(shape, position < half ? position + half : position - half);
+        }
+    }
+
+    /* Readers binary search them, so sort them */
+    for(i = 1; i < count; i++)
+    {
+        uint32_t other = connections[i];
+        int j = i;
+        while(j > 0 && connections[j - 1] > other)
+        {
+            connections[j] = connections[j - 1];
+            j--;
+        }
+        connections[j] = other;
+    }
+    return count;
+}
+
+/*
+ *  Writes a streamed world to fileName in the binary world format, room by
+ *  room, in about memoryLimit bytes. Every section but the name index is
+ *  written in room order through its own buffer. The name index needs the
+ *  rooms in hash slot order instead, so hash slots are collected in runs
+ *  that fill half the budget, sorted, spilled to a scratch file and
+ *  merged into the table at the end; the prefix index needs them in name
+ *  order, which for generated names can be counted off without sorting.
+ *  Returns false if the file could not be written.
+ */
+bool StreamWorldFile(const StreamShape *shape, int start, int end, uint64_t seed, const char *fileName,
+                     uint64_t memoryLimit)
+{
+    uint32_t numRooms = shape->numRooms;
+    uint64_t numConnections = 0;
+    uint64_t namesSize = 0;
+
+    uint32_t i;
+    for(i = 0; i < numRooms; i++)
+    {
+        char name[MAX_ROOM_NAME_LENGTH];
+        MakeRoomName(i, name);
+        numConnections += CountStreamConnections(shape, i);
+        namesSize += strlen(name) + 1;
+    }
+
+    /* Lay out the sections before writing anything */
+    WorldHeader header;
+    LayOutWorld(&header, numRooms, numConnections, namesSize);
+    header.startRoom = start;
+    header.endRoom = end;
+    header.seed = seed;
+    uint64_t numHashSlots = header.numHashSlots;
+
+    /* Sized up front, so the padding between sections is already zero */
+    int fd = open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1 || ftruncate(fd, header.fileSize) == -1 ||
+       pwrite(fd, &header, sizeof(WorldHeader), 0) != sizeof(WorldHeader))
+    {
+        perror("Failed to create world file.");
+        if(fd != -1)
+        {
+            close(fd);
+        }
+        return false;
+    }
+
+    /* Half the budget holds a run of name index records and the scratch space to sort it */
+    size_t runSize = memoryLimit / 2 / (2 * sizeof(uint64_t));
+    if(runSize > numRooms)
+    {
+        runSize = numRooms;
+    }
+    uint64_t *records = (uint64_t*)malloc(runSize * sizeof(uint64_t));
+    uint64_t *scratch = (uint64_t*)malloc(runSize * sizeof(uint64_t));
+    int maxRuns = (numRooms + runSize - 1) / runSize;
+    uint64_t *runEnds = (uint64_t*)malloc((maxRuns + 1) * sizeof(uint64_t));
+    uint32_t *connections = (uint32_t*)malloc((2 * shape->numStrides + 1) * sizeof(uint32_t));
+    SectionWriter types, offsets, links, nameOffsets, names;
+    bool opened = OpenSection(&types, fd, header.typesOffset) & OpenSection(&offsets, fd, header.offsetsOffset) &
+                  OpenSection(&links, fd, header.connectionsOffset) &
+                  OpenSection(&nameOffsets, fd, header.nameOffsetsOffset) & OpenSection(&names, fd, header.namesOffset);
+    int scratchFd = -1;
+    bool result = opened && records != NULL && scratch != NULL && runEnds != NULL && connections != NULL;
+
+    int numRuns = 0;
+    size_t used = 0;
+    uint64_t offset = 0;
+    uint64_t nameOffset = 0;
+    for(i = 0; result && i < numRooms; i++)
+    {
+        uint8_t type = i == (uint32_t)start ? START_ROOM : (i == (uint32_t)end ? END_ROOM : MID_ROOM);
+        WriteSection(&types, &type, 1);
+
+        int count = GetStreamConnections(shape, i, connections);
+        WriteSection(&offsets, &offset, sizeof(uint64_t));
+        WriteSection(&links, connections, count * sizeof(uint32_t));
+        offset += count;
+
+        char name[MAX_ROOM_NAME_LENGTH];
+        MakeRoomName(i, name);
+        size_t length = strlen(name) + 1;
+        WriteSection(&nameOffsets, &nameOffset, sizeof(uint64_t));
+        WriteSection(&names, name, length);
+        nameOffset += length;
+
+        /* Hash slot in the top half, room in the bottom, so sorting orders by slot then room */
+        records[used++] = ((HashName(name) & (numHashSlots - 1)) << 32) | i;
+        if(used == runSize || (i == numRooms - 1 && numRuns > 0))
+        {
+            /* Runs only go to disk once there is more than one */
+            if(scratchFd == -1)
+            {
+                scratchFd = OpenScratchFile();
+                result = scratchFd != -1;
+            }
+            SortRecords(records, scratch, used);
+            uint64_t runStart = numRuns > 0 ? runEnds[numRuns - 1] : 0;
+            size_t bytes = used * sizeof(uint64_t);
+            size_t done = 0;
+            while(result && done < bytes)
+            {
+                ssize_t wrote = pwrite(scratchFd, (char*)records + done, bytes - done, runStart + done);
+                result = wrote > 0;
+                done += wrote > 0 ? wrote : 0;
+            }
+            runEnds[numRuns++] = runStart + bytes;
+            used = 0;
+        }
+    }
+    WriteSection(&offsets, &offset, sizeof(uint64_t));
+    WriteSection(&nameOffsets, &nameOffset, sizeof(uint64_t));
+    result = (CloseSection(&types) & CloseSection(&offsets) & CloseSection(&links) &
+              CloseSection(&nameOffsets) & CloseSection(&names)) && result;
+
+    /* A world that fit in one run still has it in memory */
+    if(result && numRuns == 0)
+    {
+        SortRecords(records, scratch, used);
+    }
+    free(connections);
+    free(scratch);
+
+    /* Names are a base followed by a number, so name order is base order, then digit order */
+    SectionWriter sorted;
+    result = OpenSection(&sorted, fd, header.sortedNamesOffset) && result;
+    int bases[MAX_ROOM_COUNT];
+    int b;
+    for(b = 0; b < MAX_ROOM_COUNT; b++)
+    {
+        int j = b;
+        while(j > 0 && strcmp(roomNames[bases[j - 1]], roomNames[b]) > 0)
+        {
+            bases[j] = bases[j - 1];
+            j--;
+        }
+        bases[j] = b;
+    }
+    for(b = 0; result && b < MAX_ROOM_COUNT; b++)
+    {
+        uint32_t base = bases[b];
+        if(base >= numRooms)
+        {
+            continue;
+        }
+        WriteSection(&sorted, &base, sizeof(uint32_t));
+
+        /* Count 1, 10, 100, 101, ..., 11, 110, ... up to the last number this base has */
+        uint64_t last = (numRooms - 1 - base) / MAX_ROOM_COUNT;
+        uint64_t number = 1;
+        uint64_t n;
+        for(n = 0; n < last; n++)
+        {
+            uint32_t room = number * MAX_ROOM_COUNT + base;
+            WriteSection(&sorted, &room, sizeof(uint32_t));
+            if(number * 10 <= last)
+            {
+                number *= 10;
+            }
+            else
+            {
+                while(number % 10 == 9 || number + 1 > last)
+                {
+                    number /= 10;
+                }
+                number++;
+            }
+        }
+    }
+    result = CloseSection(&sorted) && result;
+
+    if(result)
+    {
+        result = WriteNameIndex(fd, header.hashOffset, numHashSlots, scratchFd, runEnds, numRuns,
+                                records, numRuns == 0 ? used : runSize);
+    }
+
+    free(records);
+    free(runEnds);
+    if(scratchFd != -1)
+    {
+        close(scratchFd);
+    }
+
+    CountStat(STAT_FILES_WRITTEN, 1);
+    CountStat(STAT_BYTES_WRITTEN, header.fileSize);
+    if(close(fd) != 0 || !result)
+    {
+        perror("Unable to write world file.");
+        return false;
+    }
+    return true;
+}
+
+/*
+ *  Writes a streamed world as one file per room into the directory open
+ *  as directory. Each room's connections are worked out as it is written.
+ *  Returns false as soon as a file can't be written.
+ */
+bool StreamRoomFiles(const StreamShape *shape, int start, int end, int directory)
+{
+    int maxConnections = 2 * shape->numStrides + 1;
+    size_t capacity = 64 + (size_t)maxConnections * (MAX_ROOM_NAME_LENGTH + 24);
+    char *text = (char*)malloc(capacity);
+    uint32_t *connections = (uint32_t*)malloc(maxConnections * sizeof(uint32_t));
+    if(text == NULL || connections == NULL)
+    {
+        perror("Failed to create file.");
+        free(text);
+        free(connections);
+        return false;
+    }
+
+    bool result = true;
+    uint32_t i;
+    for(i = 0; result && i < shape->numRooms; i++)
+    {
+        Type type = i == (uint32_t)start ? START_ROOM : (i == (uint32_t)end ? END_ROOM : MID_ROOM);
+        int count = GetStreamConnections(shape, i, connections);
+        result = WriteRoomFile(directory, text, capacity, i, type, connections, count);
+    }
+
+    free(text);
+    free(connections);
+    return result;
+}
+
+/*
+ *  Starts a section writer putting bytes into fd from offset on.
+ */
+bool OpenSection(SectionWriter *writer, int fd, uint64_t offset)
+{
+    writer->fd = fd;
+    writer->offset = offset;
+    writer->used = 0;
+    writer->buffer = (char*)malloc(SECTION_BUFFER);
+    writer->failed = writer->buffer == NULL;
+    return !writer->failed;
+}
+
+/*
+ *  Appends length bytes of data to the section, writing the buffer out
+ *  whenever it fills.
+ */
+void WriteSection(SectionWriter *writer, const void *data, size_t length)
+{
+    const char *bytes = (const char*)data;
+    while(length > 0 && !writer->failed)
+    {
+        size_t part = SECTION_BUFFER - writer->used < length ? SECTION_BUFFER - writer->used : length;
+        memcpy(writer->buffer + writer->used, bytes, part);
+        writer->used += part;
+        bytes += part;
+        length -= part;
+
+        size_t done = 0;
+        while(writer->used == SECTION_BUFFER && done < writer->used)
+        {
+            ssize_t wrote = pwrite(writer->fd, writer->buffer + done, writer->used - done, writer->offset + done);
+            CountStat(STAT_WRITE_SYSCALLS, 1);
+            if(wrote <= 0)
+            {
+                writer->failed = true;
+                return;
+            }
+            done += wrote;
+        }
+        if(done > 0)
+        {
+            writer->offset += done;
+            writer->used = 0;
+        }
+    }
+}
+
+/*
+ *  Writes out whatever the section still buffers and releases it.
+ *  Returns false if any write of the section failed.
+ */
+bool CloseSection(SectionWriter *writer)
+{
+    size_t done = 0;
+    while(!writer->failed && done < writer->used)
+    {
+        ssize_t wrote = pwrite(writer->fd, writer->buffer + done, writer->used - done, writer->offset + done);
+        CountStat(STAT_WRITE_SYSCALLS, 1);
+        writer->failed = wrote <= 0;
+        done += wrote > 0 ? wrote : 0;
+    }
+    free(writer->buffer);
+    writer->buffer = NULL;
+    return !writer->failed;
+}
+
+/*
+ *  Opens an unnamed scratch file next to the world being written, since
+ *  the runs can be as big as the world and /tmp may well be in memory.
+ *  Returns -1 if there is no way to make one.
+ */
+int OpenScratchFile(void)
+{
+    int fd = open(".", O_TMPFILE | O_RDWR, 0600);
+    if(fd == -1)
+    {
+        /* Filesystems without O_TMPFILE get a named file that is unlinked straight away */
+        char name[] = "waltsara.scratch.XXXXXX";
+        fd = mkstemp(name);
+        if(fd != -1)
+        {
+            unlink(name);
+        }
+    }
+    return fd;
+}
+
+/*
+ *  Sorts name index records by hash slot, the top 32 bits, with a radix
+ *  sort that keeps records of one slot in the order they came, which is
+ *  room order. scratch must hold count records too.
+ */
+void SortRecords(uint64_t *records, uint64_t *scratch, size_t count)
+{
+    int shift;
+    for(shift = 32; shift < 64; shift += 8)
+    {
+        size_t counts[256];
+        memset(counts, 0, sizeof(counts));
+        size_t i;
+        for(i = 0; i < count; i++)
+        {
+            counts[(records[i] >> shift) & 0xFF]++;
+        }
+
+        size_t total = 0;
+        int digit;
+        for(digit = 0; digit < 256; digit++)
+        {
+            size_t here = counts[digit];
+            counts[digit] = total;
+            total += here;
+        }
+
+        for(i = 0; i < count; i++)
+        {
+            scratch[counts[(records[i] >> shift) & 0xFF]++] = records[i];
+        }
+
+        /* Four passes, so the sorted records end up back in records */
+        uint64_t *swap = records;
+        records = scratch;
+        scratch = swap;
+    }
+}
+
+/*
+ *  Fills the name index of the world file in fd from sorted runs of
+ *  records, merging them in slot order: the runs in the scratch file
+ *  ending at runEnds, or with no runs, the count records in records.
+ *  records holds count records of buffer space to read the runs through.
+ *
+ *  Each room goes in its own slot or the first free one after it, just as
+ *  if it had been inserted by probing. Rooms pushed past the last slot
+ *  wrap around to the first free slots at the start, which are looked up
+ *  once everything else is in.
+ */
+bool WriteNameIndex(int fd, uint64_t hashOffset, uint64_t numHashSlots, int scratchFd, const uint64_t *runEnds,
+                    int numRuns, uint64_t *records, size_t count)
+{
+    int numReaders = numRuns > 0 ? numRuns : 1;
+    RunReader *readers = (RunReader*)calloc(numReaders, sizeof(RunReader));
+    int *heap = (int*)malloc(numReaders * sizeof(int));
+    uint32_t *wrapped = NULL;
+    size_t numWrapped = 0;
+    SectionWriter slots;
+    bool result = readers != NULL && heap != NULL && OpenSection(&slots, fd, hashOffset);
+    if(!result)
+    {
+        free(readers);
+        free(heap);
+        return false;
+    }
+
+    int i;
+    int heapSize = 0;
+    for(i = 0; i < numReaders; i++)
+    {
+        RunReader *reader = &readers[i];
+        reader->capacity = count / numReaders;
+        reader->buffer = records + i * reader->capacity;
+        if(numRuns == 0)
+        {
+            reader->count = count;          // Already in memory, nothing left to read
+        }
+        else
+        {
+            reader->next = i > 0 ? runEnds[i - 1] : 0;
+            reader->end = runEnds[i];
+            result = FillRun(reader, scratchFd) && result;
+        }
+
+        /* Sift up by the run's first record; runs are never empty */
+        int position = heapSize++;
+        while(position > 0 && readers[heap[(position - 1) / 2]].buffer[0] > reader->buffer[0])
+        {
+            heap[position] = heap[(position - 1) / 2];
+            position = (position - 1) / 2;
+        }
+        heap[position] = i;
+    }
+
+    uint64_t nextSlot = 0;
+    static const uint32_t empty = 0;
+    while(result && heapSize > 0)
+    {
+        RunReader *reader = &readers[heap[0]];
+        uint64_t record = reader->buffer[reader->position++];
+        uint64_t home = record >> 32;
+        uint32_t entry = (uint32_t)record + 1;
+
+        while(nextSlot < home)
+        {
+            WriteSection(&slots, &empty, sizeof(uint32_t));
+            nextSlot++;
+        }
+        if(nextSlot < numHashSlots)
+        {
+            WriteSection(&slots, &entry, sizeof(uint32_t));
+            nextSlot++;
+        }
+        else
+        {
+            uint32_t *grown = (uint32_t*)realloc(wrapped, (numWrapped + 1) * sizeof(uint32_t));
+            result = grown != NULL;
+            wrapped = grown != NULL ? grown : wrapped;
+            if(result)
+            {
+                wrapped[numWrapped++] = entry;
+            }
+        }
+
+        /* Move on within the run, dropping it from the heap once it's done */
+        if(reader->position == reader->count && !FillRun(reader, scratchFd))
+        {
+            heap[0] = heap[--heapSize];
+        }
+        int position = 0;
+        int top = heap[0];
+        while(heapSize > 0)
+        {
+            int child = 2 * position + 1;
+            if(child >= heapSize)
+            {
+                break;
+            }
+            if(child + 1 < heapSize &&
+               readers[heap[child + 1]].buffer[readers[heap[child + 1]].position] <
+               readers[heap[child]].buffer[readers[heap[child]].position])
+            {
+                child++;
+            }
+            if(readers[heap[child]].buffer[readers[heap[child]].position] >=
+               readers[top].buffer[readers[top].position])
+            {
+                break;
+            }
+            heap[position] = heap[child];
+            position = child;
+        }
+        heap[position] = top;
+    }
+    while(nextSlot < numHashSlots)
+    {
+        WriteSection(&slots, &empty, sizeof(uint32_t));
+        nextSlot++;
+    }
+    result = CloseSection(&slots) && result;
+
+    /* The few rooms that wrapped around take the first free slots from the start */
+    uint64_t slot = 0;
+    size_t w;
+    for(w = 0; result && w < numWrapped; w++)
+    {
+        uint32_t taken = 1;
+        while(taken != 0 && slot < numHashSlots)
+        {
+            result = pread(fd, &taken, sizeof(uint32_t), hashOffset + slot * sizeof(uint32_t)) == sizeof(uint32_t);
+            slot += taken != 0;
+        }
+        result = result && pwrite(fd, &wrapped[w], sizeof(uint32_t), hashOffset + slot * sizeof(uint32_t)) ==
+                           sizeof(uint32_t);
+        slot++;
+    }
+
+    free(wrapped);
+    free(heap);
+    free(readers);
+    return result;
+}
+
+/*
+ *  Reads the next records of a run into its buffer. Returns false once
+ *  the run is used up or can't be read.
+ */
+bool FillRun(RunReader *reader, int fd)
+{
+    reader->count = 0;
+    reader->position = 0;
+    if(reader->next >= reader->end)
+    {
+        return false;
+    }
+
+    size_t bytes = reader->end - reader->next;
+    if(bytes > reader->capacity * sizeof(uint64_t))
+    {
+        bytes = reader->capacity * sizeof(uint64_t);
+    }
+    size_t done = 0;
+    while(done < bytes)
+    {
+        ssize_t got = pread(fd, (char*)reader->buffer + done, bytes - done, reader->next + done);
+        if(got <= 0)
+        {
+            return false;
+        }
+        done += got;
+    }
+    reader->next += bytes;
+    reader->count = bytes / sizeof(uint64_t);
+    return true;
+}
+
+/*
+ *  Prints every counter and the peak memory use to stderr for -v, then
+ *  writes the counters as JSON if WALTSARA_STATS asked for that. Going
+ *  over the memory limit is reported either way.
+ */
+void ReportStats(bool verbose, uint64_t memoryLimit)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double peak = usage.ru_maxrss / 1024.0;         // Linux reports kilobytes
+
+    if(verbose)
+    {
+        fprintf(stderr, "Peak memory: %.1f MB\n", peak);
+        size_t length = FormatStats(NULL, 0);
+        char *text = (char*)malloc(length + 1);
+        if(text != NULL)
+        {
+            FormatStats(text, length + 1);
+            fputs(text, stderr);
+            free(text);
+        }
+    }
+    if(memoryLimit > 0 && peak * 1048576 > memoryLimit)
+    {
+        fprintf(stderr, "Peak memory of %.1f MB went over the %.1f MB limit.\n", peak, memoryLimit / 1048576.0);
+    }
+    DumpStats();
 }
@@ -0,0 +1,273 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "waltsara.feed.h"
+
+/*
+ * Bytes a feed of numRings rings of ringSize events takes.
+ */
+static size_t FeedSize(uint32_t numRings, uint32_t ringSize)
+{
+    return sizeof(FeedHeader) + (size_t)numRings * (sizeof(FeedRing) + (size_t)ringSize * sizeof(FeedEvent));
+}
+
+/*
+ * Copies name into the feed, with the leading slash shared memory names
+ * are meant to have added if it is missing.
+ */
+static void NameFeed(Feed *feed, const char *name)
+{
+    snprintf(feed->name, sizeof(feed->name), "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+/*
+ * Whether the feed called name belongs to a game that is still running.
+ * A feed whose game died without closing it can be taken over.
+ */
+static bool IsFeedInUse(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if(fd == -1)
+    {
+        return false;
+    }
+
+    bool inUse = false;
+    struct stat st;
+    if(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(FeedHeader))
+    {
+        FeedHeader *header = (FeedHeader*)mmap(NULL, sizeof(FeedHeader), PROT_READ, MAP_SHARED, fd, 0);
+        if(header != MAP_FAILED)
+        {
+            inUse = !__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE) &&
+                    (kill(header->pid, 0) == 0 || errno == EPERM);
+            munmap(header, sizeof(FeedHeader));
+        }
+    }
+    close(fd);
+    return inUse;
+}
+
+/*
+ * Creates the feed called name for a game playing world on numRings
+ * threads, and maps it for publishing. A feed left behind by a game that
+ * died is replaced; one whose game is still running is not. The whole
+ * feed is faulted in up front so publishing never takes a page fault.
+ */
+bool CreateFeed(Feed *feed, const char *name, uint32_t numRings, const World *world)
+{
+    memset(feed, 0, sizeof(Feed));
+    NameFeed(feed, name);
+    feed->size = FeedSize(numRings, FEED_EVENTS);
+
+    int fd = shm_open(feed->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(fd == -1 && errno == EEXIST && !IsFeedInUse(feed->name))
+    {
+        shm_unlink(feed->name);
+        fd = shm_open(feed->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    }
+    if(fd == -1)
+    {
+        if(errno == EEXIST)
+        {
+            fprintf(stderr, "Another game is publishing to %s.\n", feed->name);
+        }
+        else
+        {
+            perror("Failed to create the spectator feed.");
+        }
+        return false;
+    }
+    if(ftruncate(fd, feed->size) == -1)
+    {
+        perror("Failed to size the spectator feed.");
+        close(fd);
+        shm_unlink(feed->name);
+        return false;
+    }
+    feed->header = (FeedHeader*)mmap(NULL, feed->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if(feed->header == MAP_FAILED)
+    {
+        perror("Failed to map the spectator feed.");
+        feed->header = NULL;
+        shm_unlink(feed->name);
+        return false;
+    }
+    feed->owner = true;
+
+    /* The rest is zero already; the magic goes in last so nobody follows a feed half set up */
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    FeedHeader *header = feed->header;
+    header->version = FEED_VERSION;
+    header->numRings = numRings;
+    header->ringSize = FEED_EVENTS;
+    header->numRooms = world->numRooms;
+    header->startRoom = GetStartRoom(world);
+    header->endRoom = GetEndRoom(world);
+    header->fingerprint = FingerprintWorld(world);
+    header->started = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    header->pid = getpid();
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic, FEED_MAGIC, sizeof(header->magic));
+    return true;
+}
+
+/*
+ * Publishes a move of session from one room to another into ring, which
+ * only the calling thread ever publishes to. Never blocks and never
+ * enters the kernel; an observer that hasn't read the event the slot
+ * held before simply loses it.
+ */
+void PublishMove(Feed *feed, int ring, uint32_t session, uint32_t from, uint32_t to, uint32_t step)
+{
+    FeedRing *r = GetFeedRing(feed, ring);
+    uint64_t n = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    FeedEvent *event = &r->events[n & (feed->header->ringSize - 1)];
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    /* Mark the slot as being written before the fields change, and done after */
+    __atomic_store_n(&event->seq, 2 * n + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&event->session, session, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->from, from, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->to, to, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->step, step, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->time, (int64_t)now.tv_sec * 1000000000 + now.tv_nsec, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->seq, 2 * n + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->head, n + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Unmaps a feed. The game publishing it marks it closed first and removes
+ * its name, so observers still following it read what is left and stop,
+ * and nobody new finds it.
+ */
+void CloseFeed(Feed *feed)
+{
+    if(feed->header == NULL)
+    {
+        return;
+    }
+    if(feed->owner)
+    {
+        __atomic_store_n(&feed->header->closed, 1, __ATOMIC_RELEASE);
+        shm_unlink(feed->name);
+    }
+    munmap(feed->header, feed->size);
+    feed->header = NULL;
+}
+
+/*
+ * Maps the feed called name read-only, so following it can never get in
+ * the way of the game. Returns false if there is no such feed or it isn't
+ * one this program understands.
+ */
+bool AttachFeed(Feed *feed, const char *name)
+{
+    memset(feed, 0, sizeof(Feed));
+    NameFeed(feed, name);
+
+    int fd = shm_open(feed->name, O_RDONLY, 0);
+    if(fd == -1)
+    {
+        perror("Failed to open the spectator feed.");
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(FeedHeader))
+    {
+        fprintf(stderr, "%s is not a spectator feed.\n", feed->name);
+        close(fd);
+        return false;
+    }
+    feed->size = st.st_size;
+    feed->header = (FeedHeader*)mmap(NULL, feed->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(feed->header == MAP_FAILED)
+    {
+        perror("Failed to map the spectator feed.");
+        feed->header = NULL;
+        return false;
+    }
+
+    const FeedHeader *header = feed->header;
+    bool valid = memcmp(header->magic, FEED_MAGIC, sizeof(header->magic)) == 0;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(!valid || header->version != FEED_VERSION || header->ringSize == 0 ||
+       (header->ringSize & (header->ringSize - 1)) != 0 ||
+       FeedSize(header->numRings, header->ringSize) > feed->size)
+    {
+        fprintf(stderr, "%s is not a spectator feed this version can follow.\n", feed->name);
+        CloseFeed(feed);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Ring of the thread numbered ring.
+ */
+FeedRing *GetFeedRing(const Feed *feed, uint32_t ring)
+{
+    size_t ringBytes = sizeof(FeedRing) + (size_t)feed->header->ringSize * sizeof(FeedEvent);
+    return (FeedRing*)((char*)feed->header + sizeof(FeedHeader) + ring * ringBytes);
+}
+
+/*
+ * Copies up to max events of ring into events, starting with event number
+ * cursor, and moves cursor past them. Events the writer has already
+ * overwritten are skipped and added to lost. Returns the events copied, 0
+ * once the reader has caught up.
+ */
+uint32_t ReadFeed(const Feed *feed, uint32_t ring, uint64_t *cursor, FeedEvent *events, uint32_t max,
+                  uint64_t *lost)
+{
+    const FeedRing *r = GetFeedRing(feed, ring);
+    uint64_t size = feed->header->ringSize;
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+    /* Whatever is older than the ring holds is gone */
+    if(head - *cursor > size)
+    {
+        *lost += head - size - *cursor;
+        *cursor = head - size;
+    }
+
+    uint32_t count = 0;
+    while(*cursor < head && count < max)
+    {
+        uint64_t n = (*cursor)++;
+        const FeedEvent *slot = &r->events[n & (size - 1)];
+        FeedEvent *event = &events[count];
+
+        event->seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        event->session = __atomic_load_n(&slot->session, __ATOMIC_RELAXED);
+        event->from = __atomic_load_n(&slot->from, __ATOMIC_RELAXED);
+        event->to = __atomic_load_n(&slot->to, __ATOMIC_RELAXED);
+        event->step = __atomic_load_n(&slot->step, __ATOMIC_RELAXED);
+        event->time = __atomic_load_n(&slot->time, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        /* Head said event n was done, so any other seq means the writer has been round since */
+        if(event->seq != 2 * n + 2 || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != event->seq)
+        {
+            (*lost)++;
+            continue;
+        }
+        count++;
+    }
+    return count;
+}
@@ -0,0 +1,92 @@
+#ifndef WALTSARA_FEED_H
+#define WALTSARA_FEED_H
+
+/*
+ * The spectator feed: every move the adventure plays, published into POSIX
+ * shared memory for any number of local observers to follow.
+ *
+ *   header | ring 0 | ring 1 | ...
+ *
+ * There is a ring per thread that plays sessions, and only that thread
+ * ever writes to it, so publishing a move takes no lock and no atomic
+ * read-modify-write: a handful of stores into memory the thread already
+ * has in cache, and the time, which comes from the vDSO without a system
+ * call. Observers map the feed read-only and never write to it, so the
+ * game can't be slowed down or held up by them however many there are or
+ * however far behind they fall.
+ *
+ * Each ring holds the newest ringSize events and head, the number of
+ * events published into it so far. Event n goes in slot n % ringSize,
+ * guarded by its seq like a seqlock: 2n + 1 while it is written, 2n + 2
+ * once it is done. A reader copies the event and checks seq before and
+ * after; anything else means the writer lapped it and the event is gone,
+ * which readers count as lost and move past.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "waltsara.world.h"
+
+#define FEED_MAGIC "WALTFEED"
+#define FEED_VERSION 1
+#define FEED_NAME "/waltsara.feed"              // Feed waltsara.spectate follows unless told otherwise
+#define FEED_EVENTS (1 << 16)                   // Events each ring holds, a power of two
+#define FEED_NAME_LENGTH 256
+
+/* One move of one session */
+typedef struct
+{
+    uint64_t seq;                       // 2n + 1 while event n is written, 2n + 2 once it is done
+    uint32_t session;                   // Number of the session within the game publishing it
+    uint32_t from;                      // Room it left
+    uint32_t to;                        // Room it entered
+    uint32_t step;                      // Steps the session has taken, this one included
+    int64_t  time;                      // Nanoseconds since the epoch
+} FeedEvent;
+
+typedef struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t numRings;
+    uint32_t ringSize;                  // Events per ring
+    uint32_t numRooms;                  // Of the world being played
+    uint32_t startRoom;
+    uint32_t endRoom;
+    uint64_t fingerprint;               // FingerprintWorld of the world being played
+    int64_t  started;                   // Nanoseconds since the epoch
+    int32_t  pid;                       // Of the game publishing
+    uint32_t closed;                    // Set once the game has stopped publishing
+    uint64_t reserved;
+} FeedHeader;
+
+/* head on a cache line of its own, followed by its events */
+typedef struct
+{
+    uint64_t  head;                     // Events published so far
+    uint64_t  reserved[7];
+    FeedEvent events[];
+} FeedRing;
+
+/* A feed mapped by the game publishing it or by an observer */
+typedef struct
+{
+    FeedHeader *header;
+    size_t      size;
+    bool        owner;                  // Whether this process publishes it and removes it on close
+    char        name[FEED_NAME_LENGTH];
+} Feed;
+
+/* Publishing */
+bool CreateFeed(Feed *f, const char *name, uint32_t numRings, const World *w);  // Creates a feed for a game
+void PublishMove(Feed *f, int ring, uint32_t session, uint32_t from, uint32_t to, uint32_t step);  // Publishes a move
+void CloseFeed(Feed *f);                                // Unmaps a feed, and marks and removes it if ours
+
+/* Following */
+bool AttachFeed(Feed *f, const char *name);             // Maps a feed read-only
+FeedRing *GetFeedRing(const Feed *f, uint32_t ring);    // Ring of a thread
+uint32_t ReadFeed(const Feed *f, uint32_t ring, uint64_t *cursor, FeedEvent *events, uint32_t max,
+                  uint64_t *lost);                      // Copies events from cursor on, counting those gone
+
+#endif
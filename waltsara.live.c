@@ -0,0 +1,425 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "waltsara.live.h"
+
+/* Bitset helpers */
+static bool TestBit(const uint64_t *bits, uint64_t i)
+{
+    return (bits[i / 64] & (1ULL << (i % 64))) != 0;
+}
+
+static void SetBit(uint64_t *bits, uint64_t i)
+{
+    bits[i / 64] |= 1ULL << (i % 64);
+}
+
+static void ClearBit(uint64_t *bits, uint64_t i)
+{
+    bits[i / 64] &= ~(1ULL << (i % 64));
+}
+
+/*
+ * Returns the entry of connections that is from's door to 'to', or
+ * UINT64_MAX if there is none. Connections are sorted, so this is a
+ * binary search.
+ */
+static uint64_t FindDoor(const World *world, uint32_t from, uint32_t to)
+{
+    uint64_t low = world->offsets[from];
+    uint64_t high = world->offsets[from + 1];
+    while(low < high)
+    {
+        uint64_t mid = low + (high - low) / 2;
+        if(world->connections[mid] < to)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low < world->offsets[from + 1] && world->connections[low] == to ? low : UINT64_MAX;
+}
+
+/*
+ * Whether the door at the specified entry of connections, which belongs
+ * to from, can be walked through.
+ */
+static bool CanPass(const World *world, uint32_t from, uint64_t door)
+{
+    const Changes *changes = world->changes;
+    uint32_t to = world->connections[door];
+    return to < world->numRooms && !TestBit(changes->lockedDoors, door) &&
+           !TestBit(changes->closedRooms, from) && !TestBit(changes->closedRooms, to);
+}
+
+/*
+ * Whether the room still has a shortest route to the end: an open door to
+ * a room one step closer that isn't being repaired itself.
+ */
+static bool HasSupport(const World *world, uint32_t room)
+{
+    const uint32_t *distance = world->distanceToEnd;
+    uint64_t door;
+    for(door = world->offsets[room]; door < world->offsets[room + 1]; door++)
+    {
+        uint32_t next = world->connections[door];
+        if(CanPass(world, room, door) && !TestBit(world->changes->affected, next) &&
+           distance[next] != NO_PATH && distance[next] + 1 == distance[room])
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Orders room IDs by distance to the end for qsort_r; the argument is the
+ * world. Rooms the end can't be reached from come last.
+ */
+static int CompareDistances(const void *a, const void *b, void *arg)
+{
+    const uint32_t *distance = ((const World*)arg)->distanceToEnd;
+    uint32_t first = distance[*(const uint32_t*)a];
+    uint32_t second = distance[*(const uint32_t*)b];
+    return first < second ? -1 : first > second;
+}
+
+/*
+ * Spreads a shorter distance out from the specified room, whose own
+ * distance just went down, breadth first. Each room's distance only goes
+ * down once, so every room is queued at most once.
+ */
+static void RepairShorter(const World *world, uint32_t source)
+{
+    Changes *changes = world->changes;
+    uint32_t *distance = world->distanceToEnd;
+    uint32_t head = 0, tail = 0;
+    changes->queue[tail++] = source;
+    while(head < tail)
+    {
+        uint32_t room = changes->queue[head++];
+        changes->repaired++;
+        uint64_t door;
+        for(door = world->offsets[room]; door < world->offsets[room + 1]; door++)
+        {
+            uint32_t next = world->connections[door];
+            if(CanPass(world, room, door) && distance[room] + 1 < distance[next])
+            {
+                distance[next] = distance[room] + 1;
+                changes->queue[tail++] = next;
+            }
+        }
+    }
+}
+
+/*
+ * Repairs distances after the specified room may have lost its last
+ * shortest route, because a door of its locked or it closed.
+ *
+ * The rooms that lost every shortest route are found first: the room
+ * itself, then breadth first every room one step further out all of whose
+ * shortest routes ran through rooms already found. Going a level at a time
+ * means a room's every route one step closer has been looked at by the
+ * time it is. Each of those rooms then gets the best distance its
+ * unaffected neighbors offer, and the affected rooms are settled in order
+ * of distance like a breadth-first search started from all of them at
+ * once: the ones with an offer sorted, merged with a queue of the ones
+ * they improve.
+ */
+static void RepairLonger(const World *world, uint32_t seed)
+{
+    Changes *changes = world->changes;
+    uint32_t *distance = world->distanceToEnd;
+    if(distance[seed] == NO_PATH || HasSupport(world, seed))
+    {
+        return;
+    }
+
+    uint32_t count = 0;
+    SetBit(changes->affected, seed);
+    changes->rooms[count++] = seed;
+    uint32_t i;
+    for(i = 0; i < count; i++)
+    {
+        uint32_t room = changes->rooms[i];
+        uint32_t degree;
+        const uint32_t *neighbors = GetNeighbors(world, room, &degree);
+        uint32_t j;
+        for(j = 0; j < degree; j++)
+        {
+            uint32_t next = neighbors[j];
+            if(next < world->numRooms && !TestBit(changes->affected, next) &&
+               distance[next] == distance[room] + 1 && !HasSupport(world, next))
+            {
+                SetBit(changes->affected, next);
+                changes->rooms[count++] = next;
+            }
+        }
+    }
+
+    /* Best offer from the rest of the world */
+    for(i = 0; i < count; i++)
+    {
+        uint32_t room = changes->rooms[i];
+        uint32_t best = NO_PATH;
+        uint64_t door;
+        for(door = world->offsets[room]; door < world->offsets[room + 1]; door++)
+        {
+            uint32_t next = world->connections[door];
+            if(CanPass(world, room, door) && !TestBit(changes->affected, next) &&
+               distance[next] != NO_PATH && distance[next] + 1 < best)
+            {
+                best = distance[next] + 1;
+            }
+        }
+        distance[room] = best;
+    }
+    qsort_r(changes->rooms, count, sizeof(uint32_t), CompareDistances, (void*)world);
+
+    /* Settle the closest first, taking from whichever list is closer */
+    uint32_t next = 0;
+    uint32_t head = 0, tail = 0;
+    while(next < count || head < tail)
+    {
+        uint32_t room;
+        if(head == tail || (next < count && distance[changes->rooms[next]] <= distance[changes->queue[head]]))
+        {
+            room = changes->rooms[next++];
+        }
+        else
+        {
+            room = changes->queue[head++];
+        }
+        if(!TestBit(changes->affected, room))
+        {
+            continue;               // Already settled from the other list
+        }
+        if(distance[room] == NO_PATH)
+        {
+            break;                  // What is left can't reach the end any more
+        }
+        ClearBit(changes->affected, room);
+        changes->repaired++;
+
+        uint64_t door;
+        for(door = world->offsets[room]; door < world->offsets[room + 1]; door++)
+        {
+            uint32_t neighbor = world->connections[door];
+            if(CanPass(world, room, door) && TestBit(changes->affected, neighbor) &&
+               distance[room] + 1 < distance[neighbor])
+            {
+                distance[neighbor] = distance[room] + 1;
+                changes->queue[tail++] = neighbor;
+            }
+        }
+    }
+
+    for(i = 0; i < count; i++)
+    {
+        ClearBit(changes->affected, changes->rooms[i]);
+    }
+}
+
+/*
+ * Sets up the changes of the specified world, which starts with every
+ * door unlocked and every room open. Its distances must have been
+ * computed. Returns false if memory runs out.
+ */
+bool MakeWorldLive(World *world)
+{
+    if(world->distanceToEnd == NULL)
+    {
+        return false;
+    }
+
+    uint64_t roomWords = (world->numRooms + 63) / 64;
+    uint64_t doorWords = (world->offsets[world->numRooms] + 63) / 64;
+    Changes *changes = (Changes*)calloc(1, sizeof(Changes));
+    if(changes == NULL)
+    {
+        return false;
+    }
+    changes->lockedDoors = (uint64_t*)calloc(doorWords, sizeof(uint64_t));
+    changes->closedRooms = (uint64_t*)calloc(roomWords, sizeof(uint64_t));
+    changes->affected = (uint64_t*)calloc(roomWords, sizeof(uint64_t));
+    changes->rooms = (uint32_t*)malloc(world->numRooms * sizeof(uint32_t));
+    changes->queue = (uint32_t*)malloc(world->numRooms * sizeof(uint32_t));
+    world->changes = changes;
+    if(changes->lockedDoors == NULL || changes->closedRooms == NULL || changes->affected == NULL ||
+       changes->rooms == NULL || changes->queue == NULL)
+    {
+        FreeLiveWorld(world);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Releases the changes of the specified world, leaving it as it was
+ * built. Its distances stay as they are.
+ */
+void FreeLiveWorld(World *world)
+{
+    Changes *changes = world->changes;
+    if(changes == NULL)
+    {
+        return;
+    }
+
+    free(changes->lockedDoors);
+    free(changes->closedRooms);
+    free(changes->affected);
+    free(changes->rooms);
+    free(changes->queue);
+    free(changes);
+    world->changes = NULL;
+}
+
+/*
+ * Determines if 'from' has a door to 'to' that can be walked through now.
+ * In a world that never changes that is any connection.
+ */
+bool IsDoorOpen(const World *world, uint32_t from, uint32_t to)
+{
+    if(world->changes == NULL)
+    {
+        return IsConnected(world, from, to);
+    }
+
+    uint64_t door = FindDoor(world, from, to);
+    return door != UINT64_MAX && CanPass(world, from, door);
+}
+
+/*
+ * Determines if the door between 'from' and 'to' is locked.
+ */
+bool IsDoorLocked(const World *world, uint32_t from, uint32_t to)
+{
+    uint64_t door = world->changes != NULL ? FindDoor(world, from, to) : UINT64_MAX;
+    return door != UINT64_MAX && TestBit(world->changes->lockedDoors, door);
+}
+
+/*
+ * Determines if the specified room has been closed.
+ */
+bool IsRoomClosed(const World *world, uint32_t room)
+{
+    return world->changes != NULL && TestBit(world->changes->closedRooms, room);
+}
+
+/*
+ * Locks the door between 'from' and 'to' from both sides, and repairs
+ * the distances of the rooms that used it. Returns false if there is no
+ * such door or it is already locked.
+ */
+bool LockDoor(const World *world, uint32_t from, uint32_t to)
+{
+    uint64_t there = FindDoor(world, from, to);
+    uint64_t back = FindDoor(world, to, from);
+    if(there == UINT64_MAX || back == UINT64_MAX || TestBit(world->changes->lockedDoors, there))
+    {
+        return false;
+    }
+
+    SetBit(world->changes->lockedDoors, there);
+    SetBit(world->changes->lockedDoors, back);
+
+    /* Only the room further from the end can have been using it */
+    const uint32_t *distance = world->distanceToEnd;
+    RepairLonger(world, distance[from] > distance[to] ? from : to);
+    return true;
+}
+
+/*
+ * Unlocks the door between 'from' and 'to' again, and spreads the shorter
+ * routes through it. Returns false if there is no such door or it isn't
+ * locked.
+ */
+bool UnlockDoor(const World *world, uint32_t from, uint32_t to)
+{
+    uint64_t there = FindDoor(world, from, to);
+    uint64_t back = FindDoor(world, to, from);
+    if(there == UINT64_MAX || back == UINT64_MAX || !TestBit(world->changes->lockedDoors, there))
+    {
+        return false;
+    }
+
+    ClearBit(world->changes->lockedDoors, there);
+    ClearBit(world->changes->lockedDoors, back);
+    if(!CanPass(world, from, there))
+    {
+        return true;                // One of its rooms is closed, so nothing can go through it yet
+    }
+
+    uint32_t *distance = world->distanceToEnd;
+    if(distance[to] != NO_PATH && distance[to] + 1 < distance[from])
+    {
+        distance[from] = distance[to] + 1;
+        RepairShorter(world, from);
+    }
+    else if(distance[from] != NO_PATH && distance[from] + 1 < distance[to])
+    {
+        distance[to] = distance[from] + 1;
+        RepairShorter(world, to);
+    }
+    return true;
+}
+
+/*
+ * Closes the specified room, so no door to or from it can be walked
+ * through, and repairs the distances of the rooms that went through it.
+ * The start and end can't be closed. Returns false if it can't be closed
+ * or already is.
+ */
+bool CloseRoom(const World *world, uint32_t room)
+{
+    if(room >= world->numRooms || room == world->startRoom || room == world->endRoom ||
+       TestBit(world->changes->closedRooms, room))
+    {
+        return false;
+    }
+
+    SetBit(world->changes->closedRooms, room);
+    RepairLonger(world, room);
+    world->distanceToEnd[room] = NO_PATH;
+    return true;
+}
+
+/*
+ * Opens a closed room again, and spreads the shorter routes through it.
+ * Returns false if the room isn't closed.
+ */
+bool OpenRoom(const World *world, uint32_t room)
+{
+    if(room >= world->numRooms || !TestBit(world->changes->closedRooms, room))
+    {
+        return false;
+    }
+
+    ClearBit(world->changes->closedRooms, room);
+    uint32_t *distance = world->distanceToEnd;
+    uint32_t best = NO_PATH;
+    uint64_t door;
+    for(door = world->offsets[room]; door < world->offsets[room + 1]; door++)
+    {
+        uint32_t next = world->connections[door];
+        if(CanPass(world, room, door) && distance[next] != NO_PATH && distance[next] + 1 < best)
+        {
+            best = distance[next] + 1;
+        }
+    }
+
+    if(best < distance[room])
+    {
+        distance[room] = best;
+        RepairShorter(world, room);
+    }
+    return true;
+}
@@ -0,0 +1,49 @@
+#ifndef WALTSARA_LIVE_H
+#define WALTSARA_LIVE_H
+
+/*
+ * Live worlds, whose doors lock and unlock and whose rooms close and open
+ * again while they are played.
+ *
+ * The world image never changes; a live world keeps its changes next to
+ * it as one bit per entry of connections for locked doors, locked in both
+ * directions, and one bit per room for closed rooms. A door can be walked
+ * through while it is unlocked and both its rooms are open.
+ *
+ * The distance to the end from every room is kept up to date as the world
+ * changes, so hints and reachability cost what they do in a world that
+ * never changes. Nothing is recomputed over the whole world: a door that
+ * opens spreads shorter distances out from its rooms breadth first, and a
+ * door that locks or a room that closes first finds the rooms that lost
+ * every shortest route, then works out their distances again from the
+ * rooms around them. Either way the work is bounded by the rooms whose
+ * distance actually changes.
+ *
+ * Changes go through a const World like the prompt cache does, and are
+ * not thread-safe: a live world has one thread playing it at a time.
+ */
+
+#include "waltsara.world.h"
+
+/* Locked doors and closed rooms of a live world, and scratch space for repairs */
+typedef struct Changes
+{
+    uint64_t *lockedDoors;              // Bit per entry of connections
+    uint64_t *closedRooms;              // Bit per room
+    uint64_t *affected;                 // Rooms a repair is working on
+    uint32_t *rooms;                    // Affected rooms, in the order they were found
+    uint32_t *queue;                    // Rooms whose distance went down, breadth first
+    uint64_t  repaired;                 // Rooms whose distance a repair has revisited so far
+} Changes;
+
+bool MakeWorldLive(World *w);           // Sets up the changes of a world whose distances are computed
+void FreeLiveWorld(World *w);           // Releases the changes
+bool IsDoorOpen(const World *w, uint32_t from, uint32_t to);   // Whether from has an unlocked door to open room to
+bool IsDoorLocked(const World *w, uint32_t from, uint32_t to); // Whether the door between two rooms is locked
+bool IsRoomClosed(const World *w, uint32_t room);              // Whether a room has been closed
+bool LockDoor(const World *w, uint32_t from, uint32_t to);     // Locks the door between two rooms
+bool UnlockDoor(const World *w, uint32_t from, uint32_t to);   // Unlocks it again
+bool CloseRoom(const World *w, uint32_t room);                 // Takes a room out of the world
+bool OpenRoom(const World *w, uint32_t room);                  // Puts a closed room back
+
+#endif
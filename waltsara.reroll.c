@@ -0,0 +1,452 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "waltsara.live.h"
+#include "waltsara.reroll.h"
+
+#define REROLL_PICKS 64                 // Random connections tried as the partner of a swap
+#define REROLL_ATTEMPTS 8               // Rerolls undone for cutting the world up before giving up
+#define NO_ROOM UINT32_MAX
+
+/* Bitset helpers, for the locked doors of a live world */
+static bool TestBit(const uint64_t *bits, uint64_t i)
+{
+    return (bits[i / 64] & (1ULL << (i % 64))) != 0;
+}
+
+static void PutBit(uint64_t *bits, uint64_t i, bool value)
+{
+    bits[i / 64] = (bits[i / 64] & ~(1ULL << (i % 64))) | ((uint64_t)value << (i % 64));
+}
+
+/*
+ * Next random number below bound, from the splitmix64 stream in r.
+ */
+static uint64_t RandomBelow(Reroll *reroll, uint64_t bound)
+{
+    uint64_t z = (reroll->rng += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return bound > 0 ? z % bound : 0;
+}
+
+/*
+ * Returns the entry of connections that is from's door to 'to', or
+ * UINT64_MAX if there is none.
+ */
+static uint64_t FindEntry(const World *world, uint32_t from, uint32_t to)
+{
+    uint64_t low = world->offsets[from];
+    uint64_t high = world->offsets[from + 1];
+    while(low < high)
+    {
+        uint64_t mid = low + (high - low) / 2;
+        if(world->connections[mid] < to)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low < world->offsets[from + 1] && world->connections[low] == to ? low : UINT64_MAX;
+}
+
+/*
+ * Returns the room whose connections include the specified entry.
+ */
+static uint32_t FindEntryRoom(const World *world, uint64_t entry)
+{
+    uint32_t low = 0;
+    uint32_t high = world->numRooms - 1;
+    while(low < high)
+    {
+        uint32_t mid = low + (high - low + 1) / 2;
+        if(world->offsets[mid] <= entry)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+/*
+ * Whether the door between two rooms is locked in a live world.
+ */
+static bool IsLocked(const World *world, uint32_t from, uint32_t to)
+{
+    return world->changes != NULL && IsDoorLocked(world, from, to);
+}
+
+/*
+ * Replaces 'before' with 'after' among room's connections, moving the
+ * ones in between along so they stay sorted. A live world's lock bits
+ * move with their entries.
+ */
+static void ReplaceConnection(World *world, uint32_t room, uint32_t before, uint32_t after)
+{
+    uint32_t *connections = (uint32_t*)world->connections;
+    uint64_t *locked = world->changes != NULL ? world->changes->lockedDoors : NULL;
+    uint64_t first = world->offsets[room];
+    uint64_t last = world->offsets[room + 1];
+    uint64_t i = FindEntry(world, room, before);
+    bool lock = locked != NULL && TestBit(locked, i);
+
+    while(i + 1 < last && connections[i + 1] < after)
+    {
+        connections[i] = connections[i + 1];
+        if(locked != NULL)
+        {
+            PutBit(locked, i, TestBit(locked, i + 1));
+        }
+        i++;
+    }
+    while(i > first && connections[i - 1] > after)
+    {
+        connections[i] = connections[i - 1];
+        if(locked != NULL)
+        {
+            PutBit(locked, i, TestBit(locked, i - 1));
+        }
+        i--;
+    }
+    connections[i] = after;
+    if(locked != NULL)
+    {
+        PutBit(locked, i, lock);
+    }
+
+    /* Prompts show the new connection where the old one was listed */
+    for(i = first; world->listedOrder != NULL && i < last; i++)
+    {
+        if(world->listedOrder[i] == before)
+        {
+            world->listedOrder[i] = after;
+            break;
+        }
+    }
+}
+
+/*
+ * Replaces a-b and c-d with a-c and b-d. In a live world the old doors
+ * are locked first and the new ones, which take their lock bits, then
+ * unlocked, so the distances follow.
+ */
+static void ApplySwap(World *world, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+    if(world->changes != NULL)
+    {
+        LockDoor(world, a, b);
+        LockDoor(world, c, d);
+    }
+    ReplaceConnection(world, a, b, c);
+    ReplaceConnection(world, b, a, d);
+    ReplaceConnection(world, c, d, a);
+    ReplaceConnection(world, d, c, b);
+    if(world->changes != NULL)
+    {
+        UnlockDoor(world, a, c);
+        UnlockDoor(world, b, d);
+    }
+}
+
+/*
+ * Adds a room to the rooms the reroll touched, unless it is there already.
+ */
+static bool TouchRoom(Reroll *reroll, uint32_t room)
+{
+    if(reroll->marked[room] == reroll->stamp)
+    {
+        return true;
+    }
+    if(reroll->numTouched == reroll->touchedCapacity)
+    {
+        uint32_t capacity = reroll->touchedCapacity ? 2 * reroll->touchedCapacity : 64;
+        uint32_t *touched = (uint32_t*)realloc(reroll->touched, capacity * sizeof(uint32_t));
+        if(touched == NULL)
+        {
+            return false;
+        }
+        reroll->touched = touched;
+        Search *searches = (Search*)realloc(reroll->searches, capacity * sizeof(Search));
+        if(searches == NULL)
+        {
+            return false;
+        }
+        reroll->searches = searches;
+        reroll->touchedCapacity = capacity;
+    }
+    reroll->marked[room] = reroll->stamp;
+    reroll->touched[reroll->numTouched++] = room;
+    return true;
+}
+
+/*
+ * Swaps the connection between room and x with a random one elsewhere in
+ * the world, and logs the swap. Returns false if no partner turned up in
+ * REROLL_PICKS picks, which leaves the connection as it is.
+ */
+static bool SwapAway(Reroll *reroll, World *world, uint32_t room, uint32_t x)
+{
+    uint64_t numConnections = world->offsets[world->numRooms];
+    int pick;
+    for(pick = 0; pick < REROLL_PICKS; pick++)
+    {
+        uint64_t entry = RandomBelow(reroll, numConnections);
+        uint32_t u = FindEntryRoom(world, entry);
+        uint32_t v = world->connections[entry];
+        if(RandomBelow(reroll, 2))
+        {
+            uint32_t t = u;
+            u = v;
+            v = t;
+        }
+        if(u >= world->numRooms || v >= world->numRooms || u == room || u == x || v == room || v == x ||
+           IsConnected(world, room, u) || IsConnected(world, x, v) || IsLocked(world, u, v))
+        {
+            continue;
+        }
+
+        if(reroll->numSwaps == reroll->swapCapacity)
+        {
+            uint32_t capacity = reroll->swapCapacity ? 2 * reroll->swapCapacity : 64;
+            Swap *swaps = (Swap*)realloc(reroll->swaps, capacity * sizeof(Swap));
+            if(swaps == NULL)
+            {
+                return false;
+            }
+            reroll->swaps = swaps;
+            reroll->swapCapacity = capacity;
+        }
+        if(!TouchRoom(reroll, room) || !TouchRoom(reroll, x) || !TouchRoom(reroll, u) || !TouchRoom(reroll, v))
+        {
+            return false;
+        }
+
+        ApplySwap(world, room, x, u, v);
+        Swap *swap = &reroll->swaps[reroll->numSwaps++];
+        swap->a = room;
+        swap->b = x;
+        swap->c = u;
+        swap->d = v;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Returns the search a search has joined, following joins all the way.
+ */
+static uint32_t FindSearch(Search *searches, uint32_t s)
+{
+    while(searches[s].parent != s)
+    {
+        searches[s].parent = searches[searches[s].parent].parent;
+        s = searches[s].parent;
+    }
+    return s;
+}
+
+/*
+ * Determines if the touched rooms can all still reach each other, which
+ * in a world that was connected before means it still is. Searches out
+ * from every touched room at once, see waltsara.reroll.h.
+ */
+static bool IsStillConnected(Reroll *reroll, const World *world)
+{
+    Search *searches = reroll->searches;
+    uint32_t stamp = reroll->stamp;
+    uint32_t numSets = reroll->numTouched;
+    uint32_t s;
+    for(s = 0; s < reroll->numTouched; s++)
+    {
+        uint32_t room = reroll->touched[s];
+        searches[s].head = room;
+        searches[s].tail = room;
+        searches[s].parent = s;
+        searches[s].running = 1;
+        reroll->reached[room] = stamp;
+        reroll->owner[room] = s;
+        reroll->next[room] = NO_ROOM;
+    }
+
+    bool searching = true;
+    while(numSets > 1 && searching)
+    {
+        searching = false;
+        for(s = 0; s < reroll->numTouched && numSets > 1; s++)
+        {
+            uint32_t room = searches[s].head;
+            if(room == NO_ROOM)
+            {
+                continue;
+            }
+            searching = true;
+            searches[s].head = reroll->next[room];
+            reroll->searched++;
+
+            uint32_t degree;
+            const uint32_t *neighbors = GetNeighbors(world, room, &degree);
+            uint32_t i;
+            for(i = 0; i < degree; i++)
+            {
+                uint32_t neighbor = neighbors[i];
+                if(neighbor >= world->numRooms)
+                {
+                    continue;
+                }
+                if(reroll->reached[neighbor] != stamp)
+                {
+                    reroll->reached[neighbor] = stamp;
+                    reroll->owner[neighbor] = s;
+                    reroll->next[neighbor] = NO_ROOM;
+                    if(searches[s].head == NO_ROOM)
+                    {
+                        searches[s].head = neighbor;
+                    }
+                    else
+                    {
+                        reroll->next[searches[s].tail] = neighbor;
+                    }
+                    searches[s].tail = neighbor;
+                    continue;
+                }
+
+                uint32_t mine = FindSearch(searches, s);
+                uint32_t theirs = FindSearch(searches, reroll->owner[neighbor]);
+                if(mine != theirs)
+                {
+                    searches[theirs].parent = mine;
+                    searches[mine].running += searches[theirs].running;
+                    numSets--;
+                }
+            }
+
+            /* A search that runs out before meeting the others found a piece on its own */
+            if(searches[s].head == NO_ROOM && --searches[FindSearch(searches, s)].running == 0 && numSets > 1)
+            {
+                return false;
+            }
+        }
+    }
+    return numSets == 1;
+}
+
+/*
+ * Sets up scratch space for rerolling rooms of the specified world, with
+ * the specified seed. The per room arrays are allocated zeroed, so pages
+ * no reroll reaches are never touched. Returns false if memory runs out.
+ */
+bool InitializeReroll(Reroll *reroll, const World *world, uint64_t seed)
+{
+    memset(reroll, 0, sizeof(Reroll));
+    reroll->numRooms = world->numRooms;
+    reroll->rng = seed;
+    reroll->marked = (uint32_t*)calloc(world->numRooms, sizeof(uint32_t));
+    reroll->reached = (uint32_t*)calloc(world->numRooms, sizeof(uint32_t));
+    reroll->owner = (uint32_t*)calloc(world->numRooms, sizeof(uint32_t));
+    reroll->next = (uint32_t*)calloc(world->numRooms, sizeof(uint32_t));
+    if(reroll->marked == NULL || reroll->reached == NULL || reroll->owner == NULL || reroll->next == NULL)
+    {
+        FreeReroll(reroll);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Releases the scratch space of a reroll.
+ */
+void FreeReroll(Reroll *reroll)
+{
+    free(reroll->marked);
+    free(reroll->reached);
+    free(reroll->owner);
+    free(reroll->next);
+    free(reroll->touched);
+    free(reroll->searches);
+    free(reroll->swaps);
+    free(reroll->neighbors);
+    memset(reroll, 0, sizeof(Reroll));
+}
+
+/*
+ * Gives each of the specified rooms new random connections, as many as it
+ * had, by swapping every unlocked one with a connection picked from the
+ * whole world. The world image must be writable. Afterwards touched lists
+ * the rooms whose connections changed. Returns false, with the world as it
+ * was, if the swaps kept cutting the world up or memory ran out.
+ */
+bool RerollRooms(Reroll *reroll, World *world, const uint32_t *rooms, uint32_t count)
+{
+    int attempt;
+    for(attempt = 0; attempt < REROLL_ATTEMPTS; attempt++)
+    {
+        reroll->stamp++;
+        reroll->numTouched = 0;
+        reroll->numSwaps = 0;
+        bool failed = false;
+
+        uint32_t i;
+        for(i = 0; i < count && !failed; i++)
+        {
+            uint32_t room = rooms[i];
+            if(room >= world->numRooms)
+            {
+                continue;
+            }
+
+            /* Swapping changes the room's connections, so go through a copy */
+            uint32_t degree;
+            const uint32_t *neighbors = GetNeighbors(world, room, &degree);
+            if(degree > reroll->neighborCapacity)
+            {
+                uint32_t *copy = (uint32_t*)realloc(reroll->neighbors, degree * sizeof(uint32_t));
+                if(copy == NULL)
+                {
+                    failed = true;
+                    break;
+                }
+                reroll->neighbors = copy;
+                reroll->neighborCapacity = degree;
+            }
+            memcpy(reroll->neighbors, neighbors, degree * sizeof(uint32_t));
+
+            uint32_t j;
+            for(j = 0; j < degree; j++)
+            {
+                uint32_t x = reroll->neighbors[j];
+                if(x < world->numRooms && IsConnected(world, room, x) && !IsLocked(world, room, x))
+                {
+                    SwapAway(reroll, world, room, x);
+                }
+            }
+        }
+
+        if(!failed && IsStillConnected(reroll, world))
+        {
+            return true;
+        }
+
+        /* Undo, last swap first */
+        while(reroll->numSwaps > 0)
+        {
+            const Swap *swap = &reroll->swaps[--reroll->numSwaps];
+            ApplySwap(world, swap->a, swap->c, swap->b, swap->d);
+        }
+        reroll->numTouched = 0;
+        if(failed)
+        {
+            return false;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,74 @@
+#ifndef WALTSARA_REROLL_H
+#define WALTSARA_REROLL_H
+
+/*
+ * Rerolling rooms of a world that already exists: the connections of the
+ * rooms go to new random partners without the world being built again.
+ *
+ * Each connection r-x of a rerolled room is swapped with a connection u-v
+ * picked at random from the whole world, leaving r-u and x-v. Every room
+ * keeps as many connections as it had, so the degree limits still hold,
+ * the offsets of the world image stay where they are, and only the
+ * connection lists of the rooms a swap touched change. A world file is
+ * patched in place a few bytes per room, and the locked doors of a live
+ * world, a bit per entry of connections, stay where they are.
+ *
+ * The world was connected before, so every room can still reach one of
+ * the rooms the swaps touched, and the world is connected exactly when
+ * those rooms reach each other. That is checked by searching out from all
+ * of them at once, a room per search in turn, joining searches that meet.
+ * It stops when every search has met, or when one runs out of rooms
+ * first, having found a piece that got cut off; in a world of random
+ * connections the searches meet after a few hundred rooms each, however
+ * big the world. Swaps that would cut the world up are undone and made
+ * again with other partners.
+ *
+ * In a live world only unlocked doors are swapped, and each swap locks the
+ * old doors and unlocks the new ones through waltsara.live.h, so distances
+ * to the end are repaired as it goes.
+ */
+
+#include "waltsara.world.h"
+
+/* One swap, a-b and c-d made into a-c and b-d */
+typedef struct
+{
+    uint32_t a, b, c, d;
+} Swap;
+
+/* One of the searches checking that the world is still connected */
+typedef struct
+{
+    uint32_t head;                      // Next room to search from, UINT32_MAX once it has run out
+    uint32_t tail;
+    uint32_t parent;                    // Search it has met and joined, itself if none
+    uint32_t running;                   // Searches joined to this one that have rooms left, if it is their root
+} Search;
+
+/* Scratch space for rerolling rooms of one world, kept from one reroll to the next */
+typedef struct
+{
+    uint32_t  numRooms;
+    uint32_t *marked;                   // Per room: stamp of the reroll that last touched it
+    uint32_t *reached;                  // Per room: stamp of the check that last reached it
+    uint32_t *owner;                    // Per room: search that reached it
+    uint32_t *next;                     // Per room: next room in its search's queue
+    uint32_t  stamp;
+    uint32_t *touched;                  // Rooms whose connections changed, each once
+    uint32_t  numTouched;
+    uint32_t  touchedCapacity;
+    Search   *searches;                 // One per touched room
+    Swap     *swaps;                    // Swaps of the reroll, to undo them
+    uint32_t  numSwaps;
+    uint32_t  swapCapacity;
+    uint32_t *neighbors;                // Connections of the room being rerolled, as they were
+    uint32_t  neighborCapacity;
+    uint64_t  rng;                      // splitmix64 state
+    uint64_t  searched;                 // Rooms the checks have searched from, all told
+} Reroll;
+
+bool InitializeReroll(Reroll *r, const World *w, uint64_t seed);   // Scratch space for a world
+void FreeReroll(Reroll *r);
+bool RerollRooms(Reroll *r, World *w, const uint32_t *rooms, uint32_t count);  // Gives the rooms new connections
+
+#endif
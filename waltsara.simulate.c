@@ -0,0 +1,544 @@
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "waltsara.world.h"
+
+/* Helpful constants */
+#define LANES 256                               // Agents a thread walks side by side
+#define AGENT_CHUNK 4096                        // Agents a thread claims at a time
+#define SUB_BUCKETS 16                          // Histogram buckets per power of two, about 6% apart
+#define NUM_BUCKETS (64 * SUB_BUCKETS)
+#define DEFAULT_AGENTS 1000000
+#define DEFAULT_SEED 1
+#define DEFAULT_CAP_ROOMS 20                    // Steps an agent may take per room of the world unless -m says
+
+/* How an agent picks the next room */
+typedef enum
+{
+    POLICY_RANDOM,                      // Any connection, uniformly
+    POLICY_NO_BACKTRACK                 // Any connection but the one it came through, unless it is the only one
+} Policy;
+
+/*
+ * Agents being walked, one array per field. A step is a pass over each
+ * array in turn with no branches but the backtrack check, so the compiler
+ * can vectorize the random numbers and the choice of connection, leaving
+ * only the loads from the world to be done one lane at a time.
+ */
+typedef struct
+{
+    uint32_t room[LANES];
+    uint32_t previous[LANES];
+    uint64_t steps[LANES];
+    uint64_t rng[LANES];                // Each agent's own splitmix64 stream
+    uint32_t choice[LANES];             // Connection picked this step
+    uint32_t spare[LANES];              // Other half of this step's random number, for picking again
+    bool     active[LANES];             // Lane holds an agent still walking
+} Agents;
+
+/* What one thread's agents did */
+typedef struct
+{
+    uint64_t histogram[NUM_BUCKETS];    // Steps of every agent that reached the end
+    uint64_t finished;
+    uint64_t unfinished;                // Agents that gave up after maxSteps
+    uint64_t totalSteps;                // Every step taken, given up on or not
+    double   sum;                       // Steps of finished agents
+    double   sumSquares;
+    uint64_t max;
+} Tally;
+
+/* A simulation of one world shared out between threads */
+typedef struct
+{
+    const World *world;
+    Policy       policy;
+    uint64_t     seed;
+    uint64_t     numAgents;
+    uint64_t     maxSteps;
+    uint64_t     nextAgent;             // First agent of the next chunk a thread claims, atomically
+    Tally       *tallies;               // One per thread
+} Simulation;
+
+/* One simulation thread and the tally it counts into */
+typedef struct
+{
+    Simulation *simulation;
+    Tally      *tally;
+} Walker;
+
+/* Forward-declarations */
+bool SimulateWorld(const char *path, Simulation *s, int numThreads, uint64_t *steps);	// Walks every agent through one world and reports it
+void *RunAgents(void *walker);				// Body of one simulation thread
+void WalkAgents(Simulation *s, Tally *t, uint64_t first, uint64_t count);	// Walks a chunk of agents to the end
+void RecordSteps(Tally *t, uint64_t steps);		// Adds a finished agent to a tally
+int StepBucket(uint64_t steps);				// Histogram bucket of a number of steps
+uint64_t BucketStart(int bucket);			// Fewest steps that land in a bucket
+uint64_t FindPercentile(const Tally *t, double percent);	// Steps within which percent of the agents finished
+uint32_t FindPar(const World *w);			// Fewest steps from the start to the end
+uint64_t MixBits(uint64_t x);				// Scrambles 64 bits, the splitmix64 finalizer
+
+/* Command line options */
+static struct option longOptions[] = {
+    { "agents",    required_argument, NULL, 'a' },
+    { "threads",   required_argument, NULL, 'j' },
+    { "policy",    required_argument, NULL, 'p' },
+    { "seed",      required_argument, NULL, 's' },
+    { "max-steps", required_argument, NULL, 'm' },
+    { NULL, 0, NULL, 0 }
+};
+
+/*
+ * Profiles how hard worlds are by letting agents loose in them: every
+ * agent starts in the start room and picks connections at random until it
+ * reaches the end. One line per world reports the distribution of the
+ * steps they took next to par, and how many times par they took on
+ * average. Agents are seeded from their number, so results only depend
+ * on the seed and never on the thread count.
+ */
+int main(int argc, char** argv)
+{
+    Simulation simulation;
+    memset(&simulation, 0, sizeof(Simulation));
+    simulation.policy = POLICY_RANDOM;
+    simulation.seed = DEFAULT_SEED;
+    simulation.numAgents = DEFAULT_AGENTS;
+    uint64_t maxSteps = 0;
+    int numThreads = 0;
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "a:j:p:s:m:", longOptions, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 'a': simulation.numAgents = strtoull(optarg, NULL, 0); break;
+            case 'j': numThreads = atoi(optarg); break;
+            case 's': simulation.seed = strtoull(optarg, NULL, 0); break;
+            case 'm': maxSteps = strtoull(optarg, NULL, 0); break;
+            case 'p':
+                if(strcmp(optarg, "random") == 0)
+                {
+                    simulation.policy = POLICY_RANDOM;
+                    break;
+                }
+                if(strcmp(optarg, "no-backtrack") == 0)
+                {
+                    simulation.policy = POLICY_NO_BACKTRACK;
+                    break;
+                }
+                /* fall through */
+            default:
+                fprintf(stderr, "Usage: %s [-a agents] [-j threads] [-p random|no-backtrack] [-s seed]\n"
+                                "       [-m max-steps] world-file...\n", argv[0]);
+                return 1;
+        }
+    }
+    if(optind == argc || simulation.numAgents == 0)
+    {
+        fprintf(stderr, "Usage: %s [-a agents] [-j threads] [-p random|no-backtrack] [-s seed]\n"
+                        "       [-m max-steps] world-file...\n", argv[0]);
+        return 1;
+    }
+    if(numThreads < 1)
+    {
+        numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+        numThreads = numThreads < 1 ? 1 : numThreads;
+    }
+
+    simulation.tallies = (Tally*)malloc(numThreads * sizeof(Tally));
+    if(simulation.tallies == NULL)
+    {
+        perror("Failed to allocate the tallies.");
+        return 1;
+    }
+
+    struct timespec began, finished;
+    clock_gettime(CLOCK_MONOTONIC, &began);
+
+    /* One world after another, each with every thread */
+    uint64_t totalSteps = 0;
+    int failures = 0;
+    int i;
+    for(i = optind; i < argc; i++)
+    {
+        simulation.maxSteps = maxSteps;
+        uint64_t steps = 0;
+        if(!SimulateWorld(argv[i], &simulation, numThreads, &steps))
+        {
+            failures++;
+        }
+        totalSteps += steps;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (finished.tv_sec - began.tv_sec) + (finished.tv_nsec - began.tv_nsec) / 1e9;
+    printf("WORLDS: %d AGENT STEPS: %llu THREADS: %d SECONDS: %.3f STEPS/SEC: %.0f\n",
+           argc - optind - failures, (unsigned long long)totalSteps, numThreads, seconds,
+           seconds > 0 ? totalSteps / seconds : 0.0);
+
+    free(simulation.tallies);
+    return failures > 0 ? 1 : 0;
+}
+
+/*
+ * Maps the binary world at path, walks every agent through it on
+ * numThreads threads and prints a line about it. Adds the steps taken to
+ * steps. Returns false if the world can't be loaded or has no way to the
+ * end.
+ */
+bool SimulateWorld(const char *path, Simulation *simulation, int numThreads, uint64_t *steps)
+{
+    struct stat st;
+    World world;
+    if(stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        fprintf(stderr, "%s is a room directory; simulate worlds built with -f binary.\n", path);
+        return false;
+    }
+    if(!MapWorld(&world, path))
+    {
+        fprintf(stderr, "Unable to load world %s.\n", path);
+        return false;
+    }
+
+    uint32_t par = FindPar(&world);
+    if(par == NO_PATH)
+    {
+        fprintf(stderr, "%s has no way from the start to the end.\n", path);
+        FreeWorld(&world);
+        return false;
+    }
+
+    /* Agents pick among a room's connections without looking, so every room needs one */
+    uint32_t room;
+    for(room = 0; room < world.numRooms; room++)
+    {
+        if(GetDegree(&world, room) == 0)
+        {
+            fprintf(stderr, "%s has a room with no connections, %s.\n", path, GetRoomName(&world, room));
+            FreeWorld(&world);
+            return false;
+        }
+    }
+
+    /*
+     * A random walk on a world whose rooms have d connections reaches a
+     * given room in about numRooms * (d - 1) / (d - 2) steps on average,
+     * under twice the rooms for three or more, and the odds of taking k
+     * times that fall off like e^-k. Ten times over leaves all but a few
+     * agents in a hundred thousand finished, without the slowest few
+     * walking for hours.
+     */
+    if(simulation->maxSteps == 0)
+    {
+        simulation->maxSteps = DEFAULT_CAP_ROOMS * (uint64_t)world.numRooms + 1000;
+    }
+    simulation->world = &world;
+    simulation->nextAgent = 0;
+    memset(simulation->tallies, 0, numThreads * sizeof(Tally));
+
+    pthread_t *threads = (pthread_t*)malloc(numThreads * sizeof(pthread_t));
+    Walker *walkers = (Walker*)malloc(numThreads * sizeof(Walker));
+    int started = 0;
+    int i;
+    for(i = 0; walkers != NULL && i < numThreads; i++)
+    {
+        walkers[i].simulation = simulation;
+        walkers[i].tally = &simulation->tallies[i];
+    }
+    for(i = 1; threads != NULL && walkers != NULL && i < numThreads; i++)
+    {
+        if(pthread_create(&threads[started], NULL, RunAgents, &walkers[i]) == 0)
+        {
+            started++;
+        }
+    }
+
+    /* The main thread walks agents too, with the first tally */
+    Walker self;
+    self.simulation = simulation;
+    self.tally = &simulation->tallies[0];
+    RunAgents(&self);
+    for(i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(walkers);
+
+    /* Add every thread's numbers into the first */
+    Tally *total = &simulation->tallies[0];
+    for(i = 1; i < numThreads; i++)
+    {
+        const Tally *tally = &simulation->tallies[i];
+        int bucket;
+        for(bucket = 0; bucket < NUM_BUCKETS; bucket++)
+        {
+            total->histogram[bucket] += tally->histogram[bucket];
+        }
+        total->finished += tally->finished;
+        total->unfinished += tally->unfinished;
+        total->totalSteps += tally->totalSteps;
+        total->sum += tally->sum;
+        total->sumSquares += tally->sumSquares;
+        total->max = tally->max > total->max ? tally->max : total->max;
+    }
+
+    double mean = total->finished > 0 ? total->sum / total->finished : 0;
+    double variance = total->finished > 0 ? total->sumSquares / total->finished - mean * mean : 0;
+    printf("WORLD: %s ROOMS: %u PAR: %u AGENTS: %llu CAP: %llu FINISHED: %llu MEAN: %.1f STDDEV: %.1f "
+           "P50: %llu P90: %llu P99: %llu MAX: %llu SCORE: %.2f\n",
+           path, world.numRooms, par, (unsigned long long)simulation->numAgents,
+           (unsigned long long)simulation->maxSteps, (unsigned long long)total->finished,
+           mean, variance > 0 ? sqrt(variance) : 0.0,
+           (unsigned long long)FindPercentile(total, 50), (unsigned long long)FindPercentile(total, 90),
+           (unsigned long long)FindPercentile(total, 99), (unsigned long long)total->max,
+           par > 0 ? mean / par : 0.0);
+
+    *steps = total->totalSteps;
+    simulation->world = NULL;
+    FreeWorld(&world);
+    return true;
+}
+
+/*
+ * Body of one simulation thread. Claims agents a chunk at a time until
+ * they are all taken.
+ */
+void *RunAgents(void *arg)
+{
+    Walker *walker = (Walker*)arg;
+    Simulation *simulation = walker->simulation;
+    Tally *tally = walker->tally;
+
+    uint64_t first;
+    while((first = __atomic_fetch_add(&simulation->nextAgent, AGENT_CHUNK, __ATOMIC_RELAXED)) < simulation->numAgents)
+    {
+        uint64_t count = simulation->numAgents - first < AGENT_CHUNK ? simulation->numAgents - first : AGENT_CHUNK;
+        WalkAgents(simulation, tally, first, count);
+    }
+    return NULL;
+}
+
+/*
+ * Walks agents first up to first + count to the end, LANES at a time.
+ * A lane whose agent finishes or gives up takes the next agent straight
+ * away, so every lane keeps walking until the chunk runs out.
+ */
+void WalkAgents(Simulation *simulation, Tally *tally, uint64_t first, uint64_t count)
+{
+    const World *world = simulation->world;
+    const uint64_t *offsets = world->offsets;
+    const uint32_t *connections = world->connections;
+    uint32_t start = GetStartRoom(world);
+    uint32_t end = GetEndRoom(world);
+    bool noBacktrack = simulation->policy == POLICY_NO_BACKTRACK;
+
+    Agents agents;
+    uint64_t next = first;
+    int numActive = 0;
+    int lane;
+    for(lane = 0; lane < LANES; lane++)
+    {
+        agents.active[lane] = next < first + count;
+        agents.room[lane] = start;
+        agents.previous[lane] = start;
+        agents.steps[lane] = 0;
+        agents.rng[lane] = MixBits(simulation->seed ^ MixBits(next + 1));
+        numActive += agents.active[lane];
+        next += agents.active[lane];
+    }
+
+    while(numActive > 0)
+    {
+        /* Random numbers and the connection each one picks */
+        for(lane = 0; lane < LANES; lane++)
+        {
+            uint32_t room = agents.room[lane];
+            uint32_t degree = offsets[room + 1] - offsets[room];
+            uint64_t random = MixBits(agents.rng[lane] += 0x9E3779B97F4A7C15ULL);
+            agents.choice[lane] = ((random & 0xFFFFFFFF) * degree) >> 32;
+            agents.spare[lane] = random >> 32;
+        }
+
+        /* Take them, picking again among the others if that goes back the way we came */
+        for(lane = 0; lane < LANES; lane++)
+        {
+            uint32_t room = agents.room[lane];
+            uint64_t door = offsets[room];
+            uint32_t degree = offsets[room + 1] - door;
+            uint32_t target = connections[door + agents.choice[lane]];
+            if(noBacktrack && target == agents.previous[lane] && degree > 1)
+            {
+                uint32_t choice = agents.choice[lane] + 1 + (((uint64_t)agents.spare[lane] * (degree - 1)) >> 32);
+                target = connections[door + (choice >= degree ? choice - degree : choice)];
+            }
+            agents.previous[lane] = room;
+            agents.room[lane] = target;
+            agents.steps[lane]++;
+        }
+
+        /* Agents that got there, or gave up, make way for the next */
+        for(lane = 0; lane < LANES; lane++)
+        {
+            if(!agents.active[lane] || (agents.room[lane] != end && agents.steps[lane] < simulation->maxSteps))
+            {
+                continue;
+            }
+
+            tally->totalSteps += agents.steps[lane];
+            if(agents.room[lane] == end)
+            {
+                RecordSteps(tally, agents.steps[lane]);
+            }
+            else
+            {
+                tally->unfinished++;
+            }
+
+            agents.room[lane] = start;
+            agents.previous[lane] = start;
+            agents.steps[lane] = 0;
+            if(next < first + count)
+            {
+                agents.rng[lane] = MixBits(simulation->seed ^ MixBits(next + 1));
+                next++;
+            }
+            else
+            {
+                agents.active[lane] = false;
+                numActive--;
+            }
+        }
+    }
+}
+
+/*
+ * Adds an agent that reached the end in the specified number of steps.
+ */
+void RecordSteps(Tally *tally, uint64_t steps)
+{
+    tally->histogram[StepBucket(steps)]++;
+    tally->finished++;
+    tally->sum += steps;
+    tally->sumSquares += (double)steps * steps;
+    tally->max = steps > tally->max ? steps : tally->max;
+}
+
+/*
+ * Returns the histogram bucket of a number of steps. Below SUB_BUCKETS
+ * every count has a bucket of its own; above, each power of two is split
+ * into SUB_BUCKETS buckets by the bits after the leading one.
+ */
+int StepBucket(uint64_t steps)
+{
+    if(steps < SUB_BUCKETS)
+    {
+        return steps;
+    }
+    int exponent = 63 - __builtin_clzll(steps);
+    return SUB_BUCKETS + (exponent - 4) * SUB_BUCKETS + ((steps >> (exponent - 4)) & (SUB_BUCKETS - 1));
+}
+
+/*
+ * Returns the fewest steps that land in the specified bucket.
+ */
+uint64_t BucketStart(int bucket)
+{
+    if(bucket < SUB_BUCKETS)
+    {
+        return bucket;
+    }
+    int exponent = (bucket - SUB_BUCKETS) / SUB_BUCKETS + 4;
+    return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << (exponent - 4);
+}
+
+/*
+ * Returns the steps within which percent of the finished agents reached
+ * the end, to the precision of the histogram.
+ */
+uint64_t FindPercentile(const Tally *tally, double percent)
+{
+    uint64_t wanted = (uint64_t)ceil(tally->finished * percent / 100);
+    uint64_t seen = 0;
+    int bucket;
+    for(bucket = 0; bucket < NUM_BUCKETS; bucket++)
+    {
+        seen += tally->histogram[bucket];
+        if(seen >= wanted && seen > 0)
+        {
+            return BucketStart(bucket);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Finds the fewest steps from the start to the end with a breadth-first
+ * search. Returns NO_PATH if the end can't be reached.
+ */
+uint32_t FindPar(const World *world)
+{
+    uint32_t *distances = (uint32_t*)malloc(world->numRooms * sizeof(uint32_t));
+    uint32_t *queue = (uint32_t*)malloc(world->numRooms * sizeof(uint32_t));
+    uint32_t par = NO_PATH;
+    if(distances == NULL || queue == NULL)
+    {
+        free(distances);
+        free(queue);
+        return par;
+    }
+
+    uint32_t i;
+    for(i = 0; i < world->numRooms; i++)
+    {
+        distances[i] = NO_PATH;
+    }
+
+    uint32_t head = 0, tail = 0;
+    distances[world->startRoom] = 0;
+    queue[tail++] = world->startRoom;
+    while(head < tail && par == NO_PATH)
+    {
+        uint32_t room = queue[head++];
+        if(room == world->endRoom)
+        {
+            par = distances[room];
+        }
+        uint32_t degree;
+        const uint32_t *neighbors = GetNeighbors(world, room, &degree);
+        for(i = 0; i < degree; i++)
+        {
+            uint32_t next = neighbors[i];
+            if(next < world->numRooms && distances[next] == NO_PATH)
+            {
+                distances[next] = distances[room] + 1;
+                queue[tail++] = next;
+            }
+        }
+    }
+
+    free(distances);
+    free(queue);
+    return par;
+}
+
+/*
+ * Scrambles the bits of x, the splitmix64 finalizer waltsara.buildrooms
+ * seeds its streams with.
+ */
+uint64_t MixBits(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "waltsara.feed.h"
+
+/* Helpful constants */
+#define FEED_BATCH 1024                         // Events read from a ring at a time
+#define IDLE_NS 1000000                         // Pause when every ring has been read up to date
+#define TALLY_START 1024                        // Slots a tally starts with
+
+/* Occurrences of each of a set of numbers, in an open-addressing table */
+typedef struct
+{
+    uint32_t *keys;
+    uint64_t *counts;                   // 0 for an empty slot
+    uint32_t  capacity;                 // A power of two
+    uint32_t  size;
+} Tally;
+
+/* What the events read since the last report, or since the start, add up to */
+typedef struct
+{
+    uint64_t moves;
+    uint64_t wins;                      // Moves into the end room
+    uint64_t winSteps;                  // Steps those sessions took, all told
+    uint64_t lost;                      // Events the game overwrote before they were read
+    int64_t  maxLag;                    // Longest an event took to be read, in nanoseconds
+    Tally    sessions;                  // Moves per session
+    Tally    rooms;                     // Moves into each room
+} Totals;
+
+/* Forward declarations */
+void CountEvent(Totals *t, const FeedHeader *h, const FeedEvent *e, int64_t now);	// Adds an event to the totals
+void Report(const Totals *t, double seconds);		// Prints a line about the last interval
+bool AddToTally(Tally *t, uint32_t key);		// Counts one occurrence of key
+void ClearTally(Tally *t);				// Empties a tally, keeping its slots
+void FreeTally(Tally *t);				// Releases a tally
+int64_t Nanoseconds(clockid_t clock);			// Reads a clock in nanoseconds
+
+/* Command line options */
+static struct option longOptions[] = {
+    { "interval",  required_argument, NULL, 'i' },
+    { "reports",   required_argument, NULL, 'n' },
+    { "beginning", no_argument,       NULL, 'b' },
+    { NULL, 0, NULL, 0 }
+};
+
+/*
+ * Follows the spectator feed of a running waltsara.adventure and prints a
+ * line of live numbers every interval: moves a second, sessions that
+ * moved, wins, the busiest room and how far behind the game reading is.
+ * The feed is only ever read, so following it costs the game nothing.
+ * Starts from the newest events, or from the oldest the feed still holds
+ * with --beginning, and stops with a summary once the game is gone.
+ */
+int main(int argc, char** argv)
+{
+    double interval = 1.0;
+    long maxReports = 0;
+    bool fromBeginning = false;
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "i:n:b", longOptions, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 'i': interval = atof(optarg); break;
+            case 'n': maxReports = atol(optarg); break;
+            case 'b': fromBeginning = true; break;
+            default:
+                fprintf(stderr, "Usage: %s [-i interval-seconds] [-n reports] [--beginning] [feed-name]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(optind + 1 < argc || interval <= 0)
+    {
+        fprintf(stderr, "Usage: %s [-i interval-seconds] [-n reports] [--beginning] [feed-name]\n", argv[0]);
+        return 1;
+    }
+
+    Feed feed;
+    if(!AttachFeed(&feed, optind < argc ? argv[optind] : FEED_NAME))
+    {
+        return 1;
+    }
+    const FeedHeader *header = feed.header;
+    printf("FEED: %s PID: %d ROOMS: %u THREADS: %u WORLD: %016llx\n", feed.name, header->pid,
+           header->numRooms, header->numRings, (unsigned long long)header->fingerprint);
+    fflush(stdout);
+
+    uint64_t *cursors = (uint64_t*)calloc(header->numRings, sizeof(uint64_t));
+    FeedEvent *events = (FeedEvent*)malloc(FEED_BATCH * sizeof(FeedEvent));
+    Totals interim, total;
+    memset(&interim, 0, sizeof(Totals));
+    memset(&total, 0, sizeof(Totals));
+    if(cursors == NULL || events == NULL)
+    {
+        perror("Failed to allocate the cursors.");
+        return 1;
+    }
+    uint32_t i;
+    for(i = 0; i < header->numRings && !fromBeginning; i++)
+    {
+        cursors[i] = __atomic_load_n(&GetFeedRing(&feed, i)->head, __ATOMIC_ACQUIRE);
+    }
+
+    int64_t intervalNs = (int64_t)(interval * 1e9);
+    int64_t lastReport = Nanoseconds(CLOCK_MONOTONIC);
+    long reports = 0;
+    while(maxReports == 0 || reports < maxReports)
+    {
+        /* Once the game is gone, whatever is still in the rings is the last of it */
+        bool over = __atomic_load_n(&header->closed, __ATOMIC_ACQUIRE) ||
+                    (kill(header->pid, 0) == -1 && errno == ESRCH);
+
+        uint64_t read = 0;
+        for(i = 0; i < header->numRings; i++)
+        {
+            uint32_t count = ReadFeed(&feed, i, &cursors[i], events, FEED_BATCH, &interim.lost);
+            int64_t now = Nanoseconds(CLOCK_REALTIME);
+            uint32_t j;
+            for(j = 0; j < count; j++)
+            {
+                CountEvent(&interim, header, &events[j], now);
+            }
+            read += count;
+        }
+
+        int64_t now = Nanoseconds(CLOCK_MONOTONIC);
+        if(now - lastReport >= intervalNs || (over && read == 0))
+        {
+            Report(&interim, (now - lastReport) / 1e9);
+            reports++;
+            lastReport = now;
+
+            /* Fold the interval into the run's totals and start the next */
+            total.moves += interim.moves;
+            total.wins += interim.wins;
+            total.winSteps += interim.winSteps;
+            total.lost += interim.lost;
+            total.maxLag = interim.maxLag > total.maxLag ? interim.maxLag : total.maxLag;
+            uint32_t k;
+            for(k = 0; k < interim.sessions.capacity; k++)
+            {
+                if(interim.sessions.counts[k] != 0)
+                {
+                    AddToTally(&total.sessions, interim.sessions.keys[k]);
+                }
+            }
+            interim.moves = interim.wins = interim.winSteps = interim.lost = 0;
+            interim.maxLag = 0;
+            ClearTally(&interim.sessions);
+            ClearTally(&interim.rooms);
+        }
+
+        if(read == 0)
+        {
+            if(over)
+            {
+                printf("GAME OVER. MOVES: %llu SESSIONS: %u WINS: %llu MEAN WIN STEPS: %.1f LOST: %llu MAX LAG MS: %.3f\n",
+                       (unsigned long long)total.moves, total.sessions.size, (unsigned long long)total.wins,
+                       total.wins > 0 ? (double)total.winSteps / total.wins : 0.0,
+                       (unsigned long long)total.lost, total.maxLag / 1e6);
+                break;
+            }
+            struct timespec pause = { 0, IDLE_NS };
+            nanosleep(&pause, NULL);
+        }
+    }
+
+    free(cursors);
+    free(events);
+    FreeTally(&interim.sessions);
+    FreeTally(&interim.rooms);
+    FreeTally(&total.sessions);
+    CloseFeed(&feed);
+    return 0;
+}
+
+/*
+ * Adds an event read at now, in nanoseconds since the epoch, to the totals.
+ */
+void CountEvent(Totals *totals, const FeedHeader *header, const FeedEvent *event, int64_t now)
+{
+    totals->moves++;
+    if(event->to == header->endRoom)
+    {
+        totals->wins++;
+        totals->winSteps += event->step;
+    }
+    if(now - event->time > totals->maxLag)
+    {
+        totals->maxLag = now - event->time;
+    }
+    AddToTally(&totals->sessions, event->session);
+    AddToTally(&totals->rooms, event->to);
+}
+
+/*
+ * Prints a line about an interval of the given length.
+ */
+void Report(const Totals *totals, double seconds)
+{
+    uint32_t busiest = 0;
+    uint64_t busiestMoves = 0;
+    uint32_t i;
+    for(i = 0; i < totals->rooms.capacity; i++)
+    {
+        if(totals->rooms.counts[i] > busiestMoves)
+        {
+            busiest = totals->rooms.keys[i];
+            busiestMoves = totals->rooms.counts[i];
+        }
+    }
+
+    char clock[16];
+    time_t wall = time(NULL);
+    strftime(clock, sizeof(clock), "%H:%M:%S", localtime(&wall));
+    printf("%s MOVES/SEC: %.0f SESSIONS: %u WINS: %llu BUSIEST ROOM: ", clock,
+           seconds > 0 ? totals->moves / seconds : 0.0, totals->sessions.size, (unsigned long long)totals->wins);
+    if(busiestMoves > 0)
+    {
+        printf("%u (%llu) ", busiest, (unsigned long long)busiestMoves);
+    }
+    else
+    {
+        printf("- ");
+    }
+    printf("LOST: %llu LAG MS: %.3f\n", (unsigned long long)totals->lost, totals->maxLag / 1e6);
+    fflush(stdout);
+}
+
+/*
+ * Counts one occurrence of key, doubling the table once it is half full.
+ * Returns false if it can't grow.
+ */
+bool AddToTally(Tally *tally, uint32_t key)
+{
+    if(tally->size * 2 >= tally->capacity)
+    {
+        Tally grown;
+        grown.capacity = tally->capacity == 0 ? TALLY_START : tally->capacity * 2;
+        grown.size = tally->size;
+        grown.keys = (uint32_t*)malloc(grown.capacity * sizeof(uint32_t));
+        grown.counts = (uint64_t*)calloc(grown.capacity, sizeof(uint64_t));
+        if(grown.keys == NULL || grown.counts == NULL)
+        {
+            free(grown.keys);
+            free(grown.counts);
+            return false;
+        }
+        uint32_t i;
+        for(i = 0; i < tally->capacity; i++)
+        {
+            if(tally->counts[i] != 0)
+            {
+                uint32_t slot = (tally->keys[i] * 0x9E3779B1u) & (grown.capacity - 1);
+                while(grown.counts[slot] != 0)
+                {
+                    slot = (slot + 1) & (grown.capacity - 1);
+                }
+                grown.keys[slot] = tally->keys[i];
+                grown.counts[slot] = tally->counts[i];
+            }
+        }
+        FreeTally(tally);
+        *tally = grown;
+    }
+
+    uint32_t slot = (key * 0x9E3779B1u) & (tally->capacity - 1);
+    while(tally->counts[slot] != 0 && tally->keys[slot] != key)
+    {
+        slot = (slot + 1) & (tally->capacity - 1);
+    }
+    if(tally->counts[slot]++ == 0)
+    {
+        tally->keys[slot] = key;
+        tally->size++;
+    }
+    return true;
+}
+
+/*
+ * Empties a tally, keeping its slots for the next interval.
+ */
+void ClearTally(Tally *tally)
+{
+    if(tally->counts != NULL)
+    {
+        memset(tally->counts, 0, tally->capacity * sizeof(uint64_t));
+    }
+    tally->size = 0;
+}
+
+/*
+ * Releases a tally's slots.
+ */
+void FreeTally(Tally *tally)
+{
+    free(tally->keys);
+    free(tally->counts);
+    memset(tally, 0, sizeof(Tally));
+}
+
+/*
+ * Reads clock in nanoseconds.
+ */
+int64_t Nanoseconds(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
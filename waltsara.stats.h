@@ -0,0 +1,258 @@
+#ifndef WALTSARA_STATS_H
+#define WALTSARA_STATS_H
+
+/*
+ * Counters and timers for the hot paths of both programs.
+ *
+ * Each thread counts into a block of its own, found through a thread-local
+ * pointer, so a count is an add to a cache line no other thread writes.
+ * Readers add up every block, including those of threads that finished.
+ * Counters always run. Timers and the latency histogram read the clock, so
+ * they only run when the WALTSARA_STATS environment variable names a file,
+ * which gets every number as JSON at exit ("-" means stderr).
+ *
+ * Each program lists its statistics in its own enum and hands their names
+ * to StartStats. Names ending in _ns are nanoseconds spent. The helpers
+ * called on hot paths are forced inline, so a count stays a single add
+ * even in a debug build at -O0, where a call would cost more than the
+ * count.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_STATS 32                    // Most statistics a program can have
+#define LATENCY_BUCKETS 40              // Histogram bucket i holds latencies below 2^(i+1) ns
+#define STATS_ALIGNMENT 64              // Blocks never share a cache line
+
+/* One thread's numbers */
+typedef struct StatBlock
+{
+    uint64_t          counts[MAX_STATS];
+    uint64_t          latencies[LATENCY_BUCKETS];
+    struct StatBlock *next;
+} StatBlock;
+
+static const char *const *statNames = NULL;
+static int numStats = 0;
+static const char *latencyName = NULL;          // What the histogram measures, NULL if unused
+static const char *programName = "";
+static const char *statsPath = NULL;            // Where the JSON goes at exit, NULL if nowhere
+static int statsTiming = 0;                     // Whether timers read the clock
+static StatBlock *allStats = NULL;              // Every thread's block, newest first
+static StatBlock lostStats;                     // Shared by threads that couldn't get a block
+static __thread StatBlock *threadStats = NULL;
+
+/*
+ * Sets up the statistics of a program: count names in the order of its
+ * enum, and what its latency histogram measures. Reads WALTSARA_STATS.
+ */
+static void StartStats(const char *program, const char *const *names, int count, const char *latency)
+{
+    programName = program;
+    statNames = names;
+    numStats = count < MAX_STATS ? count : MAX_STATS;
+    latencyName = latency;
+    statsPath = getenv("WALTSARA_STATS");
+    if(statsPath != NULL && statsPath[0] == '\0')
+    {
+        statsPath = NULL;
+    }
+    statsTiming = statsPath != NULL;
+}
+
+/*
+ * Gives the calling thread a block of its own and adds it to the list.
+ */
+static StatBlock *JoinStats(void)
+{
+    size_t size = (sizeof(StatBlock) + STATS_ALIGNMENT - 1) / STATS_ALIGNMENT * STATS_ALIGNMENT;
+    StatBlock *block = (StatBlock*)aligned_alloc(STATS_ALIGNMENT, size);
+    if(block == NULL)
+    {
+        threadStats = &lostStats;
+        return threadStats;
+    }
+    memset(block, 0, size);
+
+    block->next = __atomic_load_n(&allStats, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&allStats, &block->next, block, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+        /* block->next now holds the newer head, try again */
+    }
+    threadStats = block;
+    return block;
+}
+
+/*
+ * Adds amount to one of the calling thread's counts. Only this thread
+ * writes it; the atomic store only keeps readers from seeing a torn value.
+ */
+static inline __attribute__((always_inline)) void CountStat(int stat, uint64_t amount)
+{
+    StatBlock *block = threadStats != NULL ? threadStats : JoinStats();
+    __atomic_store_n(&block->counts[stat], block->counts[stat] + amount, __ATOMIC_RELAXED);
+}
+
+/* Monotonic clock in nanoseconds */
+static inline __attribute__((always_inline)) uint64_t StatClock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+/*
+ * Starts a timer, returning 0 when timing is off so StopTimer skips it.
+ */
+static inline __attribute__((always_inline)) uint64_t StartTimer(void)
+{
+    return statsTiming ? StatClock() : 0;
+}
+
+/*
+ * Adds the nanoseconds since StartTimer to the specified count.
+ */
+static inline __attribute__((always_inline)) void StopTimer(int stat, uint64_t started)
+{
+    if(started != 0)
+    {
+        CountStat(stat, StatClock() - started);
+    }
+}
+
+/*
+ * Adds the time since StartTimer to the latency histogram.
+ */
+static inline __attribute__((always_inline)) void RecordLatency(uint64_t started)
+{
+    if(started == 0)
+    {
+        return;
+    }
+
+    uint64_t elapsed = StatClock() - started;
+    int bucket = 63 - __builtin_clzll(elapsed | 1);
+    if(bucket >= LATENCY_BUCKETS)
+    {
+        bucket = LATENCY_BUCKETS - 1;
+    }
+    StatBlock *block = threadStats != NULL ? threadStats : JoinStats();
+    __atomic_store_n(&block->latencies[bucket], block->latencies[bucket] + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the total of one count over every thread.
+ */
+static uint64_t SumStat(int stat)
+{
+    uint64_t total = __atomic_load_n(&lostStats.counts[stat], __ATOMIC_RELAXED);
+    StatBlock *block;
+    for(block = __atomic_load_n(&allStats, __ATOMIC_ACQUIRE); block != NULL; block = block->next)
+    {
+        total += __atomic_load_n(&block->counts[stat], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+/*
+ * Returns the total of one histogram bucket over every thread.
+ */
+static uint64_t SumLatency(int bucket)
+{
+    uint64_t total = __atomic_load_n(&lostStats.latencies[bucket], __ATOMIC_RELAXED);
+    StatBlock *block;
+    for(block = __atomic_load_n(&allStats, __ATOMIC_ACQUIRE); block != NULL; block = block->next)
+    {
+        total += __atomic_load_n(&block->latencies[bucket], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+/*
+ * Writes every count, one per line, and the non-empty histogram buckets
+ * into text, which has room for size bytes. Timers are left out unless
+ * they run, rather than shown as 0. Like snprintf, returns the length the
+ * whole report needs, so a first call can size the buffer.
+ */
+static size_t FormatStats(char *text, size_t size)
+{
+    size_t length = 0;
+    int i;
+    for(i = 0; i < numStats; i++)
+    {
+        size_t nameLength = strlen(statNames[i]);
+        if(!statsTiming && nameLength >= 3 && strcmp(statNames[i] + nameLength - 3, "_ns") == 0)
+        {
+            continue;
+        }
+        length += snprintf(text + (length < size ? length : size), length < size ? size - length : 0,
+                           "%s: %llu\n", statNames[i], (unsigned long long)SumStat(i));
+    }
+
+    for(i = 0; latencyName != NULL && i < LATENCY_BUCKETS; i++)
+    {
+        uint64_t count = SumLatency(i);
+        if(count > 0)
+        {
+            length += snprintf(text + (length < size ? length : size), length < size ? size - length : 0,
+                               "%s under %llu ns: %llu\n", latencyName,
+                               (unsigned long long)2 << i, (unsigned long long)count);
+        }
+    }
+    return length;
+}
+
+/*
+ * Writes every number as JSON to the file WALTSARA_STATS names, if any.
+ */
+static void DumpStats(void)
+{
+    if(statsPath == NULL)
+    {
+        return;
+    }
+
+    FILE *file = strcmp(statsPath, "-") == 0 ? stderr : fopen(statsPath, "w");
+    if(file == NULL)
+    {
+        perror("Unable to write statistics.");
+        return;
+    }
+
+    fprintf(file, "{\n  \"program\": \"%s\",\n  \"counters\": {", programName);
+    int i;
+    for(i = 0; i < numStats; i++)
+    {
+        fprintf(file, "%s\n    \"%s\": %llu", i > 0 ? "," : "", statNames[i], (unsigned long long)SumStat(i));
+    }
+    fputs("\n  }", file);
+
+    if(latencyName != NULL)
+    {
+        fprintf(file, ",\n  \"%s\": [", latencyName);
+        int first = 1;
+        for(i = 0; i < LATENCY_BUCKETS; i++)
+        {
+            uint64_t count = SumLatency(i);
+            if(count > 0)
+            {
+                fprintf(file, "%s\n    {\"below_ns\": %llu, \"count\": %llu}", first ? "" : ",",
+                        (unsigned long long)2 << i, (unsigned long long)count);
+                first = 0;
+            }
+        }
+        fputs("\n  ]", file);
+    }
+    fputs("\n}\n", file);
+
+    if(file != stderr)
+    {
+        fclose(file);
+    }
+}
+
+#endif
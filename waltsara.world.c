@@ -0,0 +1,848 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "waltsara.world.h"
+
+#define JOURNAL_MAGIC "WALTJRNL"
+
+/* Head of the journal of a patch of a world file, followed by the patches */
+typedef struct
+{
+    char     magic[8];
+    uint64_t generation;                // Generation of the file once patched
+    uint64_t numPatches;
+    uint64_t size;                      // Bytes in the journal
+    uint64_t check;                     // HashJournal of the whole journal
+} JournalHeader;
+
+/* One patch, followed by its bytes, padded to 8 */
+typedef struct
+{
+    uint64_t offset;
+    uint64_t length;
+} JournalPatch;
+
+/*
+ * Rounds an offset into the image up to the next section boundary.
+ */
+static uint64_t AlignOffset(uint64_t offset)
+{
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+/*
+ * Orders room IDs by name for qsort_r; the argument is the world.
+ */
+static int CompareRoomNames(const void *a, const void *b, void *arg)
+{
+    const World *world = (const World*)arg;
+    return strcmp(GetRoomName(world, *(const uint32_t*)a), GetRoomName(world, *(const uint32_t*)b));
+}
+
+/*
+ * Fills in the counts, the size of the name index and the offset of every
+ * section of a world with the specified number of rooms, connections and
+ * bytes of names. The caller sets the start, end and seed.
+ */
+void LayOutWorld(WorldHeader *header, uint32_t numRooms, uint64_t numConnections, uint64_t namesSize)
+{
+    memset(header, 0, sizeof(WorldHeader));
+    memcpy(header->magic, WORLD_MAGIC, sizeof(header->magic));
+    header->version = WORLD_VERSION;
+    header->numRooms = numRooms;
+    header->numConnections = numConnections;
+    header->namesSize = namesSize;
+    header->numHashSlots = 1;
+    while(header->numHashSlots < (uint64_t)numRooms + numRooms / 2)
+    {
+        header->numHashSlots <<= 1;             // Keep the table at most two thirds full
+    }
+
+    header->typesOffset = AlignOffset(sizeof(WorldHeader));
+    header->offsetsOffset = AlignOffset(header->typesOffset + numRooms);
+    header->connectionsOffset = header->offsetsOffset + ((uint64_t)numRooms + 1) * sizeof(uint64_t);
+    header->nameOffsetsOffset = AlignOffset(header->connectionsOffset + numConnections * sizeof(uint32_t));
+    header->hashOffset = header->nameOffsetsOffset + ((uint64_t)numRooms + 1) * sizeof(uint64_t);
+    header->sortedNamesOffset = header->hashOffset + header->numHashSlots * sizeof(uint32_t);
+    header->namesOffset = AlignOffset(header->sortedNamesOffset + (uint64_t)numRooms * sizeof(uint32_t));
+    header->fileSize = header->namesOffset + namesSize;
+}
+
+/*
+ * Allocates a zeroed heap image laid out by the specified header and
+ * attaches the world to it. Until IndexWorld is called the caller fills
+ * in the room types, offsets, connections, name offsets and names through
+ * the world's arrays, which are only const to everybody else.
+ */
+bool CreateWorld(World *world, const WorldHeader *header)
+{
+    memset(world, 0, sizeof(World));
+    void *image = calloc(1, header->fileSize);
+    if(image == NULL)
+    {
+        return false;
+    }
+
+    memcpy(image, header, sizeof(WorldHeader));
+    if(!AttachWorld(world, image, header->fileSize))
+    {
+        free(image);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Fills in the hash table and the sorted name list of a world made by
+ * CreateWorld, once every name is in place.
+ */
+void IndexWorld(World *world)
+{
+    uint32_t *hashSlots = (uint32_t*)world->hashSlots;
+    uint32_t *sortedNames = (uint32_t*)world->sortedNames;
+    uint32_t i;
+    for(i = 0; i < world->numRooms; i++)
+    {
+        uint64_t slot = HashName(GetRoomName(world, i)) & world->hashMask;
+        while(hashSlots[slot] != 0)
+        {
+            slot = (slot + 1) & world->hashMask;
+        }
+        hashSlots[slot] = i + 1;
+        sortedNames[i] = i;
+    }
+    qsort_r(sortedNames, world->numRooms, sizeof(uint32_t), CompareRoomNames, world);
+}
+
+/*
+ * Writes the name of the journal of fileName into journal: the file's
+ * own name with a dot in front, so nothing looking for worlds finds it.
+ */
+static void JournalName(const char *fileName, char *journal, size_t size)
+{
+    const char *slash = strrchr(fileName, '/');
+    int directory = slash != NULL ? (int)(slash - fileName + 1) : 0;
+    snprintf(journal, size, "%.*s.%s.journal", directory, fileName, fileName + directory);
+}
+
+/*
+ * Hash telling a complete journal from one a crash cut short: FNV-1a over
+ * its header, up to the hash itself, and everything after it.
+ */
+static uint64_t HashJournal(const uint8_t *journal, size_t size)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    for(i = 0; i < size; i++)
+    {
+        if(i < offsetof(JournalHeader, check) || i >= sizeof(JournalHeader))
+        {
+            hash = (hash ^ journal[i]) * 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+/*
+ * Copies the patches of a complete journal into the world file open on
+ * fd, whose exclusive lock the caller holds. The generation goes odd
+ * first and even again once every patch is in, with a sync after, so
+ * players mapping the file know to look again. Patches may only land on
+ * connections. Returns false if the journal doesn't fit the file or the
+ * file can't be written.
+ */
+static bool ApplyJournal(int fd, const uint8_t *journal, size_t size)
+{
+    struct stat st;
+    if(fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(WorldHeader))
+    {
+        return false;
+    }
+    void *image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(image == MAP_FAILED)
+    {
+        return false;
+    }
+
+    WorldHeader *header = (WorldHeader*)image;
+    const JournalHeader *entries = (const JournalHeader*)journal;
+    uint64_t first = header->connectionsOffset;
+    uint64_t last = first + header->numConnections * sizeof(uint32_t);
+    bool fits = last <= (uint64_t)st.st_size;
+    size_t at = sizeof(JournalHeader);
+    uint64_t i;
+    for(i = 0; i < entries->numPatches && fits; i++)
+    {
+        const JournalPatch *patch = (const JournalPatch*)(journal + at);
+        fits = at + sizeof(JournalPatch) <= size && patch->offset >= first && patch->length <= last - patch->offset &&
+               patch->length <= size - at - sizeof(JournalPatch);
+        at += sizeof(JournalPatch) + ((patch->length + 7) & ~7ULL);
+    }
+
+    bool written = false;
+    if(fits)
+    {
+        __atomic_store_n(&header->generation, entries->generation - 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        at = sizeof(JournalHeader);
+        for(i = 0; i < entries->numPatches; i++)
+        {
+            const JournalPatch *patch = (const JournalPatch*)(journal + at);
+            memcpy((char*)image + patch->offset, patch + 1, patch->length);
+            at += sizeof(JournalPatch) + ((patch->length + 7) & ~7ULL);
+        }
+        __atomic_store_n(&header->generation, entries->generation, __ATOMIC_RELEASE);
+        written = msync(image, st.st_size, MS_SYNC) == 0;
+    }
+    munmap(image, st.st_size);
+    return written;
+}
+
+/*
+ * Finishes a patch of fileName that a crash cut short, or throws away
+ * its journal if the journal itself never got written in full, in which
+ * case the file was never touched. Does nothing if there is no journal or
+ * the file can't be written by us; a file whose patch can't be finished
+ * is refused by whoever loads it.
+ */
+static void FinishPatch(const char *fileName)
+{
+    char journalName[PATH_MAX];
+    JournalName(fileName, journalName, sizeof(journalName));
+    if(access(journalName, F_OK) == -1)
+    {
+        return;
+    }
+
+    int fd = open(fileName, O_RDWR);
+    if(fd == -1)
+    {
+        return;
+    }
+    flock(fd, LOCK_EX);
+
+    /* Only now is the journal sure not to be half written by someone else */
+    int journalFd = open(journalName, O_RDONLY);
+    struct stat st;
+    uint8_t *journal = NULL;
+    if(journalFd != -1 && fstat(journalFd, &st) == 0 && st.st_size >= (off_t)sizeof(JournalHeader))
+    {
+        journal = (uint8_t*)malloc(st.st_size);
+    }
+    if(journal != NULL && pread(journalFd, journal, st.st_size, 0) == st.st_size)
+    {
+        const JournalHeader *entries = (const JournalHeader*)journal;
+        WorldHeader header;
+        if(memcmp(entries->magic, JOURNAL_MAGIC, sizeof(entries->magic)) == 0 && entries->size == (uint64_t)st.st_size &&
+           entries->check == HashJournal(journal, st.st_size) &&
+           pread(fd, &header, sizeof(WorldHeader), 0) == sizeof(WorldHeader) &&
+           entries->generation >= header.generation)
+        {
+            ApplyJournal(fd, journal, st.st_size);
+        }
+    }
+    if(journalFd != -1)
+    {
+        unlink(journalName);
+        close(journalFd);
+    }
+    free(journal);
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+/*
+ * Opens the specified world file for reading once any patch of it is
+ * finished, holding a shared lock so no patch starts until the caller
+ * has taken its copy or mapping and unlocks. Returns -1 on failure.
+ */
+static int OpenWorldFile(const char *fileName, off_t *size)
+{
+    FinishPatch(fileName);
+    int fd = open(fileName, O_RDONLY);
+    if(fd == -1)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    if(flock(fd, LOCK_SH) == -1 || fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(WorldHeader))
+    {
+        close(fd);
+        return -1;
+    }
+    *size = st.st_size;
+    return fd;
+}
+
+/*
+ * Checks that the indexes of a world just attached to an image read from
+ * a file, which may have been damaged or made by anybody, hold together,
+ * so nothing the game looks up from them can reach outside the image:
+ * each room's connections and name lie within the arrays, in order, every
+ * connection leads to a room that exists, names are NUL terminated and
+ * the name index only names rooms that exist.
+ */
+static bool CheckWorldFile(const World *world)
+{
+    const WorldHeader *header = (const WorldHeader*)world->image;
+    bool valid = world->offsets[0] == 0 && world->offsets[world->numRooms] == header->numConnections &&
+                 world->nameOffsets[0] == 0 && world->nameOffsets[world->numRooms] <= header->namesSize;
+    uint64_t i;
+    for(i = 0; valid && i < world->numRooms; i++)
+    {
+        valid = world->offsets[i] <= world->offsets[i + 1] && world->nameOffsets[i] < world->nameOffsets[i + 1] &&
+                world->names[world->nameOffsets[i + 1] - 1] == '\0';
+        uint64_t j;
+        for(j = world->offsets[i]; valid && j < world->offsets[i + 1]; j++)
+        {
+            valid = world->connections[j] < world->numRooms;
+        }
+    }
+    for(i = 0; valid && world->sortedNames != NULL && i < world->numRooms; i++)
+    {
+        valid = world->sortedNames[i] < world->numRooms;
+    }
+
+    /* Probes only stop at an empty slot, so there must be one */
+    bool empty = world->hashSlots == NULL;
+    for(i = 0; valid && !empty && i < header->numHashSlots; i++)
+    {
+        empty = world->hashSlots[i] == 0;
+    }
+
+    if(!valid || !empty)
+    {
+        fprintf(stderr, "World file is corrupt.\n");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Maps the specified binary world file read-only. Nothing is copied and
+ * the indexes are only read through once to check them, and every
+ * process playing the same file shares its pages. The world keeps an eye
+ * on the generation of the file, which patches move on.
+ */
+bool MapWorld(World *world, const char *fileName)
+{
+    memset(world, 0, sizeof(World));
+    off_t size;
+    int fd = OpenWorldFile(fileName, &size);
+    if(fd == -1)
+    {
+        return false;
+    }
+
+    void *image = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    flock(fd, LOCK_UN);                         // The mapping would keep the lock for as long as it lasts
+    close(fd);					// The mapping keeps the file alive
+    if(image == MAP_FAILED)
+    {
+        return false;
+    }
+
+    if(!AttachWorld(world, image, size) || !CheckWorldFile(world))
+    {
+        munmap(image, size);
+        return false;
+    }
+
+    world->mapped = true;
+    world->fileGeneration = &((const WorldHeader*)image)->generation;
+    return true;
+}
+
+/*
+ * Reads the specified binary world file into memory of its own, whose
+ * connections can then be changed through the world's arrays without the
+ * file or anybody else seeing. Patches of the file later on don't show
+ * through either.
+ */
+bool CopyWorld(World *world, const char *fileName)
+{
+    memset(world, 0, sizeof(World));
+    off_t size;
+    int fd = OpenWorldFile(fileName, &size);
+    if(fd == -1)
+    {
+        return false;
+    }
+
+    char *image = (char*)malloc(size);
+    off_t got = 0;
+    ssize_t result = 1;
+    while(image != NULL && got < size && (result = pread(fd, image + got, size - got, got)) > 0)
+    {
+        got += result;
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    if(image == NULL || got < size || !AttachWorld(world, image, size) || !CheckWorldFile(world))
+    {
+        free(image);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Overwrites parts of the connections of the specified world file, if it
+ * is still at the specified generation: writes the patches to the file's
+ * journal and syncs it, then copies them in and removes the journal, all
+ * under an exclusive lock. A crash at any point leaves either the world
+ * as it was or a journal that finishes the patch the next time the file
+ * is opened. Returns false, with the file as it was, if anything fails.
+ */
+bool PatchWorldFile(const char *fileName, uint64_t generation, const WorldPatch *patches, uint32_t count)
+{
+    int fd = open(fileName, O_RDWR);
+    if(fd == -1 || flock(fd, LOCK_EX) == -1)
+    {
+        perror("Failed to open the world for patching.");
+        if(fd != -1)
+        {
+            close(fd);
+        }
+        return false;
+    }
+
+    WorldHeader header;
+    if(pread(fd, &header, sizeof(WorldHeader), 0) != sizeof(WorldHeader) || header.generation != generation)
+    {
+        fprintf(stderr, "%s changed while it was being updated; try again.\n", fileName);
+        close(fd);
+        return false;
+    }
+
+    /* Lay the journal out in memory */
+    size_t size = sizeof(JournalHeader);
+    uint32_t i;
+    for(i = 0; i < count; i++)
+    {
+        size += sizeof(JournalPatch) + ((patches[i].length + 7) & ~7ULL);
+    }
+    uint8_t *journal = (uint8_t*)calloc(1, size);
+    if(journal == NULL)
+    {
+        perror("Failed to allocate the journal.");
+        close(fd);
+        return false;
+    }
+    JournalHeader *entries = (JournalHeader*)journal;
+    memcpy(entries->magic, JOURNAL_MAGIC, sizeof(entries->magic));
+    entries->generation = generation + 2;
+    entries->numPatches = count;
+    entries->size = size;
+    size_t at = sizeof(JournalHeader);
+    for(i = 0; i < count; i++)
+    {
+        JournalPatch *patch = (JournalPatch*)(journal + at);
+        patch->offset = patches[i].offset;
+        patch->length = patches[i].length;
+        memcpy(patch + 1, patches[i].data, patches[i].length);
+        at += sizeof(JournalPatch) + ((patches[i].length + 7) & ~7ULL);
+    }
+    entries->check = HashJournal(journal, size);
+
+    /* The journal and its name are on disk before the world changes */
+    char journalName[PATH_MAX];
+    JournalName(fileName, journalName, sizeof(journalName));
+    int journalFd = open(journalName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool journaled = journalFd != -1 && write(journalFd, journal, size) == (ssize_t)size && fsync(journalFd) == 0;
+    if(journalFd != -1)
+    {
+        close(journalFd);
+    }
+    char directory[PATH_MAX];
+    const char *slash = strrchr(fileName, '/');
+    snprintf(directory, sizeof(directory), "%.*s", slash != NULL ? (int)(slash - fileName + 1) : 1,
+             slash != NULL ? fileName : ".");
+    int directoryFd = open(directory, O_RDONLY | O_DIRECTORY);
+    journaled = journaled && directoryFd != -1 && fsync(directoryFd) == 0;
+    if(directoryFd != -1)
+    {
+        close(directoryFd);
+    }
+
+    bool patched = journaled && ApplyJournal(fd, journal, size);
+    if(!journaled)
+    {
+        perror("Failed to write the journal.");
+    }
+    else if(!patched)
+    {
+        perror("Failed to patch the world.");
+    }
+    if(journalFd != -1 && (patched || !journaled))
+    {
+        unlink(journalName);                    // Otherwise it finishes the patch on the next open
+    }
+    free(journal);
+    flock(fd, LOCK_UN);
+    close(fd);
+    return patched;
+}
+
+/*
+ * Checks the header of an image of the binary format and points the
+ * world's arrays into it. Only the header is looked at, so attaching is
+ * constant time; images read from a file are checked further by
+ * CheckWorldFile.
+ */
+bool AttachWorld(World *world, void *image, size_t size)
+{
+    const WorldHeader *header = (const WorldHeader*)image;
+    if(size < sizeof(WorldHeader) || memcmp(header->magic, WORLD_MAGIC, sizeof(header->magic)) != 0)
+    {
+        fprintf(stderr, "Not a world file.\n");
+        return false;
+    }
+
+    if(header->version != WORLD_VERSION)
+    {
+        fprintf(stderr, "World file version %u is not supported.\n", header->version);
+        return false;
+    }
+
+    uint64_t numRooms = header->numRooms;
+    if(header->fileSize > size || numRooms == 0 ||
+       header->startRoom >= numRooms || header->endRoom >= numRooms ||
+       header->typesOffset + numRooms > size ||
+       header->offsetsOffset + (numRooms + 1) * sizeof(uint64_t) > size ||
+       header->connectionsOffset + header->numConnections * sizeof(uint32_t) > size ||
+       header->nameOffsetsOffset + (numRooms + 1) * sizeof(uint64_t) > size ||
+       header->namesOffset + header->namesSize > size ||
+       (header->hashOffset != 0 && ((header->numHashSlots & (header->numHashSlots - 1)) != 0 ||
+                                    header->numHashSlots < numRooms ||
+                                    header->hashOffset + header->numHashSlots * sizeof(uint32_t) > size)) ||
+       (header->sortedNamesOffset != 0 && header->sortedNamesOffset + numRooms * sizeof(uint32_t) > size))
+    {
+        fprintf(stderr, "World file is truncated.\n");
+        return false;
+    }
+
+    if(header->generation % 2 != 0)
+    {
+        fprintf(stderr, "World file has a patch that was never finished.\n");
+        return false;
+    }
+
+    const char *base = (const char*)image;
+    world->numRooms    = header->numRooms;
+    world->startRoom   = header->startRoom;
+    world->endRoom     = header->endRoom;
+    world->roomType    = (const uint8_t*)(base + header->typesOffset);
+    world->offsets     = (const uint64_t*)(base + header->offsetsOffset);
+    world->connections = (const uint32_t*)(base + header->connectionsOffset);
+    world->nameOffsets = (const uint64_t*)(base + header->nameOffsetsOffset);
+    world->names       = base + header->namesOffset;
+    world->hashSlots   = header->hashOffset ? (const uint32_t*)(base + header->hashOffset) : NULL;
+    world->hashMask    = header->numHashSlots - 1;
+    world->sortedNames = header->sortedNamesOffset ? (const uint32_t*)(base + header->sortedNamesOffset) : NULL;
+    world->image       = image;
+    world->imageSize   = size;
+    world->mapped      = false;
+    world->builtIndex  = NULL;
+    world->fileGeneration = NULL;
+    world->generation  = header->generation;
+    return true;
+}
+
+/*
+ * Builds the hash table and sorted name list in one heap block for an
+ * image that was written without them.
+ */
+bool BuildNameIndex(World *world)
+{
+    uint64_t numHashSlots = 1;
+    while(numHashSlots < (uint64_t)world->numRooms + world->numRooms / 2)
+    {
+        numHashSlots <<= 1;
+    }
+
+    uint32_t *index = (uint32_t*)calloc(numHashSlots + world->numRooms, sizeof(uint32_t));
+    if(index == NULL)
+    {
+        return false;
+    }
+
+    world->hashSlots = index;
+    world->hashMask = numHashSlots - 1;
+    world->sortedNames = index + numHashSlots;
+    world->builtIndex = index;
+    IndexWorld(world);
+    return true;
+}
+
+/*
+ * Writes the world's image to fileName as a world file. The image is
+ * already in the file's layout, so this is one write for any size of
+ * world. Returns false if the file could not be written.
+ */
+bool SaveWorld(const World *world, const char *fileName)
+{
+    int fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1)
+    {
+        perror("Failed to create world file.");
+        return false;
+    }
+
+    const char *image = (const char*)world->image;
+    size_t written = 0;
+    while(written < world->imageSize)
+    {
+        ssize_t result = write(fd, image + written, world->imageSize - written);
+        if(result <= 0)
+        {
+            break;
+        }
+        written += result;
+    }
+
+    if(close(fd) != 0 || written < world->imageSize)
+    {
+        perror("Unable to write world file.");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Unmaps or frees the image behind the specified world, along with the
+ * name index, distances and prompts built for it.
+ */
+void FreeWorld(World *world)
+{
+    free(world->builtIndex);
+    free(world->listedOrder);
+    free(world->distanceToEnd);
+    if(world->prompts != NULL && world->promptBlock == NULL)
+    {
+        uint32_t i;
+        for(i = 0; i < world->numRooms; i++)
+        {
+            free(world->prompts[i]);
+        }
+    }
+    free(world->prompts);
+    free(world->promptBlock);
+    if(world->mapped)
+    {
+        munmap(world->image, world->imageSize);
+    }
+    else
+    {
+        free(world->image);
+    }
+    memset(world, 0, sizeof(World));
+}
+
+/*
+ * Gets the start room of the specified world.
+ */
+uint32_t GetStartRoom(const World *world)
+{
+    return world->startRoom;
+}
+
+/*
+ * Gets the end room of the specified world.
+ */
+uint32_t GetEndRoom(const World *world)
+{
+    return world->endRoom;
+}
+
+/*
+ * Gets the type of the specified room.
+ */
+Type GetRoomType(const World *world, uint32_t room)
+{
+    return (Type)world->roomType[room];
+}
+
+/*
+ * Gets the number of connections of the specified room.
+ */
+uint32_t GetDegree(const World *world, uint32_t room)
+{
+    return world->offsets[room + 1] - world->offsets[room];
+}
+
+/*
+ * Returns the connections of the specified room, sorted by room ID, and
+ * stores how many there are in count. The array points into the world.
+ */
+const uint32_t *GetNeighbors(const World *world, uint32_t room, uint32_t *count)
+{
+    *count = world->offsets[room + 1] - world->offsets[room];
+    return world->connections + world->offsets[room];
+}
+
+/*
+ * Determines if 'from' has a connection to 'to'. Connections are sorted,
+ * so this is a binary search even for rooms with a lot of doors.
+ */
+bool IsConnected(const World *world, uint32_t from, uint32_t to)
+{
+    uint64_t low = world->offsets[from];
+    uint64_t high = world->offsets[from + 1];
+    while(low < high)
+    {
+        uint64_t mid = low + (high - low) / 2;
+        if(world->connections[mid] < to)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low < world->offsets[from + 1] && world->connections[low] == to;
+}
+
+/*
+ * Gets the name of the specified room.
+ */
+const char *GetRoomName(const World *world, uint32_t room)
+{
+    return world->names + world->nameOffsets[room];
+}
+
+/*
+ * Retreives the room in the world with the specified name, or -1 if not
+ * found. One hash of the name plus a short probe, whatever the world size.
+ */
+int GetRoomFromName(const World *world, const char *name)
+{
+    uint64_t slot = HashName(name) & world->hashMask;
+    uint32_t entry;
+    while((entry = world->hashSlots[slot]) != 0)
+    {
+        if(entry <= world->numRooms && strcmp(name, GetRoomName(world, entry - 1)) == 0)
+        {
+            return entry - 1;
+        }
+        slot = (slot + 1) & world->hashMask;
+    }
+
+    return -1;
+}
+
+/*
+ * Finds the run of sortedNames whose names start with prefix. Stores the
+ * position of the first one in first and returns how many there are.
+ */
+uint64_t FindRoomsWithPrefix(const World *world, const char *prefix, uint64_t *first)
+{
+    size_t length = strlen(prefix);
+    uint64_t low = 0;
+    uint64_t high = world->numRooms;
+
+    /* First name not less than the prefix */
+    while(low < high)
+    {
+        uint64_t mid = low + (high - low) / 2;
+        if(strncmp(GetRoomName(world, world->sortedNames[mid]), prefix, length) < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    *first = low;
+
+    /* First name past every name that starts with the prefix */
+    high = world->numRooms;
+    while(low < high)
+    {
+        uint64_t mid = low + (high - low) / 2;
+        if(strncmp(GetRoomName(world, world->sortedNames[mid]), prefix, length) <= 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low - *first;
+}
+
+/*
+ * FNV-1a hash of a room name, which the name index is keyed by.
+ */
+uint64_t HashName(const char *name)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    while(*name != '\0')
+    {
+        hash = (hash ^ (unsigned char)*name++) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ * Current generation of the file the world was mapped from, or the one
+ * its image had if nobody else can change it.
+ */
+uint64_t GetFileGeneration(const World *world)
+{
+    return world->fileGeneration != NULL ? __atomic_load_n(world->fileGeneration, __ATOMIC_ACQUIRE)
+                                         : world->generation;
+}
+
+/*
+ * Identifies a world without reading all of it: its size, start and end,
+ * their names and connections. Two worlds with the same fingerprint are
+ * taken to be the same world, which is what a saved session checks before
+ * it is resumed in one.
+ */
+uint64_t FingerprintWorld(const World *world)
+{
+    uint64_t values[5];
+    values[0] = world->numRooms;
+    values[1] = world->startRoom;
+    values[2] = world->endRoom;
+    values[3] = world->offsets[world->numRooms];
+    values[4] = HashName(GetRoomName(world, world->startRoom)) ^ HashName(GetRoomName(world, world->endRoom));
+
+    uint64_t hash = 14695981039346656037ULL;
+    const unsigned char *bytes = (const unsigned char*)values;
+    size_t i;
+    for(i = 0; i < sizeof(values); i++)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+
+    uint32_t count;
+    const uint32_t *neighbors = GetNeighbors(world, world->startRoom, &count);
+    for(i = 0; i < count; i++)
+    {
+        hash = (hash ^ neighbors[i]) * 1099511628211ULL;
+    }
+    neighbors = GetNeighbors(world, world->endRoom, &count);
+    for(i = 0; i < count; i++)
+    {
+        hash = (hash ^ neighbors[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
@@ -0,0 +1,152 @@
+#ifndef WALTSARA_WORLD_H
+#define WALTSARA_WORLD_H
+
+/*
+ * Worlds as both programs see them, built by waltsara.buildrooms.c and
+ * played by waltsara.adventure.c.
+ *
+ * A world is laid out as a struct of arrays: room types and connection
+ * offsets are dense arrays indexed by room ID, connections are room IDs
+ * packed back to back, and names live in a string table of their own
+ * that only lookups and output ever touch. Walking the world reads a few
+ * bytes per room and never a name.
+ *
+ * The same layout is the binary world format, so a world file is mapped
+ * and played in place, and a world built in memory is saved with a single
+ * write. All fields are little-endian and every section starts on an 8
+ * byte boundary:
+ *
+ *   header | roomType[numRooms] | offsets[numRooms + 1] | connections[numConnections]
+ *          | nameOffsets[numRooms + 1] | hashSlots[numHashSlots] | sortedNames[numRooms]
+ *          | names
+ *
+ * Room i's connections are connections[offsets[i]] up to offsets[i + 1],
+ * sorted by room ID. Room i's name starts at names + nameOffsets[i] and is
+ * NUL terminated.
+ *
+ * hashSlots is an open-addressing table keyed by HashName: a power of two
+ * slots holding room ID + 1 (0 is empty), probed linearly. sortedNames lists
+ * the room IDs in strcmp order so a prefix maps to one contiguous run. Both
+ * indexes are optional; a zero offset means readers build their own.
+ * Bump WORLD_VERSION whenever this layout changes.
+ *
+ * A world file can be patched in place while it is played, a few
+ * connection lists at a time. The patches are first written to a journal
+ * next to the file, .<file name>.journal, and synced; the header's
+ * generation is then made odd, the patches copied in and the generation
+ * made even again, all under an exclusive flock. Whoever opens the file
+ * next finishes a patch that a crash cut short, or throws away a journal
+ * that was never completed, under the same lock, so a world is only ever
+ * loaded whole. Players with the file mapped read the generation before
+ * and after looking at connections, like a seqlock, and catch up when it
+ * moves on.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_ROOM_NAME_LENGTH 32
+#define WORLD_MAGIC "WALTWRLD"
+#define WORLD_VERSION 4
+#define NO_PATH UINT32_MAX                      // Distance to a room the end can't be reached from
+
+/* Bool doesn't exist in ANSI C, so I chose to define it */
+typedef enum { false, true } bool;
+
+/* Enumeration for Room type */
+typedef enum {
+  START_ROOM = 0,
+  MID_ROOM,
+  END_ROOM
+} Type;
+
+typedef struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t numRooms;
+    uint32_t startRoom;
+    uint32_t endRoom;
+    uint64_t numConnections;            // Directed connections, twice the number of doors
+    uint64_t typesOffset;               // uint8_t per room
+    uint64_t offsetsOffset;             // uint64_t per room, plus one
+    uint64_t connectionsOffset;         // uint32_t per connection
+    uint64_t nameOffsetsOffset;         // uint64_t per room, plus one
+    uint64_t namesOffset;
+    uint64_t namesSize;
+    uint64_t fileSize;
+    uint64_t hashOffset;                // uint32_t per hash slot, 0 if absent
+    uint64_t numHashSlots;
+    uint64_t sortedNamesOffset;         // uint32_t per room, 0 if absent
+    uint64_t seed;                      // Seed the world was generated from
+    uint64_t generation;                // Patches applied so far, twice over; odd while one is going in
+} WorldHeader;
+
+/* Bytes of a world file to overwrite */
+typedef struct
+{
+    uint64_t    offset;
+    uint64_t    length;
+    const void *data;
+} WorldPatch;
+
+/*
+ * A world in memory. Every array points straight into an image of the
+ * binary format: a mapped world file, or a heap image that CreateWorld
+ * made and its caller filled in. Rooms are referred to by ID.
+ */
+typedef struct
+{
+    uint32_t        numRooms;
+    uint32_t        startRoom;
+    uint32_t        endRoom;
+    const uint8_t  *roomType;
+    const uint64_t *offsets;            // Room i's connections are connections[offsets[i]..offsets[i+1])
+    const uint32_t *connections;        // Sorted by room ID within each room
+    uint32_t       *listedOrder;        // Connections in the order room files list them, shown in prompts; NULL if none
+    const uint64_t *nameOffsets;
+    const char     *names;
+    const uint32_t *hashSlots;          // Open-addressing name index, room ID + 1 per slot
+    uint64_t        hashMask;           // Number of hash slots minus one
+    const uint32_t *sortedNames;        // Room IDs in name order, for prefixes
+    void           *image;              // Start of the image
+    size_t          imageSize;
+    bool            mapped;             // Image is mmap'd rather than malloc'd
+    uint32_t       *builtIndex;         // Name index built at load time when the image has none
+    uint32_t       *distanceToEnd;      // Steps from each room to the end, if they were precomputed
+    struct Changes *changes;            // Locked doors and closed rooms of a live world, NULL if it never changes
+    uint32_t        par;                // Fewest steps from the start to the end
+    struct Prompt **prompts;            // Text the game shows in each room, filled in on first visit
+    char           *promptBlock;        // Every prompt in one block, when they were all built at once
+    const uint64_t *fileGeneration;     // Generation in the header of a file others can patch, NULL if none can
+    uint64_t        generation;         // Generation the world's caches are up to date with
+} World;
+
+/* Building and loading */
+void LayOutWorld(WorldHeader *h, uint32_t numRooms, uint64_t numConnections, uint64_t namesSize);   // Places every section
+bool CreateWorld(World *w, const WorldHeader *h);      // Zeroed heap image for the caller to fill in
+void IndexWorld(World *w);                             // Fills in the name index of a created world
+bool MapWorld(World *w, const char *fileName);         // Maps a binary world file read-only
+bool CopyWorld(World *w, const char *fileName);        // Reads a world file into memory of its own, to change it
+bool AttachWorld(World *w, void *image, size_t size);  // Points the world at an image of the binary format
+bool BuildNameIndex(World *w);                         // Builds the name index for images without one
+bool SaveWorld(const World *w, const char *fileName);  // Writes the image out as a world file
+bool PatchWorldFile(const char *fileName, uint64_t generation, const WorldPatch *patches,
+                    uint32_t count);                    // Journals and applies changes to a world file
+void FreeWorld(World *w);                              // Unmaps or frees the world and what hangs off it
+
+/* Queries */
+uint32_t GetStartRoom(const World *w);                 // Gets the start room of the world
+uint32_t GetEndRoom(const World *w);                   // Gets the end room of the world
+Type GetRoomType(const World *w, uint32_t room);       // Whether a room is the start, the end or neither
+uint32_t GetDegree(const World *w, uint32_t room);     // Number of connections of a room
+const uint32_t *GetNeighbors(const World *w, uint32_t room, uint32_t *count);   // A room's connections, sorted
+bool IsConnected(const World *w, uint32_t from, uint32_t to);  // Whether from has a connection to to
+const char *GetRoomName(const World *w, uint32_t room);        // Name of a room
+int GetRoomFromName(const World *w, const char *name);         // Room with the specified name, or -1
+uint64_t FindRoomsWithPrefix(const World *w, const char *prefix, uint64_t *first);  // Run of sortedNames matching prefix
+uint64_t HashName(const char *name);                   // Hash used by the name index
+uint64_t GetFileGeneration(const World *w);            // Current generation of the world's file
+uint64_t FingerprintWorld(const World *w);             // Cheap identifier of a world, for saved sessions
+
+#endif